@@ -240,25 +240,21 @@ asyncns_resolver_srv_done (LmResolver *resolver)
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
                "Failed to read srv request results");
     } else {
-        gchar *new_server;
-        guint  new_port;
+        GList *targets = NULL;
 
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
                "trying to parse srv response\n");
 
         result = _lm_resolver_parse_srv_response (srv_ans, srv_len,
-                                                  &new_server,
-                                                  &new_port);
+                                                  &targets);
         if (result == TRUE) {
             g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
-                   "worked, new host/post is %s/%d\n",
-                   new_server, new_port);
-
-            g_object_set (resolver,
-                          "host", new_server,
-                          "port", new_port,
-                          NULL);
-            g_free (new_server);
+                   "worked, %d targets, first is %s/%d\n",
+                   g_list_length (targets),
+                   ((LmSrvTarget *) targets->data)->host,
+                   ((LmSrvTarget *) targets->data)->port);
+
+            _lm_resolver_set_srv_targets (resolver, targets);
         }
 
         /* TODO: Check whether srv_ans needs freeing */
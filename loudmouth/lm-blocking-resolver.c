@@ -89,7 +89,7 @@ blocking_resolver_lookup_host (LmBlockingResolver *resolver)
 {
     gchar           *host;
     struct addrinfo  req;
-    struct addrinfo *ans;
+    struct addrinfo *ans = NULL;
     int              err;
     gboolean         retval = TRUE;
 
@@ -109,9 +109,7 @@ blocking_resolver_lookup_host (LmBlockingResolver *resolver)
                                  NULL);
 
         retval = FALSE;
-    }
-
-    if (ans == NULL) {
+    } else if (ans == NULL) {
         /* Couldn't find any results */
         g_object_ref (resolver);
         _lm_resolver_set_result (LM_RESOLVER (resolver), LM_RESOLVER_RESULT_FAILED,
@@ -146,8 +144,7 @@ blocking_resolver_lookup_service (LmBlockingResolver *resolver)
     gchar *service;
     gchar *protocol;
     gchar *srv;
-    gchar *new_server = NULL;
-    guint  new_port = 0;
+    GList *targets = NULL;
     gboolean  result;
     unsigned char    srv_ans[SRV_LEN];
     int              len;
@@ -165,25 +162,22 @@ blocking_resolver_lookup_service (LmBlockingResolver *resolver)
 
     len = res_query (srv, C_IN, T_SRV, srv_ans, SRV_LEN);
 
-    result = _lm_resolver_parse_srv_response (srv_ans, len,
-                                              &new_server, &new_port);
+    result = _lm_resolver_parse_srv_response (srv_ans, len, &targets);
     if (result == FALSE) {
         retval = FALSE;
+    } else {
+        _lm_resolver_set_srv_targets (LM_RESOLVER (resolver), targets);
     }
 
-    g_object_set (resolver,
-                  "host", new_server,
-                  "port", new_port,
-                  NULL);
-
     g_object_ref (resolver);
-    _lm_resolver_set_result (LM_RESOLVER (resolver), LM_RESOLVER_RESULT_OK, NULL);
+    _lm_resolver_set_result (LM_RESOLVER (resolver),
+                             result ? LM_RESOLVER_RESULT_OK : LM_RESOLVER_RESULT_FAILED,
+                             NULL);
     g_object_unref (resolver);
 
     /* Lookup the new server and the new port */
    /* blocking_resolver_lookup_host (resolver); */
 
-    g_free (new_server);
     g_free (srv);
     g_free (domain);
     g_free (service);
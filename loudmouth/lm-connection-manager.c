@@ -0,0 +1,597 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:lm-connection-manager
+ * @Title: LmConnectionManager
+ * @Short_description: Spreads connections over a number of threads
+ *
+ * A connection manager runs a number of threads, each with a
+ * #GMainContext of its own. Every connection created through it is placed
+ * on the thread running the fewest connections, all callbacks of the
+ * connection are then called in that thread.
+ *
+ * Connections are not thread safe, a managed connection should only be
+ * used from its own thread: from its callbacks or by running a function
+ * there with lm_connection_manager_invoke(). lm_connection_manager_send()
+ * can be used from any thread. Connections that are closed, or open but
+ * not in the middle of opening or authenticating, can be moved to another
+ * thread with lm_connection_manager_migrate().
+ * <informalexample><programlisting><![CDATA[
+ * static void
+ * open_connection (LmConnectionManager *manager,
+ *                  LmConnection        *connection,
+ *                  gpointer             user_data)
+ * {
+ *     lm_connection_open (connection, connection_open_cb, NULL, NULL, NULL);
+ * }
+ *
+ * manager = lm_connection_manager_new (4);
+ * for (i = 0; i < n_accounts; i++) {
+ *     connection = lm_connection_manager_add_connection (manager, server);
+ *     lm_connection_set_jid (connection, jids[i]);
+ *     lm_connection_manager_invoke (manager, connection,
+ *                                   open_connection, NULL, NULL);
+ * }
+ * ]]></programlisting></informalexample>
+ */
+
+#include <config.h>
+
+#include "lm-debug.h"
+#include "lm-internals.h"
+#include "lm-connection-manager.h"
+
+typedef struct {
+    GMainContext *context;
+    GMainLoop    *loop;
+    GThread      *thread;
+
+    guint         n_connections;
+} ManagerThread;
+
+struct _LmConnectionManager {
+    ManagerThread *threads;
+    guint          n_threads;
+
+    /* Protects the placement of the connections */
+    GMutex         lock;
+    /* LmConnection -> ManagerThread running it */
+    GHashTable    *connections;
+
+    gint           ref_count;
+};
+
+typedef struct {
+    LmConnectionManager     *manager;
+    LmConnection            *connection;
+    LmConnectionManagerFunc  func;
+    gpointer                 user_data;
+    GDestroyNotify           notify;
+} InvokeData;
+
+static void     manager_invoke (LmConnectionManager     *manager,
+                                ManagerThread           *thread,
+                                LmConnection            *connection,
+                                LmConnectionManagerFunc  func,
+                                gpointer                 user_data,
+                                GDestroyNotify           notify);
+
+static gpointer
+manager_thread_func (ManagerThread *thread)
+{
+    g_main_context_push_thread_default (thread->context);
+    g_main_loop_run (thread->loop);
+    g_main_context_pop_thread_default (thread->context);
+
+    return NULL;
+}
+
+static gboolean
+manager_quit_cb (GMainLoop *loop)
+{
+    g_main_loop_quit (loop);
+
+    return FALSE;
+}
+
+static ManagerThread *
+manager_lookup (LmConnectionManager *manager, LmConnection *connection)
+{
+    ManagerThread *thread;
+
+    g_mutex_lock (&manager->lock);
+    thread = g_hash_table_lookup (manager->connections, connection);
+    g_mutex_unlock (&manager->lock);
+
+    return thread;
+}
+
+static void
+invoke_data_free (InvokeData *data)
+{
+    if (data->notify) {
+        (data->notify) (data->user_data);
+    }
+
+    g_slice_free (InvokeData, data);
+}
+
+static gboolean
+manager_invoke_cb (InvokeData *data)
+{
+    ManagerThread *thread;
+
+    thread = manager_lookup (data->manager, data->connection);
+    if (!thread) {
+        /* Removed meanwhile */
+        return FALSE;
+    }
+
+    if (!g_main_context_is_owner (thread->context)) {
+        /* Migrated meanwhile, follow it to its new thread */
+        manager_invoke (data->manager, thread, data->connection,
+                        data->func, data->user_data, data->notify);
+        data->notify = NULL;
+        return FALSE;
+    }
+
+    (data->func) (data->manager, data->connection, data->user_data);
+
+    return FALSE;
+}
+
+static void
+manager_invoke (LmConnectionManager     *manager,
+                ManagerThread           *thread,
+                LmConnection            *connection,
+                LmConnectionManagerFunc  func,
+                gpointer                 user_data,
+                GDestroyNotify           notify)
+{
+    InvokeData *data;
+
+    data = g_slice_new (InvokeData);
+    data->manager = manager;
+    data->connection = connection;
+    data->func = func;
+    data->user_data = user_data;
+    data->notify = notify;
+
+    g_main_context_invoke_full (thread->context, G_PRIORITY_DEFAULT,
+                                (GSourceFunc) manager_invoke_cb, data,
+                                (GDestroyNotify) invoke_data_free);
+}
+
+static gboolean
+manager_attach_cb (InvokeData *data)
+{
+    ManagerThread *thread = data->user_data;
+
+    _lm_connection_attach (data->connection, thread->context);
+
+    return FALSE;
+}
+
+static void
+manager_migrate_cb (LmConnectionManager *manager,
+                    LmConnection        *connection,
+                    ManagerThread       *to)
+{
+    ManagerThread *from;
+    InvokeData    *data;
+
+    g_mutex_lock (&manager->lock);
+
+    from = g_hash_table_lookup (manager->connections, connection);
+    if (from == to) {
+        g_mutex_unlock (&manager->lock);
+        return;
+    }
+
+    if (!_lm_connection_detach (connection)) {
+        g_mutex_unlock (&manager->lock);
+        lm_verbose ("Connection is busy, not migrating it\n");
+        return;
+    }
+
+    from->n_connections--;
+    to->n_connections++;
+    g_hash_table_insert (manager->connections, connection, to);
+
+    /* Runs ahead of anything invoked for the connection from now on */
+    data = g_slice_new0 (InvokeData);
+    data->manager = manager;
+    data->connection = connection;
+    data->user_data = to;
+
+    g_main_context_invoke_full (to->context, G_PRIORITY_HIGH,
+                                (GSourceFunc) manager_attach_cb, data,
+                                (GDestroyNotify) invoke_data_free);
+
+    g_mutex_unlock (&manager->lock);
+}
+
+static void
+manager_remove_cb (LmConnectionManager *manager,
+                   LmConnection        *connection,
+                   gpointer             user_data)
+{
+    ManagerThread *thread;
+
+    g_mutex_lock (&manager->lock);
+    thread = g_hash_table_lookup (manager->connections, connection);
+    if (thread) {
+        g_hash_table_remove (manager->connections, connection);
+        thread->n_connections--;
+    }
+    g_mutex_unlock (&manager->lock);
+
+    if (!thread) {
+        return;
+    }
+
+    if (lm_connection_get_state (connection) != LM_CONNECTION_STATE_CLOSED) {
+        lm_connection_close (connection, NULL);
+    }
+
+    lm_connection_unref (connection);
+}
+
+static void
+manager_free (LmConnectionManager *manager)
+{
+    GHashTableIter  iter;
+    LmConnection   *connection;
+    guint           i;
+
+    for (i = 0; i < manager->n_threads; i++) {
+        ManagerThread *thread = &manager->threads[i];
+
+        /* Quits the loop even if it hasn't started running yet */
+        g_main_context_invoke (thread->context,
+                               (GSourceFunc) manager_quit_cb,
+                               thread->loop);
+        g_thread_join (thread->thread);
+    }
+
+    /* Nothing runs the connections anymore */
+    g_hash_table_iter_init (&iter, manager->connections);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &connection, NULL)) {
+        if (lm_connection_get_state (connection) != LM_CONNECTION_STATE_CLOSED) {
+            lm_connection_close (connection, NULL);
+        }
+        lm_connection_unref (connection);
+    }
+    g_hash_table_destroy (manager->connections);
+
+    for (i = 0; i < manager->n_threads; i++) {
+        g_main_loop_unref (manager->threads[i].loop);
+        g_main_context_unref (manager->threads[i].context);
+    }
+
+    g_free (manager->threads);
+    g_mutex_clear (&manager->lock);
+
+    g_free (manager);
+}
+
+/**
+ * lm_connection_manager_new:
+ * @n_threads: the number of threads to run
+ *
+ * Creates a new connection manager and starts @n_threads threads, each
+ * running a #GMainContext of its own.
+ *
+ * Return value: A newly created #LmConnectionManager, free with lm_connection_manager_unref().
+ **/
+LmConnectionManager *
+lm_connection_manager_new (guint n_threads)
+{
+    LmConnectionManager *manager;
+    guint                i;
+
+    g_return_val_if_fail (n_threads > 0, NULL);
+
+    manager = g_new0 (LmConnectionManager, 1);
+
+    manager->threads = g_new0 (ManagerThread, n_threads);
+    manager->n_threads = n_threads;
+    manager->connections = g_hash_table_new (NULL, NULL);
+    manager->ref_count = 1;
+
+    g_mutex_init (&manager->lock);
+
+    for (i = 0; i < n_threads; i++) {
+        ManagerThread *thread = &manager->threads[i];
+        gchar         *name;
+
+        thread->context = g_main_context_new ();
+        thread->loop = g_main_loop_new (thread->context, FALSE);
+
+        name = g_strdup_printf ("lm-manager-%u", i);
+        thread->thread = g_thread_new (name,
+                                       (GThreadFunc) manager_thread_func,
+                                       thread);
+        g_free (name);
+    }
+
+    return manager;
+}
+
+/**
+ * lm_connection_manager_get_n_threads:
+ * @manager: an #LmConnectionManager
+ *
+ * Returns the number of threads run by @manager.
+ *
+ * Return value: The number of threads.
+ **/
+guint
+lm_connection_manager_get_n_threads (LmConnectionManager *manager)
+{
+    g_return_val_if_fail (manager != NULL, 0);
+
+    return manager->n_threads;
+}
+
+/**
+ * lm_connection_manager_get_n_connections:
+ * @manager: an #LmConnectionManager
+ * @thread: index of a thread of @manager
+ *
+ * Returns the number of connections running in @thread.
+ *
+ * Return value: The number of connections.
+ **/
+guint
+lm_connection_manager_get_n_connections (LmConnectionManager *manager,
+                                         guint                thread)
+{
+    guint n_connections;
+
+    g_return_val_if_fail (manager != NULL, 0);
+    g_return_val_if_fail (thread < manager->n_threads, 0);
+
+    g_mutex_lock (&manager->lock);
+    n_connections = manager->threads[thread].n_connections;
+    g_mutex_unlock (&manager->lock);
+
+    return n_connections;
+}
+
+/**
+ * lm_connection_manager_add_connection:
+ * @manager: an #LmConnectionManager
+ * @server: the server to connect to
+ *
+ * Creates a new closed connection running in the thread of @manager that
+ * runs the fewest connections. The connection belongs to @manager and
+ * stays valid until it is removed with
+ * lm_connection_manager_remove_connection() or @manager is freed.
+ *
+ * It can be set up from the calling thread until it is opened, which has
+ * to be done in its own thread, see lm_connection_manager_invoke().
+ *
+ * Return value: The new connection.
+ **/
+LmConnection *
+lm_connection_manager_add_connection (LmConnectionManager *manager,
+                                      const gchar         *server)
+{
+    ManagerThread *thread;
+    LmConnection  *connection;
+    guint          i;
+
+    g_return_val_if_fail (manager != NULL, NULL);
+
+    g_mutex_lock (&manager->lock);
+
+    thread = &manager->threads[0];
+    for (i = 1; i < manager->n_threads; i++) {
+        if (manager->threads[i].n_connections < thread->n_connections) {
+            thread = &manager->threads[i];
+        }
+    }
+
+    connection = lm_connection_new_with_context (server, thread->context);
+
+    g_hash_table_insert (manager->connections, connection, thread);
+    thread->n_connections++;
+
+    g_mutex_unlock (&manager->lock);
+
+    return connection;
+}
+
+/**
+ * lm_connection_manager_remove_connection:
+ * @manager: an #LmConnectionManager
+ * @connection: a connection of @manager
+ *
+ * Closes @connection if it is open and drops the reference @manager holds
+ * on it. This happens in the thread running @connection, so it might
+ * still be running when this returns.
+ **/
+void
+lm_connection_manager_remove_connection (LmConnectionManager *manager,
+                                         LmConnection        *connection)
+{
+    g_return_if_fail (manager != NULL);
+    g_return_if_fail (connection != NULL);
+
+    lm_connection_manager_invoke (manager, connection,
+                                  manager_remove_cb, NULL, NULL);
+}
+
+/**
+ * lm_connection_manager_get_thread:
+ * @manager: an #LmConnectionManager
+ * @connection: an #LmConnection
+ *
+ * Returns the index of the thread @connection currently runs in.
+ *
+ * Return value: The index of the thread or -1 if @connection doesn't belong to @manager.
+ **/
+gint
+lm_connection_manager_get_thread (LmConnectionManager *manager,
+                                  LmConnection        *connection)
+{
+    ManagerThread *thread;
+
+    g_return_val_if_fail (manager != NULL, -1);
+    g_return_val_if_fail (connection != NULL, -1);
+
+    thread = manager_lookup (manager, connection);
+    if (!thread) {
+        return -1;
+    }
+
+    return thread - manager->threads;
+}
+
+/**
+ * lm_connection_manager_invoke:
+ * @manager: an #LmConnectionManager
+ * @connection: a connection of @manager
+ * @func: function to call
+ * @user_data: user data passed to @func
+ * @notify: function to free @user_data with, or %NULL
+ *
+ * Calls @func in the thread running @connection. If that is the calling
+ * thread @func is called right away. Can be called from any thread.
+ **/
+void
+lm_connection_manager_invoke (LmConnectionManager     *manager,
+                              LmConnection            *connection,
+                              LmConnectionManagerFunc  func,
+                              gpointer                 user_data,
+                              GDestroyNotify           notify)
+{
+    ManagerThread *thread;
+
+    g_return_if_fail (manager != NULL);
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (func != NULL);
+
+    thread = manager_lookup (manager, connection);
+    if (!thread) {
+        g_warning ("Connection doesn't belong to the connection manager");
+        if (notify) {
+            notify (user_data);
+        }
+        return;
+    }
+
+    manager_invoke (manager, thread, connection, func, user_data, notify);
+}
+
+/**
+ * lm_connection_manager_send:
+ * @manager: an #LmConnectionManager
+ * @connection: a connection of @manager
+ * @message: the message to send
+ *
+ * Sends @message over @connection from any thread, see
+ * lm_connection_send_threadsafe(). Failures are only reported through the
+ * disconnect function of @connection.
+ *
+ * Return value: %TRUE if the message was queued, %FALSE if @connection doesn't belong to @manager.
+ **/
+gboolean
+lm_connection_manager_send (LmConnectionManager *manager,
+                            LmConnection        *connection,
+                            LmMessage           *message)
+{
+    g_return_val_if_fail (manager != NULL, FALSE);
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (message != NULL, FALSE);
+
+    if (!manager_lookup (manager, connection)) {
+        return FALSE;
+    }
+
+    lm_connection_send_threadsafe (connection, message);
+
+    return TRUE;
+}
+
+/**
+ * lm_connection_manager_migrate:
+ * @manager: an #LmConnectionManager
+ * @connection: a connection of @manager
+ * @thread: index of the thread to move @connection to
+ *
+ * Moves @connection to another thread of @manager, for example to take
+ * load off a busy thread. This is done by the thread running @connection
+ * and does nothing if @connection is being opened or authenticated at
+ * that point, or if it uses a reactor. Use
+ * lm_connection_manager_get_thread() to find out where it ended up.
+ **/
+void
+lm_connection_manager_migrate (LmConnectionManager *manager,
+                               LmConnection        *connection,
+                               guint                thread)
+{
+    g_return_if_fail (manager != NULL);
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (thread < manager->n_threads);
+
+    lm_connection_manager_invoke (manager, connection,
+                                  (LmConnectionManagerFunc) manager_migrate_cb,
+                                  &manager->threads[thread], NULL);
+}
+
+/**
+ * lm_connection_manager_ref:
+ * @manager: an #LmConnectionManager
+ *
+ * Adds a reference to @manager.
+ *
+ * Return value: Returns the same manager.
+ **/
+LmConnectionManager *
+lm_connection_manager_ref (LmConnectionManager *manager)
+{
+    g_return_val_if_fail (manager != NULL, NULL);
+
+    g_atomic_int_inc (&manager->ref_count);
+
+    return manager;
+}
+
+/**
+ * lm_connection_manager_unref:
+ * @manager: an #LmConnectionManager
+ *
+ * Removes a reference from @manager. When no more references are present
+ * the threads are stopped and all connections of @manager are closed and
+ * freed. The last reference must not be dropped from one of the threads
+ * of @manager.
+ **/
+void
+lm_connection_manager_unref (LmConnectionManager *manager)
+{
+    g_return_if_fail (manager != NULL);
+
+    if (g_atomic_int_dec_and_test (&manager->ref_count)) {
+        manager_free (manager);
+    }
+}
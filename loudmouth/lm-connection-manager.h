@@ -0,0 +1,77 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_CONNECTION_MANAGER_H__
+#define __LM_CONNECTION_MANAGER_H__
+
+#if !defined (LM_INSIDE_LOUDMOUTH_H) && !defined (LM_COMPILATION)
+#error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#include <loudmouth/lm-connection.h>
+
+G_BEGIN_DECLS
+
+/**
+ * LmConnectionManager:
+ *
+ * This should not be accessed directly. Use the accessor functions as described below.
+ */
+typedef struct _LmConnectionManager LmConnectionManager;
+
+/**
+ * LmConnectionManagerFunc:
+ * @manager: the #LmConnectionManager
+ * @connection: the #LmConnection the function was invoked for
+ * @user_data: user data passed to lm_connection_manager_invoke()
+ *
+ * Called in the thread running @connection.
+ */
+typedef void (* LmConnectionManagerFunc) (LmConnectionManager *manager,
+                                          LmConnection        *connection,
+                                          gpointer             user_data);
+
+LmConnectionManager * lm_connection_manager_new         (guint                n_threads);
+guint          lm_connection_manager_get_n_threads      (LmConnectionManager *manager);
+guint          lm_connection_manager_get_n_connections  (LmConnectionManager *manager,
+                                                         guint                thread);
+LmConnection * lm_connection_manager_add_connection     (LmConnectionManager *manager,
+                                                         const gchar         *server);
+void           lm_connection_manager_remove_connection  (LmConnectionManager *manager,
+                                                         LmConnection        *connection);
+gint           lm_connection_manager_get_thread         (LmConnectionManager *manager,
+                                                         LmConnection        *connection);
+void           lm_connection_manager_invoke             (LmConnectionManager *manager,
+                                                         LmConnection        *connection,
+                                                         LmConnectionManagerFunc func,
+                                                         gpointer             user_data,
+                                                         GDestroyNotify       notify);
+gboolean       lm_connection_manager_send               (LmConnectionManager *manager,
+                                                         LmConnection        *connection,
+                                                         LmMessage           *message);
+void           lm_connection_manager_migrate            (LmConnectionManager *manager,
+                                                         LmConnection        *connection,
+                                                         guint                thread);
+LmConnectionManager * lm_connection_manager_ref         (LmConnectionManager *manager);
+void           lm_connection_manager_unref              (LmConnectionManager *manager);
+
+G_END_DECLS
+
+#endif /* __LM_CONNECTION_MANAGER_H__ */
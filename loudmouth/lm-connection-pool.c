@@ -0,0 +1,567 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:lm-connection-pool
+ * @Title: LmConnectionPool
+ * @Short_description: Opens many connections sharing their setup
+ *
+ * A connection pool is meant for programs that keep a large number of
+ * connections, usually to the same server. The connections of a pool
+ * share what doesn't differ between them:
+ * <itemizedlist>
+ * <listitem><para>The TLS context and the trusted certificates, which
+ * are loaded once for every CA path used in the process. TLS sessions
+ * are cached in it, so reconnects resume them.</para></listitem>
+ * <listitem><para>The keep alive timer, a single timer of the pool sends
+ * the pings of all connections at their keep alive rate.</para></listitem>
+ * <listitem><para>Name lookups, which are shared by all connections of
+ * the process as long as the results are valid.</para></listitem>
+ * </itemizedlist>
+ *
+ * Connections opened with lm_connection_pool_open() are queued and
+ * opened at the rate set with lm_connection_pool_set_open_rate(), so
+ * that starting thousands of connections doesn't flood the server or
+ * the network at once. Authentication is started from the result
+ * function as usual and is thereby staged as well.
+ *
+ * A pool is not thread safe. All of its connections have to run in the
+ * #GMainContext of the pool and the pool has to be used from the thread
+ * running that context.
+ * <informalexample><programlisting><![CDATA[
+ * pool = lm_connection_pool_new (NULL);
+ * lm_connection_pool_set_open_rate (pool, 200);
+ *
+ * for (i = 0; i < n_accounts; i++) {
+ *     connection = lm_connection_new (server);
+ *     lm_connection_set_jid (connection, jids[i]);
+ *     lm_connection_set_keep_alive_rate (connection, 60);
+ *
+ *     lm_connection_pool_add_connection (pool, connection);
+ *     lm_connection_pool_open (pool, connection,
+ *                              connection_open_cb, accounts[i], NULL,
+ *                              NULL);
+ *     lm_connection_unref (connection);
+ * }
+ * ]]></programlisting></informalexample>
+ */
+
+#include <config.h>
+
+#include "lm-debug.h"
+#include "lm-error.h"
+#include "lm-internals.h"
+#include "lm-misc.h"
+#include "lm-connection-pool.h"
+
+/* Granularity of the keep alive rates, which are given in seconds */
+#define KEEP_ALIVE_TICK 1000
+
+typedef struct {
+    LmConnection *connection;
+    /* Monotonic time the next ping is due, 0 while not scheduled */
+    gint64        keep_alive_due;
+} PoolEntry;
+
+typedef struct {
+    LmConnection     *connection;
+    LmResultFunction  func;
+    gpointer          user_data;
+    GDestroyNotify    notify;
+} PoolOpen;
+
+struct _LmConnectionPool {
+    GMainContext *context;
+
+    /* LmConnection -> PoolEntry */
+    GHashTable   *connections;
+
+    /* PoolOpen waiting for their turn */
+    GQueue       *pending;
+    guint         open_rate;
+    gint64        next_open;
+    GSource      *open_source;
+
+    GSource      *keep_alive_source;
+
+    gint          ref_count;
+};
+
+static void     pool_schedule_opens (LmConnectionPool *pool);
+
+static void
+pool_entry_free (PoolEntry *entry)
+{
+    _lm_connection_set_keep_alive_shared (entry->connection, FALSE);
+    lm_connection_unref (entry->connection);
+
+    g_slice_free (PoolEntry, entry);
+}
+
+static void
+pool_open_free (PoolOpen *open)
+{
+    if (open->notify) {
+        (open->notify) (open->user_data);
+    }
+
+    g_slice_free (PoolOpen, open);
+}
+
+static void
+pool_open_result_cb (LmConnection *connection,
+                     gboolean      success,
+                     PoolOpen     *open)
+{
+    if (open->func) {
+        (open->func) (connection, success, open->user_data);
+    }
+}
+
+static void
+pool_do_open (LmConnectionPool *pool, PoolOpen *open)
+{
+    LmConnection *connection = open->connection;
+    GError       *error = NULL;
+
+    /* The connection owns open from here on and frees it with its
+     * result callback */
+    if (!lm_connection_open (connection,
+                             (LmResultFunction) pool_open_result_cb,
+                             open,
+                             (GDestroyNotify) pool_open_free,
+                             &error)) {
+        lm_verbose ("Failed to open pooled connection: %s\n",
+                    error->message);
+        g_error_free (error);
+
+        if (open->func) {
+            (open->func) (connection, FALSE, open->user_data);
+        }
+        if (open->notify) {
+            (open->notify) (open->user_data);
+        }
+
+        open->func = NULL;
+        open->notify = NULL;
+    }
+}
+
+static gboolean
+pool_open_cb (LmConnectionPool *pool)
+{
+    gint64 now;
+    gint64 interval;
+
+    pool->open_source = NULL;
+
+    now = g_get_monotonic_time ();
+    interval = pool->open_rate ? G_USEC_PER_SEC / pool->open_rate : 0;
+
+    /* The result functions might drop the last reference */
+    lm_connection_pool_ref (pool);
+
+    /* Catches up with the rate if the main loop was late, so rates
+     * above one open per millisecond are kept as well */
+    while (!g_queue_is_empty (pool->pending) && pool->next_open <= now) {
+        PoolOpen *open = g_queue_pop_head (pool->pending);
+
+        pool->next_open += interval;
+        pool_do_open (pool, open);
+    }
+
+    pool_schedule_opens (pool);
+
+    lm_connection_pool_unref (pool);
+
+    return FALSE;
+}
+
+static void
+pool_schedule_opens (LmConnectionPool *pool)
+{
+    gint64 now;
+    gint64 delay;
+
+    if (pool->open_source || g_queue_is_empty (pool->pending)) {
+        return;
+    }
+
+    now = g_get_monotonic_time ();
+
+    /* Idle time doesn't add up to a burst of opens */
+    if (pool->next_open < now) {
+        pool->next_open = now;
+    }
+
+    delay = (pool->next_open - now + 999) / 1000;
+
+    pool->open_source = lm_misc_add_timeout (pool->context, delay,
+                                             (GSourceFunc) pool_open_cb,
+                                             pool);
+}
+
+static void
+pool_cancel_opens (LmConnectionPool *pool, LmConnection *connection)
+{
+    GList *l = pool->pending->head;
+
+    while (l) {
+        GList    *next = l->next;
+        PoolOpen *open = l->data;
+
+        if (!connection || open->connection == connection) {
+            g_queue_delete_link (pool->pending, l);
+            pool_open_free (open);
+        }
+
+        l = next;
+    }
+}
+
+static gboolean
+pool_keep_alive_cb (LmConnectionPool *pool)
+{
+    GHashTableIter  iter;
+    PoolEntry      *entry;
+    GSList         *due = NULL;
+    GSList         *l;
+    gint64          now;
+
+    now = g_get_monotonic_time ();
+
+    g_hash_table_iter_init (&iter, pool->connections);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+        guint rate;
+
+        rate = lm_connection_get_keep_alive_rate (entry->connection);
+        if (rate == 0 || !lm_connection_is_open (entry->connection)) {
+            entry->keep_alive_due = 0;
+            continue;
+        }
+
+        if (entry->keep_alive_due == 0) {
+            entry->keep_alive_due = now + rate * G_USEC_PER_SEC;
+        } else if (entry->keep_alive_due <= now) {
+            due = g_slist_prepend (due, lm_connection_ref (entry->connection));
+        }
+    }
+
+    /* Timed out connections get closed, their disconnect functions might
+     * remove them from the pool or drop the last reference to it */
+    lm_connection_pool_ref (pool);
+
+    for (l = due; l; l = l->next) {
+        LmConnection *connection = l->data;
+        gboolean      sent;
+
+        sent = _lm_connection_keep_alive (connection);
+
+        entry = g_hash_table_lookup (pool->connections, connection);
+        if (entry) {
+            entry->keep_alive_due = sent ?
+                now + lm_connection_get_keep_alive_rate (connection) * G_USEC_PER_SEC : 0;
+        }
+
+        lm_connection_unref (connection);
+    }
+    g_slist_free (due);
+
+    lm_connection_pool_unref (pool);
+
+    return TRUE;
+}
+
+static void
+pool_free (LmConnectionPool *pool)
+{
+    pool_cancel_opens (pool, NULL);
+    g_queue_free (pool->pending);
+
+    if (pool->open_source) {
+        g_source_destroy (pool->open_source);
+    }
+
+    if (pool->keep_alive_source) {
+        g_source_destroy (pool->keep_alive_source);
+    }
+
+    g_hash_table_destroy (pool->connections);
+
+    if (pool->context) {
+        g_main_context_unref (pool->context);
+    }
+
+    g_free (pool);
+}
+
+/**
+ * lm_connection_pool_new:
+ * @context: the #GMainContext the connections of the pool run in, or %NULL for the default context
+ *
+ * Creates a new connection pool. The pool opens connections as fast as
+ * possible until a rate is set with lm_connection_pool_set_open_rate().
+ *
+ * Return value: A newly created #LmConnectionPool, free with lm_connection_pool_unref().
+ **/
+LmConnectionPool *
+lm_connection_pool_new (GMainContext *context)
+{
+    LmConnectionPool *pool;
+
+    pool = g_new0 (LmConnectionPool, 1);
+
+    pool->context = context ? g_main_context_ref (context) : NULL;
+    pool->connections = g_hash_table_new_full (NULL, NULL, NULL,
+                                               (GDestroyNotify) pool_entry_free);
+    pool->pending = g_queue_new ();
+    pool->ref_count = 1;
+
+    return pool;
+}
+
+/**
+ * lm_connection_pool_set_open_rate:
+ * @pool: an #LmConnectionPool
+ * @rate: the number of connections opened per second, 0 for no limit
+ *
+ * Sets how many of the connections queued with lm_connection_pool_open()
+ * are opened per second.
+ **/
+void
+lm_connection_pool_set_open_rate (LmConnectionPool *pool, guint rate)
+{
+    g_return_if_fail (pool != NULL);
+
+    pool->open_rate = MIN (rate, G_USEC_PER_SEC);
+
+    /* Picks up the new rate from the next open on */
+    if (pool->open_source) {
+        g_source_destroy (pool->open_source);
+        pool->open_source = NULL;
+    }
+    pool->next_open = 0;
+
+    pool_schedule_opens (pool);
+}
+
+/**
+ * lm_connection_pool_get_open_rate:
+ * @pool: an #LmConnectionPool
+ *
+ * Returns the number of connections opened per second.
+ *
+ * Return value: The open rate, 0 if there is no limit.
+ **/
+guint
+lm_connection_pool_get_open_rate (LmConnectionPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, 0);
+
+    return pool->open_rate;
+}
+
+/**
+ * lm_connection_pool_add_connection:
+ * @pool: an #LmConnectionPool
+ * @connection: an #LmConnection running in the context of @pool
+ *
+ * Adds @connection to @pool, which holds a reference on it until it is
+ * removed again. Keep alive pings of @connection are sent by the timer of
+ * @pool from now on.
+ **/
+void
+lm_connection_pool_add_connection (LmConnectionPool *pool,
+                                   LmConnection     *connection)
+{
+    PoolEntry *entry;
+
+    g_return_if_fail (pool != NULL);
+    g_return_if_fail (connection != NULL);
+
+    if (g_hash_table_lookup (pool->connections, connection)) {
+        return;
+    }
+
+    entry = g_slice_new0 (PoolEntry);
+    entry->connection = lm_connection_ref (connection);
+
+    g_hash_table_insert (pool->connections, connection, entry);
+
+    _lm_connection_set_keep_alive_shared (connection, TRUE);
+
+    if (!pool->keep_alive_source) {
+        pool->keep_alive_source =
+            lm_misc_add_timeout (pool->context, KEEP_ALIVE_TICK,
+                                 (GSourceFunc) pool_keep_alive_cb,
+                                 pool);
+    }
+}
+
+/**
+ * lm_connection_pool_remove_connection:
+ * @pool: an #LmConnectionPool
+ * @connection: a connection of @pool
+ *
+ * Removes @connection from @pool without closing it. A pending open of
+ * @connection is cancelled and @connection goes back to sending its keep
+ * alive pings itself.
+ **/
+void
+lm_connection_pool_remove_connection (LmConnectionPool *pool,
+                                      LmConnection     *connection)
+{
+    g_return_if_fail (pool != NULL);
+    g_return_if_fail (connection != NULL);
+
+    pool_cancel_opens (pool, connection);
+
+    g_hash_table_remove (pool->connections, connection);
+
+    if (g_hash_table_size (pool->connections) == 0 &&
+        pool->keep_alive_source) {
+        g_source_destroy (pool->keep_alive_source);
+        pool->keep_alive_source = NULL;
+    }
+}
+
+/**
+ * lm_connection_pool_get_n_connections:
+ * @pool: an #LmConnectionPool
+ *
+ * Returns the number of connections in @pool.
+ *
+ * Return value: The number of connections.
+ **/
+guint
+lm_connection_pool_get_n_connections (LmConnectionPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, 0);
+
+    return g_hash_table_size (pool->connections);
+}
+
+/**
+ * lm_connection_pool_open:
+ * @pool: an #LmConnectionPool
+ * @connection: a connection of @pool
+ * @function: Callback function that will be called when the connection open has succeeded or failed.
+ * @user_data: Userdata sent to @function.
+ * @notify: Function to free @user_data when the connection is opened, %NULL if @user_data should not be freed.
+ * @error: location to store error, or %NULL
+ *
+ * Queues @connection to be opened as lm_connection_open() does, at the
+ * rate set for @pool. Failures to start opening are reported to
+ * @function as well.
+ *
+ * Return value: %TRUE if @connection was queued, %FALSE otherwise.
+ **/
+gboolean
+lm_connection_pool_open (LmConnectionPool  *pool,
+                         LmConnection      *connection,
+                         LmResultFunction   function,
+                         gpointer           user_data,
+                         GDestroyNotify     notify,
+                         GError           **error)
+{
+    PoolOpen *open;
+    GList    *l;
+
+    g_return_val_if_fail (pool != NULL, FALSE);
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (g_hash_table_lookup (pool->connections,
+                                               connection) != NULL, FALSE);
+
+    for (l = pool->pending->head; l; l = l->next) {
+        if (((PoolOpen *) l->data)->connection == connection) {
+            g_set_error (error,
+                         LM_ERROR,
+                         LM_ERROR_CONNECTION_OPEN,
+                         "Connection is already waiting to be opened");
+            return FALSE;
+        }
+    }
+
+    open = g_slice_new (PoolOpen);
+    open->connection = connection;
+    open->func = function;
+    open->user_data = user_data;
+    open->notify = notify;
+
+    g_queue_push_tail (pool->pending, open);
+
+    pool_schedule_opens (pool);
+
+    return TRUE;
+}
+
+/**
+ * lm_connection_pool_get_n_pending:
+ * @pool: an #LmConnectionPool
+ *
+ * Returns the number of connections waiting to be opened.
+ *
+ * Return value: The number of queued opens.
+ **/
+guint
+lm_connection_pool_get_n_pending (LmConnectionPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, 0);
+
+    return g_queue_get_length (pool->pending);
+}
+
+/**
+ * lm_connection_pool_ref:
+ * @pool: an #LmConnectionPool
+ *
+ * Adds a reference to @pool.
+ *
+ * Return value: Returns the same pool.
+ **/
+LmConnectionPool *
+lm_connection_pool_ref (LmConnectionPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, NULL);
+
+    pool->ref_count++;
+
+    return pool;
+}
+
+/**
+ * lm_connection_pool_unref:
+ * @pool: an #LmConnectionPool
+ *
+ * Removes a reference from @pool. When no more references are present
+ * the pending opens are cancelled and the references on the connections
+ * are dropped, without closing them.
+ **/
+void
+lm_connection_pool_unref (LmConnectionPool *pool)
+{
+    g_return_if_fail (pool != NULL);
+
+    pool->ref_count--;
+
+    if (pool->ref_count == 0) {
+        pool_free (pool);
+    }
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_CONNECTION_POOL_H__
+#define __LM_CONNECTION_POOL_H__
+
+#if !defined (LM_INSIDE_LOUDMOUTH_H) && !defined (LM_COMPILATION)
+#error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#include <loudmouth/lm-connection.h>
+
+G_BEGIN_DECLS
+
+/**
+ * LmConnectionPool:
+ *
+ * This should not be accessed directly. Use the accessor functions as described below.
+ */
+typedef struct _LmConnectionPool LmConnectionPool;
+
+LmConnectionPool * lm_connection_pool_new              (GMainContext      *context);
+void           lm_connection_pool_set_open_rate        (LmConnectionPool  *pool,
+                                                        guint              rate);
+guint          lm_connection_pool_get_open_rate        (LmConnectionPool  *pool);
+void           lm_connection_pool_add_connection       (LmConnectionPool  *pool,
+                                                        LmConnection      *connection);
+void           lm_connection_pool_remove_connection    (LmConnectionPool  *pool,
+                                                        LmConnection      *connection);
+guint          lm_connection_pool_get_n_connections    (LmConnectionPool  *pool);
+gboolean       lm_connection_pool_open                 (LmConnectionPool  *pool,
+                                                        LmConnection      *connection,
+                                                        LmResultFunction   function,
+                                                        gpointer           user_data,
+                                                        GDestroyNotify     notify,
+                                                        GError           **error);
+guint          lm_connection_pool_get_n_pending        (LmConnectionPool  *pool);
+LmConnectionPool * lm_connection_pool_ref              (LmConnectionPool  *pool);
+void           lm_connection_pool_unref                (LmConnectionPool  *pool);
+
+G_END_DECLS
+
+#endif /* __LM_CONNECTION_POOL_H__ */
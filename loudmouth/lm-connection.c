@@ -87,9 +87,11 @@
 #include "lm-debug.h"
 #include "lm-error.h"
 #include "lm-feature-ping.h"
+#include "lm-handler-pool.h"
 #include "lm-internals.h"
 #include "lm-message-queue.h"
 #include "lm-misc.h"
+#include "lm-mpsc-queue.h"
 #include "lm-ssl-internals.h"
 #include "lm-parser.h"
 #include "lm-sha.h"
@@ -101,8 +103,11 @@
 typedef struct {
     LmHandlerPriority  priority;
     LmMessageHandler  *handler;
+    gboolean           threaded;
 } HandlerData;
 
+#define DEFAULT_HANDLER_THREADS 4
+
 struct _LmConnection {
     /* Parameters */
     GMainContext      *context;
@@ -116,6 +121,7 @@ struct _LmConnection {
     LmOldSocket       *socket;
     LmSSL             *ssl;
     LmProxy           *proxy;
+    LmReactor         *reactor;
     LmParser          *parser;
 
     gchar             *stream_id;
@@ -139,18 +145,69 @@ struct _LmConnection {
     LmCallback        *auth_cb;
 
     LmCallback        *disconnect_cb;
+    LmCallback        *writable_cb;
+    LmCallback        *overflow_cb;
+
+    /* Output flow control */
+    gsize              send_low_watermark;
+    gsize              send_high_watermark;
+
+    /* Socket tuning */
+    gboolean           coalesce_writes;
+    gboolean           tcp_nodelay;
+    guint              send_buffer_size;
+    guint              receive_buffer_size;
 
     LmMessageQueue    *queue;
 
+    /* Limit on stanzas waiting for their handlers, 0 for none */
+    guint              incoming_max_stanzas;
+    gsize              incoming_max_bytes;
+    LmOverflowPolicy   overflow_policy;
+    gboolean           incoming_overflow;
+    guint              incoming_dropped;
+
+    /* The reply is read from the queue itself, reading can't be paused */
+    gboolean           in_blocking_send;
+
+    /* Chunks from lm_connection_send_threadsafe() */
+    LmMpscQueue       *send_queue;
+
+    /* Runs the handlers registered with
+     * lm_connection_register_threaded_message_handler() */
+    LmHandlerPool     *handler_pool;
+    gint               handler_threads;
+    LmCallback        *handler_key_cb;
+
     LmConnectionState  state;
 
     /* TODO: Move the rate to use the one in LmFeaturePing instead of keeping the two in sync */
     guint              keep_alive_rate;
     LmFeaturePing     *feature_ping;
+    /* Pings are sent by an LmConnectionPool instead of a timer of our own */
+    gboolean           keep_alive_shared;
+
+    /* Context acquired by lm_connection_get_fds() until the matching
+     * lm_connection_process() */
+    gboolean           external_acquired;
+    gint               external_priority;
 
     gint               ref_count;
 };
 
+typedef struct {
+    LmMpscNode     node;
+    LmOutputChunk *chunk;
+} SendItem;
+
+typedef struct {
+    LmMessage     *message;
+    GSList        *handlers;
+} HandlerJob;
+
+/* The connection whose handler job the current thread runs */
+static GPrivate handler_connection;
+
 typedef enum {
     AUTH_TYPE_PLAIN  = 1,
     AUTH_TYPE_DIGEST = 2,
@@ -201,8 +258,18 @@ static gboolean connection_send              (LmConnection        *connection,
                                               const gchar         *str,
                                               gint                 len,
                                               GError             **error);
+static gboolean connection_send_chunk        (LmConnection        *connection,
+                                              LmOutputChunk       *chunk,
+                                              const gchar         *key,
+                                              GError             **error);
 static void     connection_message_queue_cb  (LmMessageQueue      *queue,
                                               LmConnection        *connection);
+static void     connection_send_queue_cb     (LmMpscNode          *nodes,
+                                              LmConnection        *connection);
+static void     connection_free_send_items   (LmMpscNode          *nodes);
+static void     connection_run_handler_job   (HandlerJob          *job,
+                                              LmConnection        *connection);
+static void     connection_stop_handler_threads (LmConnection     *connection);
 static void
 connection_signal_disconnect                 (LmConnection        *connection,
                                               LmDisconnectReason   reason);
@@ -216,6 +283,8 @@ static void
 connection_socket_connect_cb                 (LmOldSocket         *socket,
                                               gboolean             result,
                                               LmConnection        *connection);
+static void     connection_socket_writable_cb (LmOldSocket        *socket,
+                                              LmConnection        *connection);
 static gboolean
 connection_get_server_from_jid               (const gchar         *jid,
                                               gchar              **server);
@@ -250,6 +319,16 @@ connection_free_handlers (LmConnection *connection)
     }
 }
 
+static GMainContext *
+connection_get_main_context (LmConnection *connection)
+{
+    if (connection->context) {
+        return connection->context;
+    }
+
+    return g_main_context_default ();
+}
+
 static void
 connection_free (LmConnection *connection)
 {
@@ -261,6 +340,10 @@ connection_free (LmConnection *connection)
         connection_do_close (connection);
     }
 
+    if (connection->handler_key_cb) {
+        _lm_utils_free_callback (connection->handler_key_cb);
+    }
+
     g_free (connection->server);
     g_free (connection->jid);
     g_free (connection->effective_jid);
@@ -288,13 +371,27 @@ connection_free (LmConnection *connection)
     }
 
     lm_connection_set_disconnect_function (connection, NULL, NULL, NULL);
+    lm_connection_set_writable_function (connection, NULL, NULL, NULL);
+    lm_connection_set_overflow_function (connection, NULL, NULL, NULL);
 
     if (connection->proxy) {
         lm_proxy_unref (connection->proxy);
     }
 
+    if (connection->reactor) {
+        lm_reactor_unref (connection->reactor);
+    }
+
     lm_message_queue_unref (connection->queue);
 
+    lm_mpsc_queue_detach (connection->send_queue);
+    connection_free_send_items (lm_mpsc_queue_pop_all (connection->send_queue));
+    lm_mpsc_queue_free (connection->send_queue);
+
+    if (connection->external_acquired) {
+        g_main_context_release (connection_get_main_context (connection));
+    }
+
     if (connection->context) {
         g_main_context_unref (connection->context);
     }
@@ -330,10 +427,147 @@ connection_run_message_handler (LmConnection *connection, LmMessage *m)
     return result;
 }
 
+static gboolean
+connection_close_idle_cb (LmConnection *connection)
+{
+    if (connection->state != LM_CONNECTION_STATE_CLOSED) {
+        lm_connection_close (connection, NULL);
+    }
+
+    lm_connection_unref (connection);
+
+    return FALSE;
+}
+
+static gboolean
+connection_unref_idle_cb (LmConnection *connection)
+{
+    lm_connection_unref (connection);
+
+    return FALSE;
+}
+
+/* Drops the reference of a handler job. The last reference is dropped on
+ * the thread running @connection, which owns the socket. */
+static void
+connection_unref_from_handler (LmConnection *connection)
+{
+    gint ref_count;
+
+    do {
+        ref_count = g_atomic_int_get (&connection->ref_count);
+        if (ref_count == 1) {
+            lm_misc_add_idle (connection->context,
+                              (GSourceFunc) connection_unref_idle_cb,
+                              connection);
+            return;
+        }
+    } while (!g_atomic_int_compare_and_exchange (&connection->ref_count,
+                                                 ref_count, ref_count - 1));
+}
+
+static void
+connection_run_handler_job (HandlerJob *job, LmConnection *connection)
+{
+    GSList          *l;
+    LmHandlerResult  result = LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+
+    g_private_set (&handler_connection, connection);
+
+    for (l = job->handlers; l; l = l->next) {
+        if (result == LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS) {
+            result = _lm_message_handler_handle_message (l->data,
+                                                         connection,
+                                                         job->message);
+        }
+
+        lm_message_handler_unref (l->data);
+    }
+
+    g_private_set (&handler_connection, NULL);
+
+    g_slist_free (job->handlers);
+    lm_message_unref (job->message);
+    g_slice_free (HandlerJob, job);
+
+    connection_unref_from_handler (connection);
+}
+
+/* Doesn't wait, the handlers still queued run on their own and each
+ * holds a reference on @connection until it is done. */
+static void
+connection_stop_handler_threads (LmConnection *connection)
+{
+    if (connection->handler_pool) {
+        lm_handler_pool_free (connection->handler_pool);
+        connection->handler_pool = NULL;
+    }
+}
+
+/* Bare JID of the sender, messages from the server share the empty key */
+static gchar *
+connection_get_handler_key (LmConnection *connection, LmMessage *m)
+{
+    const gchar *from;
+    const gchar *slash;
+
+    if (connection->handler_key_cb) {
+        LmHandlerKeyFunction func;
+
+        func = (LmHandlerKeyFunction) connection->handler_key_cb->func;
+
+        return (* func) (connection, m, connection->handler_key_cb->user_data);
+    }
+
+    from = lm_message_node_get_attribute (m->node, "from");
+    if (!from) {
+        return g_strdup ("");
+    }
+
+    slash = strchr (from, '/');
+    if (slash) {
+        return g_strndup (from, slash - from);
+    }
+
+    return g_strdup (from);
+}
+
+/* Hands @m to the handler threads, @handlers are in priority order */
+static void
+connection_queue_threaded_handlers (LmConnection *connection,
+                                    LmMessage    *m,
+                                    GSList       *handlers)
+{
+    HandlerJob *job;
+    gchar      *key;
+
+    if (!connection->handler_pool) {
+        connection->handler_pool =
+            lm_handler_pool_new (connection->handler_threads,
+                                 (LmHandlerPoolFunc) connection_run_handler_job,
+                                 connection);
+    }
+
+    /* Handlers on other threads may read it while this one goes on */
+    lm_message_freeze (m);
+
+    job = g_slice_new (HandlerJob);
+    job->message = lm_message_ref (m);
+    job->handlers = handlers;
+
+    /* Released by connection_run_handler_job() */
+    lm_connection_ref (connection);
+
+    key = connection_get_handler_key (connection, m);
+    lm_handler_pool_push (connection->handler_pool, key, job);
+    g_free (key);
+}
+
 static void
 connection_handle_message (LmConnection *connection, LmMessage *m)
 {
     GSList          *l;
+    GSList          *threaded = NULL;
     LmHandlerResult  result = LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 
     lm_connection_ref (connection);
@@ -357,11 +591,28 @@ connection_handle_message (LmConnection *connection, LmMessage *m)
          l = l->next) {
         HandlerData *hd = (HandlerData *) l->data;
 
+        if (hd->threaded) {
+            threaded = g_slist_prepend (threaded,
+                                        lm_message_handler_ref (hd->handler));
+            continue;
+        }
+
         result = _lm_message_handler_handle_message (hd->handler,
                                                      connection,
                                                      m);
     }
 
+    if (threaded) {
+        threaded = g_slist_reverse (threaded);
+
+        if (result == LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS) {
+            connection_queue_threaded_handlers (connection, m, threaded);
+        } else {
+            g_slist_free_full (threaded,
+                               (GDestroyNotify) lm_message_handler_unref);
+        }
+    }
+
     if (lm_message_get_type (m) == LM_MESSAGE_TYPE_STREAM_ERROR) {
         connection_stream_error (connection, m);
         goto out;
@@ -373,6 +624,140 @@ connection_handle_message (LmConnection *connection, LmMessage *m)
     return;
 }
 
+/* Stream level stanzas, requests and replies we wait for are dispatched
+ * ahead of presence and messages */
+static LmMessageQueuePriority
+connection_get_message_priority (LmConnection *connection, LmMessage *m)
+{
+    const gchar *id;
+
+    switch (lm_message_get_type (m)) {
+    case LM_MESSAGE_TYPE_MESSAGE:
+    case LM_MESSAGE_TYPE_PRESENCE:
+        return LM_MESSAGE_QUEUE_PRIORITY_NORMAL;
+    case LM_MESSAGE_TYPE_IQ:
+        break;
+    default:
+        return LM_MESSAGE_QUEUE_PRIORITY_HIGH;
+    }
+
+    switch (lm_message_get_sub_type (m)) {
+    case LM_MESSAGE_SUB_TYPE_GET:
+    case LM_MESSAGE_SUB_TYPE_SET:
+        return LM_MESSAGE_QUEUE_PRIORITY_HIGH;
+    default:
+        break;
+    }
+
+    id = lm_message_node_get_attribute (m->node, "id");
+    if (id && g_hash_table_lookup (connection->id_handlers, id)) {
+        return LM_MESSAGE_QUEUE_PRIORITY_HIGH;
+    }
+
+    return LM_MESSAGE_QUEUE_PRIORITY_NORMAL;
+}
+
+static gboolean
+connection_incoming_over_limit (LmConnection *connection, guint divisor)
+{
+    if (connection->incoming_max_stanzas &&
+        lm_message_queue_get_length (connection->queue) >
+        connection->incoming_max_stanzas / divisor) {
+        return TRUE;
+    }
+
+    if (connection->incoming_max_bytes &&
+        lm_message_queue_get_size (connection->queue) >
+        connection->incoming_max_bytes / divisor) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+connection_drop_incoming (LmConnection *connection)
+{
+    while (connection_incoming_over_limit (connection, 1)) {
+        LmMessage *m;
+
+        m = lm_message_queue_pop_oldest (connection->queue,
+                                         LM_MESSAGE_TYPE_PRESENCE);
+        if (!m) {
+            m = lm_message_queue_pop_oldest (connection->queue,
+                                             LM_MESSAGE_TYPE_MESSAGE);
+        }
+
+        if (!m) {
+            /* Only stanzas that can't be dropped are left */
+            return;
+        }
+
+        lm_verbose ("Incoming queue full, dropping a %s\n",
+                    _lm_message_type_to_string (lm_message_get_type (m)));
+
+        connection->incoming_dropped++;
+        lm_message_unref (m);
+    }
+}
+
+static void
+connection_check_incoming_limit (LmConnection *connection)
+{
+    if (connection->overflow_policy == LM_OVERFLOW_POLICY_DROP) {
+        connection_drop_incoming (connection);
+        return;
+    }
+
+    if (connection->incoming_overflow ||
+        !connection_incoming_over_limit (connection, 1)) {
+        return;
+    }
+
+    if (connection->overflow_policy == LM_OVERFLOW_POLICY_PAUSE_READING &&
+        connection->in_blocking_send) {
+        return;
+    }
+
+    connection->incoming_overflow = TRUE;
+
+    if (connection->overflow_policy == LM_OVERFLOW_POLICY_PAUSE_READING) {
+        if (connection->socket) {
+            lm_old_socket_set_reading_paused (connection->socket, TRUE);
+        }
+    } else if (connection->overflow_cb && connection->overflow_cb->func) {
+        LmCallback *cb = connection->overflow_cb;
+
+        (* ((LmOverflowFunction) cb->func)) (connection,
+                                             lm_message_queue_get_length (connection->queue),
+                                             cb->user_data);
+    }
+}
+
+static void
+connection_resume_incoming (LmConnection *connection)
+{
+    if (!connection->incoming_overflow) {
+        return;
+    }
+
+    connection->incoming_overflow = FALSE;
+
+    if (connection->socket) {
+        lm_old_socket_set_reading_paused (connection->socket, FALSE);
+    }
+}
+
+/* Resumes reading, and signals again on the next overflow, once the queue
+ * is down to half of the limit */
+static void
+connection_check_incoming_drained (LmConnection *connection)
+{
+    if (!connection_incoming_over_limit (connection, 2)) {
+        connection_resume_incoming (connection);
+    }
+}
+
 static void
 connection_new_message_cb (LmParser     *parser,
                            LmMessage    *m,
@@ -391,7 +776,10 @@ connection_new_message_cb (LmParser     *parser,
                 _lm_message_type_to_string (lm_message_get_type (m)),
                 from);
 
-    lm_message_queue_push_tail (connection->queue, m);
+    lm_message_queue_push_with_priority (connection->queue, m,
+                                         connection_get_message_priority (connection, m));
+
+    connection_check_incoming_limit (connection);
 }
 
 static void
@@ -418,7 +806,9 @@ connection_start_keep_alive (LmConnection *connection)
                       G_CALLBACK (connection_ping_timed_out),
                       connection);
 
-    lm_feature_ping_start (connection->feature_ping);
+    if (!connection->keep_alive_shared) {
+        lm_feature_ping_start (connection->feature_ping);
+    }
 }
 
 static void
@@ -449,13 +839,8 @@ connection_log_send (LmConnection *connection,
 }
 
 static gboolean
-connection_send (LmConnection  *connection,
-                 const gchar   *str,
-                 gint           len,
-                 GError       **error)
+connection_check_can_send (LmConnection *connection, GError **error)
 {
-    gint b_written;
-
     if (connection->state < LM_CONNECTION_STATE_OPENING) {
         g_log (LM_LOG_DOMAIN,LM_LOG_LEVEL_NET,
                "Connection is not open.\n");
@@ -467,15 +852,28 @@ connection_send (LmConnection  *connection,
         return FALSE;
     }
 
+    return TRUE;
+}
+
+static gboolean
+connection_send (LmConnection  *connection,
+                 const gchar   *str,
+                 gint           len,
+                 GError       **error)
+{
+    gint b_written;
+
+    if (!connection_check_can_send (connection, error)) {
+        return FALSE;
+    }
+
     if (len == -1) {
         len = strlen (str);
     }
 
     connection_log_send (connection, str, len);
 
-    /* Check to see if there already is an output buffer, if so, add to the
-       buffer and return */
-
+    /* If there already is an output buffer the data is appended to it */
     b_written = lm_old_socket_write (connection->socket, str, len);
 
     if (b_written < 0) {
@@ -489,65 +887,195 @@ connection_send (LmConnection  *connection,
     return TRUE;
 }
 
-static void
-connection_message_queue_cb (LmMessageQueue *queue, LmConnection *connection)
+/* Same as connection_send() but a chunk that can't be written right away is
+ * queued without copying it, replacing unsent output queued with @key */
+static gboolean
+connection_send_chunk (LmConnection   *connection,
+                       LmOutputChunk  *chunk,
+                       const gchar    *key,
+                       GError        **error)
 {
-    LmMessage *m;
-
-    m = lm_message_queue_pop_nth (connection->queue, 0);
+    gint b_written;
 
-    if (m) {
-        connection_handle_message (connection, m);
-        lm_message_unref (m);
+    if (!connection_check_can_send (connection, error)) {
+        return FALSE;
     }
-}
 
-/* Returns directly */
-/* Setups all data needed to start the connection attempts */
-static gboolean
-connection_do_open (LmConnection *connection, GError **error)
-{
-    gchar *domain = NULL;
+    connection_log_send (connection,
+                         lm_output_chunk_get_data (chunk),
+                         lm_output_chunk_get_length (chunk));
 
-    if (lm_connection_is_open (connection)) {
+    b_written = lm_old_socket_write_chunk_keyed (connection->socket,
+                                                 chunk, key);
+
+    if (b_written < 0) {
         g_set_error (error,
                      LM_ERROR,
-                     LM_ERROR_CONNECTION_NOT_OPEN,
-                     "Connection is already open, call lm_connection_close() first");
+                     LM_ERROR_CONNECTION_FAILED,
+                     "Server closed the connection");
         return FALSE;
     }
 
-    domain = _lm_connection_get_server (connection);
+    return TRUE;
+}
 
-    lm_verbose ("Connecting to: %s:%d\n", connection->server, connection->port);
+static void
+connection_message_queue_cb (LmMessageQueue *queue, LmConnection *connection)
+{
+    LmMessage *m;
 
-    connection->socket = lm_old_socket_create (connection->context,
-                                               (IncomingDataFunc) connection_incoming_data,
-                                               (SocketClosedFunc) connection_socket_closed_cb,
-                                               (ConnectResultFunc) connection_socket_connect_cb,
-                                               connection,
-                                               connection,
-                                               connection->server,
-                                               domain,
-                                               connection->port,
-                                               connection->ssl,
-                                               connection->proxy,
-                                               error);
+    m = lm_message_queue_pop_next (connection->queue);
 
-    g_free (domain);
+    connection_check_incoming_drained (connection);
 
-    if (!connection->socket) {
-        return FALSE;
+    if (m) {
+        connection_handle_message (connection, m);
+        lm_message_unref (m);
     }
+}
 
-    lm_message_queue_attach (connection->queue, connection->context);
+static void
+connection_free_send_items (LmMpscNode *nodes)
+{
+    while (nodes) {
+        SendItem *item = (SendItem *) nodes;
 
-    connection->state = LM_CONNECTION_STATE_OPENING;
+        nodes = nodes->next;
 
-    return TRUE;
+        lm_output_chunk_unref (item->chunk);
+        g_slice_free (SendItem, item);
+    }
 }
 
-void
+/* Writes a batch queued by other threads. Unless the connection already
+ * coalesces writes the batch is collected and written in one go. */
+static void
+connection_send_queue_cb (LmMpscNode *nodes, LmConnection *connection)
+{
+    LmMpscNode *node;
+    gboolean    batch;
+
+    if (!lm_connection_is_open (connection)) {
+        lm_verbose ("Dropping messages queued on a closed connection\n");
+        connection_free_send_items (nodes);
+        return;
+    }
+
+    lm_connection_ref (connection);
+
+    batch = nodes->next && !connection->coalesce_writes;
+    if (batch) {
+        lm_old_socket_set_coalesce (connection->socket, TRUE);
+    }
+
+    for (node = nodes; node; node = node->next) {
+        SendItem *item = (SendItem *) node;
+        GError   *error = NULL;
+
+        if (!connection_send_chunk (connection, item->chunk, NULL, &error)) {
+            lm_verbose ("Failed to send queued message: %s\n",
+                        error->message);
+            g_error_free (error);
+            break;
+        }
+    }
+
+    if (batch) {
+        lm_old_socket_set_coalesce (connection->socket,
+                                    connection->coalesce_writes);
+    }
+
+    connection_free_send_items (nodes);
+
+    lm_connection_unref (connection);
+}
+
+static LmOutputChunk *
+connection_message_to_chunk (LmMessage *message)
+{
+    gchar *xml_str;
+    gchar *ch;
+
+    xml_str = lm_message_node_to_string (message->node);
+    if ((ch = strstr (xml_str, "</stream:stream>"))) {
+        *ch = '\0';
+    }
+
+    return lm_output_chunk_new_take (xml_str, strlen (xml_str));
+}
+
+static void
+connection_push_chunk (LmConnection *connection, LmOutputChunk *chunk)
+{
+    SendItem *item;
+
+    item = g_slice_new (SendItem);
+    item->chunk = chunk;
+
+    lm_mpsc_queue_push (connection->send_queue, &item->node);
+}
+
+/* Returns directly */
+/* Setups all data needed to start the connection attempts */
+static gboolean
+connection_do_open (LmConnection *connection, GError **error)
+{
+    gchar *domain = NULL;
+
+    if (lm_connection_is_open (connection)) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_NOT_OPEN,
+                     "Connection is already open, call lm_connection_close() first");
+        return FALSE;
+    }
+
+    domain = _lm_connection_get_server (connection);
+
+    lm_verbose ("Connecting to: %s:%d\n", connection->server, connection->port);
+
+    connection->socket = lm_old_socket_create (connection->context,
+                                               (IncomingDataFunc) connection_incoming_data,
+                                               (SocketClosedFunc) connection_socket_closed_cb,
+                                               (ConnectResultFunc) connection_socket_connect_cb,
+                                               connection,
+                                               connection,
+                                               connection->server,
+                                               domain,
+                                               connection->port,
+                                               connection->ssl,
+                                               connection->proxy,
+                                               error);
+
+    g_free (domain);
+
+    if (!connection->socket) {
+        return FALSE;
+    }
+
+    lm_old_socket_set_watermarks (connection->socket,
+                                  connection->send_low_watermark,
+                                  connection->send_high_watermark);
+    lm_old_socket_set_writable_func (connection->socket,
+                                     (SocketWritableFunc) connection_socket_writable_cb);
+    lm_old_socket_set_reactor (connection->socket, connection->reactor);
+    lm_old_socket_set_coalesce (connection->socket,
+                                connection->coalesce_writes);
+    lm_old_socket_set_tcp_nodelay (connection->socket,
+                                   connection->tcp_nodelay);
+    lm_old_socket_set_buffer_sizes (connection->socket,
+                                    connection->send_buffer_size,
+                                    connection->receive_buffer_size);
+
+    lm_message_queue_attach (connection->queue, connection->context);
+
+    connection->incoming_overflow = FALSE;
+    connection->state = LM_CONNECTION_STATE_OPENING;
+
+    return TRUE;
+}
+
+void
 connection_do_close (LmConnection *connection)
 {
     connection_stop_keep_alive (connection);
@@ -558,6 +1086,9 @@ connection_do_close (LmConnection *connection)
 
     lm_message_queue_detach (connection->queue);
 
+    /* The handlers still queued finish on their own */
+    connection_stop_handler_threads (connection);
+
     if (!lm_connection_is_open (connection)) {
         /* lm_connection_is_open is FALSE for state OPENING as well */
         connection->state = LM_CONNECTION_STATE_CLOSED;
@@ -928,6 +1459,21 @@ connection_socket_connect_cb (LmOldSocket  *socket,
     connection_send_stream_header (connection);
 }
 
+static void
+connection_socket_writable_cb (LmOldSocket  *socket,
+                               LmConnection *connection)
+{
+    LmCallback *cb = connection->writable_cb;
+
+    if (!cb || !cb->func) {
+        return;
+    }
+
+    lm_connection_ref (connection);
+    (* ((LmWritableFunction) cb->func)) (connection, cb->user_data);
+    lm_connection_unref (connection);
+}
+
 static gboolean
 connection_get_server_from_jid (const gchar *jid, gchar **server)
 {
@@ -976,6 +1522,107 @@ connection_send_stream_header (LmConnection *connection)
     lm_message_unref (m);
 }
 
+/* Moving a connection to another context takes two steps, it is detached
+ * by the thread running its current context and attached by the one
+ * running the new context. Not possible while it is being opened or
+ * authenticated, or when it uses a reactor. */
+gboolean
+_lm_connection_detach (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    if (connection->state == LM_CONNECTION_STATE_OPENING ||
+        connection->state == LM_CONNECTION_STATE_AUTHENTICATING ||
+        connection->reactor) {
+        return FALSE;
+    }
+
+    if (connection->socket && !lm_old_socket_detach (connection->socket)) {
+        return FALSE;
+    }
+
+    if (connection->feature_ping) {
+        lm_feature_ping_stop (connection->feature_ping);
+    }
+
+    if (connection->state != LM_CONNECTION_STATE_CLOSED) {
+        lm_message_queue_detach (connection->queue);
+    }
+
+    /* Threads sending meanwhile only queue, the batch is written once
+     * attached again */
+    lm_mpsc_queue_detach (connection->send_queue);
+
+    return TRUE;
+}
+
+void
+_lm_connection_attach (LmConnection *connection, GMainContext *context)
+{
+    g_return_if_fail (connection != NULL);
+
+    if (connection->context) {
+        g_main_context_unref (connection->context);
+    }
+
+    connection->context = context ? g_main_context_ref (context) : NULL;
+
+    if (connection->socket) {
+        lm_old_socket_attach (connection->socket, context);
+    }
+
+    if (connection->state != LM_CONNECTION_STATE_CLOSED) {
+        lm_message_queue_attach (connection->queue, context);
+    }
+
+    lm_mpsc_queue_attach (connection->send_queue, context);
+
+    if (connection->feature_ping && !connection->keep_alive_shared) {
+        lm_feature_ping_start (connection->feature_ping);
+    }
+}
+
+void
+_lm_connection_set_keep_alive_shared (LmConnection *connection,
+                                      gboolean      shared)
+{
+    g_return_if_fail (connection != NULL);
+
+    if (connection->keep_alive_shared == shared) {
+        return;
+    }
+
+    connection->keep_alive_shared = shared;
+
+    if (connection->feature_ping) {
+        if (shared) {
+            lm_feature_ping_stop (connection->feature_ping);
+        } else {
+            lm_feature_ping_start (connection->feature_ping);
+        }
+    }
+}
+
+gboolean
+_lm_connection_keep_alive (LmConnection *connection)
+{
+    LmFeaturePing *fp;
+    gboolean       sent;
+
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    if (!connection->feature_ping || connection->keep_alive_rate == 0) {
+        return FALSE;
+    }
+
+    /* Timing out closes the connection, which drops the ping feature */
+    fp = g_object_ref (connection->feature_ping);
+    sent = lm_feature_ping_send (fp);
+    g_object_unref (fp);
+
+    return sent;
+}
+
 GMainContext *
 _lm_connection_get_context (LmConnection *conn)
 {
@@ -1190,6 +1837,8 @@ lm_connection_new (const gchar *server)
     connection->port        = LM_CONNECTION_DEFAULT_PORT;
     connection->queue       = lm_message_queue_new ((LmMessageQueueCallback) connection_message_queue_cb,
                                                           connection);
+    connection->send_queue  = lm_mpsc_queue_new ((LmMpscQueueFunc) connection_send_queue_cb,
+                                                 connection);
     connection->state       = LM_CONNECTION_STATE_CLOSED;
 
     connection->id_handlers = g_hash_table_new_full (g_str_hash,
@@ -1197,6 +1846,7 @@ lm_connection_new (const gchar *server)
                                                      g_free,
                                                      (GDestroyNotify) lm_message_handler_unref);
     connection->ref_count   = 1;
+    connection->handler_threads = DEFAULT_HANDLER_THREADS;
 
     for (i = 0; i < LM_MESSAGE_TYPE_UNKNOWN; ++i) {
         connection->handlers[i] = NULL;
@@ -1206,6 +1856,8 @@ lm_connection_new (const gchar *server)
         ((LmParserMessageFunction) connection_new_message_cb,
          connection, NULL);
 
+    lm_mpsc_queue_attach (connection->send_queue, NULL);
+
     return connection;
 }
 
@@ -1232,6 +1884,8 @@ lm_connection_new_with_context (const gchar *server, GMainContext *context)
         g_main_context_ref (connection->context);
     }
 
+    lm_mpsc_queue_attach (connection->send_queue, context);
+
     return connection;
 }
 
@@ -1337,6 +1991,10 @@ lm_connection_cancel_open (LmConnection *connection)
  *
  * A synchronous call to close the connection. When returning the connection is considered to be closed and can be opened again with lm_connection_open().
  *
+ * When called from a handler registered with
+ * lm_connection_register_threaded_message_handler() the connection is
+ * closed later by the thread running it.
+ *
  * Return value: Returns #TRUE if no errors where detected, otherwise #FALSE.
  **/
 gboolean
@@ -1346,6 +2004,15 @@ lm_connection_close (LmConnection *connection, GError **error)
 
     g_return_val_if_fail (connection != NULL, FALSE);
 
+    if (g_private_get (&handler_connection) == connection) {
+        /* Called by a threaded handler, the socket belongs to the
+         * thread running @connection */
+        lm_misc_add_idle (connection->context,
+                          (GSourceFunc) connection_close_idle_cb,
+                          lm_connection_ref (connection));
+        return TRUE;
+    }
+
     if (connection->socket) {
         lm_old_socket_asyncns_cancel (connection->socket);
     }
@@ -1843,6 +2510,155 @@ lm_connection_set_proxy (LmConnection *connection, LmProxy *proxy)
     }
 }
 
+/**
+ * lm_connection_get_reactor:
+ * @connection: an #LmConnection
+ *
+ * Returns the reactor watching the socket of @connection, if any.
+ *
+ * Return value: The reactor or %NULL if the socket is watched by its own source.
+ **/
+LmReactor *
+lm_connection_get_reactor (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, NULL);
+
+    return connection->reactor;
+}
+
+/**
+ * lm_connection_set_reactor:
+ * @connection: an #LmConnection
+ * @reactor: an #LmReactor or %NULL
+ *
+ * Makes @connection use @reactor to watch its socket instead of a source
+ * of its own. @reactor has to be attached to the same #GMainContext as
+ * @connection. Pass %NULL to stop using a reactor. Takes effect the next
+ * time @connection is opened.
+ **/
+void
+lm_connection_set_reactor (LmConnection *connection, LmReactor *reactor)
+{
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (reactor == NULL ||
+                      lm_reactor_get_context (reactor) == connection->context);
+
+    if (connection->state != LM_CONNECTION_STATE_CLOSED) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_VERBOSE,
+               "Can't change reactor while connected");
+        return;
+    }
+
+    if (connection->reactor) {
+        lm_reactor_unref (connection->reactor);
+    }
+
+    connection->reactor = reactor ? lm_reactor_ref (reactor) : NULL;
+}
+
+/**
+ * lm_connection_get_fds:
+ * @connection: an #LmConnection
+ * @fds: array to store the file descriptors to poll in
+ * @n_fds: the number of elements in @fds
+ * @timeout: location to store the number of milliseconds to wait at most before calling lm_connection_process(), -1 to wait for the file descriptors only
+ *
+ * Lets @connection run inside another event loop instead of a GLib main
+ * loop. Fills in @fds with the file descriptors to poll and the
+ * conditions to wait for in the events field. Once one of them is ready
+ * or @timeout has passed, set the revents fields and call
+ * lm_connection_process(), G_IO_IN for readable and G_IO_OUT for
+ * writable.
+ *
+ * This drives the whole #GMainContext of @connection, which should be a
+ * context of its own that nothing else runs, see
+ * lm_connection_new_with_context(). The context is held by the calling
+ * thread until lm_connection_process() is called. The set of file
+ * descriptors can change with every call into @connection, so fetch it
+ * again each time before waiting.
+ * <informalexample><programlisting><![CDATA[
+ * GPollFD fds[16];
+ * gint    n_fds, timeout;
+ *
+ * n_fds = lm_connection_get_fds (connection, fds, G_N_ELEMENTS (fds), &timeout);
+ * my_loop_wait (fds, n_fds, timeout);
+ * lm_connection_process (connection, fds, n_fds);
+ * ]]></programlisting></informalexample>
+ *
+ * Return value: The number of file descriptors needed. If it is larger than @n_fds only the first @n_fds were filled in, call again with a larger array.
+ **/
+gint
+lm_connection_get_fds (LmConnection *connection,
+                       GPollFD      *fds,
+                       gint          n_fds,
+                       gint         *timeout)
+{
+    GMainContext *context;
+
+    g_return_val_if_fail (connection != NULL, 0);
+    g_return_val_if_fail (fds != NULL || n_fds == 0, 0);
+    g_return_val_if_fail (timeout != NULL, 0);
+
+    context = connection_get_main_context (connection);
+
+    if (!connection->external_acquired) {
+        if (!g_main_context_acquire (context)) {
+            g_warning ("Can't drive a connection whose context is run by another thread");
+            *timeout = -1;
+            return 0;
+        }
+
+        connection->external_acquired = TRUE;
+    }
+
+    g_main_context_prepare (context, &connection->external_priority);
+
+    return g_main_context_query (context, connection->external_priority,
+                                 timeout, fds, n_fds);
+}
+
+/**
+ * lm_connection_process:
+ * @connection: an #LmConnection
+ * @fds: the file descriptors from lm_connection_get_fds() with their revents set
+ * @n_fds: the number of elements in @fds that were filled in
+ *
+ * Handles whatever is ready after waiting for the file descriptors
+ * returned by lm_connection_get_fds(), this is where incoming stanzas are
+ * parsed and handlers are called, queued output is written and timers
+ * fire. Call it after the timeout passed as well, with all revents set to
+ * 0.
+ **/
+void
+lm_connection_process (LmConnection *connection,
+                       GPollFD      *fds,
+                       gint          n_fds)
+{
+    GMainContext *context;
+
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (fds != NULL || n_fds == 0);
+
+    if (!connection->external_acquired) {
+        g_warning ("lm_connection_process() called without lm_connection_get_fds()");
+        return;
+    }
+
+    context = connection_get_main_context (connection);
+
+    lm_connection_ref (connection);
+
+    if (g_main_context_check (context, connection->external_priority,
+                              fds, n_fds)) {
+        g_main_context_dispatch (context);
+    }
+
+    connection->external_acquired = FALSE;
+    g_main_context_release (context);
+
+    lm_connection_unref (connection);
+}
+
 /**
  * lm_connection_send:
  * @connection: #LmConnection to send message over.
@@ -1858,20 +2674,49 @@ lm_connection_send (LmConnection  *connection,
                     LmMessage     *message,
                     GError       **error)
 {
-    gchar    *xml_str;
-    gchar    *ch;
-    gboolean  result;
+    LmOutputChunk *chunk;
+    gboolean       result;
 
     g_return_val_if_fail (connection != NULL, FALSE);
     g_return_val_if_fail (message != NULL, FALSE);
 
-    xml_str = lm_message_node_to_string (message->node);
-    if ((ch = strstr (xml_str, "</stream:stream>"))) {
-        *ch = '\0';
-    }
+    chunk = connection_message_to_chunk (message);
+    result = connection_send_chunk (connection, chunk, NULL, error);
+    lm_output_chunk_unref (chunk);
+
+    return result;
+}
+
+/**
+ * lm_connection_send_with_key:
+ * @connection: #LmConnection to send message over.
+ * @message: #LmMessage to send.
+ * @key: coalescing key, or %NULL
+ * @error: location to store error, or %NULL
+ *
+ * Like lm_connection_send() but tags @message with @key. If a message
+ * sent earlier with the same @key is still buffered and none of it has
+ * been written to the socket, it is replaced by @message instead of both
+ * being sent. This suits state that only matters in its latest form, such
+ * as presence, when the connection can't keep up with the sender.
+ *
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ **/
+gboolean
+lm_connection_send_with_key (LmConnection  *connection,
+                             LmMessage     *message,
+                             const gchar   *key,
+                             GError       **error)
+{
+    LmOutputChunk *chunk;
+    gboolean       result;
 
-    result = connection_send (connection, xml_str, -1, error);
-    g_free (xml_str);
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (message != NULL, FALSE);
+
+    chunk = connection_message_to_chunk (message);
+    result = connection_send_chunk (connection, chunk, key, error);
+    lm_output_chunk_unref (chunk);
 
     return result;
 }
@@ -1953,6 +2798,9 @@ lm_connection_send_with_reply_and_block (LmConnection  *connection,
 
     lm_message_queue_detach (connection->queue);
 
+    connection->in_blocking_send = TRUE;
+    connection_resume_incoming (connection);
+
     lm_connection_send (connection, message, error);
 
     while (!reply) {
@@ -1983,6 +2831,9 @@ lm_connection_send_with_reply_and_block (LmConnection  *connection,
     g_free (id);
     lm_message_queue_attach (connection->queue, connection->context);
 
+    connection->in_blocking_send = FALSE;
+    connection_check_incoming_limit (connection);
+
     return reply;
 }
 
@@ -2045,13 +2896,101 @@ lm_connection_register_message_handler  (LmConnection      *connection,
 }
 
 /**
- * lm_connection_unregister_message_handler:
- * @connection: Connection to unregister a handler for.
- * @handler: The handler to unregister.
- * @type: What type of messages to unregister this handler for.
- *
- * Unregisters a handler for @connection. @handler will no longer be called
- * when incoming messages of @type arrive.
+ * lm_connection_register_threaded_message_handler:
+ * @connection: Connection to register a handler for.
+ * @handler: Message handler to register.
+ * @type: Message type that @handler will handle.
+ * @priority: The priority in which to call @handler.
+ *
+ * Same as lm_connection_register_message_handler() but @handler is run on
+ * a pool of threads instead of the thread running @connection, so that a
+ * slow handler doesn't hold up reading and other connections.
+ *
+ * Threaded handlers run after the other handlers of @type, and only if
+ * none of them returned %LM_HANDLER_RESULT_REMOVE_MESSAGE. The message is
+ * frozen with lm_message_freeze() before it is passed on. Messages with
+ * the same key, by default the bare JID of the sender, are handled one at
+ * a time in the order they arrived, see lm_connection_set_handler_threads().
+ *
+ * Replies should be sent with lm_connection_send_threadsafe(), apart from
+ * lm_connection_close() no other function of @connection may be called
+ * from @handler. Unregister the
+ * handler with lm_connection_unregister_message_handler().
+ **/
+void
+lm_connection_register_threaded_message_handler (LmConnection      *connection,
+                                                 LmMessageHandler  *handler,
+                                                 LmMessageType      type,
+                                                 LmHandlerPriority  priority)
+{
+    HandlerData *hd;
+
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (handler != NULL);
+    g_return_if_fail (type != LM_MESSAGE_TYPE_UNKNOWN);
+
+    hd = g_new0 (HandlerData, 1);
+    hd->priority = priority;
+    hd->handler  = lm_message_handler_ref (handler);
+    hd->threaded = TRUE;
+
+    connection->handlers[type] = g_slist_insert_sorted (connection->handlers[type],
+                                                        hd,
+                                                        (GCompareFunc) connection_handler_compare_func);
+}
+
+/**
+ * lm_connection_set_handler_threads:
+ * @connection: an #LmConnection
+ * @max_threads: the maximum number of threads running handlers.
+ * @function: Function returning the key of a message, or %NULL.
+ * @user_data: User data passed to @function.
+ * @notify: Function that will be called with @user_data when @user_data needs to be freed. Pass #NULL if it shouldn't be freed.
+ *
+ * Configures how handlers registered with
+ * lm_connection_register_threaded_message_handler() are run. Messages for
+ * which @function returns the same key are handled in order, one at a
+ * time. @function is called by the thread running @connection. When
+ * @function is %NULL the bare JID of the sender is used. By default up to
+ * four threads are used.
+ *
+ * Doesn't wait for the messages already passed to the handler threads,
+ * they are still handled by the previous threads.
+ **/
+void
+lm_connection_set_handler_threads (LmConnection         *connection,
+                                   gint                  max_threads,
+                                   LmHandlerKeyFunction  function,
+                                   gpointer              user_data,
+                                   GDestroyNotify        notify)
+{
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (max_threads > 0);
+
+    connection_stop_handler_threads (connection);
+
+    if (connection->handler_key_cb) {
+        _lm_utils_free_callback (connection->handler_key_cb);
+        connection->handler_key_cb = NULL;
+    }
+
+    connection->handler_threads = max_threads;
+
+    if (function) {
+        connection->handler_key_cb = _lm_utils_new_callback (function,
+                                                             user_data,
+                                                             notify);
+    }
+}
+
+/**
+ * lm_connection_unregister_message_handler:
+ * @connection: Connection to unregister a handler for.
+ * @handler: The handler to unregister.
+ * @type: What type of messages to unregister this handler for.
+ *
+ * Unregisters a handler for @connection. @handler will no longer be called
+ * when incoming messages of @type arrive.
  **/
 void
 lm_connection_unregister_message_handler (LmConnection     *connection,
@@ -2107,6 +3046,383 @@ lm_connection_set_disconnect_function (LmConnection         *connection,
     }
 }
 
+/**
+ * lm_connection_set_send_watermarks:
+ * @connection: an #LmConnection
+ * @low: Number of buffered bytes at which @connection is considered writable again.
+ * @high: Number of buffered bytes at which @connection stops being writable, or 0 to disable flow control.
+ *
+ * Sets the watermarks used for flow control on outgoing data. Data that
+ * can't be written to the socket right away is kept in an output buffer.
+ * Once that buffer holds @high bytes or more, lm_connection_is_writable()
+ * returns %FALSE until it has drained down to @low bytes, at which point
+ * the function set with lm_connection_set_writable_function() is called.
+ *
+ * Sending is never refused because of the watermarks, it is up to the
+ * application to stop producing data while the connection isn't writable.
+ **/
+void
+lm_connection_set_send_watermarks (LmConnection *connection,
+                                   gsize         low,
+                                   gsize         high)
+{
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (high == 0 || low < high);
+
+    connection->send_low_watermark = low;
+    connection->send_high_watermark = high;
+
+    if (connection->socket) {
+        lm_old_socket_set_watermarks (connection->socket, low, high);
+    }
+}
+
+/**
+ * lm_connection_get_send_buffered:
+ * @connection: an #LmConnection
+ *
+ * Fetches the number of bytes that has been sent on @connection but not yet
+ * written to the socket.
+ *
+ * Return value: the number of buffered bytes
+ **/
+gsize
+lm_connection_get_send_buffered (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 0);
+
+    if (!connection->socket) {
+        return 0;
+    }
+
+    return lm_old_socket_get_buffered_bytes (connection->socket);
+}
+
+/**
+ * lm_connection_is_writable:
+ * @connection: an #LmConnection
+ *
+ * Checks if the output buffer of @connection is below the high watermark
+ * set with lm_connection_set_send_watermarks().
+ *
+ * Return value: %FALSE if the application should hold back data until @connection becomes writable again, %TRUE otherwise.
+ **/
+gboolean
+lm_connection_is_writable (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    if (!connection->socket) {
+        return TRUE;
+    }
+
+    return lm_old_socket_is_writable (connection->socket);
+}
+
+/**
+ * lm_connection_set_writable_function:
+ * @connection: Connection to register writable callback for.
+ * @function: Function to be called when @connection becomes writable again.
+ * @user_data: User data passed to @function.
+ * @notify: Function that will be called with @user_data when @user_data needs to be freed. Pass #NULL if it shouldn't be freed.
+ *
+ * Set the callback that will be called when the output buffer of
+ * @connection has drained below the low watermark after having passed the
+ * high watermark.
+ **/
+void
+lm_connection_set_writable_function (LmConnection       *connection,
+                                     LmWritableFunction  function,
+                                     gpointer            user_data,
+                                     GDestroyNotify      notify)
+{
+    g_return_if_fail (connection != NULL);
+
+    if (connection->writable_cb) {
+        _lm_utils_free_callback (connection->writable_cb);
+    }
+
+    if (function) {
+        connection->writable_cb = _lm_utils_new_callback (function,
+                                                          user_data,
+                                                          notify);
+    } else {
+        connection->writable_cb = NULL;
+    }
+}
+
+/**
+ * lm_connection_set_incoming_limit:
+ * @connection: an #LmConnection
+ * @max_stanzas: the maximum number of queued stanzas, 0 for no limit.
+ * @max_bytes: the maximum approximate size of the queued stanzas, 0 for no limit.
+ * @policy: what to do when the limit is reached.
+ *
+ * Limits the incoming stanzas that are waiting for their handlers to run,
+ * by default there is no limit. Once over the limit @policy is applied.
+ * Reading is resumed, and the overflow function called again, after the
+ * queue has been worked down to half of the limit.
+ **/
+void
+lm_connection_set_incoming_limit (LmConnection     *connection,
+                                  guint             max_stanzas,
+                                  gsize             max_bytes,
+                                  LmOverflowPolicy  policy)
+{
+    g_return_if_fail (connection != NULL);
+
+    connection->incoming_max_stanzas = max_stanzas;
+    connection->incoming_max_bytes = max_bytes;
+    connection->overflow_policy = policy;
+
+    connection_resume_incoming (connection);
+    connection_check_incoming_limit (connection);
+}
+
+/**
+ * lm_connection_set_overflow_function:
+ * @connection: Connection to register overflow callback for.
+ * @function: Function to be called when the incoming queue of @connection overflows.
+ * @user_data: User data passed to @function.
+ * @notify: Function that will be called with @user_data when @user_data needs to be freed. Pass #NULL if it shouldn't be freed.
+ *
+ * Set the callback that will be called when the incoming queue goes over
+ * the limit set with lm_connection_set_incoming_limit() and the policy is
+ * %LM_OVERFLOW_POLICY_SIGNAL.
+ **/
+void
+lm_connection_set_overflow_function (LmConnection       *connection,
+                                     LmOverflowFunction  function,
+                                     gpointer            user_data,
+                                     GDestroyNotify      notify)
+{
+    g_return_if_fail (connection != NULL);
+
+    if (connection->overflow_cb) {
+        _lm_utils_free_callback (connection->overflow_cb);
+    }
+
+    if (function) {
+        connection->overflow_cb = _lm_utils_new_callback (function,
+                                                          user_data,
+                                                          notify);
+    } else {
+        connection->overflow_cb = NULL;
+    }
+}
+
+/**
+ * lm_connection_get_incoming_queued:
+ * @connection: an #LmConnection
+ *
+ * Fetches the number of incoming stanzas waiting for their handlers.
+ *
+ * Return value: the incoming queue depth.
+ **/
+guint
+lm_connection_get_incoming_queued (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 0);
+
+    return lm_message_queue_get_length (connection->queue);
+}
+
+/**
+ * lm_connection_get_incoming_dropped:
+ * @connection: an #LmConnection
+ *
+ * Fetches the number of incoming stanzas dropped because of
+ * %LM_OVERFLOW_POLICY_DROP.
+ *
+ * Return value: the number of dropped stanzas.
+ **/
+guint
+lm_connection_get_incoming_dropped (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 0);
+
+    return connection->incoming_dropped;
+}
+
+/**
+ * lm_connection_set_coalesce_writes:
+ * @connection: an #LmConnection
+ * @coalesce: Whether to coalesce writes.
+ *
+ * When enabled, data sent on @connection is not written to the socket
+ * right away but buffered and flushed once the main loop gets back to
+ * @connection, so that everything sent from one callback goes out in as
+ * few system calls, TLS records and TCP segments as possible. Use
+ * lm_connection_flush() to write the buffered data earlier.
+ *
+ * Disabling coalescing flushes the data buffered so far.
+ **/
+void
+lm_connection_set_coalesce_writes (LmConnection *connection,
+                                   gboolean      coalesce)
+{
+    g_return_if_fail (connection != NULL);
+
+    connection->coalesce_writes = coalesce;
+
+    if (connection->socket) {
+        lm_old_socket_set_coalesce (connection->socket, coalesce);
+    }
+}
+
+/**
+ * lm_connection_get_coalesce_writes:
+ * @connection: an #LmConnection
+ *
+ * Fetches if writes on @connection are coalesced, see
+ * lm_connection_set_coalesce_writes().
+ *
+ * Return value: %TRUE if writes are coalesced.
+ **/
+gboolean
+lm_connection_get_coalesce_writes (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    return connection->coalesce_writes;
+}
+
+/**
+ * lm_connection_set_coalesce_presence:
+ * @connection: an #LmConnection
+ * @coalesce: Whether to coalesce incoming presence.
+ *
+ * When enabled, an incoming available or unavailable presence replaces an
+ * older one from the same full JID that is still waiting for the handlers
+ * to run, at the position of the older one. During presence floods, like
+ * joining a large chat room, handlers then only see the latest state of
+ * each resource. Subscription requests and errors are never replaced.
+ **/
+void
+lm_connection_set_coalesce_presence (LmConnection *connection,
+                                     gboolean      coalesce)
+{
+    g_return_if_fail (connection != NULL);
+
+    lm_message_queue_set_coalesce_presence (connection->queue, coalesce);
+}
+
+/**
+ * lm_connection_get_coalesce_presence:
+ * @connection: an #LmConnection
+ *
+ * Fetches if incoming presence on @connection is coalesced, see
+ * lm_connection_set_coalesce_presence().
+ *
+ * Return value: %TRUE if incoming presence is coalesced.
+ **/
+gboolean
+lm_connection_get_coalesce_presence (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    return lm_message_queue_get_coalesce_presence (connection->queue);
+}
+
+/**
+ * lm_connection_flush:
+ * @connection: an #LmConnection
+ * @error: location to store error, or %NULL
+ *
+ * Writes as much of the buffered outgoing data as the socket accepts
+ * without blocking. Whatever is left is written as soon as the socket
+ * becomes writable again.
+ *
+ * Return value: Returns #TRUE if no errors was detected, #FALSE otherwise.
+ **/
+gboolean
+lm_connection_flush (LmConnection *connection, GError **error)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    if (!lm_connection_is_open (connection)) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_NOT_OPEN,
+                     "Connection is not open, call lm_connection_open() first");
+        return FALSE;
+    }
+
+    if (!lm_old_socket_flush (connection->socket)) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_FAILED,
+                     "Server closed the connection");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * lm_connection_set_tcp_nodelay:
+ * @connection: an #LmConnection
+ * @nodelay: Whether to disable Nagle's algorithm.
+ *
+ * Sets the TCP_NODELAY option on the socket of @connection, sending small
+ * writes right away instead of waiting for outstanding data to be
+ * acknowledged. Takes effect immediately if @connection is open.
+ **/
+void
+lm_connection_set_tcp_nodelay (LmConnection *connection, gboolean nodelay)
+{
+    g_return_if_fail (connection != NULL);
+
+    connection->tcp_nodelay = nodelay;
+
+    if (connection->socket) {
+        lm_old_socket_set_tcp_nodelay (connection->socket, nodelay);
+    }
+}
+
+/**
+ * lm_connection_get_tcp_nodelay:
+ * @connection: an #LmConnection
+ *
+ * Fetches if TCP_NODELAY is set for @connection.
+ *
+ * Return value: %TRUE if Nagle's algorithm is disabled.
+ **/
+gboolean
+lm_connection_get_tcp_nodelay (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    return connection->tcp_nodelay;
+}
+
+/**
+ * lm_connection_set_socket_buffer_sizes:
+ * @connection: an #LmConnection
+ * @send_size: Size of the socket send buffer (SO_SNDBUF) in bytes, or 0 for the system default.
+ * @receive_size: Size of the socket receive buffer (SO_RCVBUF) in bytes, or 0 for the system default.
+ *
+ * Sets the kernel buffer sizes of the socket used by @connection. The
+ * receive buffer size should be set before opening @connection since it
+ * affects the TCP window negotiated when connecting.
+ **/
+void
+lm_connection_set_socket_buffer_sizes (LmConnection *connection,
+                                       guint         send_size,
+                                       guint         receive_size)
+{
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (send_size <= G_MAXINT && receive_size <= G_MAXINT);
+
+    connection->send_buffer_size = send_size;
+    connection->receive_buffer_size = receive_size;
+
+    if (connection->socket) {
+        lm_old_socket_set_buffer_sizes (connection->socket,
+                                        send_size, receive_size);
+    }
+}
+
 /**
  * lm_connection_send_raw:
  * @connection: Connection used to send
@@ -2128,6 +3444,49 @@ lm_connection_send_raw (LmConnection  *connection,
 
     return connection_send (connection, str, -1, error);
 }
+
+/**
+ * lm_connection_send_threadsafe:
+ * @connection: #LmConnection to send message over.
+ * @message: #LmMessage to send.
+ *
+ * Sends @message from any thread. The message is serialized by the calling
+ * thread and queued without taking a lock, the thread running the context
+ * of @connection writes it out. Messages queued while that thread is busy
+ * are written together in one batch, in the order they were queued.
+ *
+ * Errors can't be reported back to the caller, messages queued while
+ * @connection isn't open are dropped. The caller must hold a reference on
+ * @connection and must not modify @message while this call runs.
+ **/
+void
+lm_connection_send_threadsafe (LmConnection *connection,
+                               LmMessage    *message)
+{
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (message != NULL);
+
+    connection_push_chunk (connection, connection_message_to_chunk (message));
+}
+
+/**
+ * lm_connection_send_raw_threadsafe:
+ * @connection: Connection used to send
+ * @str: The string to send, the entire string will be sent.
+ *
+ * Same as lm_connection_send_threadsafe() but sends a raw string.
+ **/
+void
+lm_connection_send_raw_threadsafe (LmConnection *connection,
+                                   const gchar  *str)
+{
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (str != NULL);
+
+    connection_push_chunk (connection,
+                           lm_output_chunk_new_take (g_strdup (str),
+                                                     strlen (str)));
+}
 /**
  * lm_connection_get_state:
  * @connection: Connection to get state on
@@ -2173,7 +3532,7 @@ lm_connection_ref (LmConnection *connection)
 {
     g_return_val_if_fail (connection != NULL, NULL);
 
-    connection->ref_count++;
+    g_atomic_int_inc (&connection->ref_count);
 
     return connection;
 }
@@ -2190,9 +3549,7 @@ lm_connection_unref (LmConnection *connection)
 {
     g_return_if_fail (connection != NULL);
 
-    connection->ref_count--;
-
-    if (connection->ref_count == 0) {
+    if (g_atomic_int_dec_and_test (&connection->ref_count)) {
         connection_free (connection);
     }
 }
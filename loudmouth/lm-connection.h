@@ -27,6 +27,7 @@
 
 #include <loudmouth/lm-message.h>
 #include <loudmouth/lm-proxy.h>
+#include <loudmouth/lm-reactor.h>
 #include <loudmouth/lm-ssl.h>
 
 G_BEGIN_DECLS
@@ -123,6 +124,21 @@ typedef enum {
     LM_CONNECTION_STATE_AUTHENTICATED
 } LmConnectionState;
 
+/**
+ * LmOverflowPolicy:
+ * @LM_OVERFLOW_POLICY_PAUSE_READING: Stop reading from the socket until handlers have caught up, TCP flow control then holds back the server.
+ * @LM_OVERFLOW_POLICY_DROP: Drop the oldest queued presence, or if there is none the oldest queued message. Other stanzas are never dropped.
+ * @LM_OVERFLOW_POLICY_SIGNAL: Keep queuing and call the #LmOverflowFunction.
+ *
+ * What to do when more incoming stanzas are waiting for their handlers than
+ * allowed by lm_connection_set_incoming_limit().
+ */
+typedef enum {
+    LM_OVERFLOW_POLICY_PAUSE_READING,
+    LM_OVERFLOW_POLICY_DROP,
+    LM_OVERFLOW_POLICY_SIGNAL
+} LmOverflowPolicy;
+
 /**
  * LmResultFunction:
  * @connection: an #LmConnection
@@ -147,6 +163,45 @@ typedef void         (* LmDisconnectFunction) (LmConnection       *connection,
                                                LmDisconnectReason  reason,
                                                gpointer            user_data);
 
+/**
+ * LmHandlerKeyFunction:
+ * @connection: an #LmConnection
+ * @message: an incoming #LmMessage
+ * @user_data: User data passed when function being called.
+ *
+ * Callback returning the key that orders the messages passed to threaded
+ * handlers, see lm_connection_set_handler_threads().
+ *
+ * Returns: a newly allocated key.
+ */
+typedef gchar *      (* LmHandlerKeyFunction) (LmConnection       *connection,
+                                               LmMessage          *message,
+                                               gpointer            user_data);
+
+/**
+ * LmWritableFunction:
+ * @connection: an #LmConnection
+ * @user_data: User data passed when function being called.
+ *
+ * Callback called when the output buffer of a connection has drained below
+ * the low watermark.
+ */
+typedef void         (* LmWritableFunction)   (LmConnection       *connection,
+                                               gpointer            user_data);
+
+/**
+ * LmOverflowFunction:
+ * @connection: an #LmConnection
+ * @queued: the number of incoming stanzas waiting for their handlers.
+ * @user_data: User data passed when function being called.
+ *
+ * Callback called when the incoming queue of a connection goes over its
+ * limit with %LM_OVERFLOW_POLICY_SIGNAL.
+ */
+typedef void         (* LmOverflowFunction)   (LmConnection       *connection,
+                                               guint               queued,
+                                               gpointer            user_data);
+
 LmConnection *lm_connection_new               (const gchar        *server);
 LmConnection *lm_connection_new_with_context  (const gchar        *server,
                                                GMainContext       *context);
@@ -201,9 +256,23 @@ void          lm_connection_set_ssl           (LmConnection       *connection,
 LmProxy *     lm_connection_get_proxy         (LmConnection       *connection);
 void          lm_connection_set_proxy         (LmConnection       *connection,
                                                LmProxy            *proxy);
+LmReactor *   lm_connection_get_reactor       (LmConnection       *connection);
+void          lm_connection_set_reactor       (LmConnection       *connection,
+                                               LmReactor          *reactor);
+gint          lm_connection_get_fds           (LmConnection       *connection,
+                                               GPollFD            *fds,
+                                               gint                n_fds,
+                                               gint               *timeout);
+void          lm_connection_process           (LmConnection       *connection,
+                                               GPollFD            *fds,
+                                               gint                n_fds);
 gboolean      lm_connection_send              (LmConnection       *connection,
                                                LmMessage          *message,
                                                GError            **error);
+gboolean      lm_connection_send_with_key     (LmConnection       *connection,
+                                               LmMessage          *message,
+                                               const gchar        *key,
+                                               GError            **error);
 gboolean      lm_connection_send_with_reply   (LmConnection       *connection,
                                                LmMessage          *message,
                                                LmMessageHandler   *handler,
@@ -221,6 +290,17 @@ lm_connection_register_message_handler        (LmConnection       *connection,
                                                LmMessageType       type,
                                                LmHandlerPriority   priority);
 void
+lm_connection_register_threaded_message_handler (LmConnection     *connection,
+                                               LmMessageHandler   *handler,
+                                               LmMessageType       type,
+                                               LmHandlerPriority   priority);
+void
+lm_connection_set_handler_threads             (LmConnection       *connection,
+                                               gint                max_threads,
+                                               LmHandlerKeyFunction function,
+                                               gpointer            user_data,
+                                               GDestroyNotify      notify);
+void
 lm_connection_unregister_message_handler      (LmConnection       *connection,
                                                LmMessageHandler   *handler,
                                                LmMessageType       type);
@@ -230,9 +310,51 @@ lm_connection_set_disconnect_function         (LmConnection       *connection,
                                                gpointer             user_data,
                                                GDestroyNotify       notify);
 
+void          lm_connection_set_send_watermarks (LmConnection     *connection,
+                                               gsize               low,
+                                               gsize               high);
+gsize         lm_connection_get_send_buffered (LmConnection       *connection);
+gboolean      lm_connection_is_writable       (LmConnection       *connection);
+void
+lm_connection_set_writable_function           (LmConnection       *connection,
+                                               LmWritableFunction  function,
+                                               gpointer            user_data,
+                                               GDestroyNotify      notify);
+
+void          lm_connection_set_incoming_limit (LmConnection      *connection,
+                                               guint               max_stanzas,
+                                               gsize               max_bytes,
+                                               LmOverflowPolicy    policy);
+void
+lm_connection_set_overflow_function           (LmConnection       *connection,
+                                               LmOverflowFunction  function,
+                                               gpointer            user_data,
+                                               GDestroyNotify      notify);
+guint         lm_connection_get_incoming_queued (LmConnection     *connection);
+guint         lm_connection_get_incoming_dropped (LmConnection    *connection);
+
+void          lm_connection_set_coalesce_writes (LmConnection     *connection,
+                                               gboolean            coalesce);
+gboolean      lm_connection_get_coalesce_writes (LmConnection     *connection);
+void          lm_connection_set_coalesce_presence (LmConnection   *connection,
+                                               gboolean            coalesce);
+gboolean      lm_connection_get_coalesce_presence (LmConnection   *connection);
+gboolean      lm_connection_flush             (LmConnection       *connection,
+                                               GError            **error);
+void          lm_connection_set_tcp_nodelay   (LmConnection       *connection,
+                                               gboolean            nodelay);
+gboolean      lm_connection_get_tcp_nodelay   (LmConnection       *connection);
+void          lm_connection_set_socket_buffer_sizes (LmConnection *connection,
+                                               guint               send_size,
+                                               guint               receive_size);
+
 gboolean      lm_connection_send_raw          (LmConnection       *connection,
                                                const gchar        *str,
                                                GError            **error);
+void          lm_connection_send_threadsafe   (LmConnection       *connection,
+                                               LmMessage          *message);
+void          lm_connection_send_raw_threadsafe (LmConnection     *connection,
+                                               const gchar        *str);
 LmConnectionState lm_connection_get_state     (LmConnection       *connection);
 gchar *       lm_connection_get_local_host    (LmConnection       *connection);
 LmConnection* lm_connection_ref               (LmConnection       *connection);
@@ -275,4 +275,10 @@ lm_feature_ping_stop (LmFeaturePing *fp)
     priv->keep_alive_source = NULL;
 }
 
+gboolean
+lm_feature_ping_send (LmFeaturePing *fp)
+{
+    g_return_val_if_fail (LM_IS_FEATURE_PING (fp), FALSE);
 
+    return feature_ping_send_keep_alive (fp);
+}
@@ -47,6 +47,9 @@ GType   lm_feature_ping_get_type  (void);
 
 void    lm_feature_ping_start     (LmFeaturePing *fp);
 void    lm_feature_ping_stop      (LmFeaturePing *fp);
+/* Sends a ping right away, for pings scheduled by the caller instead of
+ * lm_feature_ping_start(). Returns FALSE if the pings timed out. */
+gboolean lm_feature_ping_send     (LmFeaturePing *fp);
 
 G_END_DECLS
 
@@ -0,0 +1,169 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include "lm-debug.h"
+#include "lm-handler-pool.h"
+
+/* Jobs waiting for a key. Only exists while a thread works on the key,
+ * which is what keeps jobs with the same key in order. */
+typedef struct {
+    gchar  *key;
+    GQueue  jobs;
+} KeyQueue;
+
+struct _LmHandlerPool {
+    /* One for the owner and one for each key a thread works on */
+    gint               ref_count;
+
+    GThreadPool       *threads;
+
+    GMutex             lock;
+    GHashTable        *keys;
+
+    LmHandlerPoolFunc  func;
+    gpointer           user_data;
+};
+
+static void
+key_queue_free (KeyQueue *queue)
+{
+    g_free (queue->key);
+    g_slice_free (KeyQueue, queue);
+}
+
+static void
+handler_pool_unref (LmHandlerPool *pool)
+{
+    if (!g_atomic_int_dec_and_test (&pool->ref_count)) {
+        return;
+    }
+
+    g_hash_table_destroy (pool->keys);
+    g_mutex_clear (&pool->lock);
+
+    g_free (pool);
+}
+
+static void
+handler_pool_run (KeyQueue *queue, LmHandlerPool *pool)
+{
+    while (TRUE) {
+        gpointer job;
+
+        g_mutex_lock (&pool->lock);
+        job = g_queue_pop_head (&queue->jobs);
+        if (!job) {
+            g_hash_table_remove (pool->keys, queue->key);
+            g_mutex_unlock (&pool->lock);
+
+            handler_pool_unref (pool);
+            return;
+        }
+        g_mutex_unlock (&pool->lock);
+
+        (pool->func) (job, pool->user_data);
+    }
+}
+
+LmHandlerPool *
+lm_handler_pool_new (gint               max_threads,
+                     LmHandlerPoolFunc  func,
+                     gpointer           user_data)
+{
+    LmHandlerPool *pool;
+
+    g_return_val_if_fail (max_threads > 0, NULL);
+    g_return_val_if_fail (func != NULL, NULL);
+
+    pool = g_new0 (LmHandlerPool, 1);
+
+    pool->ref_count = 1;
+    g_mutex_init (&pool->lock);
+    pool->keys = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                        NULL,
+                                        (GDestroyNotify) key_queue_free);
+    pool->func = func;
+    pool->user_data = user_data;
+
+    pool->threads = g_thread_pool_new ((GFunc) handler_pool_run, pool,
+                                       max_threads, FALSE, NULL);
+
+    return pool;
+}
+
+/* Returns without waiting, the jobs already pushed still run and the
+ * pool goes away after the last one. Can be called from one of the
+ * jobs. */
+void
+lm_handler_pool_free (LmHandlerPool *pool)
+{
+    g_return_if_fail (pool != NULL);
+
+    g_thread_pool_free (pool->threads, FALSE, FALSE);
+    pool->threads = NULL;
+
+    handler_pool_unref (pool);
+}
+
+void
+lm_handler_pool_push (LmHandlerPool *pool, const gchar *key, gpointer job)
+{
+    KeyQueue *queue;
+    gboolean  idle = FALSE;
+
+    g_return_if_fail (pool != NULL);
+    g_return_if_fail (job != NULL);
+
+    if (!key) {
+        key = "";
+    }
+
+    g_mutex_lock (&pool->lock);
+
+    queue = g_hash_table_lookup (pool->keys, key);
+    if (!queue) {
+        queue = g_slice_new0 (KeyQueue);
+        queue->key = g_strdup (key);
+        g_queue_init (&queue->jobs);
+
+        g_hash_table_insert (pool->keys, queue->key, queue);
+        idle = TRUE;
+    }
+
+    g_queue_push_tail (&queue->jobs, job);
+
+    g_mutex_unlock (&pool->lock);
+
+    if (idle) {
+        GError *error = NULL;
+
+        /* Dropped by handler_pool_run() once the key is done */
+        g_atomic_int_inc (&pool->ref_count);
+
+        if (!g_thread_pool_push (pool->threads, queue, &error)) {
+            /* The pool still runs it once a thread is available */
+            lm_verbose ("Failed to start handler thread: %s\n",
+                        error->message);
+            g_error_free (error);
+        }
+    }
+}
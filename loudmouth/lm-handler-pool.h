@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_HANDLER_POOL_H__
+#define __LM_HANDLER_POOL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Runs jobs on a pool of threads. Jobs pushed with the same key run one
+ * after the other in the order they were pushed, jobs with different keys
+ * run in parallel. */
+typedef struct _LmHandlerPool LmHandlerPool;
+
+typedef void (* LmHandlerPoolFunc) (gpointer job,
+                                    gpointer user_data);
+
+LmHandlerPool * lm_handler_pool_new  (gint               max_threads,
+                                      LmHandlerPoolFunc  func,
+                                      gpointer           user_data);
+void            lm_handler_pool_free (LmHandlerPool     *pool);
+void            lm_handler_pool_push (LmHandlerPool     *pool,
+                                      const gchar       *key,
+                                      gpointer           job);
+
+G_END_DECLS
+
+#endif /* __LM_HANDLER_POOL_H__ */
@@ -57,11 +57,24 @@ typedef struct {
     struct addrinfo *current_addr;
     LmOldSocketT         fd;
     GIOChannel      *io_channel;
+    /* Waits for the connect to finish */
+    GSource         *watch;
+    gint64           start_time;
+    /* The LmSrvTarget the address belongs to, if any */
+    gpointer         srv_target;
 } LmConnectData;
 
 GMainContext *   _lm_connection_get_context       (LmConnection       *conn);
+gboolean         _lm_connection_detach            (LmConnection       *connection);
+void             _lm_connection_attach            (LmConnection       *connection,
+                                                   GMainContext       *context);
 /* Need to free the return value */
 gchar *          _lm_connection_get_server        (LmConnection       *conn);
+/* Keep alives of a shared connection are sent by the owner calling
+ * _lm_connection_keep_alive(), which returns FALSE if none are running */
+void             _lm_connection_set_keep_alive_shared (LmConnection   *connection,
+                                                       gboolean        shared);
+gboolean         _lm_connection_keep_alive        (LmConnection       *connection);
 gboolean         _lm_old_socket_failed_with_error (LmConnectData         *data,
                                                    int                    error);
 gboolean         _lm_old_socket_failed            (LmConnectData         *data);
@@ -83,6 +96,7 @@ void
 _lm_message_node_add_child_node               (LmMessageNode         *node,
                                                LmMessageNode         *child);
 LmMessageNode *  _lm_message_node_new         (const gchar           *name);
+gsize            _lm_message_node_get_size    (LmMessageNode         *node);
 void             _lm_debug_init               (void);
 gboolean         _lm_proxy_connect_cb         (GIOChannel            *source,
                                                GIOCondition           condition,
@@ -116,4 +130,19 @@ gchar       *    _lm_sock_get_local_host      (LmOldSocketT              sock);
 
 gboolean         _lm_sock_set_keepalive       (LmOldSocketT              sock,
                                                int                    delay);
+gboolean         _lm_sock_set_nodelay         (LmOldSocketT              sock,
+                                               gboolean               nodelay);
+gboolean         _lm_sock_set_cork            (LmOldSocketT              sock,
+                                               gboolean               cork);
+gboolean         _lm_sock_set_buffer_sizes    (LmOldSocketT              sock,
+                                               int                    send_size,
+                                               int                    receive_size);
+gssize           _lm_sock_write               (LmOldSocketT              sock,
+                                               const gchar           *buf,
+                                               gsize                  len);
+#ifndef G_OS_WIN32
+gssize           _lm_sock_writev              (LmOldSocketT              sock,
+                                               const struct iovec    *iov,
+                                               int                    n_iov);
+#endif /* G_OS_WIN32 */
 #endif /* __LM_INTERNALS_H__ */
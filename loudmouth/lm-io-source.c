@@ -0,0 +1,349 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include "lm-io-source.h"
+#include "lm-reactor-internals.h"
+
+/* g_source_add_unix_fd() lets GLib keep the descriptor registered instead
+ * of rebuilding a GPollFD for it every iteration */
+#if GLIB_CHECK_VERSION(2,36,0) && !defined(G_OS_WIN32)
+#define USE_UNIX_FD 1
+#endif
+
+#define ALWAYS_WATCHED (G_IO_ERR | G_IO_HUP | G_IO_NVAL)
+
+typedef struct {
+    GSource       source;
+    LmIOSource   *io_source;
+
+#ifdef USE_UNIX_FD
+    gpointer      tag;
+#else
+    GPollFD       pollfd;
+#endif
+} IOGSource;
+
+struct _LmIOSource {
+    GIOChannel     *channel;
+    GIOCondition    condition;
+
+    LmIOSourceFunc  func;
+    gpointer        user_data;
+
+    /* Exactly one of these watches the socket */
+    IOGSource      *source;
+    LmReactor      *reactor;
+
+    gboolean        destroyed;
+    gint            ref_count;
+};
+
+static gboolean    io_source_prepare_func    (GSource         *source,
+                                              gint            *timeout);
+static gboolean    io_source_check_func      (GSource         *source);
+static gboolean    io_source_dispatch_func   (GSource         *source,
+                                              GSourceFunc      callback,
+                                              gpointer         user_data);
+static void        io_source_finalize_func   (GSource         *source);
+
+static GSourceFuncs source_funcs = {
+    io_source_prepare_func,
+    io_source_check_func,
+    io_source_dispatch_func,
+    io_source_finalize_func
+};
+
+static GIOCondition
+io_source_get_revents (IOGSource *gsource)
+{
+#ifdef USE_UNIX_FD
+    return g_source_query_unix_fd ((GSource *) gsource, gsource->tag);
+#else
+    return gsource->pollfd.revents;
+#endif
+}
+
+static gboolean
+io_source_prepare_func (GSource *source, gint *timeout)
+{
+    *timeout = -1;
+
+    return FALSE;
+}
+
+static gboolean
+io_source_check_func (GSource *source)
+{
+    IOGSource *gsource = (IOGSource *) source;
+
+    return (io_source_get_revents (gsource) &
+            (gsource->io_source->condition | ALWAYS_WATCHED)) != 0;
+}
+
+static gboolean
+io_source_dispatch_func (GSource     *source,
+                         GSourceFunc  callback,
+                         gpointer     user_data)
+{
+    IOGSource  *gsource = (IOGSource *) source;
+    LmIOSource *io_source = gsource->io_source;
+
+    _lm_io_source_dispatch (io_source,
+                            io_source_get_revents (gsource) &
+                            (io_source->condition | ALWAYS_WATCHED));
+
+    return !io_source->destroyed;
+}
+
+static void
+io_source_finalize_func (GSource *source)
+{
+    _lm_io_source_unref (((IOGSource *) source)->io_source);
+}
+
+#ifndef USE_UNIX_FD
+static void
+io_source_setup_pollfd (IOGSource *gsource)
+{
+    LmIOSource *io_source = gsource->io_source;
+
+#ifdef G_OS_WIN32
+    g_io_channel_win32_make_pollfd (io_source->channel,
+                                    io_source->condition | ALWAYS_WATCHED,
+                                    &gsource->pollfd);
+#else
+    gsource->pollfd.fd = g_io_channel_unix_get_fd (io_source->channel);
+    gsource->pollfd.events = io_source->condition | ALWAYS_WATCHED;
+    gsource->pollfd.revents = 0;
+#endif
+}
+#endif /* USE_UNIX_FD */
+
+static LmIOSource *
+io_source_new (GIOChannel     *channel,
+               GIOCondition    condition,
+               LmIOSourceFunc  func,
+               gpointer        user_data)
+{
+    LmIOSource *io_source;
+
+    io_source = g_new0 (LmIOSource, 1);
+
+    io_source->channel = g_io_channel_ref (channel);
+    io_source->condition = condition;
+    io_source->func = func;
+    io_source->user_data = user_data;
+    io_source->ref_count = 1;
+
+    return io_source;
+}
+
+LmIOSource *
+lm_io_source_new (GMainContext   *context,
+                  GIOChannel     *channel,
+                  GIOCondition    condition,
+                  LmIOSourceFunc  func,
+                  gpointer        user_data)
+{
+    LmIOSource *io_source;
+    IOGSource  *gsource;
+
+    g_return_val_if_fail (channel != NULL, NULL);
+    g_return_val_if_fail (func != NULL, NULL);
+
+    io_source = io_source_new (channel, condition, func, user_data);
+
+    gsource = (IOGSource *) g_source_new (&source_funcs, sizeof (IOGSource));
+    gsource->io_source = _lm_io_source_ref (io_source);
+    io_source->source = gsource;
+
+#ifdef USE_UNIX_FD
+    gsource->tag = g_source_add_unix_fd ((GSource *) gsource,
+                                         g_io_channel_unix_get_fd (channel),
+                                         condition | ALWAYS_WATCHED);
+#else
+    io_source_setup_pollfd (gsource);
+    g_source_add_poll ((GSource *) gsource, &gsource->pollfd);
+#endif
+
+    g_source_attach ((GSource *) gsource, context);
+    g_source_unref ((GSource *) gsource);
+
+    return io_source;
+}
+
+LmIOSource *
+lm_io_source_new_with_reactor (LmReactor      *reactor,
+                               GIOChannel     *channel,
+                               GIOCondition    condition,
+                               LmIOSourceFunc  func,
+                               gpointer        user_data)
+{
+    LmIOSource *io_source;
+
+    g_return_val_if_fail (reactor != NULL, NULL);
+    g_return_val_if_fail (channel != NULL, NULL);
+    g_return_val_if_fail (func != NULL, NULL);
+
+    io_source = io_source_new (channel, condition, func, user_data);
+    io_source->reactor = lm_reactor_ref (reactor);
+
+    _lm_reactor_add (reactor, io_source, condition | ALWAYS_WATCHED);
+
+    return io_source;
+}
+
+void
+lm_io_source_set_condition (LmIOSource *io_source, GIOCondition condition)
+{
+    g_return_if_fail (io_source != NULL);
+
+    if (io_source->condition == condition || io_source->destroyed) {
+        return;
+    }
+
+    io_source->condition = condition;
+
+    if (io_source->reactor) {
+        _lm_reactor_modify (io_source->reactor, io_source,
+                            condition | ALWAYS_WATCHED);
+        return;
+    }
+
+#ifdef USE_UNIX_FD
+    g_source_modify_unix_fd ((GSource *) io_source->source,
+                             io_source->source->tag,
+                             condition | ALWAYS_WATCHED);
+#elif defined(G_OS_WIN32)
+    /* The event object is bound to the condition it was created for */
+    g_source_remove_poll ((GSource *) io_source->source,
+                          &io_source->source->pollfd);
+    io_source_setup_pollfd (io_source->source);
+    g_source_add_poll ((GSource *) io_source->source,
+                       &io_source->source->pollfd);
+#else
+    /* Picked up when the poll array is built for the next iteration */
+    io_source->source->pollfd.events = condition | ALWAYS_WATCHED;
+#endif
+}
+
+GIOCondition
+lm_io_source_get_condition (LmIOSource *io_source)
+{
+    g_return_val_if_fail (io_source != NULL, 0);
+
+    return io_source->condition;
+}
+
+gboolean
+lm_io_source_is_edge_triggered (LmIOSource *io_source)
+{
+    g_return_val_if_fail (io_source != NULL, FALSE);
+
+    return io_source->reactor != NULL;
+}
+
+/* Makes sure @io_source is dispatched again with @condition even though
+ * nothing changed on the socket, for a user that stopped reading or
+ * writing before the socket would block. Level triggered sources are
+ * dispatched again anyway. */
+void
+lm_io_source_mark_ready (LmIOSource *io_source, GIOCondition condition)
+{
+    g_return_if_fail (io_source != NULL);
+
+    if (io_source->reactor && !io_source->destroyed) {
+        _lm_reactor_mark_ready (io_source->reactor, io_source, condition);
+    }
+}
+
+void
+lm_io_source_destroy (LmIOSource *io_source)
+{
+    g_return_if_fail (io_source != NULL);
+
+    if (io_source->destroyed) {
+        return;
+    }
+
+    io_source->destroyed = TRUE;
+
+    if (io_source->reactor) {
+        _lm_reactor_remove (io_source->reactor, io_source);
+    } else {
+        g_source_destroy ((GSource *) io_source->source);
+    }
+
+    _lm_io_source_unref (io_source);
+}
+
+gint
+_lm_io_source_get_fd (LmIOSource *io_source)
+{
+    return g_io_channel_unix_get_fd (io_source->channel);
+}
+
+LmIOSource *
+_lm_io_source_ref (LmIOSource *io_source)
+{
+    io_source->ref_count++;
+
+    return io_source;
+}
+
+void
+_lm_io_source_unref (LmIOSource *io_source)
+{
+    io_source->ref_count--;
+
+    if (io_source->ref_count == 0) {
+        if (io_source->reactor) {
+            lm_reactor_unref (io_source->reactor);
+        }
+
+        g_io_channel_unref (io_source->channel);
+        g_free (io_source);
+    }
+}
+
+gboolean
+_lm_io_source_is_destroyed (LmIOSource *io_source)
+{
+    return io_source->destroyed;
+}
+
+/* Runs the callback, which owns @io_source until it returns FALSE */
+void
+_lm_io_source_dispatch (LmIOSource *io_source, GIOCondition condition)
+{
+    if (io_source->destroyed || condition == 0) {
+        return;
+    }
+
+    _lm_io_source_ref (io_source);
+
+    if (!(io_source->func) (io_source, condition, io_source->user_data)) {
+        lm_io_source_destroy (io_source);
+    }
+
+    _lm_io_source_unref (io_source);
+}
@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_IO_SOURCE_H__
+#define __LM_IO_SOURCE_H__
+
+#include <glib.h>
+
+#include "lm-reactor.h"
+
+G_BEGIN_DECLS
+
+/* Single watch on a socket for everything it is interested in, the
+ * condition is changed in place instead of adding and removing watches.
+ * G_IO_ERR and G_IO_HUP are always watched for.
+ *
+ * The watch is either its own GSource or registered with an LmReactor. A
+ * reactor is edge triggered, users have to read and write until the
+ * socket would block or call lm_io_source_mark_ready() to be dispatched
+ * again. */
+typedef struct _LmIOSource LmIOSource;
+
+typedef gboolean (* LmIOSourceFunc) (LmIOSource    *source,
+                                     GIOCondition   condition,
+                                     gpointer       user_data);
+
+LmIOSource *  lm_io_source_new            (GMainContext   *context,
+                                           GIOChannel     *channel,
+                                           GIOCondition    condition,
+                                           LmIOSourceFunc  func,
+                                           gpointer        user_data);
+LmIOSource *  lm_io_source_new_with_reactor (LmReactor    *reactor,
+                                             GIOChannel   *channel,
+                                             GIOCondition  condition,
+                                             LmIOSourceFunc func,
+                                             gpointer      user_data);
+void          lm_io_source_set_condition  (LmIOSource     *source,
+                                           GIOCondition    condition);
+GIOCondition  lm_io_source_get_condition  (LmIOSource     *source);
+gboolean      lm_io_source_is_edge_triggered (LmIOSource  *source);
+void          lm_io_source_mark_ready     (LmIOSource     *source,
+                                           GIOCondition    condition);
+void          lm_io_source_destroy        (LmIOSource     *source);
+
+/* Used by LmReactor */
+gint          _lm_io_source_get_fd        (LmIOSource     *source);
+LmIOSource *  _lm_io_source_ref           (LmIOSource     *source);
+void          _lm_io_source_unref         (LmIOSource     *source);
+gboolean      _lm_io_source_is_destroyed  (LmIOSource     *source);
+void          _lm_io_source_dispatch      (LmIOSource     *source,
+                                           GIOCondition    condition);
+
+G_END_DECLS
+
+#endif /* __LM_IO_SOURCE_H__ */
@@ -30,6 +30,10 @@
 #include "lm-internals.h"
 #include "lm-message-node.h"
 
+/* Set in the reference count once the node is frozen, keeps the struct
+ * as it was. The references are counted in the bits below. */
+#define NODE_FROZEN (1 << 30)
+
 typedef struct {
     gchar *key;
     gchar *value;
@@ -37,6 +41,7 @@ typedef struct {
 
 static void            message_node_free            (LmMessageNode    *node);
 static LmMessageNode * message_node_last_child      (LmMessageNode    *node);
+static gboolean        message_node_is_frozen       (LmMessageNode    *node);
 
 static void
 message_node_free (LmMessageNode *node)
@@ -68,6 +73,12 @@ message_node_free (LmMessageNode *node)
     g_free (node);
 }
 
+static gboolean
+message_node_is_frozen (LmMessageNode *node)
+{
+    return (g_atomic_int_get (&node->ref_count) & NODE_FROZEN) != 0;
+}
+
 static LmMessageNode *
 message_node_last_child (LmMessageNode *node)
 {
@@ -108,12 +119,48 @@ _lm_message_node_new (const gchar *name)
 
     return node;
 }
+
+/* Roughly the number of bytes @node takes up as XML, without escaping */
+gsize
+_lm_message_node_get_size (LmMessageNode *node)
+{
+    LmMessageNode *child;
+    GSList        *l;
+    gsize          size;
+
+    g_return_val_if_fail (node != NULL, 0);
+
+    /* <name></name> */
+    size = 5;
+    if (node->name) {
+        size += 2 * strlen (node->name);
+    }
+
+    if (node->value) {
+        size += strlen (node->value);
+    }
+
+    for (l = node->attributes; l; l = l->next) {
+        KeyValuePair *kvp = (KeyValuePair *) l->data;
+
+        /* ' key="value"' */
+        size += strlen (kvp->key) + strlen (kvp->value) + 4;
+    }
+
+    for (child = node->children; child; child = child->next) {
+        size += _lm_message_node_get_size (child);
+    }
+
+    return size;
+}
+
 void
 _lm_message_node_add_child_node (LmMessageNode *node, LmMessageNode *child)
 {
     LmMessageNode *prev;
 
     g_return_if_fail (node != NULL);
+    g_return_if_fail (!message_node_is_frozen (node));
 
     prev = message_node_last_child (node);
     lm_message_node_ref (child);
@@ -155,6 +202,7 @@ void
 lm_message_node_set_value (LmMessageNode *node, const gchar *value)
 {
     g_return_if_fail (node != NULL);
+    g_return_if_fail (!message_node_is_frozen (node));
 
     g_free (node->value);
 
@@ -185,6 +233,7 @@ lm_message_node_add_child (LmMessageNode *node,
 
     g_return_val_if_fail (node != NULL, NULL);
     g_return_val_if_fail (name != NULL, NULL);
+    g_return_val_if_fail (!message_node_is_frozen (node), NULL);
 
     child = _lm_message_node_new (name);
 
@@ -246,6 +295,7 @@ lm_message_node_set_attribute (LmMessageNode *node,
     g_return_if_fail (node != NULL);
     g_return_if_fail (name != NULL);
     g_return_if_fail (value != NULL);
+    g_return_if_fail (!message_node_is_frozen (node));
 
     for (l = node->attributes; l; l = l->next) {
         KeyValuePair *kvp = (KeyValuePair *) l->data;
@@ -387,6 +437,7 @@ void
 lm_message_node_set_raw_mode (LmMessageNode *node, gboolean raw_mode)
 {
     g_return_if_fail (node != NULL);
+    g_return_if_fail (!message_node_is_frozen (node));
 
     node->raw_mode = raw_mode;
 }
@@ -404,7 +455,7 @@ lm_message_node_ref (LmMessageNode *node)
 {
     g_return_val_if_fail (node != NULL, NULL);
 
-    node->ref_count++;
+    g_atomic_int_inc (&node->ref_count);
 
     return node;
 }
@@ -424,13 +475,56 @@ lm_message_node_unref (LmMessageNode *node)
 {
     g_return_if_fail (node != NULL);
 
-    node->ref_count--;
-
-    if (node->ref_count == 0) {
+    /* Returns the count from before, the frozen flag aside */
+    if ((g_atomic_int_add (&node->ref_count, -1) & ~NODE_FROZEN) == 1) {
         message_node_free (node);
     }
 }
 
+/**
+ * lm_message_node_freeze:
+ * @node: an #LmMessageNode
+ *
+ * Makes @node and all of its children immutable. A frozen tree can be
+ * read by several threads at the same time, each holding its own
+ * reference, without copying it. Calls that would modify a frozen node
+ * fail with a warning. Freezing can't be undone, and has to be done by
+ * the thread that built the tree before it is shared.
+ **/
+void
+lm_message_node_freeze (LmMessageNode *node)
+{
+    LmMessageNode *child;
+
+    g_return_if_fail (node != NULL);
+
+    if (message_node_is_frozen (node)) {
+        return;
+    }
+
+    for (child = node->children; child; child = child->next) {
+        lm_message_node_freeze (child);
+    }
+
+    g_atomic_int_or (&node->ref_count, NODE_FROZEN);
+}
+
+/**
+ * lm_message_node_is_frozen:
+ * @node: an #LmMessageNode
+ *
+ * Checks if @node has been frozen with lm_message_node_freeze().
+ *
+ * Return value: %TRUE if @node can no longer be modified.
+ **/
+gboolean
+lm_message_node_is_frozen (LmMessageNode *node)
+{
+    g_return_val_if_fail (node != NULL, FALSE);
+
+    return message_node_is_frozen (node);
+}
+
 /**
  * lm_message_node_to_string:
  * @node: an #LmMessageNode
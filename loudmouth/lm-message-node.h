@@ -82,6 +82,8 @@ void           lm_message_node_set_raw_mode   (LmMessageNode *node,
 LmMessageNode *lm_message_node_ref            (LmMessageNode *node);
 void           lm_message_node_unref          (LmMessageNode *node);
 gchar *        lm_message_node_to_string      (LmMessageNode *node);
+void           lm_message_node_freeze         (LmMessageNode *node);
+gboolean       lm_message_node_is_frozen      (LmMessageNode *node);
 
 G_END_DECLS
 
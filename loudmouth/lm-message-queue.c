@@ -20,10 +20,23 @@
 
 #include <config.h>
 
+#include "lm-debug.h"
+#include "lm-internals.h"
 #include "lm-message-queue.h"
 
+/* Number of high priority messages dispatched in a row before a waiting
+ * normal one gets its turn */
+#define MAX_HIGH_PRIORITY_BURST 8
+
 struct _LmMessageQueue {
-    GQueue                  *messages;
+    GQueue                   messages[LM_MESSAGE_QUEUE_N_PRIORITIES];
+    guint                    high_burst;
+
+    /* Approximate size of the queued messages in bytes */
+    gsize                    size;
+
+    /* Full JID -> link of its queued presence, when coalescing */
+    GHashTable              *presences;
 
     GMainContext            *context;
     GSource                 *source;
@@ -63,14 +76,43 @@ foreach_free_message (LmMessage *m, gpointer user_data)
 static void
 message_queue_free (LmMessageQueue *queue)
 {
+    gint i;
+
     lm_message_queue_detach (queue);
 
-    g_queue_foreach (queue->messages, (GFunc) foreach_free_message, NULL);
-    g_queue_free (queue->messages);
+    if (queue->presences) {
+        g_hash_table_destroy (queue->presences);
+    }
+
+    for (i = 0; i < LM_MESSAGE_QUEUE_N_PRIORITIES; i++) {
+        g_queue_foreach (&queue->messages[i],
+                         (GFunc) foreach_free_message, NULL);
+        g_queue_clear (&queue->messages[i]);
+    }
 
     g_free (queue);
 }
 
+/* Finds the queue holding the @n:th message counted in priority order and
+ * turns @n into the position in that queue */
+static GQueue *
+message_queue_find_nth (LmMessageQueue *queue, guint *n)
+{
+    gint i;
+
+    for (i = 0; i < LM_MESSAGE_QUEUE_N_PRIORITIES; i++) {
+        guint length = g_queue_get_length (&queue->messages[i]);
+
+        if (*n < length) {
+            return &queue->messages[i];
+        }
+
+        *n -= length;
+    }
+
+    return NULL;
+}
+
 static gboolean
 message_queue_prepare_func (GSource *source, gint *timeout)
 {
@@ -78,7 +120,7 @@ message_queue_prepare_func (GSource *source, gint *timeout)
 
     queue = ((MessageQueueSource *)source)->queue;
 
-    return !g_queue_is_empty (queue->messages);
+    return !lm_message_queue_is_empty (queue);
 }
 
 static gboolean
@@ -108,10 +150,14 @@ lm_message_queue_new (LmMessageQueueCallback  callback,
                       gpointer                user_data)
 {
     LmMessageQueue *queue;
+    gint            i;
 
     queue = g_new0 (LmMessageQueue, 1);
 
-    queue->messages = g_queue_new ();
+    for (i = 0; i < LM_MESSAGE_QUEUE_N_PRIORITIES; i++) {
+        g_queue_init (&queue->messages[i]);
+    }
+
     queue->context = NULL;
     queue->source = NULL;
     queue->ref_count = 1;
@@ -162,45 +208,287 @@ lm_message_queue_detach (LmMessageQueue *queue)
     queue->context = NULL;
 }
 
+/* Presence telling the current state of a resource, only the latest one
+ * of those matters */
+static gboolean
+message_queue_is_state_presence (LmMessage *m)
+{
+    if (lm_message_get_type (m) != LM_MESSAGE_TYPE_PRESENCE) {
+        return FALSE;
+    }
+
+    switch (lm_message_get_sub_type (m)) {
+    case LM_MESSAGE_SUB_TYPE_NOT_SET:
+    case LM_MESSAGE_SUB_TYPE_AVAILABLE:
+    case LM_MESSAGE_SUB_TYPE_UNAVAILABLE:
+        break;
+    default:
+        return FALSE;
+    }
+
+    return lm_message_node_get_attribute (m->node, "from") != NULL;
+}
+
+/* Replaces a queued presence from the same full JID in place */
+static gboolean
+message_queue_coalesce_presence (LmMessageQueue *queue, LmMessage *m)
+{
+    GList     *link;
+    LmMessage *old;
+
+    if (!message_queue_is_state_presence (m)) {
+        return FALSE;
+    }
+
+    link = g_hash_table_lookup (queue->presences,
+                                lm_message_node_get_attribute (m->node, "from"));
+    if (!link) {
+        return FALSE;
+    }
+
+    old = link->data;
+    link->data = m;
+
+    /* The key points into the old message */
+    g_hash_table_remove (queue->presences,
+                         lm_message_node_get_attribute (old->node, "from"));
+    g_hash_table_insert (queue->presences,
+                         (gpointer) lm_message_node_get_attribute (m->node, "from"),
+                         link);
+
+    queue->size -= MIN (queue->size, _lm_message_node_get_size (old->node));
+    queue->size += _lm_message_node_get_size (m->node);
+
+    lm_verbose ("Replaced queued presence from %s\n",
+                lm_message_node_get_attribute (m->node, "from"));
+
+    lm_message_unref (old);
+
+    return TRUE;
+}
+
+/* While enabled a newer presence from the same full JID replaces the one
+ * still waiting in the queue, see message_queue_is_state_presence() */
+void
+lm_message_queue_set_coalesce_presence (LmMessageQueue *queue,
+                                        gboolean        coalesce)
+{
+    GList *l;
+
+    g_return_if_fail (queue != NULL);
+
+    if (!coalesce) {
+        if (queue->presences) {
+            g_hash_table_destroy (queue->presences);
+            queue->presences = NULL;
+        }
+        return;
+    }
+
+    if (queue->presences) {
+        return;
+    }
+
+    queue->presences = g_hash_table_new (g_str_hash, g_str_equal);
+
+    /* Index what is already queued, the latest presence wins */
+    for (l = queue->messages[LM_MESSAGE_QUEUE_PRIORITY_NORMAL].head; l; l = l->next) {
+        LmMessage *m = l->data;
+
+        if (message_queue_is_state_presence (m)) {
+            g_hash_table_insert (queue->presences,
+                                 (gpointer) lm_message_node_get_attribute (m->node, "from"),
+                                 l);
+        }
+    }
+}
+
+gboolean
+lm_message_queue_get_coalesce_presence (LmMessageQueue *queue)
+{
+    g_return_val_if_fail (queue != NULL, FALSE);
+
+    return queue->presences != NULL;
+}
+
 void
 lm_message_queue_push_tail (LmMessageQueue *queue, LmMessage *m)
 {
     g_return_if_fail (queue != NULL);
     g_return_if_fail (m != NULL);
 
-    g_queue_push_tail (queue->messages, m);
+    lm_message_queue_push_with_priority (queue, m,
+                                         LM_MESSAGE_QUEUE_PRIORITY_NORMAL);
 }
 
+void
+lm_message_queue_push_with_priority (LmMessageQueue         *queue,
+                                     LmMessage              *m,
+                                     LmMessageQueuePriority  priority)
+{
+    g_return_if_fail (queue != NULL);
+    g_return_if_fail (m != NULL);
+    g_return_if_fail (priority < LM_MESSAGE_QUEUE_N_PRIORITIES);
+
+    if (queue->presences && message_queue_coalesce_presence (queue, m)) {
+        return;
+    }
+
+    g_queue_push_tail (&queue->messages[priority], m);
+    queue->size += _lm_message_node_get_size (m->node);
+
+    if (queue->presences && message_queue_is_state_presence (m)) {
+        g_hash_table_insert (queue->presences,
+                             (gpointer) lm_message_node_get_attribute (m->node, "from"),
+                             queue->messages[priority].tail);
+    }
+}
+
+static LmMessage *
+message_queue_remove_link (LmMessageQueue *queue,
+                           GQueue         *messages,
+                           GList          *link)
+{
+    LmMessage *m;
+
+    if (!link) {
+        return NULL;
+    }
+
+    m = link->data;
+
+    if (queue->presences && message_queue_is_state_presence (m)) {
+        const gchar *from = lm_message_node_get_attribute (m->node, "from");
+
+        if (g_hash_table_lookup (queue->presences, from) == link) {
+            g_hash_table_remove (queue->presences, from);
+        }
+    }
+
+    g_queue_delete_link (messages, link);
+    queue->size -= MIN (queue->size, _lm_message_node_get_size (m->node));
+
+    return m;
+}
+
+/* Pops the message to dispatch next. High priority messages go first, but
+ * after a burst of them a waiting normal message is let through so that
+ * a flood of high priority messages doesn't starve the rest. */
+LmMessage *
+lm_message_queue_pop_next (LmMessageQueue *queue)
+{
+    GQueue *high;
+    GQueue *normal;
+
+    g_return_val_if_fail (queue != NULL, NULL);
+
+    high = &queue->messages[LM_MESSAGE_QUEUE_PRIORITY_HIGH];
+    normal = &queue->messages[LM_MESSAGE_QUEUE_PRIORITY_NORMAL];
+
+    if (!g_queue_is_empty (high) &&
+        (queue->high_burst < MAX_HIGH_PRIORITY_BURST ||
+         g_queue_is_empty (normal))) {
+        queue->high_burst++;
+        return message_queue_remove_link (queue, high, high->head);
+    }
+
+    queue->high_burst = 0;
+
+    return message_queue_remove_link (queue, normal, normal->head);
+}
+
+/* Removes the oldest normal priority message of @type, high priority
+ * messages are never removed */
+LmMessage *
+lm_message_queue_pop_oldest (LmMessageQueue *queue, LmMessageType type)
+{
+    GQueue *normal;
+    GList  *l;
+
+    g_return_val_if_fail (queue != NULL, NULL);
+
+    normal = &queue->messages[LM_MESSAGE_QUEUE_PRIORITY_NORMAL];
+
+    for (l = normal->head; l; l = l->next) {
+        LmMessage *m = l->data;
+
+        if (lm_message_get_type (m) == type) {
+            return message_queue_remove_link (queue, normal, l);
+        }
+    }
+
+    return NULL;
+}
+
+/* Messages are counted in priority order */
 LmMessage *
 lm_message_queue_peek_nth (LmMessageQueue *queue, guint n)
 {
+    GQueue *messages;
+
     g_return_val_if_fail (queue != NULL, NULL);
 
-    return (LmMessage *) g_queue_peek_nth (queue->messages, n);
+    messages = message_queue_find_nth (queue, &n);
+    if (!messages) {
+        return NULL;
+    }
+
+    return (LmMessage *) g_queue_peek_nth (messages, n);
 }
 
 LmMessage *
 lm_message_queue_pop_nth (LmMessageQueue *queue, guint n)
 {
+    GQueue *messages;
+
     g_return_val_if_fail (queue != NULL, NULL);
 
-    return (LmMessage *) g_queue_pop_nth (queue->messages, n);
+    messages = message_queue_find_nth (queue, &n);
+    if (!messages) {
+        return NULL;
+    }
+
+    return message_queue_remove_link (queue, messages,
+                                      g_queue_peek_nth_link (messages, n));
 }
 
 guint
 lm_message_queue_get_length (LmMessageQueue *queue)
 {
+    guint length = 0;
+    gint  i;
+
     g_return_val_if_fail (queue != NULL, 0);
 
-    return g_queue_get_length (queue->messages);
+    for (i = 0; i < LM_MESSAGE_QUEUE_N_PRIORITIES; i++) {
+        length += g_queue_get_length (&queue->messages[i]);
+    }
+
+    return length;
+}
+
+gsize
+lm_message_queue_get_size (LmMessageQueue *queue)
+{
+    g_return_val_if_fail (queue != NULL, 0);
+
+    return queue->size;
 }
 
 gboolean
 lm_message_queue_is_empty (LmMessageQueue *queue)
 {
+    gint i;
+
     g_return_val_if_fail (queue != NULL, TRUE);
 
-    return g_queue_is_empty (queue->messages);
+    for (i = 0; i < LM_MESSAGE_QUEUE_N_PRIORITIES; i++) {
+        if (!g_queue_is_empty (&queue->messages[i])) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
 }
 
 LmMessageQueue *
@@ -26,6 +26,14 @@
 
 typedef struct _LmMessageQueue LmMessageQueue;
 
+/* Messages of a higher priority are dispatched first, see
+ * lm_message_queue_pop_next() */
+typedef enum {
+    LM_MESSAGE_QUEUE_PRIORITY_HIGH,
+    LM_MESSAGE_QUEUE_PRIORITY_NORMAL,
+    LM_MESSAGE_QUEUE_N_PRIORITIES
+} LmMessageQueuePriority;
+
 typedef void (* LmMessageQueueCallback) (LmMessageQueue *queue,
                                          gpointer        user_data);
 
@@ -37,13 +45,24 @@ void              lm_message_queue_attach      (LmMessageQueue        *queue,
 void              lm_message_queue_detach      (LmMessageQueue *queue);
 void              lm_message_queue_push_tail   (LmMessageQueue *queue,
                                                 LmMessage      *m);
+void              lm_message_queue_push_with_priority (LmMessageQueue *queue,
+                                                LmMessage      *m,
+                                                LmMessageQueuePriority priority);
+LmMessage *       lm_message_queue_pop_next    (LmMessageQueue *queue);
 LmMessage *       lm_message_queue_peek_nth    (LmMessageQueue *queue,
                                                 guint           n);
 LmMessage *       lm_message_queue_pop_nth     (LmMessageQueue *queue,
                                                 guint           n);
 guint             lm_message_queue_get_length  (LmMessageQueue *queue);
+gsize             lm_message_queue_get_size    (LmMessageQueue *queue);
+LmMessage *       lm_message_queue_pop_oldest  (LmMessageQueue *queue,
+                                                LmMessageType   type);
 gboolean          lm_message_queue_is_empty    (LmMessageQueue *queue);
 
+void              lm_message_queue_set_coalesce_presence (LmMessageQueue *queue,
+                                                gboolean        coalesce);
+gboolean          lm_message_queue_get_coalesce_presence (LmMessageQueue *queue);
+
 LmMessageQueue *  lm_message_queue_ref         (LmMessageQueue *queue);
 void              lm_message_queue_unref       (LmMessageQueue *queue);
 
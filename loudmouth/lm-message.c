@@ -328,6 +328,37 @@ lm_message_get_node (LmMessage *message)
     return message->node;
 }
 
+/**
+ * lm_message_freeze:
+ * @message: an #LmMessage
+ *
+ * Makes @message immutable so that it can be shared between threads, see
+ * lm_message_node_freeze(). A frozen message can still be sent.
+ **/
+void
+lm_message_freeze (LmMessage *message)
+{
+    g_return_if_fail (message != NULL);
+
+    lm_message_node_freeze (message->node);
+}
+
+/**
+ * lm_message_is_frozen:
+ * @message: an #LmMessage
+ *
+ * Checks if @message has been frozen with lm_message_freeze().
+ *
+ * Return value: %TRUE if @message can no longer be modified.
+ **/
+gboolean
+lm_message_is_frozen (LmMessage *message)
+{
+    g_return_val_if_fail (message != NULL, FALSE);
+
+    return lm_message_node_is_frozen (message->node);
+}
+
 /**
  * lm_message_ref:
  * @message: an #LmMessage
@@ -341,7 +372,7 @@ lm_message_ref (LmMessage *message)
 {
     g_return_val_if_fail (message != NULL, NULL);
 
-    PRIV(message)->ref_count++;
+    g_atomic_int_inc (&PRIV(message)->ref_count);
 
     return message;
 }
@@ -358,9 +389,7 @@ lm_message_unref (LmMessage *message)
 {
     g_return_if_fail (message != NULL);
 
-    PRIV(message)->ref_count--;
-
-    if (PRIV(message)->ref_count == 0) {
+    if (g_atomic_int_dec_and_test (&PRIV(message)->ref_count)) {
         lm_message_node_unref (message->node);
         g_free (message->priv);
         g_free (message);
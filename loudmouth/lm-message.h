@@ -121,6 +121,8 @@ LmMessage *      lm_message_new_with_sub_type (const gchar      *to,
 LmMessageType    lm_message_get_type          (LmMessage        *message);
 LmMessageSubType lm_message_get_sub_type      (LmMessage        *message);
 LmMessageNode *  lm_message_get_node          (LmMessage        *message);
+void             lm_message_freeze            (LmMessage        *message);
+gboolean         lm_message_is_frozen         (LmMessage        *message);
 LmMessage *      lm_message_ref               (LmMessage        *message);
 void             lm_message_unref             (LmMessage        *message);
 
@@ -0,0 +1,230 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include "lm-mpsc-queue.h"
+
+typedef struct {
+    GSource      source;
+    LmMpscQueue *queue;
+} MpscQueueSource;
+
+struct _LmMpscQueue {
+    /* Last pushed node, the list runs backwards from it */
+    LmMpscNode      *head;
+
+    /* Context to wake up, only changed by the consumer. The lock keeps
+     * it alive while a producer wakes it up. */
+    GMutex           context_lock;
+    GMainContext    *context;
+    GSource         *source;
+
+    LmMpscQueueFunc  func;
+    gpointer         user_data;
+};
+
+static gboolean mpsc_source_prepare  (GSource     *source,
+                                      gint        *timeout);
+static gboolean mpsc_source_check    (GSource     *source);
+static gboolean mpsc_source_dispatch (GSource     *source,
+                                      GSourceFunc  callback,
+                                      gpointer     user_data);
+
+static GSourceFuncs source_funcs = {
+    mpsc_source_prepare,
+    mpsc_source_check,
+    mpsc_source_dispatch,
+    NULL
+};
+
+static gboolean
+mpsc_source_prepare (GSource *source, gint *timeout)
+{
+    LmMpscQueue *queue = ((MpscQueueSource *) source)->queue;
+
+    *timeout = -1;
+
+    return !lm_mpsc_queue_is_empty (queue);
+}
+
+static gboolean
+mpsc_source_check (GSource *source)
+{
+    LmMpscQueue *queue = ((MpscQueueSource *) source)->queue;
+
+    return !lm_mpsc_queue_is_empty (queue);
+}
+
+static gboolean
+mpsc_source_dispatch (GSource     *source,
+                      GSourceFunc  callback,
+                      gpointer     user_data)
+{
+    LmMpscQueue *queue = ((MpscQueueSource *) source)->queue;
+    LmMpscNode  *nodes;
+
+    nodes = lm_mpsc_queue_pop_all (queue);
+    if (nodes) {
+        (queue->func) (nodes, queue->user_data);
+    }
+
+    return TRUE;
+}
+
+LmMpscQueue *
+lm_mpsc_queue_new (LmMpscQueueFunc func, gpointer user_data)
+{
+    LmMpscQueue *queue;
+
+    g_return_val_if_fail (func != NULL, NULL);
+
+    queue = g_new0 (LmMpscQueue, 1);
+
+    g_mutex_init (&queue->context_lock);
+    queue->func = func;
+    queue->user_data = user_data;
+
+    return queue;
+}
+
+/* Nodes still queued are left to the caller, see lm_mpsc_queue_pop_all() */
+void
+lm_mpsc_queue_free (LmMpscQueue *queue)
+{
+    g_return_if_fail (queue != NULL);
+
+    lm_mpsc_queue_detach (queue);
+
+    g_mutex_clear (&queue->context_lock);
+    g_free (queue);
+}
+
+/* Can be called from any thread. Returns TRUE if the queue was empty, in
+ * which case the attached context has been woken up. */
+gboolean
+lm_mpsc_queue_push (LmMpscQueue *queue, LmMpscNode *node)
+{
+    LmMpscNode *head;
+
+    g_return_val_if_fail (queue != NULL, FALSE);
+    g_return_val_if_fail (node != NULL, FALSE);
+
+    do {
+        head = g_atomic_pointer_get (&queue->head);
+        node->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange (&queue->head,
+                                                     head, node));
+
+    if (head) {
+        /* Already pending, it is picked up with the same batch */
+        return FALSE;
+    }
+
+    /* Only taken when the queue was empty, the consumer may be detaching */
+    g_mutex_lock (&queue->context_lock);
+    if (queue->context) {
+        g_main_context_wakeup (queue->context);
+    }
+    g_mutex_unlock (&queue->context_lock);
+
+    return TRUE;
+}
+
+/* Takes all queued nodes, returned in the order they were pushed */
+LmMpscNode *
+lm_mpsc_queue_pop_all (LmMpscQueue *queue)
+{
+    LmMpscNode *head;
+    LmMpscNode *nodes = NULL;
+
+    g_return_val_if_fail (queue != NULL, NULL);
+
+    do {
+        head = g_atomic_pointer_get (&queue->head);
+    } while (head && !g_atomic_pointer_compare_and_exchange (&queue->head,
+                                                             head, NULL));
+
+    while (head) {
+        LmMpscNode *next = head->next;
+
+        head->next = nodes;
+        nodes = head;
+        head = next;
+    }
+
+    return nodes;
+}
+
+gboolean
+lm_mpsc_queue_is_empty (LmMpscQueue *queue)
+{
+    g_return_val_if_fail (queue != NULL, TRUE);
+
+    return g_atomic_pointer_get (&queue->head) == NULL;
+}
+
+void
+lm_mpsc_queue_attach (LmMpscQueue *queue, GMainContext *context)
+{
+    MpscQueueSource *source;
+
+    g_return_if_fail (queue != NULL);
+
+    lm_mpsc_queue_detach (queue);
+
+    if (!context) {
+        context = g_main_context_default ();
+    }
+
+    source = (MpscQueueSource *) g_source_new (&source_funcs,
+                                               sizeof (MpscQueueSource));
+    source->queue = queue;
+    queue->source = (GSource *) source;
+
+    g_source_attach (queue->source, context);
+
+    g_mutex_lock (&queue->context_lock);
+    queue->context = g_main_context_ref (context);
+    g_mutex_unlock (&queue->context_lock);
+}
+
+void
+lm_mpsc_queue_detach (LmMpscQueue *queue)
+{
+    GMainContext *context;
+
+    g_return_if_fail (queue != NULL);
+
+    if (queue->source) {
+        g_source_destroy (queue->source);
+        g_source_unref (queue->source);
+        queue->source = NULL;
+    }
+
+    g_mutex_lock (&queue->context_lock);
+    context = queue->context;
+    queue->context = NULL;
+    g_mutex_unlock (&queue->context_lock);
+
+    if (context) {
+        g_main_context_unref (context);
+    }
+}
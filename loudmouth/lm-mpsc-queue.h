@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_MPSC_QUEUE_H__
+#define __LM_MPSC_QUEUE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Lock free queue with any number of producer threads and a single
+ * consumer. Producers push nodes embedded in their own structures, the
+ * consumer takes everything pushed so far at once, in push order.
+ *
+ * Once attached to a context the consumer function is called from there
+ * with each batch. The context is only woken up by the push that finds
+ * the queue empty. */
+typedef struct _LmMpscQueue LmMpscQueue;
+typedef struct _LmMpscNode  LmMpscNode;
+
+struct _LmMpscNode {
+    LmMpscNode *next;
+};
+
+/* @nodes is the batch in push order, linked through their next fields */
+typedef void (* LmMpscQueueFunc) (LmMpscNode *nodes,
+                                  gpointer    user_data);
+
+LmMpscQueue * lm_mpsc_queue_new       (LmMpscQueueFunc  func,
+                                       gpointer         user_data);
+void          lm_mpsc_queue_free      (LmMpscQueue     *queue);
+gboolean      lm_mpsc_queue_push      (LmMpscQueue     *queue,
+                                       LmMpscNode      *node);
+LmMpscNode *  lm_mpsc_queue_pop_all   (LmMpscQueue     *queue);
+gboolean      lm_mpsc_queue_is_empty  (LmMpscQueue     *queue);
+void          lm_mpsc_queue_attach    (LmMpscQueue     *queue,
+                                       GMainContext    *context);
+void          lm_mpsc_queue_detach    (LmMpscQueue     *queue);
+
+G_END_DECLS
+
+#endif /* __LM_MPSC_QUEUE_H__ */
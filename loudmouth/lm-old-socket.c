@@ -42,17 +42,35 @@
 #include "lm-debug.h"
 #include "lm-error.h"
 #include "lm-internals.h"
+#include "lm-io-source.h"
 #include "lm-misc.h"
+#include "lm-output-queue.h"
 #include "lm-proxy.h"
 #include "lm-resolver.h"
 #include "lm-ssl.h"
 #include "lm-ssl-internals.h"
 #include "lm-sock.h"
+#include "lm-uring.h"
 #include "lm-old-socket.h"
 
-#define IN_BUFFER_SIZE 1024
+/* The receive buffer grows while reads keep filling it and shrinks back
+ * after a while of small reads */
+#define IN_BUFFER_MIN_SIZE   4096
+#define IN_BUFFER_MAX_SIZE   65536
+#define IN_SHRINK_AFTER      16
+/* Bytes read in one dispatch before giving other sources a chance */
+#define IN_MAX_READ_PER_DISPATCH (4 * IN_BUFFER_MAX_SIZE)
+
 #define SRV_LEN 8192
 
+/* How long an attempt to connect gets before the next address is raced
+ * against it, as recommended by RFC 8305 */
+#define CONNECT_ATTEMPT_DELAY 250
+
+/* Queued output is coalesced into writes of at most one TLS record */
+#define OUT_RECORD_SIZE 16384
+#define OUT_IOV_MAX     64
+
 struct _LmOldSocket {
     LmConnection      *connection;
     GMainContext      *context;
@@ -63,27 +81,78 @@ struct _LmOldSocket {
 
     LmSSL             *ssl;
     gboolean           ssl_started;
+    /* The TLS handshake is driven by the watch, which waits for ssl_wait.
+     * Output is queued until it is done. */
+    gboolean           ssl_handshaking;
+    gboolean           ssl_delayed;
+    /* Connected to an _xmpps-client target, TLS is started without
+     * StartTLS (XEP-0368) */
+    gboolean           direct_tls;
+    GIOCondition       ssl_wait;
+    GSource           *ssl_timer;
     LmProxy           *proxy;
 
     GIOChannel        *io_channel;
-    GSource           *watch_in;
-    GSource           *watch_err;
-    GSource           *watch_hup;
+    /* Watches for incoming data, for the socket to become writable while
+     * there is buffered output, and for errors */
+    LmIOSource        *watch;
+    LmReactor         *reactor;
+    /* Replaces the watch for plain sockets when io_uring is available */
+    LmUringSocket     *uring;
 
     LmOldSocketT       fd;
 
-    GSource           *watch_connect;
-
     gboolean           cancel_open;
 
-    GSource           *watch_out;
-    GString           *out_buf;
-
-    LmConnectData     *connect_data;
+    /* Condition the buffered output waits for, 0 if there is none */
+    GIOCondition       out_condition;
+    LmOutputQueue     *out_queue;
+    gchar             *out_record;
+    gsize              out_low_watermark;
+    gsize              out_high_watermark;
+    gboolean           out_blocked;
+
+    gchar             *in_buf;
+    gsize              in_buf_size;
+    guint              in_small_reads;
+
+    /* A TLS read returned because the TLS layer needs to write first */
+    gboolean           in_wants_write;
+
+    /* The reader can't keep up, incoming data is left in the kernel.
+     * Data io_uring received before its recv was cancelled is held in
+     * in_stash. */
+    gboolean           in_paused;
+    GString           *in_stash;
+
+    /* Writes are queued and flushed together from the output watch */
+    gboolean           coalesce;
+
+    gboolean           tcp_nodelay;
+    gint               send_buffer_size;
+    gint               receive_buffer_size;
+
+    /* Attempts to connect racing each other, the first to connect wins */
+    gboolean           connecting;
+    GSList            *connect_attempts;
+    GSource           *connect_timer;
+
+    /* SRV targets in the order to try them and the one being tried */
+    GList             *srv_targets;
+    GList             *srv_current;
+    /* The resolver is looking up the next host to connect to */
+    gboolean           resolving;
+    /* Looks up the _xmpps-client targets next to the _xmpp-client ones,
+     * srv_pending counts the lookups that haven't finished */
+    LmResolver        *tls_resolver;
+    guint              srv_pending;
+    /* Earlier resolvers, pending attempts use their results */
+    GSList            *old_resolvers;
 
     IncomingDataFunc   data_func;
     SocketClosedFunc   closed_func;
     ConnectResultFunc  connect_func;
+    SocketWritableFunc writable_func;
     gpointer           user_data;
 
     guint              ref_count;
@@ -92,29 +161,26 @@ struct _LmOldSocket {
 };
 
 static void         socket_free                    (LmOldSocket    *socket);
+static void         old_socket_start_attempt       (LmOldSocket    *socket);
+static void         old_socket_resolve_host        (LmOldSocket    *socket,
+                                                    const gchar    *host);
 static gboolean     socket_do_connect              (LmConnectData  *connect_data);
 static gboolean     socket_connect_cb              (GIOChannel     *source,
                                                     GIOCondition    condition,
                                                     LmConnectData  *connect_data);
-static gboolean     socket_in_event                (GIOChannel     *source,
-                                                    GIOCondition    condition,
-                                                    LmOldSocket    *socket);
-static gboolean     socket_hup_event               (GIOChannel     *source,
-                                                    GIOCondition    condition,
-                                                    LmOldSocket    *socket);
-static gboolean     socket_error_event             (GIOChannel     *source,
-                                                    GIOCondition    condition,
-                                                    LmOldSocket    *socket);
-static gboolean     socket_buffered_write_cb       (GIOChannel     *source,
+static gboolean     socket_io_cb                   (LmIOSource     *source,
                                                     GIOCondition    condition,
                                                     LmOldSocket    *socket);
 static void         socket_close_io_channel        (GIOChannel     *io_channel);
-static gboolean     old_socket_output_is_buffered  (LmOldSocket    *socket,
-                                                    const gchar    *buffer,
-                                                    gint            len);
-static void         old_socket_setup_output_buffer (LmOldSocket    *socket,
-                                                    const gchar    *buffer,
-                                                    gint            len);
+static void         old_socket_update_condition    (LmOldSocket    *socket);
+static void         old_socket_check_high_watermark (LmOldSocket   *socket);
+static void         old_socket_check_low_watermark (LmOldSocket    *socket);
+
+static gboolean
+old_socket_is_edge_triggered (LmOldSocket *socket)
+{
+    return socket->watch && lm_io_source_is_edge_triggered (socket->watch);
+}
 
 static void
 socket_free (LmOldSocket *socket)
@@ -130,14 +196,32 @@ socket_free (LmOldSocket *socket)
         lm_proxy_unref (socket->proxy);
     }
 
-    if (socket->out_buf) {
-        g_string_free (socket->out_buf, TRUE);
+    lm_output_queue_free (socket->out_queue);
+    g_free (socket->out_record);
+    g_free (socket->in_buf);
+
+    if (socket->in_stash) {
+        g_string_free (socket->in_stash, TRUE);
+    }
+
+    if (socket->reactor) {
+        lm_reactor_unref (socket->reactor);
     }
 
     if (socket->resolver) {
         g_object_unref (socket->resolver);
     }
 
+    if (socket->tls_resolver) {
+        g_object_unref (socket->tls_resolver);
+    }
+
+    lm_resolver_free_srv_targets (socket->srv_targets);
+
+    if (socket->context) {
+        g_main_context_unref (socket->context);
+    }
+
     g_free (socket);
 }
 
@@ -146,48 +230,268 @@ old_socket_do_write (LmOldSocket *socket, const gchar *buf, guint len)
 {
     gint b_written;
 
+    /* Both return 0 instead of blocking, the rest of the data is then
+     * queued and written when the socket is ready again. */
     if (socket->ssl_started) {
         b_written = _lm_ssl_send (socket->ssl, buf, len);
     } else {
-        GIOStatus io_status = G_IO_STATUS_AGAIN;
-        gsize     bytes_written;
-
-        while (io_status == G_IO_STATUS_AGAIN) {
-            io_status = g_io_channel_write_chars (socket->io_channel,
-                                                  buf, len,
-                                                  &bytes_written,
-                                                  NULL);
+        b_written = _lm_sock_write (socket->fd, buf, len);
+    }
+
+    return b_written;
+}
+
+/* Writes as much as possible of the output queue with a single call,
+ * returns the number of bytes written and sets @attempted to the number
+ * of bytes that was handed to the socket. */
+static gint
+old_socket_write_queued (LmOldSocket *socket, gsize *attempted)
+{
+    gint b_written;
+
+#ifndef G_OS_WIN32
+    if (!socket->ssl_started) {
+        struct iovec iov[OUT_IOV_MAX];
+        guint        n_iov;
+        guint        i;
+
+        n_iov = lm_output_queue_get_iovec (socket->out_queue,
+                                           iov, OUT_IOV_MAX);
+
+        *attempted = 0;
+        for (i = 0; i < n_iov; i++) {
+            *attempted += iov[i].iov_len;
+        }
+
+        b_written = _lm_sock_writev (socket->fd, iov, n_iov);
+    } else
+#endif /* G_OS_WIN32 */
+    {
+        /* Gather the small chunks into a single record instead of
+         * producing one record per stanza */
+        if (!socket->out_record) {
+            socket->out_record = g_malloc (OUT_RECORD_SIZE);
         }
 
-        b_written = bytes_written;
+        *attempted = lm_output_queue_peek (socket->out_queue,
+                                           socket->out_record,
+                                           OUT_RECORD_SIZE);
 
-        if (io_status != G_IO_STATUS_NORMAL) {
-            b_written = -1;
+        b_written = old_socket_do_write (socket, socket->out_record,
+                                         *attempted);
+
+        /* A TLS write that would block is retried with the same data */
+        if (b_written >= 0 && (gsize) b_written < *attempted) {
+            lm_output_queue_pin (socket->out_queue, *attempted);
         }
     }
 
+    if (b_written > 0) {
+        lm_output_queue_consume (socket->out_queue, b_written);
+    }
+
     return b_written;
 }
 
+/* Writes the output queue until it is empty or the socket would block.
+ * Returns FALSE on a write error. */
+static gboolean
+old_socket_drain (LmOldSocket *socket)
+{
+    gboolean corked = FALSE;
+    gboolean result = TRUE;
+
+    /* When a coalesced batch takes several writes let the kernel pack
+     * them into full segments */
+    if (socket->coalesce &&
+        lm_output_queue_get_size (socket->out_queue) > OUT_RECORD_SIZE) {
+        corked = _lm_sock_set_cork (socket->fd, TRUE);
+    }
+
+    while (!lm_output_queue_is_empty (socket->out_queue)) {
+        gint  b_written;
+        gsize attempted;
+
+        b_written = old_socket_write_queued (socket, &attempted);
+
+        if (b_written < 0) {
+            result = FALSE;
+            break;
+        }
+
+        /* The socket buffer is full, wait until it is writable. An edge
+         * triggered watch only fires again once a write would block. */
+        if (b_written == 0 ||
+            ((gsize) b_written < attempted && !old_socket_is_edge_triggered (socket))) {
+            break;
+        }
+    }
+
+    if (corked) {
+        _lm_sock_set_cork (socket->fd, FALSE);
+    }
+
+    return result;
+}
+
+/* Everything goes through the output queue, the sends are submitted
+ * together with the rest of the ring before the main loop polls. When
+ * coalescing the batch is only put together then, so that all data sent
+ * during the iteration goes out in one write. */
+static gint
+old_socket_uring_write (LmOldSocket   *socket,
+                        LmOutputChunk *chunk,
+                        const gchar   *key,
+                        const gchar   *buf,
+                        gint           len)
+{
+    if (chunk) {
+        lm_output_queue_push_keyed (socket->out_queue, chunk, key);
+    } else {
+        chunk = lm_output_chunk_new (buf, len);
+        lm_output_queue_push_keyed (socket->out_queue, chunk, key);
+        lm_output_chunk_unref (chunk);
+    }
+
+    if (socket->coalesce) {
+        lm_verbose ("Coalescing %d bytes into output buffer\n", len);
+        lm_uring_socket_send_later (socket->uring, socket->out_queue);
+    } else {
+        lm_uring_socket_send (socket->uring, socket->out_queue);
+    }
+    old_socket_check_high_watermark (socket);
+
+    return len;
+}
+
+/* Data that can't be written right away is queued, replacing data queued
+ * earlier with the same @key that hasn't been written yet */
+static gint
+old_socket_write (LmOldSocket   *socket,
+                  LmOutputChunk *chunk,
+                  const gchar   *key,
+                  const gchar   *buf,
+                  gint           len)
+{
+    gint b_written = 0;
+    gint retry_len = 0;
+
+    if (socket->uring) {
+        return old_socket_uring_write (socket, chunk, key, buf, len);
+    }
+
+    if (socket->coalesce) {
+        lm_verbose ("Coalescing %d bytes into output buffer\n", len);
+    } else if (socket->ssl_handshaking) {
+        lm_verbose ("Queueing %d bytes until the TLS handshake is done\n", len);
+    } else if (lm_output_queue_is_empty (socket->out_queue)) {
+        gint to_write = len;
+
+        /* A TLS write that would block has to be retried with at least as
+         * much data, make sure that fits in what is gathered from the
+         * queue later on. */
+        if (socket->ssl_started) {
+            to_write = MIN (len, OUT_RECORD_SIZE);
+        }
+
+        b_written = old_socket_do_write (socket, buf, to_write);
+
+        if (b_written < 0 || b_written == len) {
+            return b_written;
+        }
+
+        if (socket->ssl_started && b_written == 0) {
+            retry_len = to_write;
+        }
+    } else {
+        lm_verbose ("Appending %d bytes to output buffer\n", len);
+    }
+
+    if (chunk && b_written == 0) {
+        if (lm_output_queue_push_keyed (socket->out_queue, chunk, key)) {
+            lm_verbose ("Replaced unsent output with key %s\n", key);
+        }
+    } else if (chunk) {
+        lm_output_queue_push (socket->out_queue, chunk, b_written);
+    } else {
+        chunk = lm_output_chunk_new (buf + b_written, len - b_written);
+        lm_output_queue_push (socket->out_queue, chunk, 0);
+        lm_output_chunk_unref (chunk);
+    }
+
+    /* The blocked TLS write is retried from the queue with the same data,
+     * a keyed chunk must not be swapped out in the meantime */
+    if (retry_len > 0) {
+        lm_output_queue_pin (socket->out_queue, retry_len);
+    }
+
+    old_socket_update_condition (socket);
+    old_socket_check_high_watermark (socket);
+
+    return len;
+}
+
 gint
 lm_old_socket_write (LmOldSocket *socket, const gchar *buf, gint len)
 {
-    gint b_written;
+    return old_socket_write (socket, NULL, NULL, buf, len);
+}
+
+/* Like lm_old_socket_write() but if the data has to be buffered the chunk
+ * is queued as is instead of being copied */
+gint
+lm_old_socket_write_chunk (LmOldSocket *socket, LmOutputChunk *chunk)
+{
+    return lm_old_socket_write_chunk_keyed (socket, chunk, NULL);
+}
+
+/* Like lm_old_socket_write_chunk() but @chunk takes the place of a chunk
+ * queued with the same @key that hasn't been written yet */
+gint
+lm_old_socket_write_chunk_keyed (LmOldSocket   *socket,
+                                 LmOutputChunk *chunk,
+                                 const gchar   *key)
+{
+    return old_socket_write (socket, chunk, key,
+                             lm_output_chunk_get_data (chunk),
+                             lm_output_chunk_get_length (chunk));
+}
 
-    if (old_socket_output_is_buffered (socket, buf, len)) {
-        return len;
+static void
+old_socket_check_high_watermark (LmOldSocket *socket)
+{
+    if (socket->out_blocked || socket->out_high_watermark == 0) {
+        return;
     }
 
-    b_written = old_socket_do_write (socket, buf, len);
+    if (lm_old_socket_get_buffered_bytes (socket) >= socket->out_high_watermark) {
+        lm_verbose ("Output buffer passed high watermark (%d bytes)\n",
+                    (int) socket->out_high_watermark);
+        socket->out_blocked = TRUE;
+    }
+}
 
-    if (b_written < len && b_written != -1) {
-        old_socket_setup_output_buffer (socket,
-                                        buf + b_written,
-                                        len - b_written);
-        return len;
+static void
+old_socket_check_low_watermark (LmOldSocket *socket)
+{
+    if (!socket->out_blocked) {
+        return;
     }
 
-    return b_written;
+    if (lm_old_socket_get_buffered_bytes (socket) > socket->out_low_watermark) {
+        return;
+    }
+
+    lm_verbose ("Output buffer drained below low watermark (%d bytes)\n",
+                (int) socket->out_low_watermark);
+
+    socket->out_blocked = FALSE;
+
+    if (socket->writable_func) {
+        lm_old_socket_ref (socket);
+        (socket->writable_func) (socket, socket->user_data);
+        lm_old_socket_unref (socket);
+    }
 }
 
 static gboolean
@@ -240,109 +544,365 @@ socket_read_incoming (LmOldSocket *socket,
     return TRUE;
 }
 
+static void
+socket_deliver_incoming (LmOldSocket *socket, const gchar *buf, gsize len)
+{
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "\nRECV [%d]:\n",
+           (int)len);
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+           "-----------------------------------\n");
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "'%s'\n", buf);
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+           "-----------------------------------\n");
+
+    lm_verbose ("Read: %d chars\n", (int)len);
+
+    (socket->data_func) (socket, buf, socket->user_data);
+}
+
+/* Adapts the receive buffer to the amount of data read in one go */
+static void
+socket_resize_in_buf (LmOldSocket *socket, gboolean filled)
+{
+    gsize new_size = socket->in_buf_size;
+
+    if (filled) {
+        socket->in_small_reads = 0;
+        new_size = MIN (socket->in_buf_size * 2, IN_BUFFER_MAX_SIZE);
+    } else if (socket->in_buf_size > IN_BUFFER_MIN_SIZE &&
+               ++socket->in_small_reads >= IN_SHRINK_AFTER) {
+        socket->in_small_reads = 0;
+        new_size = socket->in_buf_size / 2;
+    }
+
+    if (new_size != socket->in_buf_size) {
+        lm_verbose ("Receive buffer resized to %d bytes\n", (int) new_size);
+
+        g_free (socket->in_buf);
+        socket->in_buf = g_malloc (new_size);
+        socket->in_buf_size = new_size;
+    }
+}
+
+/* Returns FALSE if the connection was closed */
 static gboolean
-socket_in_event (GIOChannel   *source,
-                 GIOCondition  condition,
-                 LmOldSocket     *socket)
+socket_in_event (LmOldSocket *socket, gboolean *read_anything)
 {
-    gchar    buf[IN_BUFFER_SIZE];
     gsize    bytes_read = 0;
-    gboolean read_anything = FALSE;
+    gsize    filled = 0;
+    gsize    total = 0;
+    gboolean grew = FALSE;
     gboolean hangup = 0;
     gint     reason = 0;
 
-    if (!socket->io_channel) {
-        return FALSE;
+    if (!socket->in_buf) {
+        socket->in_buf_size = IN_BUFFER_MIN_SIZE;
+        socket->in_buf = g_malloc (socket->in_buf_size);
     }
 
-    while (socket_read_incoming (socket, buf, IN_BUFFER_SIZE,
+    /* Read until the socket is drained, the parser is fed once per full
+     * buffer and once with whatever is left at the end */
+    while (socket_read_incoming (socket,
+                                 socket->in_buf + filled,
+                                 socket->in_buf_size - filled,
                                  &bytes_read, &hangup, &reason)) {
+        filled += bytes_read;
+        total += bytes_read;
+
+        if (filled + 1 < socket->in_buf_size) {
+            /* A short read means the kernel buffer is empty, only TLS
+             * might still hold decrypted data. An edge triggered watch
+             * needs the read that would block, or the EOF, before it
+             * fires again. */
+            if ((!socket->ssl_started || _lm_ssl_pending (socket->ssl) == 0) &&
+                !old_socket_is_edge_triggered (socket)) {
+                break;
+            }
+            continue;
+        }
 
-        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "\nRECV [%d]:\n",
-               (int)bytes_read);
-        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
-               "-----------------------------------\n");
-        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "'%s'\n", buf);
-        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
-               "-----------------------------------\n");
+        socket_deliver_incoming (socket, socket->in_buf, filled);
+        filled = 0;
 
-        lm_verbose ("Read: %d chars\n", (int)bytes_read);
+        if (!socket->io_channel) {
+            break;
+        }
 
-        (socket->data_func) (socket, buf, socket->user_data);
+        /* Nothing may be left inside TLS, it would not wake up the
+         * watch once resumed */
+        if (socket->in_paused &&
+            (!socket->ssl_started || _lm_ssl_pending (socket->ssl) == 0)) {
+            break;
+        }
 
-        read_anything = TRUE;
+        socket_resize_in_buf (socket, TRUE);
+        grew = TRUE;
+
+        /* Let other sources run, the source fires again for the rest.
+         * Data buffered inside TLS would not wake it up so that is
+         * always drained. */
+        if (total >= IN_MAX_READ_PER_DISPATCH &&
+            (!socket->ssl_started || _lm_ssl_pending (socket->ssl) == 0)) {
+            if (old_socket_is_edge_triggered (socket)) {
+                lm_io_source_mark_ready (socket->watch, G_IO_IN);
+            }
+            break;
+        }
+    }
+
+    if (filled > 0 && socket->io_channel) {
+        socket_deliver_incoming (socket, socket->in_buf, filled);
     }
 
+    if (!grew && socket->in_buf && total < socket->in_buf_size / 4) {
+        socket_resize_in_buf (socket, FALSE);
+    }
+
+    if (!hangup && socket->io_channel && socket->ssl_started &&
+        _lm_ssl_get_read_wait (socket->ssl) == G_IO_OUT) {
+        /* Retried from socket_io_cb once writable */
+        socket->in_wants_write = TRUE;
+    }
+
+    *read_anything = (total > 0);
+
     /* If we have read something, delay the hangup so that the data can be
      * processed. */
-    if (hangup && !read_anything) {
+    if (hangup && total == 0) {
         (socket->closed_func) (socket, reason, socket->user_data);
         return FALSE;
     }
 
-    return TRUE;
+    if (hangup && socket->io_channel && old_socket_is_edge_triggered (socket)) {
+        /* Read the EOF again in the next round */
+        lm_io_source_mark_ready (socket->watch, G_IO_IN);
+    }
+
+    return socket->io_channel != NULL;
 }
 
-static gboolean
-socket_hup_event (GIOChannel   *source,
-                  GIOCondition  condition,
-                  LmOldSocket     *socket)
+static void
+socket_hup_event (LmOldSocket *socket, GIOCondition condition)
 {
     lm_verbose ("HUP event: %d->'%s'\n",
                 condition, lm_misc_io_condition_to_str (condition));
 
-    if (!socket->io_channel) {
-        return FALSE;
-    }
-
     (socket->closed_func) (socket, LM_DISCONNECT_REASON_HUP,
                            socket->user_data);
-
-    return TRUE;
 }
 
-static gboolean
-socket_error_event (GIOChannel   *source,
-                    GIOCondition  condition,
-                    LmOldSocket     *socket)
+static void
+socket_error_event (LmOldSocket *socket, GIOCondition condition)
 {
     lm_verbose ("ERROR event: %d->'%s'\n",
                 condition, lm_misc_io_condition_to_str (condition));
 
-    if (!socket->io_channel) {
-        return FALSE;
-    }
-
     (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR,
                            socket->user_data);
+}
 
-    return TRUE;
+static void
+socket_uring_recv_cb (LmUringSocket *usock,
+                      const gchar   *buf,
+                      gssize         len,
+                      LmOldSocket   *socket)
+{
+    lm_old_socket_ref (socket);
+
+    if (socket->in_stash && (len <= 0 || !socket->in_paused)) {
+        GString *stash = socket->in_stash;
+
+        socket->in_stash = NULL;
+        socket_deliver_incoming (socket, stash->str, stash->len);
+        g_string_free (stash, TRUE);
+    }
+
+    if (len > 0 && socket->in_paused) {
+        if (!socket->in_stash) {
+            socket->in_stash = g_string_sized_new (len);
+        }
+        g_string_append_len (socket->in_stash, buf, len);
+    } else if (len > 0) {
+        socket_deliver_incoming (socket, buf, len);
+    } else if (len == 0) {
+        lm_verbose ("Connection closed by peer\n");
+        (socket->closed_func) (socket, LM_DISCONNECT_REASON_HUP,
+                               socket->user_data);
+    } else {
+        lm_verbose ("Receive failed: %s\n", g_strerror (-len));
+        (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR,
+                               socket->user_data);
+    }
+
+    lm_old_socket_unref (socket);
+}
+
+static void
+socket_uring_sent_cb (LmUringSocket *usock,
+                      gsize          sent,
+                      gint           error,
+                      LmOldSocket   *socket)
+{
+    lm_old_socket_ref (socket);
+
+    lm_output_queue_consume (socket->out_queue, sent);
+
+    if (error < 0) {
+        lm_verbose ("Send failed: %s\n", g_strerror (-error));
+        (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR,
+                               socket->user_data);
+    } else {
+        lm_uring_socket_send (usock, socket->out_queue);
+        old_socket_check_low_watermark (socket);
+    }
+
+    lm_old_socket_unref (socket);
+}
+
+static void
+old_socket_ssl_stop_handshake (LmOldSocket *socket)
+{
+    if (socket->ssl_timer) {
+        g_source_destroy (socket->ssl_timer);
+        socket->ssl_timer = NULL;
+    }
+
+    socket->ssl_handshaking = FALSE;
+}
+
+/* Drops the connection to a direct TLS target that failed the handshake
+ * and goes on with the remaining addresses and targets, which may use
+ * StartTLS instead (XEP-0368) */
+static void
+old_socket_direct_tls_failed (LmOldSocket *socket)
+{
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+           "Direct TLS to %s failed, trying the next address\n",
+           socket->server);
+
+    if (socket->watch) {
+        lm_io_source_destroy (socket->watch);
+        socket->watch = NULL;
+    }
+
+    socket_close_io_channel (socket->io_channel);
+    socket->io_channel = NULL;
+    socket->fd = -1;
+    socket->out_condition = 0;
+    socket->in_wants_write = FALSE;
+
+    _lm_ssl_close (socket->ssl);
+    socket->direct_tls = FALSE;
+
+    socket->connecting = TRUE;
+    old_socket_start_attempt (socket);
+}
+
+static void
+old_socket_ssl_failed (LmOldSocket *socket)
+{
+    old_socket_ssl_stop_handshake (socket);
+
+    /* The resolver is kept until a direct TLS handshake is done */
+    if (socket->direct_tls && socket->resolver) {
+        old_socket_direct_tls_failed (socket);
+    } else if (socket->ssl_delayed) {
+        (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR,
+                               socket->user_data);
+    } else if (socket->connect_func) {
+        (socket->connect_func) (socket, FALSE, socket->user_data);
+    }
 }
 
+static gboolean
+old_socket_ssl_timeout_cb (LmOldSocket *socket)
+{
+    socket->ssl_timer = NULL;
+
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+           "TLS handshake not done after %u ms\n",
+           _lm_ssl_get_handshake_timeout (socket->ssl));
+
+    lm_old_socket_ref (socket);
+    old_socket_ssl_failed (socket);
+    lm_old_socket_unref (socket);
+
+    return FALSE;
+}
+
+/* Takes the handshake as far as it gets without blocking, called by the
+ * watch whenever the socket is ready for what the handshake waits for */
+static void
+old_socket_ssl_handshake (LmOldSocket *socket)
+{
+    GError    *error = NULL;
+    GIOStatus  status;
+
+    status = _lm_ssl_handshake (socket->ssl, &socket->ssl_wait, &error);
+    if (status == G_IO_STATUS_AGAIN) {
+        old_socket_update_condition (socket);
+        return;
+    }
+
+    if (status != G_IO_STATUS_NORMAL) {
+        lm_verbose ("Could not begin SSL\n");
+
+        if (error) {
+            g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+                   "%s\n", error->message);
+            g_error_free (error);
+        }
+
+        old_socket_ssl_failed (socket);
+        return;
+    }
+
+    old_socket_ssl_stop_handshake (socket);
+    socket->ssl_started = TRUE;
+
+    if (socket->resolver) {
+        g_object_unref (socket->resolver);
+        socket->resolver = NULL;
+    }
+
+    lm_verbose ("SSL handshake done\n");
+
+    /* Sends what was queued during the handshake */
+    old_socket_update_condition (socket);
+
+    if (!socket->ssl_delayed && socket->connect_func) {
+        (socket->connect_func) (socket, TRUE, socket->user_data);
+    }
+}
+
+/* Starts the handshake on the watch of the socket. Returns FALSE if TLS
+ * could not be set up, a failed handshake is reported later on through
+ * the connect function or, for StartTLS, the closed function. */
 static gboolean
 _lm_old_socket_ssl_init (LmOldSocket *socket, gboolean delayed)
 {
     GError *error = NULL;
     const gchar *ssl_verify_domain = NULL;
+    const gchar *alpn = NULL;
 
     lm_verbose ("Setting up SSL...\n");
 
     _lm_ssl_initialize (socket->ssl);
 
-#ifdef HAVE_GNUTLS
-    /* GNU TLS requires the socket to be blocking */
-    _lm_sock_set_blocking (socket->fd, TRUE);
-#endif
-
-    /* If we're using StartTLS, the correct thing is to verify against
-     * the domain. If we're using old SSL, we should verify against the
-     * hostname. */
-    if (delayed)
+    /* If we're using StartTLS or direct TLS, the correct thing is to
+     * verify against the domain. If we're using old SSL, we should verify
+     * against the hostname. */
+    if (delayed || socket->direct_tls)
         ssl_verify_domain = socket->domain;
     else
         ssl_verify_domain = socket->server;
 
-    if (!_lm_ssl_begin (socket->ssl, socket->fd, ssl_verify_domain, &error)) {
+    if (socket->direct_tls && _lm_ssl_get_use_alpn (socket->ssl)) {
+        alpn = "xmpp-client";
+    }
+
+    if (!_lm_ssl_begin (socket->ssl, socket->fd, ssl_verify_domain,
+                        alpn, &error)) {
         lm_verbose ("Could not begin SSL\n");
 
         if (error) {
@@ -351,21 +911,21 @@ _lm_old_socket_ssl_init (LmOldSocket *socket, gboolean delayed)
             g_error_free (error);
         }
 
-        _lm_sock_shutdown (socket->fd);
-        _lm_sock_close (socket->fd);
-
-        if (!delayed && socket->connect_func) {
-            (socket->connect_func) (socket, FALSE, socket->user_data);
-        }
-
         return FALSE;
     }
 
-#ifdef HAVE_GNUTLS
-    _lm_sock_set_blocking (socket->fd, FALSE);
-#endif
+    socket->ssl_handshaking = TRUE;
+    socket->ssl_delayed = delayed;
+    /* The client speaks first */
+    socket->ssl_wait = G_IO_OUT;
 
-    socket->ssl_started = TRUE;
+    socket->ssl_timer =
+        lm_misc_add_timeout (socket->context,
+                             _lm_ssl_get_handshake_timeout (socket->ssl),
+                             (GSourceFunc) old_socket_ssl_timeout_cb,
+                             socket);
+
+    old_socket_update_condition (socket);
 
     return TRUE;
 }
@@ -380,6 +940,151 @@ lm_old_socket_starttls (LmOldSocket *socket)
 
 
 
+static void
+old_socket_free_attempt (LmConnectData *connect_data)
+{
+    if (connect_data->watch) {
+        g_source_destroy (connect_data->watch);
+    }
+
+    if (connect_data->io_channel) {
+        socket_close_io_channel (connect_data->io_channel);
+    }
+
+    g_free (connect_data);
+}
+
+/* Gives up on the attempts still racing, except for @winner */
+static void
+old_socket_stop_connecting (LmOldSocket *socket, LmConnectData *winner)
+{
+    GSList *l;
+
+    if (socket->connect_timer) {
+        g_source_destroy (socket->connect_timer);
+        socket->connect_timer = NULL;
+    }
+
+    for (l = socket->connect_attempts; l; l = l->next) {
+        if (l->data != winner) {
+            old_socket_free_attempt (l->data);
+        }
+    }
+
+    g_slist_free (socket->connect_attempts);
+    socket->connect_attempts = NULL;
+    socket->connecting = FALSE;
+
+    g_slist_free_full (socket->old_resolvers, g_object_unref);
+    socket->old_resolvers = NULL;
+}
+
+static void
+old_socket_connect_failed (LmOldSocket *socket)
+{
+    old_socket_stop_connecting (socket, NULL);
+
+    if (socket->connect_func) {
+        (socket->connect_func) (socket, FALSE, socket->user_data);
+    }
+}
+
+static gboolean
+old_socket_connect_timeout_cb (LmOldSocket *socket)
+{
+    socket->connect_timer = NULL;
+
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+           "No connection after %d ms, trying the next address too\n",
+           CONNECT_ATTEMPT_DELAY);
+
+    old_socket_start_attempt (socket);
+
+    return FALSE;
+}
+
+/* Moves on to the next SRV target once the addresses of the current one
+ * are used up, returns FALSE if there is none */
+static gboolean
+old_socket_next_srv_target (LmOldSocket *socket)
+{
+    LmSrvTarget *target;
+
+    if (!socket->srv_current || !socket->srv_current->next) {
+        return FALSE;
+    }
+
+    socket->srv_current = socket->srv_current->next;
+    target = socket->srv_current->data;
+
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+           "Trying SRV target %s port %u\n", target->host, target->port);
+
+    old_socket_resolve_host (socket, target->host);
+
+    return TRUE;
+}
+
+/* Starts connecting to the next resolved address. Attempts are started
+ * CONNECT_ATTEMPT_DELAY apart, or right away when one fails, and race each
+ * other until the first one connects (RFC 8305). */
+static void
+old_socket_start_attempt (LmOldSocket *socket)
+{
+    LmConnectData   *connect_data;
+    struct addrinfo *addr;
+
+    if (socket->connect_timer) {
+        g_source_destroy (socket->connect_timer);
+        socket->connect_timer = NULL;
+    }
+
+    /* Continues once the host is resolved */
+    if (socket->resolving) {
+        return;
+    }
+
+    addr = lm_resolver_results_get_next (socket->resolver);
+    if (!addr) {
+        if (old_socket_next_srv_target (socket)) {
+            return;
+        }
+
+        /* Ran out of addresses, failed once the last attempt has */
+        if (!socket->connect_attempts) {
+            old_socket_connect_failed (socket);
+        }
+        return;
+    }
+
+    connect_data = g_new0 (LmConnectData, 1);
+    connect_data->socket = socket;
+    connect_data->connection = socket->connection;
+    connect_data->current_addr = addr;
+    connect_data->fd = -1;
+    connect_data->start_time = g_get_monotonic_time ();
+    if (socket->srv_current) {
+        connect_data->srv_target = socket->srv_current->data;
+    }
+
+    socket->connect_attempts = g_slist_prepend (socket->connect_attempts,
+                                                connect_data);
+
+    if (!socket_do_connect (connect_data)) {
+        /* Already moved on to the next address */
+        return;
+    }
+
+    /* A proxy is negotiated with over a single connection */
+    if (!socket->proxy) {
+        socket->connect_timer =
+            lm_misc_add_timeout (socket->context,
+                                 CONNECT_ATTEMPT_DELAY,
+                                 (GSourceFunc) old_socket_connect_timeout_cb,
+                                 socket);
+    }
+}
+
 void
 _lm_old_socket_succeeded (LmConnectData *connect_data)
 {
@@ -387,11 +1092,6 @@ _lm_old_socket_succeeded (LmConnectData *connect_data)
 
     socket = connect_data->socket;
 
-    if (socket->watch_connect) {
-        g_source_destroy (socket->watch_connect);
-        socket->watch_connect = NULL;
-    }
-
     /* Need some way to report error/success */
     if (socket->cancel_open) {
         lm_verbose ("Cancelling connection...\n");
@@ -401,54 +1101,80 @@ _lm_old_socket_succeeded (LmConnectData *connect_data)
         return;
     }
 
+    old_socket_stop_connecting (socket, connect_data);
+
+    if (connect_data->watch) {
+        g_source_destroy (connect_data->watch);
+    }
+
+    if (connect_data->srv_target) {
+        LmSrvTarget *target = connect_data->srv_target;
+
+        lm_resolver_add_connect_time (target->host, target->port,
+                                      g_get_monotonic_time () -
+                                      connect_data->start_time);
+
+        g_free (socket->server);
+        socket->server = g_strdup (target->host);
+        socket->port = target->port;
+        socket->direct_tls = target->direct_tls;
+    }
+
     socket->fd = connect_data->fd;
     socket->io_channel = connect_data->io_channel;
 
-    g_object_unref (socket->resolver);
-    socket->resolver = NULL;
+    /* Still needed to go on with the next address if a direct TLS
+     * handshake fails */
+    if (!socket->direct_tls) {
+        g_object_unref (socket->resolver);
+        socket->resolver = NULL;
+    }
 
-    socket->connect_data = NULL;
     g_free (connect_data);
 
-    /* old-style ssl should be started immediately */
-    if (socket->ssl && (lm_ssl_get_use_starttls (socket->ssl) == FALSE)) {
-        if (!_lm_old_socket_ssl_init (socket, FALSE)) {
-            return;
-        }
+    /* TLS has to read and write the socket itself, that includes plain
+     * connections that might switch to StartTLS later on */
+    if (!socket->ssl && !socket->reactor) {
+        socket->uring = lm_uring_socket_new (socket->context,
+                                             socket->fd,
+                                             (LmUringRecvFunc) socket_uring_recv_cb,
+                                             (LmUringSentFunc) socket_uring_sent_cb,
+                                             socket);
     }
 
-    socket->watch_in =
-        lm_misc_add_io_watch (socket->context,
-                              socket->io_channel,
-                              G_IO_IN,
-                              (GIOFunc) socket_in_event,
-                              socket);
-
-    /* FIXME: if we add these, we don't get ANY
-     * response from the server, this is to do with the way that
-     * windows handles watches, see bug #331214.
-     */
-#ifndef G_OS_WIN32
-    socket->watch_err =
-        lm_misc_add_io_watch (socket->context,
-                              socket->io_channel,
-                              G_IO_ERR,
-                              (GIOFunc) socket_error_event,
-                              socket);
+    if (socket->uring) {
+        lm_verbose ("Using io_uring for socket I/O\n");
+    } else if (socket->reactor) {
+        socket->watch = lm_io_source_new_with_reactor (socket->reactor,
+                                                       socket->io_channel,
+                                                       G_IO_IN,
+                                                       (LmIOSourceFunc) socket_io_cb,
+                                                       socket);
+    } else {
+        socket->watch = lm_io_source_new (socket->context,
+                                          socket->io_channel,
+                                          G_IO_IN,
+                                          (LmIOSourceFunc) socket_io_cb,
+                                          socket);
+    }
 
-    socket->watch_hup =
-        lm_misc_add_io_watch (socket->context,
-                              socket->io_channel,
-                              G_IO_HUP,
-                              (GIOFunc) socket_hup_event,
-                              socket);
-#endif
+    /* old-style ssl and direct TLS should be started immediately, the
+     * connect is reported once the handshake is done */
+    if (socket->ssl &&
+        (!lm_ssl_get_use_starttls (socket->ssl) || socket->direct_tls)) {
+        if (!_lm_old_socket_ssl_init (socket, FALSE)) {
+            old_socket_ssl_failed (socket);
+        }
+        return;
+    }
 
     if (socket->connect_func) {
         (socket->connect_func) (socket, TRUE, socket->user_data);
     }
 }
 
+/* Drops the failed attempt and moves on to the next address. Always
+ * returns FALSE, @connect_data is freed. */
 gboolean
 _lm_old_socket_failed_with_error (LmConnectData *connect_data, int error)
 {
@@ -460,35 +1186,13 @@ _lm_old_socket_failed_with_error (LmConnectData *connect_data, int error)
 
     socket = lm_old_socket_ref (connect_data->socket);
 
-    connect_data->current_addr = lm_resolver_results_get_next (socket->resolver);
+    socket->connect_attempts = g_slist_remove (socket->connect_attempts,
+                                               connect_data);
+    old_socket_free_attempt (connect_data);
 
-    if (socket->watch_connect) {
-        g_source_destroy (socket->watch_connect);
-        socket->watch_connect = NULL;
-    }
-
-    if (connect_data->io_channel != NULL) {
-        socket_close_io_channel (connect_data->io_channel);
-        connect_data->io_channel = NULL;
-    }
-
-    if (connect_data->current_addr == NULL) { /*Ran Out Of Addresses*/
-        if (socket->connect_func) {
-            (socket->connect_func) (socket, FALSE, socket->user_data);
-        }
-
-        /* if the user callback called connection_close(), this is already freed */
-        if (socket->connect_data != NULL) {
-            if (socket->resolver) {
-                g_object_unref (socket->resolver);
-            }
-
-            socket->connect_data = NULL;
-            g_free (connect_data);
-        }
-    } else {
-        /* try to connect to the next host */
-        return socket_do_connect (connect_data);
+    /* Unless the socket was closed meanwhile */
+    if (socket->connecting) {
+        old_socket_start_attempt (socket);
     }
 
     lm_old_socket_unref (socket);
@@ -500,89 +1204,46 @@ gboolean
 _lm_old_socket_failed (LmConnectData *connect_data)
 {
     return _lm_old_socket_failed_with_error (connect_data,
-                                             _lm_sock_get_last_error());
-}
-
-static gboolean
-socket_connect_cb (GIOChannel   *source,
-                   GIOCondition  condition,
-                   LmConnectData *connect_data)
-{
-    LmOldSocket     *socket;
-    /* struct addrinfo *addr; */
-    int              err;
-    socklen_t        len;
-    LmOldSocketT     fd;
-    gboolean         result = FALSE;
-
-    socket = lm_old_socket_ref (connect_data->socket);
-    /* addr = connect_data->current_addr; */
-    fd = g_io_channel_unix_get_fd (source);
-
-    if (condition == G_IO_ERR) {
-        len = sizeof (err);
-        _lm_sock_get_error (fd, &err, &len);
-        if (!_lm_sock_is_blocking_error (err)) {
-            g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_VERBOSE,
-                   "Connection failed.\n");
-
-            /* error condition, but might be possible to recover
-             * from it (by connecting to the next host) */
-            if (!_lm_old_socket_failed_with_error (connect_data, err)) {
-                socket->watch_connect = NULL;
-                goto out;
-            }
-        }
-    }
-
-#if 0
-    if (_lm_connection_async_connect_waiting (socket->connection)) {
-        gint res;
-
-        fd = g_io_channel_unix_get_fd (source);
-
-        res = _lm_sock_connect (fd, addr->ai_addr, (int)addr->ai_addrlen);
-        if (res < 0) {
-            err = _lm_sock_get_last_error ();
-            if (_lm_sock_is_blocking_success (err)) {
-                _lm_connection_set_async_connect_waiting (socket->connection, FALSE);
+                                             _lm_sock_get_last_error());
+}
 
-                g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
-                       "Connection success (1).\n");
+static gboolean
+socket_connect_cb (GIOChannel    *source,
+                   GIOCondition   condition,
+                   LmConnectData *connect_data)
+{
+    int       err = 0;
+    socklen_t len;
 
-                _lm_old_socket_succeeded (connect_data);
-            }
+    if (connect_data->socket->proxy) {
+        /* Never keeps the watch */
+        connect_data->watch = NULL;
+        return _lm_proxy_connect_cb (source, condition, connect_data);
+    }
 
-            if (_lm_connection_async_connect_waiting (socket->connection) &&
-                !_lm_sock_is_blocking_error (err)) {
-                g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
-                       "Connection failed.\n");
+    /* A failed connect can be reported as writable as well */
+    len = sizeof (err);
+    _lm_sock_get_error (connect_data->fd, &err, &len);
 
-                _lm_sock_close (connect_data->fd);
-                _lm_old_socket_failed_with_error (connect_data, err);
+    if (err != 0 && _lm_sock_is_blocking_error (err)) {
+        return TRUE;
+    }
 
-                socket->watch_connect = NULL;
-                goto out;
-            }
-        }
-    } else {
-#endif
-    {
-        /* for blocking sockets, G_IO_OUT means we are connected */
-        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_VERBOSE,
-               "Connection success (2).\n");
+    connect_data->watch = NULL;
 
-        _lm_old_socket_succeeded (connect_data);
+    if (err != 0 || (condition & G_IO_ERR)) {
+        _lm_old_socket_failed_with_error (connect_data, err);
+        return FALSE;
     }
 
-    result = TRUE;
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_VERBOSE, "Connection success.\n");
 
- out:
-    lm_old_socket_unref(socket);
+    _lm_old_socket_succeeded (connect_data);
 
-    return result;
+    return FALSE;
 }
 
+/* Returns FALSE if the attempt failed right away */
 static gboolean
 socket_do_connect (LmConnectData *connect_data)
 {
@@ -593,6 +1254,7 @@ socket_do_connect (LmConnectData *connect_data)
     char             name[NI_MAXHOST];
     char             portname[NI_MAXSERV];
     struct addrinfo *addr;
+    struct sockaddr_storage sa;
 
     socket = connect_data->socket;
     addr = connect_data->current_addr;
@@ -603,13 +1265,22 @@ socket_do_connect (LmConnectData *connect_data)
 
     if (socket->proxy) {
         port = htons (lm_proxy_get_port (socket->proxy));
+    } else if (connect_data->srv_target) {
+        port = htons (((LmSrvTarget *) connect_data->srv_target)->port);
     } else {
         port = htons (socket->port);
     }
 
-    ((struct sockaddr_in *) addr->ai_addr)->sin_port = port;
+    /* The resolved address is shared with other connections */
+    memcpy (&sa, addr->ai_addr, addr->ai_addrlen);
+
+    if (addr->ai_family == AF_INET6) {
+        ((struct sockaddr_in6 *) &sa)->sin6_port = port;
+    } else {
+        ((struct sockaddr_in *) &sa)->sin_port = port;
+    }
 
-    res = getnameinfo (addr->ai_addr,
+    res = getnameinfo ((struct sockaddr *) &sa,
                        (socklen_t)addr->ai_addrlen,
                        name,     sizeof (name),
                        portname, sizeof (portname),
@@ -627,7 +1298,6 @@ socket_do_connect (LmConnectData *connect_data)
                               addr->ai_protocol);
 
     if (!_LM_SOCK_VALID (fd)) {
-        g_print("invalid fd\n");
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
                "Failed making socket, error:%d...\n",
                _lm_sock_get_last_error ());
@@ -647,29 +1317,28 @@ socket_do_connect (LmConnectData *connect_data)
 
     _lm_sock_set_blocking (connect_data->fd, FALSE);
 
-    if (socket->proxy) {
-        socket->watch_connect =
-            lm_misc_add_io_watch (socket->context,
-                                  connect_data->io_channel,
-                                  G_IO_OUT|G_IO_ERR,
-                                  (GIOFunc) _lm_proxy_connect_cb,
-                                  connect_data);
-    } else {
-        socket->watch_connect =
-            lm_misc_add_io_watch (socket->context,
-                                  connect_data->io_channel,
-                                  G_IO_OUT|G_IO_ERR,
-                                  (GIOFunc) socket_connect_cb,
-                                  connect_data);
+    /* The receive buffer size has to be set before connecting for the
+     * window scaling to take it into account */
+    _lm_sock_set_buffer_sizes (connect_data->fd,
+                               socket->send_buffer_size,
+                               socket->receive_buffer_size);
+    if (socket->tcp_nodelay) {
+        _lm_sock_set_nodelay (connect_data->fd, TRUE);
     }
 
+    connect_data->watch =
+        lm_misc_add_io_watch (socket->context,
+                              connect_data->io_channel,
+                              G_IO_OUT|G_IO_ERR,
+                              (GIOFunc) socket_connect_cb,
+                              connect_data);
+
     res = _lm_sock_connect (connect_data->fd,
-                            addr->ai_addr, (int)addr->ai_addrlen);
+                            (struct sockaddr *) &sa, (int)addr->ai_addrlen);
     if (res < 0) {
         err = _lm_sock_get_last_error ();
         if (!_lm_sock_is_blocking_error (err)) {
-            _lm_sock_close (connect_data->fd);
-            g_print("unable to connect\n");
+            /* The descriptor is closed along with the channel */
             return _lm_old_socket_failed_with_error (connect_data, err);
         }
     }
@@ -677,72 +1346,114 @@ socket_do_connect (LmConnectData *connect_data)
     return TRUE;
 }
 
-static gboolean
-old_socket_output_is_buffered (LmOldSocket     *socket,
-                               const gchar  *buffer,
-                               gint          len)
+/* Makes the socket source wait for what is needed to make progress with
+ * the buffered output, normally G_IO_OUT but a TLS write might have to wait
+ * for incoming data. */
+static void
+old_socket_update_condition (LmOldSocket *socket)
 {
-    if (socket->out_buf) {
-        lm_verbose ("Appending %d bytes to output buffer\n", len);
-        g_string_append_len (socket->out_buf, buffer, len);
-        return TRUE;
+    GIOCondition condition = socket->in_paused ? 0 : G_IO_IN;
+
+    socket->out_condition = 0;
+
+    if (socket->ssl_handshaking) {
+        /* Reading and writing is up to the handshake meanwhile */
+        condition = socket->ssl_wait;
+    } else if (!lm_output_queue_is_empty (socket->out_queue)) {
+        socket->out_condition = G_IO_OUT;
+
+        if (socket->ssl_started && _lm_ssl_get_send_wait (socket->ssl)) {
+            socket->out_condition = _lm_ssl_get_send_wait (socket->ssl);
+        }
     }
 
-    return FALSE;
-}
+    condition |= socket->out_condition;
 
-static void
-old_socket_setup_output_buffer (LmOldSocket *socket, const gchar *buffer, gint len)
-{
-    lm_verbose ("OUTPUT BUFFER ENABLED\n");
+    if (socket->in_wants_write) {
+        condition |= G_IO_OUT;
+    }
+
+    if (!socket->watch ||
+        condition == lm_io_source_get_condition (socket->watch)) {
+        return;
+    }
 
-    socket->out_buf = g_string_new_len (buffer, len);
+    lm_verbose ("Socket now waiting for %s\n",
+                lm_misc_io_condition_to_str (condition));
 
-    socket->watch_out =
-        lm_misc_add_io_watch (socket->context,
-                              socket->io_channel,
-                              G_IO_OUT,
-                              (GIOFunc) socket_buffered_write_cb,
-                              socket);
+    lm_io_source_set_condition (socket->watch, condition);
 }
 
 static gboolean
-socket_buffered_write_cb (GIOChannel   *source,
-                          GIOCondition  condition,
-                          LmOldSocket     *socket)
+socket_io_cb (LmIOSource   *source,
+              GIOCondition  condition,
+              LmOldSocket  *socket)
 {
-    gint     b_written;
-    GString *out_buf;
+    gboolean read_anything = FALSE;
+    gboolean keep_source;
 
-    out_buf = socket->out_buf;
-    if (!out_buf) {
-        /* Should not be possible */
+    if (!socket->io_channel) {
         return FALSE;
     }
 
-    b_written = old_socket_do_write (socket, out_buf->str, out_buf->len);
+    lm_old_socket_ref (socket);
 
-    if (b_written < 0) {
-        (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR,
-                               socket->user_data);
-        return FALSE;
+    if (socket->ssl_handshaking) {
+        if (condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+            lm_verbose ("Connection lost during the TLS handshake\n");
+            old_socket_ssl_failed (socket);
+        } else if (condition & socket->ssl_wait) {
+            old_socket_ssl_handshake (socket);
+        }
+        goto out;
     }
 
-    g_string_erase (out_buf, 0, (gsize) b_written);
-    if (out_buf->len == 0) {
-        lm_verbose ("Output buffer is empty, going back to normal output\n");
+    if ((condition & G_IO_IN) ||
+        (socket->in_wants_write && (condition & G_IO_OUT))) {
+        socket->in_wants_write = FALSE;
 
-        if (socket->watch_out) {
-            g_source_destroy (socket->watch_out);
-            socket->watch_out = NULL;
+        if (!socket_in_event (socket, &read_anything)) {
+            goto out;
         }
+    }
 
-        g_string_free (out_buf, TRUE);
-        socket->out_buf = NULL;
-        return FALSE;
+    if (socket->out_condition & condition) {
+        if (!old_socket_drain (socket)) {
+            socket_error_event (socket, condition);
+            goto out;
+        }
+
+        if (lm_output_queue_is_empty (socket->out_queue)) {
+            lm_verbose ("Output buffer is empty, going back to normal output\n");
+        }
     }
 
-    return TRUE;
+    /* Any incoming data is processed before reporting the hangup */
+    if (read_anything && (condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) &&
+        old_socket_is_edge_triggered (socket)) {
+        lm_io_source_mark_ready (source,
+                                 condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL));
+    } else if (!read_anything) {
+        if (condition & (G_IO_ERR | G_IO_NVAL)) {
+            socket_error_event (socket, condition);
+            goto out;
+        }
+
+        if (condition & G_IO_HUP) {
+            socket_hup_event (socket, condition);
+            goto out;
+        }
+    }
+
+    old_socket_update_condition (socket);
+    old_socket_check_low_watermark (socket);
+
+ out:
+    keep_source = (socket->watch == source);
+
+    lm_old_socket_unref (socket);
+
+    return keep_source;
 }
 
 static void
@@ -766,47 +1477,66 @@ old_socket_resolver_host_cb (LmResolver       *resolver,
                              gpointer          user_data)
 {
     LmOldSocket *socket = (LmOldSocket *) user_data;
-    char dispbuf[128];
-    struct sockaddr_in *addr; /* FIXME:IPv6 */
-    const char *converr;
 
     lm_verbose ("LmOldSocket::host_cb (result=%d)\n", result);
 
+    if (!socket->connecting) {
+        return;
+    }
+
+    socket->resolving = FALSE;
+
+    /* Without results this moves on to the next SRV target, if any */
     if (result != LM_RESOLVER_RESULT_OK) {
-        lm_verbose ("error while resolving, bailing out\n");
-        if (socket->connect_func) {
-            (socket->connect_func) (socket, FALSE, socket->user_data);
-        }
-        /*FIXME: Leaking Resolvers Until Clean Up Can Be Properly Handled
-        g_object_unref (socket->resolver);
-        socket->resolver = NULL;*/
-        g_free (socket->connect_data);
-        socket->connect_data = NULL;
+        lm_verbose ("error while resolving\n");
+    }
 
-        return;
+    old_socket_start_attempt (socket);
+}
+
+/* The resolver being replaced is kept until connecting is done since it
+ * might be the one calling */
+static void
+old_socket_resolve_host (LmOldSocket *socket, const gchar *host)
+{
+    if (socket->resolver) {
+        socket->old_resolvers = g_slist_prepend (socket->old_resolvers,
+                                                 socket->resolver);
     }
 
-    socket->connect_data->current_addr =
-        lm_resolver_results_get_next (resolver);
+    socket->resolver = lm_resolver_new_for_host (host,
+                                                 old_socket_resolver_host_cb,
+                                                 socket);
 
-    if (socket->connect_data->current_addr) { /* FIXME:IPv6 */
-        addr = (struct sockaddr_in *) (socket->connect_data->current_addr->ai_addr);
-        converr = inet_ntop(AF_INET,&(addr->sin_addr),dispbuf,sizeof(dispbuf));
-        if (converr) {
-            g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_VERBOSE,
-                   "Attempting Connection to %s\n",dispbuf);
-        } else {
-            g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_VERBOSE,
-                   "Attempting Connection (unable to convert address to presentable format)\n");
-        };
-        socket_do_connect (socket->connect_data);
-    } else { /* FIXME: IPv6 Support? */
-        g_log (LM_LOG_DOMAIN,G_LOG_LEVEL_ERROR,
-               "Unable to locate server available over IPv4.\n");
-    };
+    if (socket->context) {
+        g_object_set (socket->resolver, "context", socket->context, NULL);
+    }
+
+    socket->resolving = TRUE;
+
+    lm_resolver_lookup (socket->resolver);
+}
+
+static gint
+old_socket_compare_srv_priority (const LmSrvTarget *a,
+                                 const LmSrvTarget *b)
+{
+    if (a->priority != b->priority) {
+        return a->priority < b->priority ? -1 : 1;
+    }
+
+    /* Direct TLS goes first on equal priority (XEP-0368) */
+    return b->direct_tls - a->direct_tls;
+}
 
-    /* FIXME: What do we do here?  How to make the mainloop exit with an
-       error, while having no ref to said mainloop */
+/* Merges the targets of the _xmpp-client and _xmpps-client lookups.
+ * The sort is stable, which keeps the weighted order of each lookup
+ * within a priority. */
+static GList *
+old_socket_merge_srv_targets (GList *targets, GList *more)
+{
+    return g_list_sort (g_list_concat (targets, more),
+                        (GCompareFunc) old_socket_compare_srv_priority);
 }
 
 /* FIXME: Need to have a way to only get srv reply and then decide if the
@@ -825,12 +1555,54 @@ old_socket_resolver_srv_cb (LmResolver       *resolver,
 
     lm_verbose ("LmOldSocket::srv_cb (result=%d)\n", result);
 
-    if (result != LM_RESOLVER_RESULT_OK) {
+    /* The socket is being closed */
+    if (result == LM_RESOLVER_RESULT_CANCELLED) {
+        return;
+    }
+
+    if (result == LM_RESOLVER_RESULT_OK) {
+        GList *targets;
+
+        targets = lm_resolver_get_srv_targets (resolver);
+        if (resolver == socket->tls_resolver) {
+            GList *l;
+
+            for (l = targets; l; l = l->next) {
+                ((LmSrvTarget *) l->data)->direct_tls = TRUE;
+            }
+        }
+
+        socket->srv_targets = old_socket_merge_srv_targets (socket->srv_targets,
+                                                            targets);
+    }
+
+    if (socket->srv_pending > 0 && --socket->srv_pending > 0) {
+        /* Waiting for the other lookup */
+        return;
+    }
+
+    if (socket->tls_resolver) {
+        socket->old_resolvers = g_slist_prepend (socket->old_resolvers,
+                                                 socket->tls_resolver);
+        socket->tls_resolver = NULL;
+    }
+
+    if (!socket->srv_targets) {
         lm_verbose ("SRV lookup failed, trying jid domain\n");
         socket->server = g_strdup (socket->domain);
     } else {
-        g_object_get (resolver, "host", &socket->server, NULL);
-        g_object_get (resolver, "port", &socket->port, NULL);
+        LmSrvTarget *target = socket->srv_targets->data;
+
+        socket->server = g_strdup (target->host);
+        socket->port = target->port;
+
+        /* Connecting through a proxy only goes to the first target */
+        if (socket->proxy) {
+            lm_resolver_free_srv_targets (socket->srv_targets);
+            socket->srv_targets = NULL;
+        } else {
+            socket->srv_current = socket->srv_targets;
+        }
     }
 
     if (socket->proxy) {
@@ -842,14 +1614,7 @@ old_socket_resolver_srv_cb (LmResolver       *resolver,
         remote_addr = socket->domain;
     }
 
-    g_object_unref (socket->resolver);
-
-    socket->resolver =
-            lm_resolver_new_for_host (remote_addr,
-                                      old_socket_resolver_host_cb,
-                                      socket);
-
-    lm_resolver_lookup (socket->resolver);
+    old_socket_resolve_host (socket, remote_addr);
 }
 
 LmOldSocket *
@@ -867,7 +1632,6 @@ lm_old_socket_create (GMainContext      *context,
                       GError           **error)
 {
     LmOldSocket   *socket;
-    LmConnectData *data;
 
     g_return_val_if_fail (domain != NULL, NULL);
     g_return_val_if_fail ((port >= LM_MIN_PORT && port <= LM_MAX_PORT), NULL);
@@ -887,6 +1651,7 @@ lm_old_socket_create (GMainContext      *context,
     socket->ssl = ssl;
     socket->ssl_started = FALSE;
     socket->proxy = NULL;
+    socket->out_queue = lm_output_queue_new ();
 
     if (context) {
         socket->context = g_main_context_ref (context);
@@ -896,11 +1661,7 @@ lm_old_socket_create (GMainContext      *context,
         socket->proxy = lm_proxy_ref (proxy);
     }
 
-    data = g_new0 (LmConnectData, 1);
-    data->socket = socket;
-    data->connection = socket->connection;
-    data->fd = -1;
-    socket->connect_data = data;
+    socket->connecting = TRUE;
 
     if (!server) {
         socket->resolver = lm_resolver_new_for_service (socket->domain,
@@ -908,6 +1669,18 @@ lm_old_socket_create (GMainContext      *context,
                                                         "tcp",
                                                         old_socket_resolver_srv_cb,
                                                         socket);
+
+        /* A proxy can't tell which of the targets it connects to */
+        if (ssl && lm_ssl_get_use_starttls (ssl) &&
+            lm_ssl_get_use_direct_tls (ssl) && !proxy) {
+            socket->tls_resolver =
+                lm_resolver_new_for_service (socket->domain,
+                                             "xmpps-client",
+                                             "tcp",
+                                             old_socket_resolver_srv_cb,
+                                             socket);
+            socket->srv_pending = 2;
+        }
     } else {
         socket->resolver =
             lm_resolver_new_for_host (socket->server ? socket->server : socket->domain,
@@ -917,6 +1690,9 @@ lm_old_socket_create (GMainContext      *context,
 
     if (socket->context) {
         g_object_set (socket->resolver, "context", context, NULL);
+        if (socket->tls_resolver) {
+            g_object_set (socket->tls_resolver, "context", context, NULL);
+        }
     }
 
     socket->data_func = data_func;
@@ -924,70 +1700,100 @@ lm_old_socket_create (GMainContext      *context,
     socket->connect_func = connect_func;
     socket->user_data = user_data;
 
+    if (socket->tls_resolver) {
+        lm_resolver_lookup (socket->tls_resolver);
+    }
     lm_resolver_lookup (socket->resolver);
 
     return socket;
 }
 
-void
+/* Writes as much of the buffered output as the socket takes without
+ * blocking, the rest is left to the output watch. */
+gboolean
 lm_old_socket_flush (LmOldSocket *socket)
 {
-    g_return_if_fail (socket != NULL);
-    g_return_if_fail (socket->io_channel != NULL);
+    gboolean result;
+
+    g_return_val_if_fail (socket != NULL, FALSE);
+    g_return_val_if_fail (socket->io_channel != NULL, FALSE);
+
+    if (socket->uring) {
+        lm_uring_socket_send (socket->uring, socket->out_queue);
+        lm_uring_socket_flush (socket->uring);
+        return TRUE;
+    }
+
+    /* Written once the handshake is done */
+    if (socket->ssl_handshaking) {
+        return TRUE;
+    }
+
+    lm_old_socket_ref (socket);
+
+    result = old_socket_drain (socket);
+    if (result) {
+        old_socket_update_condition (socket);
+        old_socket_check_low_watermark (socket);
+    }
+
+    lm_old_socket_unref (socket);
 
-    g_io_channel_flush (socket->io_channel, NULL);
+    return result;
 }
 
 void
 lm_old_socket_close (LmOldSocket *socket)
 {
-    LmConnectData *data;
-
     g_return_if_fail (socket != NULL);
 
-    if (socket->watch_connect) {
-        g_source_destroy (socket->watch_connect);
-        socket->watch_connect = NULL;
+    if (socket->connecting) {
+        old_socket_stop_connecting (socket, NULL);
     }
 
-    data = socket->connect_data;
-    if (data) {
-        if (data->io_channel) {
-            socket_close_io_channel (data->io_channel);
-        }
-        socket->connect_data = NULL;
-        g_free (data);
-    }
+    old_socket_ssl_stop_handshake (socket);
 
-    /* FIXME: Leaking Resolvers Until Clean Up Can Be Corrected
+    /* Resolvers hold a reference of their own while calling back, so this
+     * is fine from within the callback as well */
     if (socket->resolver) {
+        lm_resolver_cancel (socket->resolver);
         g_object_unref (socket->resolver);
         socket->resolver = NULL;
-    } */
-
-    if (socket->io_channel) {
-        if (socket->watch_in) {
-            g_source_destroy (socket->watch_in);
-            socket->watch_in = NULL;
-        }
+    }
 
-        if (socket->watch_err) {
-            g_source_destroy (socket->watch_err);
-            socket->watch_err = NULL;
-        }
+    if (socket->tls_resolver) {
+        lm_resolver_cancel (socket->tls_resolver);
+        g_object_unref (socket->tls_resolver);
+        socket->tls_resolver = NULL;
+    }
 
-        if (socket->watch_hup) {
-            g_source_destroy (socket->watch_hup);
-            socket->watch_hup = NULL;
+    if (socket->io_channel) {
+        if (socket->watch) {
+            lm_io_source_destroy (socket->watch);
+            socket->watch = NULL;
         }
 
-        if (socket->watch_out) {
-            g_source_destroy (socket->watch_out);
-            socket->watch_out = NULL;
+        /* The sends in flight complete first, then the rest of the queue,
+         * such as the end of the stream, is written the same way as
+         * without io_uring. Whatever is still in flight after that is
+         * cancelled before the descriptor goes away. */
+        if (socket->uring) {
+            gsize sent;
+
+            if (lm_uring_socket_close (socket->uring, &sent)) {
+                lm_output_queue_consume (socket->out_queue, sent);
+                socket->uring = NULL;
+                old_socket_drain (socket);
+            }
+            socket->uring = NULL;
         }
 
         socket_close_io_channel (socket->io_channel);
 
+        lm_output_queue_clear (socket->out_queue);
+        socket->out_condition = 0;
+        socket->in_wants_write = FALSE;
+
         socket->io_channel = NULL;
         socket->fd = -1;
     }
@@ -997,6 +1803,190 @@ lm_old_socket_close (LmOldSocket *socket)
     }
 }
 
+void
+lm_old_socket_set_watermarks (LmOldSocket *socket,
+                              gsize        low,
+                              gsize        high)
+{
+    g_return_if_fail (socket != NULL);
+    g_return_if_fail (high == 0 || low < high);
+
+    socket->out_low_watermark = low;
+    socket->out_high_watermark = high;
+
+    if (high == 0) {
+        socket->out_blocked = FALSE;
+    } else {
+        old_socket_check_high_watermark (socket);
+    }
+}
+
+void
+lm_old_socket_set_writable_func (LmOldSocket        *socket,
+                                 SocketWritableFunc  writable_func)
+{
+    g_return_if_fail (socket != NULL);
+
+    socket->writable_func = writable_func;
+}
+
+gsize
+lm_old_socket_get_buffered_bytes (LmOldSocket *socket)
+{
+    g_return_val_if_fail (socket != NULL, 0);
+
+    return lm_output_queue_get_size (socket->out_queue);
+}
+
+gboolean
+lm_old_socket_is_writable (LmOldSocket *socket)
+{
+    g_return_val_if_fail (socket != NULL, FALSE);
+
+    return !socket->out_blocked;
+}
+
+void
+lm_old_socket_set_coalesce (LmOldSocket *socket, gboolean coalesce)
+{
+    g_return_if_fail (socket != NULL);
+
+    socket->coalesce = coalesce;
+
+    if (!coalesce && socket->io_channel) {
+        lm_old_socket_flush (socket);
+    }
+}
+
+/* Stops reading from the socket until resumed, so that TCP flow control
+ * holds back the sender. Data already read is still delivered. */
+void
+lm_old_socket_set_reading_paused (LmOldSocket *socket, gboolean paused)
+{
+    g_return_if_fail (socket != NULL);
+
+    if (socket->in_paused == paused) {
+        return;
+    }
+
+    socket->in_paused = paused;
+
+    lm_verbose ("%s reading\n", paused ? "Pausing" : "Resuming");
+
+    if (socket->uring) {
+        lm_uring_socket_set_receiving (socket->uring, !paused);
+
+        if (!paused && socket->in_stash) {
+            GString *stash = socket->in_stash;
+
+            socket->in_stash = NULL;
+
+            lm_old_socket_ref (socket);
+            socket_deliver_incoming (socket, stash->str, stash->len);
+            lm_old_socket_unref (socket);
+
+            g_string_free (stash, TRUE);
+        }
+        return;
+    }
+
+    old_socket_update_condition (socket);
+
+    if (!paused && socket->watch) {
+        /* Data that arrived meanwhile doesn't wake up an edge triggered
+         * watch again */
+        lm_io_source_mark_ready (socket->watch, G_IO_IN);
+    }
+}
+
+/* Removes the watch of a connected socket so that it can be moved to
+ * another context with lm_old_socket_attach(). Not possible while
+ * connecting or when the socket isn't watched by a source of its own. */
+gboolean
+lm_old_socket_detach (LmOldSocket *socket)
+{
+    g_return_val_if_fail (socket != NULL, FALSE);
+
+    if (socket->connecting || socket->ssl_handshaking ||
+        socket->reactor || socket->uring) {
+        return FALSE;
+    }
+
+    if (socket->watch) {
+        lm_io_source_destroy (socket->watch);
+        socket->watch = NULL;
+    }
+
+    return TRUE;
+}
+
+void
+lm_old_socket_attach (LmOldSocket *socket, GMainContext *context)
+{
+    g_return_if_fail (socket != NULL);
+    g_return_if_fail (socket->watch == NULL);
+
+    if (socket->context) {
+        g_main_context_unref (socket->context);
+    }
+
+    socket->context = context ? g_main_context_ref (context) : NULL;
+
+    if (!socket->io_channel) {
+        return;
+    }
+
+    socket->watch = lm_io_source_new (socket->context,
+                                      socket->io_channel,
+                                      G_IO_IN,
+                                      (LmIOSourceFunc) socket_io_cb,
+                                      socket);
+
+    /* Wait for output again if there was some buffered */
+    old_socket_update_condition (socket);
+}
+
+/* Sockets using a reactor are watched by it once connected */
+void
+lm_old_socket_set_reactor (LmOldSocket *socket, LmReactor *reactor)
+{
+    g_return_if_fail (socket != NULL);
+    g_return_if_fail (socket->watch == NULL);
+
+    if (socket->reactor) {
+        lm_reactor_unref (socket->reactor);
+    }
+
+    socket->reactor = reactor ? lm_reactor_ref (reactor) : NULL;
+}
+
+void
+lm_old_socket_set_tcp_nodelay (LmOldSocket *socket, gboolean nodelay)
+{
+    g_return_if_fail (socket != NULL);
+
+    socket->tcp_nodelay = nodelay;
+
+    if (socket->io_channel) {
+        _lm_sock_set_nodelay (socket->fd, nodelay);
+    }
+}
+
+void
+lm_old_socket_set_buffer_sizes (LmOldSocket *socket,
+                                guint        send_size,
+                                guint        receive_size)
+{
+    g_return_if_fail (socket != NULL);
+
+    socket->send_buffer_size = send_size;
+    socket->receive_buffer_size = receive_size;
+
+    if (socket->io_channel) {
+        _lm_sock_set_buffer_sizes (socket->fd, send_size, receive_size);
+    }
+}
+
 gchar *
 lm_old_socket_get_local_host (LmOldSocket *socket)
 {
@@ -1048,7 +2038,8 @@ lm_old_socket_asyncns_cancel (LmOldSocket *socket)
 gboolean
 lm_old_socket_get_use_starttls (LmOldSocket *socket)
 {
-    if (!socket->ssl) {
+    /* Already running TLS when connected with direct TLS */
+    if (!socket->ssl || socket->direct_tls) {
         return FALSE;
     }
 
@@ -1058,7 +2049,7 @@ lm_old_socket_get_use_starttls (LmOldSocket *socket)
 gboolean
 lm_old_socket_get_require_starttls (LmOldSocket *socket)
 {
-    if (!socket->ssl) {
+    if (!socket->ssl || socket->direct_tls) {
         return FALSE;
     }
 
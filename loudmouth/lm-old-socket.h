@@ -24,6 +24,8 @@
 #include <glib.h>
 
 #include "lm-internals.h"
+#include "lm-output-queue.h"
+#include "lm-reactor.h"
 
 typedef struct _LmOldSocket LmOldSocket;
 
@@ -39,6 +41,9 @@ typedef void    (* ConnectResultFunc) (LmOldSocket         *socket,
                                        gboolean             result,
                                        gpointer             user_data);
 
+typedef void    (* SocketWritableFunc) (LmOldSocket        *socket,
+                                        gpointer            user_data);
+
 LmOldSocket * lm_old_socket_create          (GMainContext       *context,
                                              IncomingDataFunc    data_func,
                                              SocketClosedFunc    closed_func,
@@ -54,7 +59,12 @@ LmOldSocket * lm_old_socket_create          (GMainContext       *context,
 gint           lm_old_socket_write          (LmOldSocket       *socket,
                                              const gchar       *buf,
                                              gint               len);
-void           lm_old_socket_flush          (LmOldSocket        *socket);
+gint           lm_old_socket_write_chunk    (LmOldSocket       *socket,
+                                             LmOutputChunk     *chunk);
+gint           lm_old_socket_write_chunk_keyed (LmOldSocket    *socket,
+                                             LmOutputChunk     *chunk,
+                                             const gchar       *key);
+gboolean       lm_old_socket_flush          (LmOldSocket        *socket);
 void           lm_old_socket_close          (LmOldSocket        *socket);
 LmOldSocket *  lm_old_socket_ref            (LmOldSocket        *socket);
 void           lm_old_socket_unref          (LmOldSocket        *socket);
@@ -62,6 +72,27 @@ gboolean       lm_old_socket_starttls       (LmOldSocket        *socket);
 gboolean       lm_old_socket_set_keepalive  (LmOldSocket        *socket,
                                              int                 delay);
 gchar *        lm_old_socket_get_local_host (LmOldSocket        *socket);
+void           lm_old_socket_set_coalesce   (LmOldSocket        *socket,
+                                             gboolean            coalesce);
+void           lm_old_socket_set_reactor    (LmOldSocket        *socket,
+                                             LmReactor          *reactor);
+gboolean       lm_old_socket_detach         (LmOldSocket        *socket);
+void           lm_old_socket_attach         (LmOldSocket        *socket,
+                                             GMainContext       *context);
+void           lm_old_socket_set_tcp_nodelay (LmOldSocket       *socket,
+                                              gboolean           nodelay);
+void           lm_old_socket_set_buffer_sizes (LmOldSocket      *socket,
+                                               guint             send_size,
+                                               guint             receive_size);
+void           lm_old_socket_set_watermarks (LmOldSocket        *socket,
+                                             gsize               low,
+                                             gsize               high);
+void           lm_old_socket_set_writable_func (LmOldSocket     *socket,
+                                                SocketWritableFunc writable_func);
+gsize          lm_old_socket_get_buffered_bytes (LmOldSocket    *socket);
+gboolean       lm_old_socket_is_writable    (LmOldSocket        *socket);
+void           lm_old_socket_set_reading_paused (LmOldSocket    *socket,
+                                                 gboolean        paused);
 void           lm_old_socket_asyncns_cancel (LmOldSocket        *socket);
 
 gboolean       lm_old_socket_get_use_starttls (LmOldSocket      *socket);
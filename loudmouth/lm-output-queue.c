@@ -0,0 +1,375 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "lm-output-queue.h"
+
+struct _LmOutputChunk {
+    gchar *data;
+    gsize  len;
+
+    gint   ref_count;
+};
+
+typedef struct {
+    LmOutputChunk *chunk;
+    gsize          offset;
+
+    /* Set for chunks that a newer one with the same key replaces */
+    gchar         *key;
+    /* The data has been handed to a write that may still be retried or
+     * is still running, it can't be replaced anymore */
+    gboolean       pinned;
+} OutputEntry;
+
+struct _LmOutputQueue {
+    GQueue     *entries;
+
+    /* Number of bytes left to write, over all entries */
+    gsize       size;
+
+    /* Key -> OutputEntry, created with the first keyed entry */
+    GHashTable *keys;
+};
+
+static void
+output_entry_free (LmOutputQueue *queue, OutputEntry *entry)
+{
+    if (entry->key) {
+        if (g_hash_table_lookup (queue->keys, entry->key) == entry) {
+            g_hash_table_remove (queue->keys, entry->key);
+        }
+        g_free (entry->key);
+    }
+
+    lm_output_chunk_unref (entry->chunk);
+    g_slice_free (OutputEntry, entry);
+}
+
+LmOutputChunk *
+lm_output_chunk_new (const gchar *data, gsize len)
+{
+    return lm_output_chunk_new_take (g_memdup (data, len), len);
+}
+
+LmOutputChunk *
+lm_output_chunk_new_take (gchar *data, gsize len)
+{
+    LmOutputChunk *chunk;
+
+    chunk = g_slice_new (LmOutputChunk);
+
+    chunk->data = data;
+    chunk->len = len;
+    chunk->ref_count = 1;
+
+    return chunk;
+}
+
+const gchar *
+lm_output_chunk_get_data (LmOutputChunk *chunk)
+{
+    g_return_val_if_fail (chunk != NULL, NULL);
+
+    return chunk->data;
+}
+
+gsize
+lm_output_chunk_get_length (LmOutputChunk *chunk)
+{
+    g_return_val_if_fail (chunk != NULL, 0);
+
+    return chunk->len;
+}
+
+LmOutputChunk *
+lm_output_chunk_ref (LmOutputChunk *chunk)
+{
+    g_return_val_if_fail (chunk != NULL, NULL);
+
+    chunk->ref_count++;
+
+    return chunk;
+}
+
+void
+lm_output_chunk_unref (LmOutputChunk *chunk)
+{
+    g_return_if_fail (chunk != NULL);
+
+    chunk->ref_count--;
+
+    if (chunk->ref_count == 0) {
+        g_free (chunk->data);
+        g_slice_free (LmOutputChunk, chunk);
+    }
+}
+
+LmOutputQueue *
+lm_output_queue_new (void)
+{
+    LmOutputQueue *queue;
+
+    queue = g_new0 (LmOutputQueue, 1);
+
+    queue->entries = g_queue_new ();
+    queue->size = 0;
+
+    return queue;
+}
+
+void
+lm_output_queue_free (LmOutputQueue *queue)
+{
+    g_return_if_fail (queue != NULL);
+
+    lm_output_queue_clear (queue);
+    g_queue_free (queue->entries);
+
+    if (queue->keys) {
+        g_hash_table_destroy (queue->keys);
+    }
+
+    g_free (queue);
+}
+
+/* Queues the data of @chunk starting at @offset, the bytes before @offset
+ * are considered already written. */
+void
+lm_output_queue_push (LmOutputQueue *queue,
+                      LmOutputChunk *chunk,
+                      gsize          offset)
+{
+    OutputEntry *entry;
+
+    g_return_if_fail (queue != NULL);
+    g_return_if_fail (chunk != NULL);
+    g_return_if_fail (offset <= chunk->len);
+
+    if (offset == chunk->len) {
+        return;
+    }
+
+    entry = g_slice_new0 (OutputEntry);
+    entry->chunk = lm_output_chunk_ref (chunk);
+    entry->offset = offset;
+
+    g_queue_push_tail (queue->entries, entry);
+    queue->size += chunk->len - offset;
+}
+
+/* Queues @chunk, or if a chunk queued with the same @key hasn't been
+ * written at all yet puts @chunk in its place. Returns TRUE if a chunk
+ * was replaced. */
+gboolean
+lm_output_queue_push_keyed (LmOutputQueue *queue,
+                            LmOutputChunk *chunk,
+                            const gchar   *key)
+{
+    OutputEntry *entry;
+
+    g_return_val_if_fail (queue != NULL, FALSE);
+    g_return_val_if_fail (chunk != NULL, FALSE);
+
+    if (!key || chunk->len == 0) {
+        lm_output_queue_push (queue, chunk, 0);
+        return FALSE;
+    }
+
+    if (!queue->keys) {
+        queue->keys = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+
+    entry = g_hash_table_lookup (queue->keys, key);
+    if (entry && entry->offset == 0 && !entry->pinned) {
+        queue->size -= entry->chunk->len;
+        queue->size += chunk->len;
+
+        lm_output_chunk_unref (entry->chunk);
+        entry->chunk = lm_output_chunk_ref (chunk);
+
+        return TRUE;
+    }
+
+    entry = g_slice_new0 (OutputEntry);
+    entry->chunk = lm_output_chunk_ref (chunk);
+    entry->key = g_strdup (key);
+
+    g_queue_push_tail (queue->entries, entry);
+    queue->size += chunk->len;
+
+    /* An older entry that can't be replaced anymore keeps its data */
+    g_hash_table_replace (queue->keys, entry->key, entry);
+
+    return FALSE;
+}
+
+/* Keeps the entries holding the first @len bytes from being replaced, for
+ * a write that has to be retried with the same data */
+void
+lm_output_queue_pin (LmOutputQueue *queue, gsize len)
+{
+    GList *l;
+
+    g_return_if_fail (queue != NULL);
+
+    for (l = queue->entries->head; l && len > 0; l = l->next) {
+        OutputEntry *entry = (OutputEntry *) l->data;
+
+        entry->pinned = TRUE;
+        len -= MIN (len, entry->chunk->len - entry->offset);
+    }
+}
+
+gsize
+lm_output_queue_get_size (LmOutputQueue *queue)
+{
+    g_return_val_if_fail (queue != NULL, 0);
+
+    return queue->size;
+}
+
+gboolean
+lm_output_queue_is_empty (LmOutputQueue *queue)
+{
+    g_return_val_if_fail (queue != NULL, TRUE);
+
+    return queue->size == 0;
+}
+
+/* Copies up to @len bytes from the head of the queue into @buf without
+ * consuming them. Used to coalesce small chunks into a single write, for
+ * example one SSL record. */
+gsize
+lm_output_queue_peek (LmOutputQueue *queue,
+                      gchar         *buf,
+                      gsize          len)
+{
+    GList *l;
+    gsize  copied = 0;
+
+    g_return_val_if_fail (queue != NULL, 0);
+
+    for (l = queue->entries->head; l && copied < len; l = l->next) {
+        OutputEntry *entry = (OutputEntry *) l->data;
+        gsize        n;
+
+        n = MIN (entry->chunk->len - entry->offset, len - copied);
+        memcpy (buf + copied, entry->chunk->data + entry->offset, n);
+        copied += n;
+    }
+
+    return copied;
+}
+
+/* Drops @len written bytes from the head of the queue. Fully written
+ * chunks are released, a partially written one just has its offset
+ * moved. */
+void
+lm_output_queue_consume (LmOutputQueue *queue, gsize len)
+{
+    g_return_if_fail (queue != NULL);
+    g_return_if_fail (len <= queue->size);
+
+    queue->size -= len;
+
+    while (len > 0) {
+        OutputEntry *entry;
+        gsize        left;
+
+        entry = (OutputEntry *) g_queue_peek_head (queue->entries);
+        left = entry->chunk->len - entry->offset;
+
+        if (len < left) {
+            entry->offset += len;
+            break;
+        }
+
+        len -= left;
+        g_queue_pop_head (queue->entries);
+        output_entry_free (queue, entry);
+    }
+}
+
+void
+lm_output_queue_clear (LmOutputQueue *queue)
+{
+    OutputEntry *entry;
+
+    g_return_if_fail (queue != NULL);
+
+    while ((entry = g_queue_pop_head (queue->entries))) {
+        output_entry_free (queue, entry);
+    }
+
+    queue->size = 0;
+}
+
+/* Stores a new reference to each of the first @n_chunks queued chunks in
+ * @chunks, in the same order as lm_output_queue_get_iovec() returns them.
+ * Keeps the data alive while it is being written asynchronously, the
+ * entries are pinned as well. */
+guint
+lm_output_queue_ref_chunks (LmOutputQueue  *queue,
+                            LmOutputChunk **chunks,
+                            guint           n_chunks)
+{
+    GList *l;
+    guint  n = 0;
+
+    g_return_val_if_fail (queue != NULL, 0);
+
+    for (l = queue->entries->head; l && n < n_chunks; l = l->next) {
+        OutputEntry *entry = (OutputEntry *) l->data;
+
+        entry->pinned = TRUE;
+        chunks[n++] = lm_output_chunk_ref (entry->chunk);
+    }
+
+    return n;
+}
+
+#ifndef G_OS_WIN32
+/* Fills in at most @n_iov entries of @iov with the queued data, suitable
+ * for a single writev() call. Returns the number of entries used. */
+guint
+lm_output_queue_get_iovec (LmOutputQueue *queue,
+                           struct iovec  *iov,
+                           guint          n_iov)
+{
+    GList *l;
+    guint  n = 0;
+
+    g_return_val_if_fail (queue != NULL, 0);
+
+    for (l = queue->entries->head; l && n < n_iov; l = l->next) {
+        OutputEntry *entry = (OutputEntry *) l->data;
+
+        iov[n].iov_base = entry->chunk->data + entry->offset;
+        iov[n].iov_len = entry->chunk->len - entry->offset;
+        n++;
+    }
+
+    return n;
+}
+#endif /* G_OS_WIN32 */
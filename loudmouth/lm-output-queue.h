@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_OUTPUT_QUEUE_H__
+#define __LM_OUTPUT_QUEUE_H__
+
+#include <glib.h>
+
+#ifndef G_OS_WIN32
+#include <sys/uio.h>
+#endif
+
+G_BEGIN_DECLS
+
+/* Immutable, reference counted block of serialized output. The same chunk
+ * can be queued on several output queues at once. */
+typedef struct _LmOutputChunk LmOutputChunk;
+
+/* Queue of chunks waiting to be written to a socket. Each queued chunk has
+ * its own write offset so a partial write never moves any data around. */
+typedef struct _LmOutputQueue LmOutputQueue;
+
+LmOutputChunk * lm_output_chunk_new         (const gchar   *data,
+                                             gsize          len);
+LmOutputChunk * lm_output_chunk_new_take    (gchar         *data,
+                                             gsize          len);
+const gchar *   lm_output_chunk_get_data    (LmOutputChunk *chunk);
+gsize           lm_output_chunk_get_length  (LmOutputChunk *chunk);
+LmOutputChunk * lm_output_chunk_ref         (LmOutputChunk *chunk);
+void            lm_output_chunk_unref       (LmOutputChunk *chunk);
+
+LmOutputQueue * lm_output_queue_new         (void);
+void            lm_output_queue_free        (LmOutputQueue *queue);
+void            lm_output_queue_push        (LmOutputQueue *queue,
+                                             LmOutputChunk *chunk,
+                                             gsize          offset);
+gboolean        lm_output_queue_push_keyed  (LmOutputQueue *queue,
+                                             LmOutputChunk *chunk,
+                                             const gchar   *key);
+void            lm_output_queue_pin         (LmOutputQueue *queue,
+                                             gsize          len);
+gsize           lm_output_queue_get_size    (LmOutputQueue *queue);
+gboolean        lm_output_queue_is_empty    (LmOutputQueue *queue);
+gsize           lm_output_queue_peek        (LmOutputQueue *queue,
+                                             gchar         *buf,
+                                             gsize          len);
+void            lm_output_queue_consume     (LmOutputQueue *queue,
+                                             gsize          len);
+void            lm_output_queue_clear       (LmOutputQueue *queue);
+guint           lm_output_queue_ref_chunks  (LmOutputQueue  *queue,
+                                             LmOutputChunk **chunks,
+                                             guint           n_chunks);
+#ifndef G_OS_WIN32
+guint           lm_output_queue_get_iovec   (LmOutputQueue *queue,
+                                             struct iovec  *iov,
+                                             guint          n_iov);
+#endif
+
+G_END_DECLS
+
+#endif /* __LM_OUTPUT_QUEUE_H__ */
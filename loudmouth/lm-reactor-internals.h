@@ -0,0 +1,41 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_REACTOR_INTERNALS_H__
+#define __LM_REACTOR_INTERNALS_H__
+
+#include <glib.h>
+
+#include "lm-io-source.h"
+#include "lm-reactor.h"
+
+void  _lm_reactor_add        (LmReactor    *reactor,
+                              LmIOSource   *io_source,
+                              GIOCondition  condition);
+void  _lm_reactor_modify     (LmReactor    *reactor,
+                              LmIOSource   *io_source,
+                              GIOCondition  condition);
+void  _lm_reactor_remove     (LmReactor    *reactor,
+                              LmIOSource   *io_source);
+void  _lm_reactor_mark_ready (LmReactor    *reactor,
+                              LmIOSource   *io_source,
+                              GIOCondition  condition);
+
+#endif /* __LM_REACTOR_INTERNALS_H__ */
@@ -0,0 +1,484 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:lm-reactor
+ * @Title: LmReactor
+ * @Short_description: Shared event source for many connections
+ *
+ * A reactor watches the sockets of all connections using it with a single
+ * edge triggered epoll instance, which is attached to the main context as
+ * one source. Every main loop iteration then only costs as much as the
+ * number of connections that actually have something to do, instead of
+ * growing with the number of open connections. This pays off with
+ * thousands of connections on one context.
+ *
+ * Reactors are only available where epoll is, see
+ * lm_reactor_is_supported().
+ * <informalexample><programlisting><![CDATA[
+ * LmReactor *reactor;
+ *
+ * reactor = lm_reactor_new (NULL);
+ * for (i = 0; i < n_accounts; i++) {
+ *     connections[i] = lm_connection_new (server);
+ *     lm_connection_set_reactor (connections[i], reactor);
+ *     ...
+ * }
+ * lm_reactor_unref (reactor);
+ * ]]></programlisting></informalexample>
+ */
+
+#include <config.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#endif
+
+#include "lm-debug.h"
+#include "lm-io-source.h"
+#include "lm-reactor-internals.h"
+
+/* Number of events fetched and dispatched in one main loop iteration */
+#define REACTOR_MAX_EVENTS 256
+
+#if GLIB_CHECK_VERSION(2,36,0)
+#define USE_UNIX_FD 1
+#endif
+
+typedef struct {
+    LmIOSource   *io_source;
+    GIOCondition  condition;
+} ReadyItem;
+
+typedef struct {
+    GSource    source;
+    LmReactor *reactor;
+
+#ifdef USE_UNIX_FD
+    gpointer   tag;
+#else
+    GPollFD    pollfd;
+#endif
+} ReactorSource;
+
+struct _LmReactor {
+    GMainContext *context;
+    GSource      *source;
+
+    gint          epfd;
+
+    /* Sources to dispatch again without waiting for an event */
+    GQueue       *ready;
+    GHashTable   *ready_items;
+
+    gint          ref_count;
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static gboolean    reactor_prepare_func    (GSource         *source,
+                                            gint            *timeout);
+static gboolean    reactor_check_func      (GSource         *source);
+static gboolean    reactor_dispatch_func   (GSource         *source,
+                                            GSourceFunc      callback,
+                                            gpointer         user_data);
+
+static GSourceFuncs source_funcs = {
+    reactor_prepare_func,
+    reactor_check_func,
+    reactor_dispatch_func,
+    NULL
+};
+
+static guint32
+reactor_events_from_condition (GIOCondition condition)
+{
+    guint32 events = EPOLLET;
+
+    if (condition & G_IO_IN) {
+        events |= EPOLLIN;
+    }
+    if (condition & G_IO_PRI) {
+        events |= EPOLLPRI;
+    }
+    if (condition & G_IO_OUT) {
+        events |= EPOLLOUT;
+    }
+    if (condition & G_IO_ERR) {
+        events |= EPOLLERR;
+    }
+    if (condition & G_IO_HUP) {
+        events |= EPOLLHUP;
+    }
+
+    return events;
+}
+
+static GIOCondition
+reactor_condition_from_events (guint32 events)
+{
+    GIOCondition condition = 0;
+
+    if (events & EPOLLIN) {
+        condition |= G_IO_IN;
+    }
+    if (events & EPOLLPRI) {
+        condition |= G_IO_PRI;
+    }
+    if (events & EPOLLOUT) {
+        condition |= G_IO_OUT;
+    }
+    if (events & EPOLLERR) {
+        condition |= G_IO_ERR;
+    }
+    if (events & EPOLLHUP) {
+        condition |= G_IO_HUP;
+    }
+
+    return condition;
+}
+
+static gboolean
+reactor_prepare_func (GSource *source, gint *timeout)
+{
+    LmReactor *reactor = ((ReactorSource *) source)->reactor;
+
+    *timeout = -1;
+
+    return !g_queue_is_empty (reactor->ready);
+}
+
+static gboolean
+reactor_check_func (GSource *source)
+{
+    ReactorSource *rsource = (ReactorSource *) source;
+    GIOCondition   revents;
+
+#ifdef USE_UNIX_FD
+    revents = g_source_query_unix_fd (source, rsource->tag);
+#else
+    revents = rsource->pollfd.revents;
+#endif
+
+    return (revents & G_IO_IN) || !g_queue_is_empty (rsource->reactor->ready);
+}
+
+static gboolean
+reactor_dispatch_func (GSource     *source,
+                       GSourceFunc  callback,
+                       gpointer     user_data)
+{
+    LmReactor          *reactor = ((ReactorSource *) source)->reactor;
+    struct epoll_event  events[REACTOR_MAX_EVENTS];
+    GQueue             *ready;
+    ReadyItem          *item;
+    gint                n_events;
+    gint                i;
+
+    lm_reactor_ref (reactor);
+
+    do {
+        n_events = epoll_wait (reactor->epfd, events, REACTOR_MAX_EVENTS, 0);
+    } while (n_events < 0 && errno == EINTR);
+
+    /* Whatever is marked ready while dispatching waits for the next
+     * iteration */
+    ready = reactor->ready;
+    reactor->ready = g_queue_new ();
+    g_hash_table_remove_all (reactor->ready_items);
+
+    /* A callback might destroy any of the other sources */
+    for (i = 0; i < n_events; i++) {
+        _lm_io_source_ref (events[i].data.ptr);
+    }
+
+    for (i = 0; i < n_events; i++) {
+        _lm_io_source_dispatch (events[i].data.ptr,
+                                reactor_condition_from_events (events[i].events));
+    }
+
+    for (i = 0; i < n_events; i++) {
+        _lm_io_source_unref (events[i].data.ptr);
+    }
+
+    while ((item = g_queue_pop_head (ready))) {
+        _lm_io_source_dispatch (item->io_source, item->condition);
+        _lm_io_source_unref (item->io_source);
+        g_slice_free (ReadyItem, item);
+    }
+
+    g_queue_free (ready);
+
+    lm_reactor_unref (reactor);
+
+    return TRUE;
+}
+
+static void
+reactor_ctl (LmReactor    *reactor,
+             gint          op,
+             LmIOSource   *io_source,
+             GIOCondition  condition)
+{
+    struct epoll_event event;
+
+    event.events = reactor_events_from_condition (condition);
+    event.data.ptr = io_source;
+
+    if (epoll_ctl (reactor->epfd, op, _lm_io_source_get_fd (io_source),
+                   &event) < 0) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+               "epoll_ctl (%d) failed: %s\n", op, g_strerror (errno));
+    }
+}
+
+void
+_lm_reactor_add (LmReactor    *reactor,
+                 LmIOSource   *io_source,
+                 GIOCondition  condition)
+{
+    reactor_ctl (reactor, EPOLL_CTL_ADD, io_source, condition);
+}
+
+/* Modifying re-arms the descriptor, a condition that is already met is
+ * reported right away */
+void
+_lm_reactor_modify (LmReactor    *reactor,
+                    LmIOSource   *io_source,
+                    GIOCondition  condition)
+{
+    reactor_ctl (reactor, EPOLL_CTL_MOD, io_source, condition);
+}
+
+void
+_lm_reactor_remove (LmReactor *reactor, LmIOSource *io_source)
+{
+    reactor_ctl (reactor, EPOLL_CTL_DEL, io_source, 0);
+
+    /* Queued ready items are skipped once the source is destroyed */
+}
+
+void
+_lm_reactor_mark_ready (LmReactor    *reactor,
+                        LmIOSource   *io_source,
+                        GIOCondition  condition)
+{
+    ReadyItem *item;
+
+    item = g_hash_table_lookup (reactor->ready_items, io_source);
+    if (item) {
+        item->condition |= condition;
+        return;
+    }
+
+    item = g_slice_new (ReadyItem);
+    item->io_source = _lm_io_source_ref (io_source);
+    item->condition = condition;
+
+    g_queue_push_tail (reactor->ready, item);
+    g_hash_table_insert (reactor->ready_items, io_source, item);
+
+    if (reactor->context) {
+        g_main_context_wakeup (reactor->context);
+    }
+}
+
+#else  /* HAVE_SYS_EPOLL_H */
+
+void
+_lm_reactor_add (LmReactor    *reactor,
+                 LmIOSource   *io_source,
+                 GIOCondition  condition)
+{
+}
+
+void
+_lm_reactor_modify (LmReactor    *reactor,
+                    LmIOSource   *io_source,
+                    GIOCondition  condition)
+{
+}
+
+void
+_lm_reactor_remove (LmReactor *reactor, LmIOSource *io_source)
+{
+}
+
+void
+_lm_reactor_mark_ready (LmReactor    *reactor,
+                        LmIOSource   *io_source,
+                        GIOCondition  condition)
+{
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+/**
+ * lm_reactor_is_supported:
+ *
+ * Checks if reactors are available on this platform.
+ *
+ * Return value: %TRUE if lm_reactor_new() can be used.
+ **/
+gboolean
+lm_reactor_is_supported (void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/**
+ * lm_reactor_new:
+ * @context: The #GMainContext to attach the reactor to, or %NULL for the default context.
+ *
+ * Creates a new reactor which connections on @context can share with
+ * lm_connection_set_reactor().
+ *
+ * Return value: A newly created #LmReactor, or %NULL if reactors are not supported or it could not be created.
+ **/
+LmReactor *
+lm_reactor_new (GMainContext *context)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    LmReactor     *reactor;
+    ReactorSource *rsource;
+    gint           epfd;
+
+    epfd = epoll_create (REACTOR_MAX_EVENTS);
+    if (epfd < 0) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+               "Could not create epoll instance: %s\n", g_strerror (errno));
+        return NULL;
+    }
+
+    reactor = g_new0 (LmReactor, 1);
+
+    reactor->epfd = epfd;
+    reactor->ready = g_queue_new ();
+    reactor->ready_items = g_hash_table_new (g_direct_hash, g_direct_equal);
+    reactor->ref_count = 1;
+
+    if (context) {
+        reactor->context = g_main_context_ref (context);
+    }
+
+    rsource = (ReactorSource *) g_source_new (&source_funcs,
+                                              sizeof (ReactorSource));
+    rsource->reactor = reactor;
+
+#ifdef USE_UNIX_FD
+    rsource->tag = g_source_add_unix_fd ((GSource *) rsource, epfd, G_IO_IN);
+#else
+    rsource->pollfd.fd = epfd;
+    rsource->pollfd.events = G_IO_IN;
+    g_source_add_poll ((GSource *) rsource, &rsource->pollfd);
+#endif
+
+    reactor->source = (GSource *) rsource;
+    g_source_attach (reactor->source, context);
+
+    return reactor;
+#else
+    return NULL;
+#endif /* HAVE_SYS_EPOLL_H */
+}
+
+/**
+ * lm_reactor_get_context:
+ * @reactor: an #LmReactor
+ *
+ * Fetches the context @reactor is attached to.
+ *
+ * Return value: the #GMainContext, %NULL for the default context.
+ **/
+GMainContext *
+lm_reactor_get_context (LmReactor *reactor)
+{
+    g_return_val_if_fail (reactor != NULL, NULL);
+
+    return reactor->context;
+}
+
+/**
+ * lm_reactor_ref:
+ * @reactor: an #LmReactor
+ *
+ * Adds a reference to @reactor.
+ *
+ * Return value: Returns the same reactor.
+ **/
+LmReactor *
+lm_reactor_ref (LmReactor *reactor)
+{
+    g_return_val_if_fail (reactor != NULL, NULL);
+
+    reactor->ref_count++;
+
+    return reactor;
+}
+
+/**
+ * lm_reactor_unref:
+ * @reactor: an #LmReactor
+ *
+ * Removes a reference from @reactor. When no more references are present
+ * the reactor is freed. Every connection using @reactor holds a reference
+ * to it.
+ **/
+void
+lm_reactor_unref (LmReactor *reactor)
+{
+    g_return_if_fail (reactor != NULL);
+
+    reactor->ref_count--;
+
+    if (reactor->ref_count > 0) {
+        return;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    {
+        ReadyItem *item;
+
+        while ((item = g_queue_pop_head (reactor->ready))) {
+            _lm_io_source_unref (item->io_source);
+            g_slice_free (ReadyItem, item);
+        }
+    }
+
+    g_source_destroy (reactor->source);
+    g_source_unref (reactor->source);
+    close (reactor->epfd);
+#endif
+
+    g_queue_free (reactor->ready);
+    g_hash_table_destroy (reactor->ready_items);
+
+    if (reactor->context) {
+        g_main_context_unref (reactor->context);
+    }
+
+    g_free (reactor);
+}
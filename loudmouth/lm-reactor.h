@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_REACTOR_H__
+#define __LM_REACTOR_H__
+
+#if !defined (LM_INSIDE_LOUDMOUTH_H) && !defined (LM_COMPILATION)
+#error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * LmReactor:
+ *
+ * This should not be accessed directly. Use the accessor functions as described below.
+ */
+typedef struct _LmReactor LmReactor;
+
+gboolean       lm_reactor_is_supported   (void);
+LmReactor *    lm_reactor_new            (GMainContext *context);
+GMainContext * lm_reactor_get_context    (LmReactor    *reactor);
+LmReactor *    lm_reactor_ref            (LmReactor    *reactor);
+void           lm_reactor_unref          (LmReactor    *reactor);
+
+G_END_DECLS
+
+#endif /* __LM_REACTOR_H__ */
@@ -31,14 +31,28 @@
 #include <resolv.h>
 
 #include "lm-asyncns-resolver.h"
-#include "lm-blocking-resolver.h"
+#include "lm-threaded-resolver.h"
 #include "lm-debug.h"
 #include "lm-internals.h"
 #include "lm-marshal.h"
+#include "lm-misc.h"
 #include "lm-resolver.h"
 
 #define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_RESOLVER, LmResolverPriv))
 
+/* Lookups are shared by all resolvers through a cache. getaddrinfo()
+ * doesn't tell the TTL of host records so they are kept for a fixed time,
+ * SRV records for their TTL. Failures are kept briefly to not retry them
+ * for every connection of a reconnect storm. */
+#define CACHE_HOST_TTL        60
+#define CACHE_MAX_TTL         3600
+#define CACHE_NEGATIVE_TTL    5
+#define CACHE_MAX_ENTRIES     256
+
+/* How long a measured connect time is used to order SRV targets */
+#define CONNECT_TIME_MAX_AGE  (10 * 60 * G_USEC_PER_SEC)
+#define CONNECT_TIMES_MAX     128
+
 typedef struct LmResolverPriv LmResolverPriv;
 struct LmResolverPriv {
     GMainContext       *context;
@@ -60,9 +74,47 @@ struct LmResolverPriv {
     LmResolverResult    result;
     struct addrinfo    *results;
     struct addrinfo    *current_result;
+    GList              *srv_targets;
+
+    /* The shared lookup, it owns the results */
+    struct CacheEntry  *cache_entry;
+    GSource            *cache_source;
+};
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+    gint              ref_count;
+    gchar            *key;
+
+    /* The resolver doing the lookup, NULL once it is done */
+    LmResolver       *leader;
+    /* Resolvers waiting for the same lookup */
+    GSList           *waiters;
+
+    LmResolverResult  result;
+    struct addrinfo  *results;
+    /* Reordered for every resolver the entry is delivered to */
+    GList            *srv_targets;
+    gint64            expires;
 };
 
+G_LOCK_DEFINE_STATIC (cache);
+static GHashTable *cache;
+
+typedef struct {
+    gint64 usec;
+    gint64 measured;
+} ConnectTime;
+
+/* Shared by all connections */
+G_LOCK_DEFINE_STATIC (connect_times);
+static GHashTable *connect_times;
+
 static void     resolver_finalize            (GObject           *object);
+static GList *  resolver_srv_targets_copy    (GList             *targets);
+static GList *  resolver_srv_order           (GList             *targets);
+static void     resolver_cache_leave         (LmResolver        *resolver);
+static void     resolver_cache_entry_unref   (CacheEntry        *entry);
 static void     resolver_get_property        (GObject           *object,
                                               guint              param_id,
                                               GValue            *value,
@@ -178,10 +230,16 @@ resolver_finalize (GObject *object)
         g_main_context_unref (priv->context);
     }
 
-    if (priv->results) {
-        freeaddrinfo (priv->results);
+    G_LOCK (cache);
+    resolver_cache_leave (LM_RESOLVER (object));
+    G_UNLOCK (cache);
+
+    if (priv->cache_entry) {
+        resolver_cache_entry_unref (priv->cache_entry);
     }
 
+    lm_resolver_free_srv_targets (priv->srv_targets);
+
     (G_OBJECT_CLASS (lm_resolver_parent_class)->finalize) (object);
 }
 
@@ -278,7 +336,7 @@ lm_resolver_new (GMainContext *context)
 #ifdef HAVE_ASYNCNS
     resolver = g_object_new (LM_TYPE_ASYNCNS_RESOLVER, NULL);
 #else
-    resolver = g_object_new (LM_TYPE_BLOCKING_RESOLVER, NULL);
+    resolver = g_object_new (LM_TYPE_THREADED_RESOLVER, NULL);
 #endif
 
     g_object_set (resolver, "context", context, NULL);
@@ -292,7 +350,7 @@ resolver_get_gtype (void)
 #ifdef HAVE_ASYNCNS
     return LM_TYPE_ASYNCNS_RESOLVER;
 #else
-    return LM_TYPE_BLOCKING_RESOLVER;
+    return LM_TYPE_THREADED_RESOLVER;
 #endif /* HAVE_ASYNCNS */
 }
 
@@ -350,14 +408,330 @@ lm_resolver_new_for_service (const gchar        *domain,
     return resolver;
 }
 
+/* Copies the results so that they can be shared, they are only read from
+ * then on */
+static struct addrinfo *
+resolver_addrinfo_copy (const struct addrinfo *results)
+{
+    struct addrinfo  *head = NULL;
+    struct addrinfo **tail = &head;
+
+    for (; results; results = results->ai_next) {
+        struct addrinfo *ai;
+
+        if (results->ai_family != AF_INET && results->ai_family != AF_INET6) {
+            continue;
+        }
+
+        ai = g_malloc0 (sizeof (struct addrinfo) + results->ai_addrlen);
+        ai->ai_flags = results->ai_flags;
+        ai->ai_family = results->ai_family;
+        ai->ai_socktype = results->ai_socktype;
+        ai->ai_protocol = results->ai_protocol;
+        ai->ai_addrlen = results->ai_addrlen;
+        ai->ai_addr = (struct sockaddr *) (ai + 1);
+        memcpy (ai->ai_addr, results->ai_addr, results->ai_addrlen);
+
+        *tail = ai;
+        tail = &ai->ai_next;
+    }
+
+    return head;
+}
+
+static void
+resolver_addrinfo_free (struct addrinfo *results)
+{
+    while (results) {
+        struct addrinfo *next = results->ai_next;
+
+        g_free (results);
+        results = next;
+    }
+}
+
+static CacheEntry *
+resolver_cache_entry_ref (CacheEntry *entry)
+{
+    g_atomic_int_inc (&entry->ref_count);
+
+    return entry;
+}
+
+static void
+resolver_cache_entry_unref (CacheEntry *entry)
+{
+    if (!g_atomic_int_dec_and_test (&entry->ref_count)) {
+        return;
+    }
+
+    g_free (entry->key);
+    resolver_addrinfo_free (entry->results);
+    lm_resolver_free_srv_targets (entry->srv_targets);
+    g_slist_free (entry->waiters);
+    g_slice_free (CacheEntry, entry);
+}
+
+static gchar *
+resolver_cache_key (LmResolverPriv *priv)
+{
+    gchar *name;
+    gchar *key;
+
+    if (priv->type == LM_RESOLVER_SRV) {
+        name = _lm_resolver_create_srv_string (priv->domain,
+                                               priv->service,
+                                               priv->protocol);
+        key = g_strconcat ("srv:", name, NULL);
+        g_free (name);
+    } else {
+        key = g_strconcat ("host:", priv->host, NULL);
+    }
+
+    name = g_ascii_strdown (key, -1);
+    g_free (key);
+
+    return name;
+}
+
+static gboolean
+resolver_cache_entry_is_stale (gpointer    key,
+                               CacheEntry *entry,
+                               gint64     *now)
+{
+    return !entry->leader && entry->expires <= *now;
+}
+
+static void
+resolver_deliver (LmResolver       *resolver,
+                  LmResolverResult  result,
+                  struct addrinfo  *results)
+{
+    LmResolverPriv *priv;
+
+    priv = GET_PRIV (resolver);
+
+    priv->result = result;
+    priv->results = priv->current_result = results;
+
+    lm_verbose ("Calling resolver callback: %s\n", priv->host);
+
+    priv->callback (resolver, result, priv->user_data);
+}
+
+static gboolean
+resolver_cache_deliver_cb (LmResolver *resolver)
+{
+    LmResolverPriv *priv;
+    CacheEntry     *entry;
+
+    priv = GET_PRIV (resolver);
+
+    G_LOCK (cache);
+    priv->cache_source = NULL;
+    entry = priv->cache_entry;
+    G_UNLOCK (cache);
+
+    g_object_ref (resolver);
+
+    /* Ordered for each resolver, so that connections spread over the
+     * targets by weight and pick up connect times measured since */
+    if (entry->srv_targets) {
+        GList *targets;
+
+        targets = resolver_srv_targets_copy (entry->srv_targets);
+        _lm_resolver_set_srv_targets (resolver, resolver_srv_order (targets));
+    }
+
+    resolver_deliver (resolver, entry->result, entry->results);
+
+    g_object_unref (resolver);
+
+    return FALSE;
+}
+
+static gboolean
+resolver_cache_lookup_cb (LmResolver *resolver)
+{
+    LmResolverPriv *priv;
+
+    priv = GET_PRIV (resolver);
+
+    G_LOCK (cache);
+    priv->cache_source = NULL;
+    G_UNLOCK (cache);
+
+    LM_RESOLVER_GET_CLASS(resolver)->lookup (resolver);
+
+    return FALSE;
+}
+
+/* Runs @func for @resolver from its own context, with the cache lock
+ * held */
+static void
+resolver_cache_schedule (LmResolver *resolver, GSourceFunc func)
+{
+    LmResolverPriv *priv;
+
+    priv = GET_PRIV (resolver);
+
+    priv->cache_source = lm_misc_add_idle (priv->context, func, resolver);
+}
+
+/* Stops @resolver from doing or waiting for a lookup, with the cache lock
+ * held. A waiting resolver takes over a lookup that is still needed. */
+static void
+resolver_cache_leave (LmResolver *resolver)
+{
+    LmResolverPriv *priv;
+    CacheEntry     *entry;
+
+    priv = GET_PRIV (resolver);
+    entry = priv->cache_entry;
+
+    if (priv->cache_source) {
+        g_source_destroy (priv->cache_source);
+        priv->cache_source = NULL;
+    }
+
+    if (!entry) {
+        return;
+    }
+
+    if (entry->leader != resolver) {
+        entry->waiters = g_slist_remove (entry->waiters, resolver);
+        return;
+    }
+
+    if (entry->waiters) {
+        entry->leader = entry->waiters->data;
+        entry->waiters = g_slist_delete_link (entry->waiters, entry->waiters);
+
+        resolver_cache_schedule (entry->leader,
+                                 (GSourceFunc) resolver_cache_lookup_cb);
+        return;
+    }
+
+    entry->leader = NULL;
+    entry->result = LM_RESOLVER_RESULT_CANCELLED;
+
+    if (cache && g_hash_table_lookup (cache, entry->key) == entry) {
+        g_hash_table_remove (cache, entry->key);
+    }
+}
+
+/* Called by the resolver that did the lookup, with the cache lock held */
+static void
+resolver_cache_complete (LmResolver       *resolver,
+                         LmResolverResult  result,
+                         struct addrinfo  *results)
+{
+    LmResolverPriv *priv;
+    CacheEntry     *entry;
+    gint64          ttl;
+    GSList         *l;
+
+    priv = GET_PRIV (resolver);
+    entry = priv->cache_entry;
+
+    entry->result = result;
+    entry->results = results;
+    entry->srv_targets = resolver_srv_targets_copy (priv->srv_targets);
+
+    if (result != LM_RESOLVER_RESULT_OK) {
+        ttl = CACHE_NEGATIVE_TTL;
+    } else if (priv->type == LM_RESOLVER_SRV) {
+        GList *t;
+
+        ttl = CACHE_MAX_TTL;
+        for (t = priv->srv_targets; t; t = t->next) {
+            ttl = MIN (ttl, ((LmSrvTarget *) t->data)->ttl);
+        }
+    } else {
+        ttl = CACHE_HOST_TTL;
+    }
+
+    entry->expires = g_get_monotonic_time () + ttl * G_USEC_PER_SEC;
+    entry->leader = NULL;
+
+    for (l = entry->waiters; l; l = l->next) {
+        resolver_cache_schedule (l->data,
+                                 (GSourceFunc) resolver_cache_deliver_cb);
+    }
+
+    g_slist_free (entry->waiters);
+    entry->waiters = NULL;
+}
+
+/* Answers from the cache when possible and otherwise joins an identical
+ * lookup that is already going on. Only the first resolver looks up. */
 void
 lm_resolver_lookup (LmResolver *resolver)
 {
+    LmResolverPriv *priv;
+    CacheEntry     *entry;
+    gchar          *key;
+    gint64          now;
+    gboolean        start_lookup = FALSE;
+
     if (!LM_RESOLVER_GET_CLASS(resolver)) {
         g_assert_not_reached ();
     }
 
-    LM_RESOLVER_GET_CLASS(resolver)->lookup (resolver);
+    priv = GET_PRIV (resolver);
+    g_return_if_fail (priv->cache_entry == NULL);
+
+    key = resolver_cache_key (priv);
+    now = g_get_monotonic_time ();
+
+    G_LOCK (cache);
+
+    if (!cache) {
+        cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                       (GDestroyNotify) resolver_cache_entry_unref);
+    }
+
+    entry = g_hash_table_lookup (cache, key);
+    if (entry && resolver_cache_entry_is_stale (NULL, entry, &now)) {
+        g_hash_table_remove (cache, key);
+        entry = NULL;
+    }
+
+    if (!entry) {
+        if (g_hash_table_size (cache) >= CACHE_MAX_ENTRIES) {
+            g_hash_table_foreach_remove (cache,
+                                         (GHRFunc) resolver_cache_entry_is_stale,
+                                         &now);
+        }
+
+        entry = g_slice_new0 (CacheEntry);
+        entry->ref_count = 1;
+        entry->key = key;
+        entry->leader = resolver;
+        g_hash_table_insert (cache, entry->key, entry);
+
+        start_lookup = TRUE;
+    } else {
+        g_free (key);
+
+        lm_verbose ("Resolver %s: %s\n", entry->key,
+                    entry->leader ? "joining lookup" : "cached");
+    }
+
+    priv->cache_entry = resolver_cache_entry_ref (entry);
+
+    if (entry->leader && !start_lookup) {
+        entry->waiters = g_slist_append (entry->waiters, resolver);
+    } else if (!start_lookup) {
+        resolver_cache_schedule (resolver,
+                                 (GSourceFunc) resolver_cache_deliver_cb);
+    }
+
+    G_UNLOCK (cache);
+
+    if (start_lookup) {
+        LM_RESOLVER_GET_CLASS(resolver)->lookup (resolver);
+    }
 }
 
 void
@@ -367,6 +741,10 @@ lm_resolver_cancel (LmResolver *resolver)
         g_assert_not_reached ();
     }
 
+    G_LOCK (cache);
+    resolver_cache_leave (resolver);
+    G_UNLOCK (cache);
+
     LM_RESOLVER_GET_CLASS(resolver)->cancel (resolver);
 }
 
@@ -390,9 +768,9 @@ skipresult:
 
     ret_val = priv->current_result;
     priv->current_result = priv->current_result->ai_next;
-    if (ret_val->ai_family != AF_INET) {
+    if (ret_val->ai_family != AF_INET && ret_val->ai_family != AF_INET6) {
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_VERBOSE,
-               "skipping non-IPv4 resolver entry\n");
+               "skipping non-IP resolver entry\n");
         goto skipresult;
     };
 
@@ -411,6 +789,95 @@ lm_resolver_results_reset (LmResolver *resolver)
     priv->current_result = priv->results;
 }
 
+static LmSrvTarget *
+resolver_srv_target_copy (const LmSrvTarget *target)
+{
+    LmSrvTarget *copy;
+
+    copy = g_slice_dup (LmSrvTarget, target);
+    copy->host = g_strdup (target->host);
+
+    return copy;
+}
+
+static void
+resolver_srv_target_free (LmSrvTarget *target)
+{
+    g_free (target->host);
+    g_slice_free (LmSrvTarget, target);
+}
+
+static GList *
+resolver_srv_targets_copy (GList *targets)
+{
+    GList *copy = NULL;
+
+    for (; targets; targets = targets->next) {
+        copy = g_list_prepend (copy, resolver_srv_target_copy (targets->data));
+    }
+
+    return g_list_reverse (copy);
+}
+
+GList *
+lm_resolver_get_srv_targets (LmResolver *resolver)
+{
+    LmResolverPriv *priv;
+
+    g_return_val_if_fail (LM_IS_RESOLVER (resolver), NULL);
+
+    priv = GET_PRIV (resolver);
+
+    return resolver_srv_targets_copy (priv->srv_targets);
+}
+
+void
+lm_resolver_free_srv_targets (GList *targets)
+{
+    g_list_free_full (targets, (GDestroyNotify) resolver_srv_target_free);
+}
+
+static gboolean
+resolver_connect_time_is_stale (gpointer     key,
+                                ConnectTime *time,
+                                gint64      *now)
+{
+    return *now - time->measured >= CONNECT_TIME_MAX_AGE;
+}
+
+void
+lm_resolver_add_connect_time (const gchar *host, guint port, gint64 usec)
+{
+    ConnectTime *time;
+    gint64       now;
+
+    g_return_if_fail (host != NULL);
+
+    now = g_get_monotonic_time ();
+
+    G_LOCK (connect_times);
+
+    if (!connect_times) {
+        connect_times = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    }
+
+    if (g_hash_table_size (connect_times) >= CONNECT_TIMES_MAX) {
+        g_hash_table_foreach_remove (connect_times,
+                                     (GHRFunc) resolver_connect_time_is_stale,
+                                     &now);
+    }
+
+    time = g_new (ConnectTime, 1);
+    time->usec = usec;
+    time->measured = now;
+
+    g_hash_table_replace (connect_times,
+                          g_strdup_printf ("%s:%u", host, port), time);
+
+    G_UNLOCK (connect_times);
+}
+
 gchar *
 _lm_resolver_create_srv_string (const gchar *domain,
                                 const gchar *service,
@@ -423,30 +890,254 @@ _lm_resolver_create_srv_string (const gchar *domain,
     return g_strdup_printf ("_%s._%s.%s", service, protocol, domain);
 }
 
+/* Alternates the address families, starting with the one the system
+ * prefers, so that connection attempts race both (RFC 8305, section 4) */
+static struct addrinfo *
+resolver_interleave_families (struct addrinfo *results)
+{
+    struct addrinfo  *preferred = NULL;
+    struct addrinfo  *other = NULL;
+    struct addrinfo **preferred_tail = &preferred;
+    struct addrinfo **other_tail = &other;
+    struct addrinfo  *head = NULL;
+    struct addrinfo **tail = &head;
+    struct addrinfo  *ai;
+    struct addrinfo  *next;
+
+    if (!results) {
+        return NULL;
+    }
+
+    for (ai = results; ai; ai = next) {
+        next = ai->ai_next;
+        ai->ai_next = NULL;
+
+        if (ai->ai_family == results->ai_family) {
+            *preferred_tail = ai;
+            preferred_tail = &ai->ai_next;
+        } else {
+            *other_tail = ai;
+            other_tail = &ai->ai_next;
+        }
+    }
+
+    while (preferred || other) {
+        if (preferred) {
+            *tail = preferred;
+            tail = &preferred->ai_next;
+            preferred = preferred->ai_next;
+        }
+        if (other) {
+            *tail = other;
+            tail = &other->ai_next;
+            other = other->ai_next;
+        }
+    }
+
+    *tail = NULL;
+
+    return head;
+}
+
 void
 _lm_resolver_set_result (LmResolver       *resolver,
                          LmResolverResult  result,
                          struct addrinfo  *results)
+{
+    LmResolverPriv  *priv;
+    struct addrinfo *shared;
+    gboolean         lookup_wanted;
+
+    g_return_if_fail (LM_IS_RESOLVER (resolver));
+
+    priv = GET_PRIV (resolver);
+
+    shared = resolver_interleave_families (resolver_addrinfo_copy (results));
+    if (results) {
+        freeaddrinfo (results);
+    }
+
+    G_LOCK (cache);
+
+    if (result == LM_RESOLVER_RESULT_CANCELLED) {
+        resolver_cache_leave (resolver);
+        lookup_wanted = TRUE;
+    } else {
+        /* Nobody is interested anymore if the lookup was cancelled */
+        lookup_wanted = priv->cache_entry && priv->cache_entry->leader == resolver;
+        if (lookup_wanted) {
+            resolver_cache_complete (resolver, result, shared);
+            shared = NULL;
+        }
+    }
+
+    G_UNLOCK (cache);
+
+    resolver_addrinfo_free (shared);
+
+    if (lookup_wanted) {
+        resolver_deliver (resolver, result,
+                          result == LM_RESOLVER_RESULT_OK ?
+                          priv->cache_entry->results : NULL);
+    }
+}
+
+/* Takes over @targets, the first one also becomes the host and port */
+void
+_lm_resolver_set_srv_targets (LmResolver *resolver, GList *targets)
 {
     LmResolverPriv *priv;
+    LmSrvTarget    *first;
 
     g_return_if_fail (LM_IS_RESOLVER (resolver));
 
     priv = GET_PRIV (resolver);
 
-    priv->result = result;
-    priv->results = priv->current_result = results;
+    lm_resolver_free_srv_targets (priv->srv_targets);
+    priv->srv_targets = targets;
 
-    lm_verbose ("Calling resolver callback: %s\n", priv->host);
+    if (targets) {
+        first = targets->data;
+        g_object_set (resolver,
+                      "host", first->host,
+                      "port", first->port,
+                      NULL);
+    }
+}
 
-    priv->callback (resolver, result, priv->user_data);
+static gint
+resolver_srv_priority_compare (const LmSrvTarget *a, const LmSrvTarget *b)
+{
+    if (a->priority != b->priority) {
+        return a->priority < b->priority ? -1 : 1;
+    }
+
+    /* Targets without weight go first, they are only picked when nothing
+     * else is */
+    if ((a->weight == 0) != (b->weight == 0)) {
+        return a->weight == 0 ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static gboolean
+resolver_get_connect_time (const LmSrvTarget *target, gint64 *usec)
+{
+    ConnectTime *time;
+    gchar       *key;
+    gboolean     found = FALSE;
+
+    key = g_strdup_printf ("%s:%u", target->host, target->port);
+
+    G_LOCK (connect_times);
+
+    if (connect_times) {
+        time = g_hash_table_lookup (connect_times, key);
+        if (time &&
+            g_get_monotonic_time () - time->measured < CONNECT_TIME_MAX_AGE) {
+            *usec = time->usec;
+            found = TRUE;
+        }
+    }
+
+    G_UNLOCK (connect_times);
+
+    g_free (key);
+
+    return found;
 }
 
+/* Orders the targets of one priority by weighted random selection as
+ * described in RFC 2782, then moves the one that connected fastest lately
+ * to the front */
+static GList *
+resolver_srv_order_priority (GList *targets)
+{
+    GList       *ordered = NULL;
+    GList       *l;
+    GList       *fastest = NULL;
+    gint64       fastest_usec = 0;
+
+    while (targets) {
+        guint32 total = 0;
+        guint32 pick;
+
+        for (l = targets; l; l = l->next) {
+            total += ((LmSrvTarget *) l->data)->weight;
+        }
+
+        pick = g_random_int_range (0, total + 1);
+
+        for (l = targets; l->next; l = l->next) {
+            guint weight = ((LmSrvTarget *) l->data)->weight;
+
+            if (pick <= weight) {
+                break;
+            }
+            pick -= weight;
+        }
+
+        targets = g_list_remove_link (targets, l);
+        ordered = g_list_concat (ordered, l);
+    }
+
+    for (l = ordered; l; l = l->next) {
+        gint64 usec;
+
+        if (resolver_get_connect_time (l->data, &usec) &&
+            (!fastest || usec < fastest_usec)) {
+            fastest = l;
+            fastest_usec = usec;
+        }
+    }
+
+    if (fastest && fastest != ordered) {
+        ordered = g_list_remove_link (ordered, fastest);
+        ordered = g_list_concat (fastest, ordered);
+    }
+
+    return ordered;
+}
+
+static GList *
+resolver_srv_order (GList *targets)
+{
+    GList *ordered = NULL;
+
+    targets = g_list_sort (targets,
+                           (GCompareFunc) resolver_srv_priority_compare);
+
+    while (targets) {
+        GList *priority = targets;
+        GList *l;
+        guint  prio = ((LmSrvTarget *) targets->data)->priority;
+
+        for (l = targets; l->next; l = l->next) {
+            if (((LmSrvTarget *) l->next->data)->priority != prio) {
+                break;
+            }
+        }
+
+        targets = l->next;
+        if (targets) {
+            targets->prev = NULL;
+            l->next = NULL;
+        }
+
+        ordered = g_list_concat (ordered,
+                                 resolver_srv_order_priority (priority));
+    }
+
+    return ordered;
+}
+
+/* Returns the targets of all SRV records in @srv, in the order to try
+ * them */
 gboolean
 _lm_resolver_parse_srv_response (unsigned char  *srv,
                                  int             srv_len,
-                                 gchar         **out_server,
-                                 guint          *out_port)
+                                 GList         **out_targets)
 {
     int                  qdcount;
     int                  ancount;
@@ -455,11 +1146,11 @@ _lm_resolver_parse_srv_response (unsigned char  *srv,
     unsigned char       *end;
     HEADER              *head;
     char                 name[256];
-    char                 pref_name[256];
-    guint                pref_port = 0;
-    guint                pref_prio = 9999;
+    GList               *targets = NULL;
 
-    pref_name[0] = 0;
+    if (srv_len < (int) sizeof (HEADER)) {
+        return FALSE;
+    }
 
     pos = srv + sizeof (HEADER);
     end = srv + srv_len;
@@ -470,38 +1161,66 @@ _lm_resolver_parse_srv_response (unsigned char  *srv,
 
     /* Ignore the questions */
     while (qdcount-- > 0 && (len = dn_expand (srv, end, pos, name, 255)) >= 0) {
-        g_assert (len >= 0);
         pos += len + QFIXEDSZ;
     }
 
     /* Parse the answers */
     while (ancount-- > 0 && (len = dn_expand (srv, end, pos, name, 255)) >= 0) {
-        /* Ignore the initial string */
-        uint16_t pref, port;
+        uint16_t     type, dlen, prio, weight, port;
+        uint32_t     ttl;
+        LmSrvTarget *target;
 
-        g_assert (len >= 0);
+        /* Ignore the initial string */
         pos += len;
-        /* Ignore type, ttl, class and dlen */
-        pos += 10;
-        GETSHORT (pref, pos);
-        /* Ignore weight */
+        if (pos + 10 > end) {
+            break;
+        }
+
+        GETSHORT (type, pos);
+        /* Ignore class */
         pos += 2;
+        GETLONG (ttl, pos);
+        GETSHORT (dlen, pos);
+
+        if (pos + dlen > end) {
+            break;
+        }
+
+        if (type != T_SRV || dlen < 6) {
+            pos += dlen;
+            continue;
+        }
+
+        GETSHORT (prio, pos);
+        GETSHORT (weight, pos);
         GETSHORT (port, pos);
 
         len = dn_expand (srv, end, pos, name, 255);
-        if (pref < pref_prio) {
-            pref_prio = pref;
-            strcpy (pref_name, name);
-            pref_port = port;
+        if (len < 0) {
+            break;
         }
-        pos += len;
+        pos += dlen - 6;
+
+        /* A target of "." means the service isn't available */
+        if (name[0] == '\0' || strcmp (name, ".") == 0) {
+            continue;
+        }
+
+        target = g_slice_new0 (LmSrvTarget);
+        target->host = g_strdup (name);
+        target->port = port;
+        target->priority = prio;
+        target->weight = weight;
+        target->ttl = ttl;
+
+        targets = g_list_prepend (targets, target);
     }
 
-    if (pref_name[0]) {
-        *out_server = g_strdup (pref_name);
-        *out_port = pref_port;
-        return TRUE;
+    if (!targets) {
+        return FALSE;
     }
-    return FALSE;
-}
 
+    *out_targets = resolver_srv_order (g_list_reverse (targets));
+
+    return TRUE;
+}
@@ -58,6 +58,17 @@ typedef enum {
     LM_RESOLVER_RESULT_CANCELLED
 } LmResolverResult;
 
+/* One SRV record, see RFC 2782 */
+typedef struct {
+    gchar *host;
+    guint  port;
+    guint  priority;
+    guint  weight;
+    guint  ttl;
+    /* Set by users on _xmpps-client targets, TLS starts on connect */
+    gboolean direct_tls;
+} LmSrvTarget;
+
 typedef void (*LmResolverCallback) (LmResolver       *resolver,
                                     LmResolverResult  result,
                                     gpointer          user_data);
@@ -78,6 +89,13 @@ void              lm_resolver_cancel            (LmResolver         *resolver);
 /* To iterate through the results */
 struct addrinfo * lm_resolver_results_get_next  (LmResolver         *resolver);
 void              lm_resolver_results_reset     (LmResolver         *resolver);
+/* SRV targets in the order to try them, free with lm_resolver_free_srv_targets() */
+GList *           lm_resolver_get_srv_targets   (LmResolver         *resolver);
+void              lm_resolver_free_srv_targets  (GList              *targets);
+/* Makes the fastest to connect of equally preferred SRV targets go first */
+void              lm_resolver_add_connect_time  (const gchar        *host,
+                                                 guint               port,
+                                                 gint64              usec);
 
 /* Only for sub classes */
 gchar *           _lm_resolver_create_srv_string (const gchar        *domain,
@@ -87,10 +105,11 @@ gchar *           _lm_resolver_create_srv_string (const gchar        *domain,
 void              _lm_resolver_set_result       (LmResolver         *resolver,
                                                  LmResolverResult    result,
                                                  struct addrinfo    *results);
+void              _lm_resolver_set_srv_targets  (LmResolver         *resolver,
+                                                 GList              *targets);
 gboolean        _lm_resolver_parse_srv_response (unsigned char      *srv,
                                                  int                 srv_len,
-                                                 gchar            **out_server,
-                                                 guint              *out_port);
+                                                 GList             **out_targets);
 
 G_END_DECLS
 
@@ -345,6 +345,124 @@ _lm_sock_set_keepalive (LmOldSocketT sock, int delay)
     return TRUE;
 }
 
+gboolean
+_lm_sock_set_nodelay (LmOldSocketT sock, gboolean nodelay)
+{
+    int opt = nodelay ? 1 : 0;
+
+    if (setsockopt (sock, IPPROTO_TCP, TCP_NODELAY,
+                    (const void *) &opt, sizeof (opt)) < 0) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Holds back partial segments while corked, returns FALSE if the platform
+ * has no support for it. */
+gboolean
+_lm_sock_set_cork (LmOldSocketT sock, gboolean cork)
+{
+#if defined(TCP_CORK) || defined(TCP_NOPUSH)
+    int opt = cork ? 1 : 0;
+
+#ifdef TCP_CORK
+    if (setsockopt (sock, IPPROTO_TCP, TCP_CORK, &opt, sizeof (opt)) < 0) {
+        return FALSE;
+    }
+#else
+    if (setsockopt (sock, IPPROTO_TCP, TCP_NOPUSH, &opt, sizeof (opt)) < 0) {
+        return FALSE;
+    }
+#endif
+
+    return TRUE;
+#else
+    return FALSE;
+#endif /* TCP_CORK || TCP_NOPUSH */
+}
+
+/* Sizes of 0 leave the system default in place */
+gboolean
+_lm_sock_set_buffer_sizes (LmOldSocketT sock,
+                           int          send_size,
+                           int          receive_size)
+{
+    gboolean result = TRUE;
+
+    if (send_size > 0 &&
+        setsockopt (sock, SOL_SOCKET, SO_SNDBUF,
+                    (const void *) &send_size, sizeof (send_size)) < 0) {
+        result = FALSE;
+    }
+
+    if (receive_size > 0 &&
+        setsockopt (sock, SOL_SOCKET, SO_RCVBUF,
+                    (const void *) &receive_size, sizeof (receive_size)) < 0) {
+        result = FALSE;
+    }
+
+    return result;
+}
+
+static gboolean
+sock_is_would_block_error (int err)
+{
+#ifndef G_OS_WIN32
+    return (err == EAGAIN || err == EWOULDBLOCK);
+#else  /* G_OS_WIN32 */
+    return (err == WSAEWOULDBLOCK);
+#endif /* G_OS_WIN32 */
+}
+
+/* Returns the number of bytes written, 0 if the socket would block or -1
+ * on error. Never waits for the socket to become writable. */
+gssize
+_lm_sock_write (LmOldSocketT  sock,
+                const gchar  *buf,
+                gsize         len)
+{
+    gssize res;
+    int    flags = 0;
+
+#ifdef MSG_NOSIGNAL
+    /* A closed connection is reported as an error, not as SIGPIPE */
+    flags = MSG_NOSIGNAL;
+#endif
+
+    do {
+        res = send (sock, buf, len, flags);
+    } while (res < 0 && _lm_sock_get_last_error () == EINTR);
+
+    if (res < 0 && sock_is_would_block_error (_lm_sock_get_last_error ())) {
+        return 0;
+    }
+
+    return res;
+}
+
+#ifndef G_OS_WIN32
+/* Writes the gathered buffers with a single system call. Returns the number
+ * of bytes written, 0 if the socket would block or -1 on error. */
+gssize
+_lm_sock_writev (LmOldSocketT        sock,
+                 const struct iovec *iov,
+                 int                 n_iov)
+{
+    gssize res;
+
+    do {
+        res = writev (sock, iov, n_iov);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0 && sock_is_would_block_error (errno)) {
+        return 0;
+    }
+
+    return res;
+}
+#endif /* G_OS_WIN32 */
+
 gchar *
 _lm_sock_get_local_host (LmOldSocketT sock)
 {
@@ -37,6 +37,7 @@ G_BEGIN_DECLS
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #define _LM_SOCK_EINPROGRESS EINPROGRESS
 #define _LM_SOCK_EWOULDBLOCK EWOULDBLOOK
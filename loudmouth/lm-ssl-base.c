@@ -21,6 +21,9 @@
 #include "lm-ssl-base.h"
 #include "lm-ssl-internals.h"
 
+/* How long the server gets to finish the TLS handshake by default */
+#define SSL_HANDSHAKE_TIMEOUT 30000
+
 void
 _lm_ssl_base_init (LmSSLBase      *base,
                    const gchar    *expected_fingerprint,
@@ -34,6 +37,7 @@ _lm_ssl_base_init (LmSSLBase      *base,
     base->data_notify    = notify;
     base->fingerprint[0] = '\0';
     base->cipher_list    = NULL;
+    base->handshake_timeout = SSL_HANDSHAKE_TIMEOUT;
 
     if (expected_fingerprint) {
         base->expected_fingerprint = g_memdup (expected_fingerprint, 16);
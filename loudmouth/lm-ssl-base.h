@@ -36,6 +36,16 @@ struct _LmSSLBase {
     char            fingerprint[20];
     gboolean        use_starttls;
     gboolean        require_starttls;
+    /* Connect with TLS right away to _xmpps-client SRV targets */
+    gboolean        use_direct_tls;
+    gboolean        use_alpn;
+
+    /* Milliseconds the server gets to finish the handshake */
+    guint           handshake_timeout;
+
+    /* Handshakes that resumed a cached session and those that didn't */
+    guint           resumption_hits;
+    guint           resumption_misses;
 
     gint            ref_count;
 };
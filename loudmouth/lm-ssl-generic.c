@@ -32,6 +32,42 @@ _lm_ssl_func_always_continue (LmSSL       *ssl,
     return LM_SSL_RESPONSE_CONTINUE;;
 }
 
+/* Contexts are never freed, there is one per CA path used */
+G_LOCK_DEFINE_STATIC (contexts);
+static GHashTable *contexts = NULL;
+
+LmSSLContext *
+_lm_ssl_context_get (const gchar *ca_path)
+{
+    LmSSLContext *context;
+    const gchar  *key = ca_path ? ca_path : "";
+
+    G_LOCK (contexts);
+
+    if (!contexts) {
+        contexts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free,
+                                          (GDestroyNotify) _lm_ssl_context_unref);
+    }
+
+    /* Created with the lock held so the certificates are loaded once */
+    context = g_hash_table_lookup (contexts, key);
+    if (!context) {
+        context = _lm_ssl_context_new (ca_path);
+        if (context) {
+            g_hash_table_insert (contexts, g_strdup (key), context);
+        }
+    }
+
+    if (context) {
+        _lm_ssl_context_ref (context);
+    }
+
+    G_UNLOCK (contexts);
+
+    return context;
+}
+
 /* Define the SSL functions as noops if we compile without support */
 #ifndef HAVE_SSL
 
@@ -44,6 +80,30 @@ _lm_ssl_new (const gchar    *expected_fingerprint,
     return NULL;
 }
 
+LmSSLContext *
+_lm_ssl_context_new (const gchar *ca_path)
+{
+    return NULL;
+}
+
+LmSSLContext *
+_lm_ssl_context_ref (LmSSLContext *context)
+{
+    return context;
+}
+
+void
+_lm_ssl_context_unref (LmSSLContext *context)
+{
+    /* NOOP */
+}
+
+void
+_lm_ssl_set_context (LmSSL *ssl, LmSSLContext *context)
+{
+    /* NOOP */
+}
+
 void
 _lm_ssl_initialize (LmSSL *ssl)
 {
@@ -54,11 +114,22 @@ gboolean
 _lm_ssl_begin (LmSSL        *ssl,
                gint          fd,
                const gchar  *server,
+               const gchar  *alpn,
                GError      **error)
 {
     return TRUE;
 }
 
+GIOStatus
+_lm_ssl_handshake (LmSSL         *ssl,
+                   GIOCondition  *wait,
+                   GError       **error)
+{
+    *wait = 0;
+
+    return G_IO_STATUS_NORMAL;
+}
+
 GIOStatus
 _lm_ssl_read (LmSSL *ssl,
               gchar *buf,
@@ -71,12 +142,31 @@ _lm_ssl_read (LmSSL *ssl,
     return G_IO_STATUS_EOF;
 }
 
-gboolean
+gint
 _lm_ssl_send (LmSSL *ssl, const gchar *str, gint len)
 {
     /* NOOP */
-    return TRUE;
+    return -1;
+}
+
+GIOCondition
+_lm_ssl_get_read_wait (LmSSL *ssl)
+{
+    return 0;
+}
+
+GIOCondition
+_lm_ssl_get_send_wait (LmSSL *ssl)
+{
+    return 0;
+}
+
+gsize
+_lm_ssl_pending (LmSSL *ssl)
+{
+    return 0;
 }
+
 void
 _lm_ssl_close (LmSSL *ssl)
 {
@@ -150,6 +240,41 @@ lm_ssl_get_fingerprint (LmSSL *ssl)
     return LM_SSL_BASE(ssl)->fingerprint;
 }
 
+/**
+ * lm_ssl_get_resumption_hits:
+ * @ssl: an #LmSSL
+ *
+ * Returns the number of handshakes made with @ssl that resumed a TLS
+ * session cached from an earlier connection to the same server.
+ *
+ * Return value: The number of resumed handshakes.
+ **/
+guint
+lm_ssl_get_resumption_hits (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, 0);
+
+    return LM_SSL_BASE(ssl)->resumption_hits;
+}
+
+/**
+ * lm_ssl_get_resumption_misses:
+ * @ssl: an #LmSSL
+ *
+ * Returns the number of handshakes made with @ssl that had to negotiate
+ * a new TLS session, because none was cached for the server or the
+ * server didn't accept it.
+ *
+ * Return value: The number of full handshakes.
+ **/
+guint
+lm_ssl_get_resumption_misses (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, 0);
+
+    return LM_SSL_BASE(ssl)->resumption_misses;
+}
+
 /**
  * lm_ssl_ref:
  * @ssl: an #LmSSL
@@ -188,6 +313,8 @@ void
 lm_ssl_set_ca (LmSSL *ssl, const gchar    *ca_path)
 {
   _lm_ssl_base_set_ca_path(LM_SSL_BASE(ssl), ca_path);
+  /* Built again with the new certificates on the next connect */
+  _lm_ssl_set_context (ssl, NULL);
 }
 
 
@@ -237,6 +364,75 @@ lm_ssl_get_require_starttls (LmSSL *ssl)
     return base->require_starttls;
 }
 
+/**
+ * lm_ssl_use_direct_tls:
+ * @ssl: an #LmSSL
+ * @use_direct_tls: whether to look for direct TLS targets
+ * @use_alpn: whether to offer "xmpp-client" through ALPN on them
+ *
+ * Set whether direct TLS (XEP-0368) should be used. When no server is set
+ * on the connection, _xmpps-client._tcp SRV targets are then tried along
+ * with the _xmpp-client._tcp ones. TLS is started right away on those,
+ * which saves the round trips of negotiating STARTTLS. Other targets still
+ * use STARTTLS as configured with lm_ssl_use_starttls().
+ **/
+void
+lm_ssl_use_direct_tls (LmSSL    *ssl,
+                       gboolean  use_direct_tls,
+                       gboolean  use_alpn)
+{
+    LmSSLBase *base;
+
+    g_return_if_fail (ssl != NULL);
+
+    base = LM_SSL_BASE (ssl);
+    base->use_direct_tls = use_direct_tls;
+    base->use_alpn = use_alpn;
+}
+
+/**
+ * lm_ssl_get_use_direct_tls:
+ * @ssl: an #LmSSL
+ *
+ * Return value: TRUE if @ssl is configured to use direct TLS.
+ **/
+gboolean
+lm_ssl_get_use_direct_tls (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, FALSE);
+
+    return LM_SSL_BASE (ssl)->use_direct_tls;
+}
+
+gboolean
+_lm_ssl_get_use_alpn (LmSSL *ssl)
+{
+    return LM_SSL_BASE (ssl)->use_alpn;
+}
+
+/**
+ * lm_ssl_set_handshake_timeout:
+ * @ssl: an #LmSSL
+ * @timeout: the timeout in milliseconds
+ *
+ * Sets how long the server gets to finish the TLS handshake before the
+ * connection fails. The default is 30 seconds.
+ **/
+void
+lm_ssl_set_handshake_timeout (LmSSL *ssl, guint timeout)
+{
+    g_return_if_fail (ssl != NULL);
+    g_return_if_fail (timeout > 0);
+
+    LM_SSL_BASE (ssl)->handshake_timeout = timeout;
+}
+
+guint
+_lm_ssl_get_handshake_timeout (LmSSL *ssl)
+{
+    return LM_SSL_BASE (ssl)->handshake_timeout;
+}
+
 /**
  * lm_ssl_unref
  * @ssl: an #LmSSL
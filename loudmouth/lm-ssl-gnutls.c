@@ -39,17 +39,102 @@
 
 #define CA_PEM_FILE "/etc/ssl/certs/ca-certificates.crt"
 
+/* Servers a session is kept for per context */
+#define SESSION_CACHE_MAX 256
+
+struct _LmSSLContext {
+    gnutls_certificate_credentials_t gnutls_xcred;
+
+    /* Server name -> GBytes with the session data to resume, shared
+     * between threads */
+    GMutex                           lock;
+    GHashTable                      *sessions;
+
+    gint                             ref_count;
+};
+
 struct _LmSSL {
     LmSSLBase base;
 
+    LmSSLContext                    *context;
     gnutls_session_t                 gnutls_session;
-    gnutls_certificate_credentials_t gnutls_xcred;
     gboolean                         started;
+    /* Sessions of this connection are cached under this name */
+    gchar                           *server;
+
+    GIOCondition                     read_wait;
+    GIOCondition                     send_wait;
 };
 
 static gboolean       ssl_verify_certificate    (LmSSL       *ssl,
                                                  const gchar *server);
 
+static GIOCondition
+ssl_get_wait_condition (LmSSL *ssl)
+{
+    /* 0 means that the interrupted operation was reading */
+    if (gnutls_record_get_direction (ssl->gnutls_session) == 0) {
+        return G_IO_IN;
+    }
+
+    return G_IO_OUT;
+}
+
+static void
+ssl_context_set_session (LmSSLContext *context,
+                         const gchar  *server,
+                         GBytes       *data)
+{
+    g_mutex_lock (&context->lock);
+
+    if (!data) {
+        g_hash_table_remove (context->sessions, server);
+    } else {
+        if (g_hash_table_size (context->sessions) >= SESSION_CACHE_MAX &&
+            !g_hash_table_lookup (context->sessions, server)) {
+            g_hash_table_remove_all (context->sessions);
+        }
+
+        g_hash_table_replace (context->sessions, g_strdup (server), data);
+    }
+
+    g_mutex_unlock (&context->lock);
+}
+
+static void
+ssl_context_resume_session (LmSSLContext *context, LmSSL *ssl)
+{
+    GBytes *data;
+
+    g_mutex_lock (&context->lock);
+
+    /* Copied by GnuTLS, which also skips sessions that expired */
+    data = g_hash_table_lookup (context->sessions, ssl->server);
+    if (data) {
+        gnutls_session_set_data (ssl->gnutls_session,
+                                 g_bytes_get_data (data, NULL),
+                                 g_bytes_get_size (data));
+    }
+
+    g_mutex_unlock (&context->lock);
+}
+
+/* With TLS 1.3 the tickets arrive after the handshake, the session is
+ * therefore saved when the connection is closed */
+static void
+ssl_save_session (LmSSL *ssl)
+{
+    gnutls_datum_t data;
+
+    if (gnutls_session_get_data2 (ssl->gnutls_session, &data) < 0) {
+        return;
+    }
+
+    ssl_context_set_session (ssl->context, ssl->server,
+                             g_bytes_new (data.data, data.size));
+    gnutls_free (data.data);
+}
+
 static gboolean
 ssl_verify_certificate (LmSSL *ssl, const gchar *server)
 {
@@ -186,19 +271,8 @@ _lm_ssl_new (const gchar    *expected_fingerprint,
     return ssl;
 }
 
-void
-_lm_ssl_initialize (LmSSL *ssl)
-{
-    gnutls_global_init ();
-    gnutls_certificate_allocate_credentials (&ssl->gnutls_xcred);
-    gnutls_certificate_set_x509_trust_file(ssl->gnutls_xcred,
-                                           CA_PEM_FILE,
-                                           GNUTLS_X509_FMT_PEM);
-}
-
-gboolean
-_lm_ssl_set_ca (LmSSL       *ssl,
-                const gchar *ca_path)
+static gboolean
+ssl_context_set_ca (LmSSLContext *context, const gchar *ca_path)
 {
     struct stat target;
 
@@ -227,7 +301,7 @@ _lm_ssl_set_ca (LmSSL       *ssl,
 
             if ((stat (path, &file) == 0) && S_ISREG (file.st_mode)) {
                 success = gnutls_certificate_set_x509_trust_file (
-                                ssl->gnutls_xcred, path, GNUTLS_X509_FMT_PEM);
+                                context->gnutls_xcred, path, GNUTLS_X509_FMT_PEM);
                 if (success > 0)
                     worked_at_least_once = 1;
                 if (success < 0) {
@@ -249,7 +323,7 @@ _lm_ssl_set_ca (LmSSL       *ssl,
 
     } else if (S_ISREG (target.st_mode)) {
         int success = 0;
-        success = gnutls_certificate_set_x509_trust_file (ssl->gnutls_xcred,
+        success = gnutls_certificate_set_x509_trust_file (context->gnutls_xcred,
                                                           ca_path,
                                                           GNUTLS_X509_FMT_PEM);
         if (success < 0) {
@@ -262,12 +336,82 @@ _lm_ssl_set_ca (LmSSL       *ssl,
     return TRUE;
 }
 
+LmSSLContext *
+_lm_ssl_context_new (const gchar *ca_path)
+{
+    LmSSLContext *context;
+
+    gnutls_global_init ();
+
+    context = g_new0 (LmSSLContext, 1);
+    context->ref_count = 1;
+
+    gnutls_certificate_allocate_credentials (&context->gnutls_xcred);
+    gnutls_certificate_set_x509_trust_file(context->gnutls_xcred,
+                                           CA_PEM_FILE,
+                                           GNUTLS_X509_FMT_PEM);
+    if (ca_path) {
+        ssl_context_set_ca (context, ca_path);
+    }
+
+    g_mutex_init (&context->lock);
+    context->sessions = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free,
+                                               (GDestroyNotify) g_bytes_unref);
+
+    return context;
+}
+
+LmSSLContext *
+_lm_ssl_context_ref (LmSSLContext *context)
+{
+    g_atomic_int_inc (&context->ref_count);
+
+    return context;
+}
+
+void
+_lm_ssl_context_unref (LmSSLContext *context)
+{
+    if (g_atomic_int_dec_and_test (&context->ref_count)) {
+        g_hash_table_destroy (context->sessions);
+        g_mutex_clear (&context->lock);
+        gnutls_certificate_free_credentials (context->gnutls_xcred);
+        g_free (context);
+        gnutls_global_deinit ();
+    }
+}
+
+void
+_lm_ssl_set_context (LmSSL *ssl, LmSSLContext *context)
+{
+    if (context) {
+        _lm_ssl_context_ref (context);
+    }
+
+    if (ssl->context) {
+        _lm_ssl_context_unref (ssl->context);
+    }
+
+    ssl->context = context;
+}
+
+void
+_lm_ssl_initialize (LmSSL *ssl)
+{
+    if (!ssl->context) {
+        ssl->context = _lm_ssl_context_get (LM_SSL_BASE (ssl)->ca_path);
+    }
+}
+
 gboolean
-_lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
+_lm_ssl_begin (LmSSL       *ssl,
+               gint         fd,
+               const gchar *server,
+               const gchar *alpn,
+               GError     **error)
 {
-    int ret;
     LmSSLBase *base;
-    gboolean auth_ok = TRUE;
 
     base = LM_SSL_BASE(ssl);
     gnutls_init (&ssl->gnutls_session, GNUTLS_CLIENT);
@@ -276,20 +420,68 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
     } else {
       gnutls_priority_set_direct (ssl->gnutls_session, "NORMAL", NULL);
     }
-    if (base->ca_path) {
-      _lm_ssl_set_ca(ssl, base->ca_path);
-    }
     gnutls_credentials_set (ssl->gnutls_session,
                             GNUTLS_CRD_CERTIFICATE,
-                            ssl->gnutls_xcred);
+                            ssl->context->gnutls_xcred);
 
     gnutls_transport_set_ptr (ssl->gnutls_session,
                               (gnutls_transport_ptr_t)(glong) fd);
 
-    ret = gnutls_handshake (ssl->gnutls_session);
+    g_free (ssl->server);
+    ssl->server = g_ascii_strdown (server, -1);
+
+    if (!g_hostname_is_ip_address (server)) {
+        gnutls_server_name_set (ssl->gnutls_session, GNUTLS_NAME_DNS,
+                                server, strlen (server));
+    }
+    if (alpn) {
+        gnutls_datum_t protocol;
+
+        protocol.data = (unsigned char *) alpn;
+        protocol.size = strlen (alpn);
+        gnutls_alpn_set_protocols (ssl->gnutls_session, &protocol, 1, 0);
+    }
+    ssl_context_resume_session (ssl->context, ssl);
+
+    return TRUE;
+}
+
+GIOStatus
+_lm_ssl_handshake (LmSSL *ssl, GIOCondition *wait, GError **error)
+{
+    int ret;
+    LmSSLBase *base;
+    gboolean auth_ok = TRUE;
+
+    base = LM_SSL_BASE(ssl);
+
+    *wait = 0;
+
+    /* Warning alerts and other non-fatal errors don't wait for the
+     * socket, the handshake goes on right away */
+    do {
+        ret = gnutls_handshake (ssl->gnutls_session);
+    } while (ret < 0 && !gnutls_error_is_fatal (ret) &&
+             ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED);
+
+    if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+        *wait = ssl_get_wait_condition (ssl);
+        return G_IO_STATUS_AGAIN;
+    }
 
     if (ret >= 0) {
-        auth_ok = ssl_verify_certificate (ssl, server);
+        if (gnutls_session_is_resumed (ssl->gnutls_session)) {
+            base->resumption_hits++;
+        } else {
+            base->resumption_misses++;
+        }
+
+        auth_ok = ssl_verify_certificate (ssl, ssl->server);
+    }
+
+    if (!auth_ok) {
+        /* Not to be resumed without asking again */
+        ssl_context_set_session (ssl->context, ssl->server, NULL);
     }
 
     if (ret < 0 || !auth_ok) {
@@ -306,7 +498,7 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
                      "*** GNUTLS %s: %s",
                      errmsg, gnutls_strerror (ret));
 
-        return FALSE;
+        return G_IO_STATUS_ERROR;
     }
 
     lm_verbose ("GNUTLS negotiated cipher suite: %s",
@@ -319,7 +511,7 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
 
     ssl->started = TRUE;
 
-    return TRUE;
+    return G_IO_STATUS_NORMAL;
 }
 
 GIOStatus
@@ -329,9 +521,11 @@ _lm_ssl_read (LmSSL *ssl, gchar *buf, gint len, gsize *bytes_read)
     gint      b_read;
 
     *bytes_read = 0;
+    ssl->read_wait = 0;
     b_read = gnutls_record_recv (ssl->gnutls_session, buf, len);
 
-    if (b_read == GNUTLS_E_AGAIN) {
+    if (b_read == GNUTLS_E_AGAIN || b_read == GNUTLS_E_INTERRUPTED) {
+        ssl->read_wait = ssl_get_wait_condition (ssl);
         status = G_IO_STATUS_AGAIN;
     }
     else if (b_read == 0) {
@@ -352,35 +546,66 @@ _lm_ssl_send (LmSSL *ssl, const gchar *str, gint len)
 {
     gint bytes_written;
 
+    ssl->send_wait = 0;
+
+    /* When retrying after GNUTLS_E_AGAIN the record is already encrypted
+     * and buffered by GnuTLS, the data passed is ignored and the length of
+     * the original record is returned once it has been flushed. */
     bytes_written = gnutls_record_send (ssl->gnutls_session, str, len);
 
-    while (bytes_written < 0) {
+    if (bytes_written < 0) {
         if (bytes_written != GNUTLS_E_INTERRUPTED &&
             bytes_written != GNUTLS_E_AGAIN) {
             return -1;
         }
 
-        bytes_written = gnutls_record_send (ssl->gnutls_session,
-                                            str, len);
+        ssl->send_wait = ssl_get_wait_condition (ssl);
+
+        return 0;
     }
 
     return bytes_written;
 }
 
+GIOCondition
+_lm_ssl_get_read_wait (LmSSL *ssl)
+{
+    return ssl->read_wait;
+}
+
+GIOCondition
+_lm_ssl_get_send_wait (LmSSL *ssl)
+{
+    return ssl->send_wait;
+}
+
+gsize
+_lm_ssl_pending (LmSSL *ssl)
+{
+    return gnutls_record_check_pending (ssl->gnutls_session);
+}
+
 void
 _lm_ssl_close (LmSSL *ssl)
 {
-    if (!ssl->started)
+    if (!ssl->gnutls_session)
         return;
 
+    /* Only a finished handshake has a session worth resuming */
+    if (ssl->started) {
+        ssl_save_session (ssl);
+    }
+
     gnutls_deinit (ssl->gnutls_session);
-    gnutls_certificate_free_credentials (ssl->gnutls_xcred);
-    gnutls_global_deinit ();
+    ssl->gnutls_session = NULL;
+    ssl->started = FALSE;
 }
 
 void
 _lm_ssl_free (LmSSL *ssl)
 {
+    _lm_ssl_set_context (ssl, NULL);
+    g_free (ssl->server);
     _lm_ssl_base_free_fields (LM_SSL_BASE (ssl));
     g_free (ssl);
 }
@@ -23,6 +23,10 @@
 
 #include <glib.h>
 
+/* Immutable part of the TLS setup: library context and trusted CAs,
+ * can be shared by any number of LmSSL */
+typedef struct _LmSSLContext LmSSLContext;
+
 LmSSLResponse   _lm_ssl_func_always_continue (LmSSL       *ssl,
                                               LmSSLStatus  status,
                                               gpointer     user_data);
@@ -31,12 +35,34 @@ LmSSL *          _lm_ssl_new              (const gchar    *expected_fingerprint,
                                            gpointer        user_data,
                                            GDestroyNotify  notify);
 
+LmSSLContext *   _lm_ssl_context_new      (const gchar      *ca_path);
+/* Returns a reference to the context shared by every LmSSL trusting
+ * @ca_path, TLS sessions are cached per server name in it */
+LmSSLContext *   _lm_ssl_context_get      (const gchar      *ca_path);
+LmSSLContext *   _lm_ssl_context_ref      (LmSSLContext     *context);
+void             _lm_ssl_context_unref    (LmSSLContext     *context);
+/* Makes @ssl use @context from the next handshake on, %NULL to have
+ * _lm_ssl_initialize() create a context of its own */
+void             _lm_ssl_set_context      (LmSSL            *ssl,
+                                           LmSSLContext     *context);
+
 void             _lm_ssl_initialize       (LmSSL            *ssl);
-gboolean         _lm_ssl_set_ca           (LmSSL            *ssl,
-                                           const gchar    *ca_path);
+gboolean         _lm_ssl_get_use_alpn     (LmSSL            *ssl);
+guint            _lm_ssl_get_handshake_timeout (LmSSL       *ssl);
+/* Sets up a session on the non-blocking @fd, the handshake is then
+ * driven by _lm_ssl_handshake(). @alpn is the protocol to offer through
+ * ALPN, or %NULL. */
 gboolean         _lm_ssl_begin            (LmSSL            *ssl,
                                            gint              fd,
                                            const gchar      *server,
+                                           const gchar      *alpn,
+                                           GError          **error);
+/* Continues the handshake as far as possible without blocking. Returns
+ * G_IO_STATUS_AGAIN with @wait set to the condition to wait for before
+ * calling again, G_IO_STATUS_NORMAL once the handshake is done and the
+ * certificate verified, or G_IO_STATUS_ERROR. */
+GIOStatus        _lm_ssl_handshake        (LmSSL            *ssl,
+                                           GIOCondition     *wait,
                                            GError          **error);
 GIOStatus        _lm_ssl_read             (LmSSL            *ssl,
                                            gchar            *buf,
@@ -45,6 +71,12 @@ GIOStatus        _lm_ssl_read             (LmSSL            *ssl,
 gint             _lm_ssl_send             (LmSSL            *ssl,
                                            const gchar      *str,
                                            gint              len);
+/* Condition the socket has to reach before a read or send that returned
+ * G_IO_STATUS_AGAIN or 0 can make progress, 0 if it didn't block */
+GIOCondition     _lm_ssl_get_read_wait    (LmSSL            *ssl);
+GIOCondition     _lm_ssl_get_send_wait    (LmSSL            *ssl);
+/* Number of decrypted bytes that can be read without touching the socket */
+gsize            _lm_ssl_pending          (LmSSL            *ssl);
 void             _lm_ssl_close            (LmSSL            *ssl);
 void             _lm_ssl_free             (LmSSL            *ssl);
 
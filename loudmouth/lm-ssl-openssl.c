@@ -43,19 +43,38 @@
 
 #define LM_SSL_CN_MAX       63
 
+/* Servers a session is kept for per context */
+#define SESSION_CACHE_MAX   256
+
+struct _LmSSLContext {
+    SSL_CTX *ssl_ctx;
+
+    /* Server name -> SSL_SESSION to resume, shared between threads */
+    GMutex      lock;
+    GHashTable *sessions;
+
+    gint     ref_count;
+};
+
 struct _LmSSL {
     LmSSLBase base;
 
-    const SSL_METHOD *ssl_method;
-    SSL_CTX *ssl_ctx;
+    LmSSLContext *context;
     SSL *ssl;
+    /* Sessions of this connection are cached under this name */
+    gchar *server;
     /*BIO *bio;*/
+
+    GIOCondition read_wait;
+    GIOCondition send_wait;
 };
 
 int ssl_verify_cb (int preverify_ok, X509_STORE_CTX *x509_ctx);
 
 static gboolean ssl_verify_certificate (LmSSL *ssl, const gchar *server);
-static GIOStatus ssl_io_status_from_return (LmSSL *ssl, gint error);
+static GIOStatus ssl_io_status_from_return (LmSSL        *ssl,
+                                            gint          error,
+                                            GIOCondition *wait);
 
 /*static char _ssl_error_code[11];*/
 
@@ -289,18 +308,30 @@ ssl_verify_certificate (LmSSL *ssl, const gchar *server)
 }
 
 static GIOStatus
-ssl_io_status_from_return (LmSSL *ssl, gint ret)
+ssl_io_status_from_return (LmSSL *ssl, gint ret, GIOCondition *wait)
 {
     gint      error;
     GIOStatus status;
 
+    if (wait) {
+        *wait = 0;
+    }
+
     if (ret > 0) return G_IO_STATUS_NORMAL;
 
     error = SSL_get_error(ssl->ssl, ret);
     switch (error) {
     case SSL_ERROR_WANT_READ:
+        status = G_IO_STATUS_AGAIN;
+        if (wait) {
+            *wait = G_IO_IN;
+        }
+        break;
     case SSL_ERROR_WANT_WRITE:
         status = G_IO_STATUS_AGAIN;
+        if (wait) {
+            *wait = G_IO_OUT;
+        }
         break;
     case SSL_ERROR_ZERO_RETURN:
         status = G_IO_STATUS_EOF;
@@ -331,10 +362,104 @@ _lm_ssl_new (const gchar    *expected_fingerprint,
     return ssl;
 }
 
-void
-_lm_ssl_initialize (LmSSL *ssl)
+static gboolean
+ssl_context_set_ca (LmSSLContext *context, const gchar *ca_path)
 {
-    static gboolean initialized = FALSE;
+    struct stat target;
+    int success = 0;
+
+    if (stat (ca_path, &target) != 0) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL,
+               "ca_path '%s': no such file or directory", ca_path);
+        return FALSE;
+    }
+
+    if (S_ISDIR (target.st_mode)) {
+        success = SSL_CTX_load_verify_locations(context->ssl_ctx, NULL, ca_path);
+    } else if (S_ISREG (target.st_mode)) {
+        success = SSL_CTX_load_verify_locations(context->ssl_ctx, ca_path, NULL);
+    }
+    if (success == 0) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL,
+               "Loading of ca_path '%s' failed: %s",
+               ca_path,
+               ERR_error_string(ERR_peek_last_error(), NULL));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+ssl_context_set_session (LmSSLContext *context,
+                         const gchar  *server,
+                         SSL_SESSION  *session)
+{
+    g_mutex_lock (&context->lock);
+
+    if (!session) {
+        g_hash_table_remove (context->sessions, server);
+    } else {
+        if (g_hash_table_size (context->sessions) >= SESSION_CACHE_MAX &&
+            !g_hash_table_lookup (context->sessions, server)) {
+            g_hash_table_remove_all (context->sessions);
+        }
+
+        g_hash_table_replace (context->sessions, g_strdup (server), session);
+    }
+
+    g_mutex_unlock (&context->lock);
+}
+
+static void
+ssl_context_resume_session (LmSSLContext *context, LmSSL *ssl)
+{
+    SSL_SESSION *session;
+
+    g_mutex_lock (&context->lock);
+
+    session = g_hash_table_lookup (context->sessions, ssl->server);
+    if (session &&
+        SSL_SESSION_get_time (session) + SSL_SESSION_get_timeout (session) < time (NULL)) {
+        g_hash_table_remove (context->sessions, ssl->server);
+        session = NULL;
+    }
+
+    /* Takes a reference of its own */
+    if (session) {
+        SSL_set_session (ssl->ssl, session);
+    }
+
+    g_mutex_unlock (&context->lock);
+}
+
+/* Called for every session the server hands out, with TLS 1.3 that
+ * happens after the handshake */
+static int
+ssl_new_session_cb (SSL *s, SSL_SESSION *session)
+{
+    LmSSLContext *context;
+    LmSSL        *ssl;
+
+    context = SSL_CTX_get_app_data (SSL_get_SSL_CTX (s));
+    ssl = SSL_get_app_data (s);
+
+    if (!context || !ssl || !ssl->server) {
+        return 0;
+    }
+
+    ssl_context_set_session (context, ssl->server, session);
+
+    /* Keeps the reference passed in */
+    return 1;
+}
+
+LmSSLContext *
+_lm_ssl_context_new (const gchar *ca_path)
+{
+    static gboolean  initialized = FALSE;
+    const SSL_METHOD *ssl_method;
+    LmSSLContext     *context;
     /*const char *cert_file = NULL;*/
 
     if (!initialized) {
@@ -347,14 +472,18 @@ _lm_ssl_initialize (LmSSL *ssl)
     /* don't use TLSv1_client_method() because otherwise we don't get
      * connections to TLS1_1 and TLS1_2 only servers
      */
-    ssl->ssl_method = SSLv23_client_method();
-    if (ssl->ssl_method == NULL) {
+    ssl_method = SSLv23_client_method();
+    if (ssl_method == NULL) {
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL,
                "SSLv23_client_method() == NULL");
         abort();
     }
-    ssl->ssl_ctx = SSL_CTX_new(ssl->ssl_method);
-    if (ssl->ssl_ctx == NULL) {
+
+    context = g_new0 (LmSSLContext, 1);
+    context->ref_count = 1;
+
+    context->ssl_ctx = SSL_CTX_new(ssl_method);
+    if (context->ssl_ctx == NULL) {
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL, "SSL_CTX_new() == NULL");
         abort();
     }
@@ -366,7 +495,7 @@ _lm_ssl_initialize (LmSSL *ssl)
      * See http://twistedmatrix.com/trac/ticket/3463 and
      * Loudmouth [#28].
      */
-    SSL_CTX_set_options (ssl->ssl_ctx, (SSL_OP_NO_TICKET | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3));
+    SSL_CTX_set_options (context->ssl_ctx, (SSL_OP_NO_TICKET | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3));
 
     /*if (access("/etc/ssl/cert.pem", R_OK) == 0)
       cert_file = "/etc/ssl/cert.pem";
@@ -374,62 +503,88 @@ _lm_ssl_initialize (LmSSL *ssl)
       cert_file, "/etc/ssl/certs")) {
       g_warning("SSL_CTX_load_verify_locations() failed");
       }*/
-    SSL_CTX_set_default_verify_paths (ssl->ssl_ctx);
-    SSL_CTX_set_verify (ssl->ssl_ctx, SSL_VERIFY_PEER, ssl_verify_cb);
+    SSL_CTX_set_default_verify_paths (context->ssl_ctx);
+    SSL_CTX_set_verify (context->ssl_ctx, SSL_VERIFY_PEER, ssl_verify_cb);
+
+    g_mutex_init (&context->lock);
+    context->sessions = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free,
+                                               (GDestroyNotify) SSL_SESSION_free);
+
+    /* Sessions are kept per server name by us, the internal cache is
+     * looked up by session id which a client doesn't know up front */
+    SSL_CTX_set_app_data (context->ssl_ctx, context);
+    SSL_CTX_set_session_cache_mode (context->ssl_ctx,
+                                    SSL_SESS_CACHE_CLIENT |
+                                    SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb (context->ssl_ctx, ssl_new_session_cb);
+
+    if (ca_path) {
+        ssl_context_set_ca (context, ca_path);
+    }
+
+    return context;
 }
 
-gboolean
-_lm_ssl_set_ca (LmSSL       *ssl,
-                const gchar *ca_path)
+LmSSLContext *
+_lm_ssl_context_ref (LmSSLContext *context)
 {
-    struct stat target;
-    int success = 0;
+    g_atomic_int_inc (&context->ref_count);
 
-    if (stat (ca_path, &target) != 0) {
-        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL,
-               "ca_path '%s': no such file or directory", ca_path);
-        return FALSE;
+    return context;
+}
+
+void
+_lm_ssl_context_unref (LmSSLContext *context)
+{
+    if (g_atomic_int_dec_and_test (&context->ref_count)) {
+        g_hash_table_destroy (context->sessions);
+        g_mutex_clear (&context->lock);
+        SSL_CTX_free (context->ssl_ctx);
+        g_free (context);
     }
+}
 
-    if (S_ISDIR (target.st_mode)) {
-        success = SSL_CTX_load_verify_locations(ssl->ssl_ctx, NULL, ca_path);
-    } else if (S_ISREG (target.st_mode)) {
-        success = SSL_CTX_load_verify_locations(ssl->ssl_ctx, ca_path, NULL);
+void
+_lm_ssl_set_context (LmSSL *ssl, LmSSLContext *context)
+{
+    if (context) {
+        _lm_ssl_context_ref (context);
     }
-    if (success == 0) {
-        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL,
-               "Loading of ca_path '%s' failed: %s",
-               ca_path,
-               ERR_error_string(ERR_peek_last_error(), NULL));
-        return FALSE;
+
+    if (ssl->context) {
+        _lm_ssl_context_unref (ssl->context);
     }
 
-    return TRUE;
+    ssl->context = context;
+}
+
+void
+_lm_ssl_initialize (LmSSL *ssl)
+{
+    if (!ssl->context) {
+        ssl->context = _lm_ssl_context_get (LM_SSL_BASE(ssl)->ca_path);
+    }
 }
 
 gboolean
-_lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
+_lm_ssl_begin (LmSSL       *ssl,
+               gint         fd,
+               const gchar *server,
+               const gchar *alpn,
+               GError     **error)
 {
-    gint ssl_ret;
-    GIOStatus status;
     LmSSLBase *base;
 
     base = LM_SSL_BASE(ssl);
-    if (!ssl->ssl_ctx) {
+    if (!ssl->context) {
         g_set_error (error,
                      LM_ERROR, LM_ERROR_CONNECTION_OPEN,
                      "No SSL Context for OpenSSL");
         return FALSE;
     }
 
-    if (base->cipher_list) {
-        SSL_CTX_set_cipher_list(ssl->ssl_ctx, base->cipher_list);
-    }
-    if (base->ca_path) {
-        _lm_ssl_set_ca (ssl, base->ca_path);
-    }
-
-    ssl->ssl = SSL_new(ssl->ssl_ctx);
+    ssl->ssl = SSL_new(ssl->context->ssl_ctx);
     if (ssl->ssl == NULL) {
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL, "SSL_new() == NULL");
         g_set_error(error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
@@ -437,6 +592,36 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
         return FALSE;
     }
 
+    /* The context may be shared, the cipher list is set per connection */
+    if (base->cipher_list) {
+        SSL_set_cipher_list(ssl->ssl, base->cipher_list);
+    }
+
+    /* Writes that would block are retried from the output queue of the
+     * socket, which may have grown and moved in the meantime. */
+    SSL_set_mode (ssl->ssl,
+                  SSL_MODE_ENABLE_PARTIAL_WRITE |
+                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    g_free (ssl->server);
+    ssl->server = g_ascii_strdown (server, -1);
+
+    SSL_set_app_data (ssl->ssl, ssl);
+    if (!g_hostname_is_ip_address (server)) {
+        SSL_set_tlsext_host_name (ssl->ssl, server);
+    }
+    if (alpn) {
+        /* A single protocol in wire format, prefixed with its length */
+        gsize          len = strlen (alpn);
+        unsigned char *protos = g_malloc (len + 1);
+
+        protos[0] = (unsigned char) len;
+        memcpy (protos + 1, alpn, len);
+        SSL_set_alpn_protos (ssl->ssl, protos, len + 1);
+        g_free (protos);
+    }
+    ssl_context_resume_session (ssl->context, ssl);
+
     if (!SSL_set_fd (ssl->ssl, fd)) {
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL, "SSL_set_fd() failed");
         g_set_error(error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
@@ -452,29 +637,51 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
       }
       SSL_set_bio(ssl->ssl, ssl->bio, ssl->bio);*/
 
-    do {
-        ssl_ret = SSL_connect(ssl->ssl);
-        if (ssl_ret <= 0) {
-            status = ssl_io_status_from_return(ssl, ssl_ret);
-            if (status != G_IO_STATUS_AGAIN) {
-                ssl_print_state(ssl, "SSL_connect",
-                                ssl_ret);
-                g_set_error(error, LM_ERROR,
-                            LM_ERROR_CONNECTION_OPEN,
-                            "SSL_connect()");
-                return FALSE;
-            }
+    SSL_set_connect_state (ssl->ssl);
+
+    return TRUE;
+}
+
+GIOStatus
+_lm_ssl_handshake (LmSSL *ssl, GIOCondition *wait, GError **error)
+{
+    gint ssl_ret;
+    GIOStatus status;
+    LmSSLBase *base;
+
+    base = LM_SSL_BASE(ssl);
 
+    ssl_ret = SSL_connect(ssl->ssl);
+    if (ssl_ret <= 0) {
+        status = ssl_io_status_from_return(ssl, ssl_ret, wait);
+        if (status == G_IO_STATUS_AGAIN) {
+            return status;
         }
-    } while (ssl_ret <= 0);
 
-    if (!ssl_verify_certificate (ssl, server)) {
+        ssl_print_state(ssl, "SSL_connect", ssl_ret);
+        g_set_error(error, LM_ERROR,
+                    LM_ERROR_CONNECTION_OPEN,
+                    "SSL_connect()");
+        return G_IO_STATUS_ERROR;
+    }
+
+    *wait = 0;
+
+    if (SSL_session_reused (ssl->ssl)) {
+        base->resumption_hits++;
+    } else {
+        base->resumption_misses++;
+    }
+
+    if (!ssl_verify_certificate (ssl, ssl->server)) {
+        /* Not to be resumed without asking again */
+        ssl_context_set_session (ssl->context, ssl->server, NULL);
         g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
                      "*** SSL certificate verification failed");
-        return FALSE;
+        return G_IO_STATUS_ERROR;
     }
 
-    return TRUE;
+    return G_IO_STATUS_NORMAL;
 }
 
 GIOStatus
@@ -485,7 +692,7 @@ _lm_ssl_read (LmSSL *ssl, gchar *buf, gint len, gsize *bytes_read)
 
     *bytes_read = 0;
     ssl_ret = SSL_read(ssl->ssl, buf, len);
-    status = ssl_io_status_from_return(ssl, ssl_ret);
+    status = ssl_io_status_from_return(ssl, ssl_ret, &ssl->read_wait);
     if (status == G_IO_STATUS_NORMAL) {
         *bytes_read = ssl_ret;
     }
@@ -499,18 +706,44 @@ _lm_ssl_send (LmSSL *ssl, const gchar *str, gint len)
     GIOStatus status;
     gint ssl_ret;
 
-    do {
-        ssl_ret = SSL_write(ssl->ssl, str, len);
-        if (ssl_ret <= 0) {
-            status = ssl_io_status_from_return(ssl, ssl_ret);
-            if (status != G_IO_STATUS_AGAIN)
-                return -1;
+    ssl_ret = SSL_write(ssl->ssl, str, len);
+    if (ssl_ret <= 0) {
+        status = ssl_io_status_from_return(ssl, ssl_ret, &ssl->send_wait);
+        if (status != G_IO_STATUS_AGAIN) {
+            return -1;
         }
-    } while (ssl_ret <= 0);
+
+        /* Nothing written, the caller retries once send_wait is met */
+        return 0;
+    }
+
+    ssl->send_wait = 0;
 
     return ssl_ret;
 }
 
+GIOCondition
+_lm_ssl_get_read_wait (LmSSL *ssl)
+{
+    return ssl->read_wait;
+}
+
+GIOCondition
+_lm_ssl_get_send_wait (LmSSL *ssl)
+{
+    return ssl->send_wait;
+}
+
+gsize
+_lm_ssl_pending (LmSSL *ssl)
+{
+    gint pending;
+
+    pending = SSL_pending (ssl->ssl);
+
+    return pending > 0 ? pending : 0;
+}
+
 void
 _lm_ssl_close (LmSSL *ssl)
 {
@@ -524,8 +757,8 @@ _lm_ssl_close (LmSSL *ssl)
 void
 _lm_ssl_free (LmSSL *ssl)
 {
-    SSL_CTX_free(ssl->ssl_ctx);
-    ssl->ssl_ctx = NULL;
+    _lm_ssl_set_context (ssl, NULL);
+    g_free (ssl->server);
 
     _lm_ssl_base_free_fields (LM_SSL_BASE(ssl));
     g_free (ssl);
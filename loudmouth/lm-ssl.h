@@ -131,14 +131,26 @@ void                  lm_ssl_set_ca          (LmSSL *ssl,
 
 const gchar *         lm_ssl_get_fingerprint (LmSSL          *ssl);
 
+guint                 lm_ssl_get_resumption_hits   (LmSSL     *ssl);
+guint                 lm_ssl_get_resumption_misses (LmSSL     *ssl);
+
 void                  lm_ssl_use_starttls    (LmSSL *ssl,
                                               gboolean use_starttls,
                                               gboolean require);
 
+void                  lm_ssl_set_handshake_timeout (LmSSL     *ssl,
+                                                    guint      timeout);
+
 gboolean              lm_ssl_get_use_starttls (LmSSL *ssl);
 
 gboolean              lm_ssl_get_require_starttls (LmSSL *ssl);
 
+void                  lm_ssl_use_direct_tls  (LmSSL          *ssl,
+                                              gboolean        use_direct_tls,
+                                              gboolean        use_alpn);
+
+gboolean              lm_ssl_get_use_direct_tls (LmSSL       *ssl);
+
 LmSSL *               lm_ssl_ref             (LmSSL          *ssl);
 void                  lm_ssl_unref           (LmSSL          *ssl);
 
@@ -0,0 +1,304 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <sys/types.h>
+#include <netdb.h>
+
+/* Needed on Mac OS X */
+#if HAVE_ARPA_NAMESER_COMPAT_H
+#include <arpa/nameser_compat.h>
+#endif
+
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "lm-debug.h"
+#include "lm-internals.h"
+#include "lm-misc.h"
+
+#include "lm-threaded-resolver.h"
+
+#define SRV_LEN 8192
+
+/* Lookups of all resolvers share this many threads */
+#define RESOLVER_MAX_THREADS 4
+
+#define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_THREADED_RESOLVER, LmThreadedResolverPriv))
+
+typedef struct ResolverJob ResolverJob;
+
+typedef struct LmThreadedResolverPriv LmThreadedResolverPriv;
+struct LmThreadedResolverPriv {
+    ResolverJob *job;
+};
+
+/* A lookup, it is cancelled by clearing the resolver */
+struct ResolverJob {
+    LmResolver       *resolver;
+    GMainContext     *context;
+
+    LmResolverType    type;
+    gchar            *name;
+
+    LmResolverResult  result;
+    struct addrinfo  *results;
+    GList            *srv_targets;
+};
+
+/* Protects the resolver of the jobs */
+G_LOCK_DEFINE_STATIC (jobs);
+static GThreadPool *pool;
+
+static void     threaded_resolver_finalize    (GObject       *object);
+static void     threaded_resolver_lookup      (LmResolver    *resolver);
+static void     threaded_resolver_cancel      (LmResolver    *resolver);
+
+G_DEFINE_TYPE (LmThreadedResolver, lm_threaded_resolver, LM_TYPE_RESOLVER)
+
+static void
+lm_threaded_resolver_class_init (LmThreadedResolverClass *class)
+{
+    GObjectClass    *object_class   = G_OBJECT_CLASS (class);
+    LmResolverClass *resolver_class = LM_RESOLVER_CLASS (class);
+
+    object_class->finalize = threaded_resolver_finalize;
+
+    resolver_class->lookup = threaded_resolver_lookup;
+    resolver_class->cancel = threaded_resolver_cancel;
+
+    g_type_class_add_private (object_class,
+                              sizeof (LmThreadedResolverPriv));
+}
+
+static void
+lm_threaded_resolver_init (LmThreadedResolver *threaded_resolver)
+{
+    (void) GET_PRIV (threaded_resolver);
+}
+
+static void
+threaded_resolver_finalize (GObject *object)
+{
+    /* A lookup still running is left to finish on its own */
+    threaded_resolver_cancel (LM_RESOLVER (object));
+
+    (G_OBJECT_CLASS (lm_threaded_resolver_parent_class)->finalize) (object);
+}
+
+static void
+threaded_resolver_job_free (ResolverJob *job)
+{
+    if (job->results) {
+        freeaddrinfo (job->results);
+    }
+
+    lm_resolver_free_srv_targets (job->srv_targets);
+
+    if (job->context) {
+        g_main_context_unref (job->context);
+    }
+
+    g_free (job->name);
+    g_slice_free (ResolverJob, job);
+}
+
+static void
+threaded_resolver_lookup_host (ResolverJob *job)
+{
+    struct addrinfo  req;
+    struct addrinfo *ans = NULL;
+    int              err;
+
+    memset (&req, 0, sizeof(req));
+    req.ai_family   = PF_UNSPEC;
+    req.ai_socktype = SOCK_STREAM;
+    req.ai_protocol = IPPROTO_TCP;
+
+    err = getaddrinfo (job->name, NULL, &req, &ans);
+
+    if (err != 0 || ans == NULL) {
+        job->result = LM_RESOLVER_RESULT_FAILED;
+    } else {
+        job->result = LM_RESOLVER_RESULT_OK;
+        job->results = ans;
+    }
+}
+
+static void
+threaded_resolver_lookup_service (ResolverJob *job)
+{
+    unsigned char srv_ans[SRV_LEN];
+    int           len;
+
+    /* The resolver state is kept per thread */
+    res_init ();
+
+    len = res_query (job->name, C_IN, T_SRV, srv_ans, SRV_LEN);
+
+    if (len > 0 &&
+        _lm_resolver_parse_srv_response (srv_ans, len, &job->srv_targets)) {
+        job->result = LM_RESOLVER_RESULT_OK;
+    } else {
+        job->result = LM_RESOLVER_RESULT_FAILED;
+    }
+}
+
+/* Runs in the main context of the resolver */
+static gboolean
+threaded_resolver_done_cb (ResolverJob *job)
+{
+    LmResolver *resolver;
+
+    G_LOCK (jobs);
+
+    resolver = job->resolver;
+    if (resolver) {
+        GET_PRIV (resolver)->job = NULL;
+        g_object_ref (resolver);
+    }
+
+    G_UNLOCK (jobs);
+
+    if (resolver) {
+        if (job->srv_targets) {
+            _lm_resolver_set_srv_targets (resolver, job->srv_targets);
+            job->srv_targets = NULL;
+        }
+
+        _lm_resolver_set_result (resolver, job->result, job->results);
+        job->results = NULL;
+
+        g_object_unref (resolver);
+    }
+
+    threaded_resolver_job_free (job);
+
+    return FALSE;
+}
+
+/* Runs in a thread of the pool */
+static void
+threaded_resolver_run (ResolverJob *job, gpointer user_data)
+{
+    gboolean cancelled;
+
+    G_LOCK (jobs);
+    cancelled = job->resolver == NULL;
+    G_UNLOCK (jobs);
+
+    if (!cancelled) {
+        if (job->type == LM_RESOLVER_SRV) {
+            threaded_resolver_lookup_service (job);
+        } else {
+            threaded_resolver_lookup_host (job);
+        }
+    }
+
+    G_LOCK (jobs);
+
+    if (job->resolver) {
+        lm_misc_add_idle (job->context,
+                          (GSourceFunc) threaded_resolver_done_cb,
+                          job);
+        job = NULL;
+    }
+
+    G_UNLOCK (jobs);
+
+    if (job) {
+        threaded_resolver_job_free (job);
+    }
+}
+
+static void
+threaded_resolver_lookup (LmResolver *resolver)
+{
+    LmThreadedResolverPriv *priv;
+    ResolverJob            *job;
+    GMainContext           *context;
+    gint                    type;
+
+    g_return_if_fail (LM_IS_THREADED_RESOLVER (resolver));
+
+    priv = GET_PRIV (resolver);
+
+    g_object_get (resolver, "context", &context, "type", &type, NULL);
+
+    job = g_slice_new0 (ResolverJob);
+    job->resolver = resolver;
+    job->context = context ? g_main_context_ref (context) : NULL;
+    job->type = type;
+
+    if (type == LM_RESOLVER_SRV) {
+        gchar *domain;
+        gchar *service;
+        gchar *protocol;
+
+        g_object_get (resolver,
+                      "domain", &domain,
+                      "service", &service,
+                      "protocol", &protocol,
+                      NULL);
+
+        job->name = _lm_resolver_create_srv_string (domain, service, protocol);
+
+        g_free (domain);
+        g_free (service);
+        g_free (protocol);
+    } else {
+        g_object_get (resolver, "host", &job->name, NULL);
+    }
+
+    G_LOCK (jobs);
+
+    if (!pool) {
+        pool = g_thread_pool_new ((GFunc) threaded_resolver_run, NULL,
+                                  RESOLVER_MAX_THREADS, FALSE, NULL);
+    }
+
+    priv->job = job;
+    g_thread_pool_push (pool, job, NULL);
+
+    G_UNLOCK (jobs);
+}
+
+/* The result of a cancelled lookup is dropped, a lookup that hasn't
+ * started yet is skipped */
+static void
+threaded_resolver_cancel (LmResolver *resolver)
+{
+    LmThreadedResolverPriv *priv;
+
+    g_return_if_fail (LM_IS_THREADED_RESOLVER (resolver));
+
+    priv = GET_PRIV (resolver);
+
+    G_LOCK (jobs);
+
+    if (priv->job) {
+        priv->job->resolver = NULL;
+        priv->job = NULL;
+    }
+
+    G_UNLOCK (jobs);
+}
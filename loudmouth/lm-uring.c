@@ -0,0 +1,953 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_IO_URING
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <liburing.h>
+#endif
+
+#include "lm-debug.h"
+#include "lm-uring.h"
+
+#ifdef HAVE_IO_URING
+
+/* Size of the submission queue shared by all sockets of a context */
+#define URING_ENTRIES     512
+/* Receive buffers provided to the kernel, shared by all sockets of a ring.
+ * One byte of each is kept free to nul terminate the data. */
+#define URING_BUF_GROUP   0
+#define URING_N_BUFS      256
+#define URING_BUF_SIZE    4096
+/* Queued chunks sent with one sendmsg */
+#define URING_SEND_BATCH  16
+/* Completions handled in one dispatch before giving other sources a chance */
+#define URING_MAX_CQES    1024
+/* How long closing a socket waits for its sends in flight, in ms */
+#define URING_CLOSE_WAIT  500
+
+typedef enum {
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_CANCEL
+} UringOpType;
+
+/* Passed as the user data of the requests of a socket */
+typedef struct {
+    LmUringSocket *usock;
+    UringOpType    type;
+} UringOp;
+
+/* A completion reaped while closing another socket, handled by the next
+ * dispatch */
+typedef struct {
+    UringOp *op;
+    gint     res;
+    guint    flags;
+} UringCompletion;
+
+typedef struct {
+    GSource                   source;
+    GMainContext             *context;
+
+    /* eventfd the ring signals whenever completions are posted */
+    GPollFD                   pollfd;
+
+    struct io_uring           ring;
+    gboolean                  ring_initialized;
+    struct io_uring_buf_ring *buf_ring;
+    gchar                    *buffers;
+
+    /* Requests prepared since the last submit */
+    guint                     n_unsubmitted;
+    /* Sockets to send for before the next poll, queued to batch their
+     * writes or because the submission queue was full */
+    GSList                   *send_later;
+    GArray                   *deferred;
+
+    /* Sockets using the ring, protected by the urings lock */
+    guint                     n_users;
+} LmUring;
+
+struct _LmUringSocket {
+    LmUring         *uring;
+    LmOldSocketT     fd;
+
+    UringOp          recv_op;
+    UringOp          send_op;
+    UringOp          cancel_op;
+
+    gboolean         recv_armed;
+    /* The reader is paused, the recv is cancelled and not armed again */
+    gboolean         recv_paused;
+
+    /* The chunks of the sends in flight are kept alive until the kernel is
+     * done with them, the queue might be cleared meanwhile */
+    LmOutputChunk   *send_chunks[URING_SEND_BATCH];
+    struct iovec     send_iov[URING_SEND_BATCH];
+    struct msghdr    send_msg;
+    guint            n_send_chunks;
+    guint            n_sends;
+    gsize            sent;
+    gint             send_error;
+    /* The queue to send before the next poll */
+    LmOutputQueue   *send_queue;
+
+    gboolean         closed;
+
+    LmUringRecvFunc  recv_func;
+    LmUringSentFunc  sent_func;
+    gpointer         user_data;
+
+    /* One reference for the owner and one for each request in flight */
+    guint            ref_count;
+};
+
+static gboolean uring_prepare  (GSource     *source,
+                                gint        *timeout);
+static gboolean uring_check    (GSource     *source);
+static gboolean uring_dispatch (GSource     *source,
+                                GSourceFunc  callback,
+                                gpointer     user_data);
+static void     uring_finalize (GSource     *source);
+
+static GSourceFuncs uring_source_funcs = {
+    uring_prepare,
+    uring_check,
+    uring_dispatch,
+    uring_finalize
+};
+
+/* One ring per main context */
+G_LOCK_DEFINE_STATIC (urings);
+static GHashTable *urings = NULL;
+static gboolean    uring_unsupported = FALSE;
+
+static void
+uring_submit (LmUring *uring)
+{
+    gint ret;
+
+    if (uring->n_unsubmitted == 0) {
+        return;
+    }
+
+    ret = io_uring_submit (&uring->ring);
+    if (ret < 0) {
+        g_warning ("io_uring submit failed: %s", g_strerror (-ret));
+    }
+
+    uring->n_unsubmitted = 0;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe (LmUring *uring)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = io_uring_get_sqe (&uring->ring);
+    if (!sqe) {
+        /* Submission queue is full */
+        uring_submit (uring);
+        sqe = io_uring_get_sqe (&uring->ring);
+    }
+
+    if (sqe) {
+        uring->n_unsubmitted++;
+    }
+
+    return sqe;
+}
+
+static void
+uring_recycle_buffer (LmUring *uring, guint bid)
+{
+    io_uring_buf_ring_add (uring->buf_ring,
+                           uring->buffers + bid * URING_BUF_SIZE,
+                           URING_BUF_SIZE - 1, bid,
+                           io_uring_buf_ring_mask (URING_N_BUFS), 0);
+    io_uring_buf_ring_advance (uring->buf_ring, 1);
+}
+
+static void
+uring_prep_recv (struct io_uring_sqe *sqe, LmOldSocketT fd)
+{
+    io_uring_prep_recv_multishot (sqe, fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+}
+
+/* Multishot recv needs Linux 6.0, which is newer than the buffer rings.
+ * Tried once on a socket pair when the ring is set up. */
+static gboolean
+uring_probe_multishot_recv (LmUring *uring)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    gboolean             supported = FALSE;
+    int                  fds[2];
+    gint                 i;
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return FALSE;
+    }
+
+    if (write (fds[1], "", 1) != 1) {
+        goto out;
+    }
+
+    sqe = io_uring_get_sqe (&uring->ring);
+    uring_prep_recv (sqe, fds[0]);
+    io_uring_sqe_set_data (sqe, NULL);
+
+    if (io_uring_submit_and_wait (&uring->ring, 1) < 0 ||
+        io_uring_wait_cqe (&uring->ring, &cqe) < 0) {
+        goto out;
+    }
+
+    supported = (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE));
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uring_recycle_buffer (uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    io_uring_cqe_seen (&uring->ring, cqe);
+
+    if (!supported) {
+        goto out;
+    }
+
+    /* Completes both the cancel and the recv */
+    sqe = io_uring_get_sqe (&uring->ring);
+    io_uring_prep_cancel_fd (sqe, fds[0], 0);
+    io_uring_sqe_set_data (sqe, NULL);
+    io_uring_submit (&uring->ring);
+
+    for (i = 0; i < 2; i++) {
+        if (io_uring_wait_cqe (&uring->ring, &cqe) < 0) {
+            supported = FALSE;
+            break;
+        }
+        io_uring_cqe_seen (&uring->ring, cqe);
+    }
+
+ out:
+    close (fds[0]);
+    close (fds[1]);
+
+    return supported;
+}
+
+static LmUring *
+uring_new (GMainContext *context)
+{
+    LmUring *uring;
+    guint    i;
+    gint     ret;
+
+    uring = (LmUring *) g_source_new (&uring_source_funcs, sizeof (LmUring));
+    uring->pollfd.fd = -1;
+
+    ret = io_uring_queue_init (URING_ENTRIES, &uring->ring, 0);
+    if (ret < 0) {
+        lm_verbose ("io_uring not available: %s\n", g_strerror (-ret));
+        goto error;
+    }
+    uring->ring_initialized = TRUE;
+
+    uring->buf_ring = io_uring_setup_buf_ring (&uring->ring, URING_N_BUFS,
+                                               URING_BUF_GROUP, 0, &ret);
+    if (!uring->buf_ring) {
+        lm_verbose ("io_uring buffer rings not available: %s\n",
+                    g_strerror (-ret));
+        goto error;
+    }
+
+    uring->buffers = g_malloc (URING_N_BUFS * URING_BUF_SIZE);
+    for (i = 0; i < URING_N_BUFS; i++) {
+        io_uring_buf_ring_add (uring->buf_ring,
+                               uring->buffers + i * URING_BUF_SIZE,
+                               URING_BUF_SIZE - 1, i,
+                               io_uring_buf_ring_mask (URING_N_BUFS), i);
+    }
+    io_uring_buf_ring_advance (uring->buf_ring, URING_N_BUFS);
+
+    if (!uring_probe_multishot_recv (uring)) {
+        lm_verbose ("io_uring multishot recv not available\n");
+        goto error;
+    }
+
+    uring->pollfd.fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (uring->pollfd.fd < 0 ||
+        io_uring_register_eventfd (&uring->ring, uring->pollfd.fd) < 0) {
+        lm_verbose ("Could not set up io_uring eventfd\n");
+        goto error;
+    }
+
+    uring->pollfd.events = G_IO_IN;
+    g_source_add_poll ((GSource *) uring, &uring->pollfd);
+
+    uring->context = g_main_context_ref (context);
+    g_source_attach ((GSource *) uring, context);
+
+    return uring;
+
+ error:
+    g_source_unref ((GSource *) uring);
+
+    return NULL;
+}
+
+static LmUring *
+uring_get (GMainContext *context)
+{
+    LmUring *uring = NULL;
+
+    if (!context) {
+        context = g_main_context_default ();
+    }
+
+    G_LOCK (urings);
+
+    if (!urings) {
+        urings = g_hash_table_new (NULL, NULL);
+    }
+
+    uring = g_hash_table_lookup (urings, context);
+    if (!uring && !uring_unsupported) {
+        uring = uring_new (context);
+        if (uring) {
+            g_hash_table_insert (urings, context, uring);
+        } else {
+            /* Not worth trying again for every connection */
+            uring_unsupported = TRUE;
+        }
+    }
+
+    if (uring) {
+        uring->n_users++;
+    }
+
+    G_UNLOCK (urings);
+
+    return uring;
+}
+
+static void
+uring_release (LmUring *uring)
+{
+    G_LOCK (urings);
+
+    uring->n_users--;
+    if (uring->n_users == 0) {
+        g_hash_table_remove (urings, uring->context);
+        g_source_destroy ((GSource *) uring);
+        g_source_unref ((GSource *) uring);
+    }
+
+    G_UNLOCK (urings);
+}
+
+static LmUringSocket *
+uring_socket_ref (LmUringSocket *usock)
+{
+    usock->ref_count++;
+
+    return usock;
+}
+
+static void
+uring_socket_unref (LmUringSocket *usock)
+{
+    usock->ref_count--;
+
+    if (usock->ref_count == 0) {
+        uring_release (usock->uring);
+        g_slice_free (LmUringSocket, usock);
+    }
+}
+
+static void
+uring_send_later (LmUring *uring)
+{
+    GSList *waiting;
+    GSList *l;
+
+    waiting = uring->send_later;
+    uring->send_later = NULL;
+
+    for (l = waiting; l; l = l->next) {
+        LmUringSocket *usock = l->data;
+        LmOutputQueue *queue = usock->send_queue;
+
+        usock->send_queue = NULL;
+        if (!usock->closed) {
+            lm_uring_socket_send (usock, queue);
+        }
+
+        uring_socket_unref (usock);
+    }
+
+    g_slist_free (waiting);
+}
+
+static gboolean
+uring_socket_arm_recv (LmUringSocket *usock)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe (usock->uring);
+    if (!sqe) {
+        return FALSE;
+    }
+
+    uring_prep_recv (sqe, usock->fd);
+    io_uring_sqe_set_data (sqe, &usock->recv_op);
+
+    usock->recv_armed = TRUE;
+    uring_socket_ref (usock);
+
+    return TRUE;
+}
+
+static void
+uring_socket_recv_done (LmUringSocket *usock, gint res, guint flags)
+{
+    LmUring  *uring = usock->uring;
+    gboolean  more = (flags & IORING_CQE_F_MORE) != 0;
+
+    if (!more) {
+        usock->recv_armed = FALSE;
+    }
+
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        guint  bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        gchar *buf = uring->buffers + bid * URING_BUF_SIZE;
+
+        buf[res] = '\0';
+
+        if (!usock->closed) {
+            (usock->recv_func) (usock, buf, res, usock->user_data);
+        }
+
+        uring_recycle_buffer (uring, bid);
+    } else if (res == -ENOBUFS) {
+        lm_verbose ("Out of io_uring receive buffers\n");
+    } else if (res != -ECANCELED && !usock->closed) {
+        /* End of stream or an error */
+        (usock->recv_func) (usock, NULL, res, usock->user_data);
+    }
+
+    /* The recv stops after errors, when it ran out of buffers or when it
+     * was cancelled to pause reading */
+    if (!more) {
+        if (!usock->closed && !usock->recv_paused &&
+            (res > 0 || res == -ENOBUFS || res == -ECANCELED)) {
+            uring_socket_arm_recv (usock);
+        }
+
+        uring_socket_unref (usock);
+    }
+}
+
+static void
+uring_socket_send_done (LmUringSocket *usock, gint res)
+{
+    guint i;
+
+    usock->n_sends--;
+
+    if (res > 0) {
+        usock->sent += res;
+    } else if (res < 0 && res != -ECANCELED && usock->send_error == 0) {
+        usock->send_error = res;
+    }
+
+    if (usock->n_sends == 0) {
+        for (i = 0; i < usock->n_send_chunks; i++) {
+            lm_output_chunk_unref (usock->send_chunks[i]);
+        }
+        usock->n_send_chunks = 0;
+
+        if (!usock->closed) {
+            (usock->sent_func) (usock, usock->sent, usock->send_error,
+                                usock->user_data);
+        }
+    }
+
+    uring_socket_unref (usock);
+}
+
+static void
+uring_handle_completion (UringOp *op, gint res, guint flags)
+{
+    switch (op->type) {
+    case URING_OP_RECV:
+        uring_socket_recv_done (op->usock, res, flags);
+        break;
+    case URING_OP_SEND:
+        uring_socket_send_done (op->usock, res);
+        break;
+    case URING_OP_CANCEL:
+        uring_socket_unref (op->usock);
+        break;
+    }
+}
+
+/* Everything prepared during the main loop iteration is submitted with one
+ * system call right before polling */
+static gboolean
+uring_prepare (GSource *source, gint *timeout)
+{
+    LmUring *uring = (LmUring *) source;
+
+    if (uring->send_later) {
+        uring_send_later (uring);
+    }
+
+    uring_submit (uring);
+
+    /* Sends that found the submission queue full get another try now
+     * that it is empty, and soon again if they still don't fit */
+    if (uring->send_later) {
+        uring_send_later (uring);
+        uring_submit (uring);
+    }
+
+    *timeout = uring->send_later ? 1 : -1;
+
+    return uring->deferred || io_uring_cq_ready (&uring->ring) > 0;
+}
+
+static gboolean
+uring_check (GSource *source)
+{
+    LmUring *uring = (LmUring *) source;
+
+    return (uring->pollfd.revents & G_IO_IN) || uring->deferred ||
+        io_uring_cq_ready (&uring->ring) > 0;
+}
+
+static gboolean
+uring_dispatch (GSource     *source,
+                GSourceFunc  callback,
+                gpointer     user_data)
+{
+    LmUring *uring = (LmUring *) source;
+    guint64  value;
+    guint    i;
+
+    /* The eventfd only wakes up the loop, the completions are read from
+     * the ring */
+    if (uring->pollfd.revents & G_IO_IN) {
+        while (read (uring->pollfd.fd, &value, sizeof (value)) < 0 &&
+               errno == EINTR);
+    }
+
+    if (uring->deferred) {
+        GArray *deferred = uring->deferred;
+
+        uring->deferred = NULL;
+        for (i = 0; i < deferred->len; i++) {
+            UringCompletion *c = &g_array_index (deferred, UringCompletion, i);
+
+            uring_handle_completion (c->op, c->res, c->flags);
+        }
+        g_array_free (deferred, TRUE);
+    }
+
+    for (i = 0; i < URING_MAX_CQES; i++) {
+        struct io_uring_cqe *cqe;
+        UringOp             *op;
+        gint                 res;
+        guint                flags;
+
+        if (io_uring_peek_cqe (&uring->ring, &cqe) != 0) {
+            break;
+        }
+
+        op = io_uring_cqe_get_data (cqe);
+        res = cqe->res;
+        flags = cqe->flags;
+
+        /* Release the slot before the callbacks queue new requests */
+        io_uring_cqe_seen (&uring->ring, cqe);
+
+        if (op) {
+            uring_handle_completion (op, res, flags);
+        }
+    }
+
+    uring_submit (uring);
+
+    if (uring->send_later) {
+        uring_send_later (uring);
+    }
+
+    return TRUE;
+}
+
+static void
+uring_finalize (GSource *source)
+{
+    LmUring *uring = (LmUring *) source;
+
+    if (uring->buf_ring) {
+        io_uring_free_buf_ring (&uring->ring, uring->buf_ring,
+                                URING_N_BUFS, URING_BUF_GROUP);
+    }
+
+    if (uring->ring_initialized) {
+        io_uring_queue_exit (&uring->ring);
+    }
+
+    if (uring->pollfd.fd >= 0) {
+        close (uring->pollfd.fd);
+    }
+
+    g_free (uring->buffers);
+
+    if (uring->deferred) {
+        g_array_free (uring->deferred, TRUE);
+    }
+
+    if (uring->context) {
+        g_main_context_unref (uring->context);
+    }
+}
+
+/* Waits up to @timeout ms for the sends of @usock to complete, sending the
+ * rest of its queue from the sent callback meanwhile. With a timeout of 0
+ * only the completions already posted are handled. Completions of other
+ * sockets are left to the next dispatch, no callbacks are made for them
+ * from here. */
+static void
+uring_socket_wait_for_sends (LmUringSocket *usock, guint timeout)
+{
+    LmUring *uring = usock->uring;
+    gint64   end;
+
+    end = g_get_monotonic_time () + timeout * 1000;
+
+    while (usock->n_sends > 0) {
+        struct __kernel_timespec  ts;
+        struct io_uring_cqe      *cqe;
+        UringCompletion           c;
+        gint64                    left;
+
+        uring_submit (uring);
+
+        if (io_uring_peek_cqe (&uring->ring, &cqe) != 0) {
+            left = end - g_get_monotonic_time ();
+            if (left <= 0) {
+                break;
+            }
+
+            ts.tv_sec = left / G_USEC_PER_SEC;
+            ts.tv_nsec = (left % G_USEC_PER_SEC) * 1000;
+
+            if (io_uring_wait_cqe_timeout (&uring->ring, &cqe, &ts) != 0) {
+                continue;
+            }
+        }
+
+        c.op = io_uring_cqe_get_data (cqe);
+        c.res = cqe->res;
+        c.flags = cqe->flags;
+        io_uring_cqe_seen (&uring->ring, cqe);
+
+        if (!c.op) {
+            continue;
+        }
+
+        if (c.op->usock == usock) {
+            uring_handle_completion (c.op, c.res, c.flags);
+        } else {
+            if (!uring->deferred) {
+                uring->deferred = g_array_new (FALSE, FALSE,
+                                               sizeof (UringCompletion));
+            }
+            g_array_append_val (uring->deferred, c);
+        }
+    }
+}
+
+LmUringSocket *
+lm_uring_socket_new (GMainContext    *context,
+                     LmOldSocketT     fd,
+                     LmUringRecvFunc  recv_func,
+                     LmUringSentFunc  sent_func,
+                     gpointer         user_data)
+{
+    LmUringSocket *usock;
+    LmUring       *uring;
+
+    g_return_val_if_fail (recv_func != NULL, NULL);
+    g_return_val_if_fail (sent_func != NULL, NULL);
+
+    uring = uring_get (context);
+    if (!uring) {
+        return NULL;
+    }
+
+    usock = g_slice_new0 (LmUringSocket);
+
+    usock->uring = uring;
+    usock->fd = fd;
+    usock->recv_op.usock = usock;
+    usock->recv_op.type = URING_OP_RECV;
+    usock->send_op.usock = usock;
+    usock->send_op.type = URING_OP_SEND;
+    usock->cancel_op.usock = usock;
+    usock->cancel_op.type = URING_OP_CANCEL;
+    usock->recv_func = recv_func;
+    usock->sent_func = sent_func;
+    usock->user_data = user_data;
+    usock->ref_count = 1;
+
+    if (!uring_socket_arm_recv (usock)) {
+        uring_socket_unref (usock);
+        return NULL;
+    }
+
+    return usock;
+}
+
+/* Queues a send for the head of @queue. Only one batch is in flight at a
+ * time, the sent callback has to consume the written data from the queue
+ * before sending the rest. */
+void
+lm_uring_socket_send (LmUringSocket *usock, LmOutputQueue *queue)
+{
+    struct io_uring_sqe *sqe;
+    guint                n_iov;
+
+    g_return_if_fail (usock != NULL);
+    g_return_if_fail (queue != NULL);
+
+    if (usock->closed || usock->n_sends > 0) {
+        return;
+    }
+
+    n_iov = lm_output_queue_get_iovec (queue, usock->send_iov,
+                                       URING_SEND_BATCH);
+    if (n_iov == 0) {
+        return;
+    }
+
+    sqe = uring_get_sqe (usock->uring);
+    if (!sqe) {
+        lm_uring_socket_send_later (usock, queue);
+        return;
+    }
+
+    memset (&usock->send_msg, 0, sizeof (usock->send_msg));
+    usock->send_msg.msg_iov = usock->send_iov;
+    usock->send_msg.msg_iovlen = n_iov;
+
+    /* A single write for the whole batch, MSG_WAITALL makes the kernel
+     * finish a short one itself */
+    io_uring_prep_sendmsg (sqe, usock->fd, &usock->send_msg,
+                           MSG_NOSIGNAL | MSG_WAITALL);
+    io_uring_sqe_set_data (sqe, &usock->send_op);
+
+    usock->sent = 0;
+    usock->send_error = 0;
+    usock->n_sends = 1;
+    uring_socket_ref (usock);
+
+    usock->n_send_chunks = lm_output_queue_ref_chunks (queue,
+                                                       usock->send_chunks,
+                                                       n_iov);
+}
+
+/* Sends @queue right before the main loop polls, so that everything
+ * queued during the iteration goes out in one batch */
+void
+lm_uring_socket_send_later (LmUringSocket *usock, LmOutputQueue *queue)
+{
+    LmUring *uring;
+
+    g_return_if_fail (usock != NULL);
+    g_return_if_fail (queue != NULL);
+
+    uring = usock->uring;
+
+    if (usock->closed || usock->send_queue) {
+        return;
+    }
+
+    usock->send_queue = queue;
+    uring->send_later = g_slist_append (uring->send_later,
+                                        uring_socket_ref (usock));
+}
+
+gboolean
+lm_uring_socket_is_sending (LmUringSocket *usock)
+{
+    g_return_val_if_fail (usock != NULL, FALSE);
+
+    return usock->n_sends > 0;
+}
+
+/* Submits the queued requests now instead of before the next poll and
+ * handles the sends of @usock the kernel finished right away */
+void
+lm_uring_socket_flush (LmUringSocket *usock)
+{
+    g_return_if_fail (usock != NULL);
+
+    uring_submit (usock->uring);
+    uring_socket_wait_for_sends (usock, 0);
+}
+
+/* Stops receiving while the reader can't keep up, so that the kernel
+ * buffers fill up and TCP flow control holds back the sender. Completions
+ * already posted are still passed on. */
+void
+lm_uring_socket_set_receiving (LmUringSocket *usock, gboolean receiving)
+{
+    struct io_uring_sqe *sqe;
+
+    g_return_if_fail (usock != NULL);
+
+    if (usock->closed || usock->recv_paused == !receiving) {
+        return;
+    }
+
+    usock->recv_paused = !receiving;
+
+    if (receiving) {
+        /* A recv still waiting for its cancel is armed again once that
+         * completes */
+        if (!usock->recv_armed) {
+            uring_socket_arm_recv (usock);
+        }
+        return;
+    }
+
+    if (!usock->recv_armed) {
+        return;
+    }
+
+    sqe = uring_get_sqe (usock->uring);
+    if (sqe) {
+        io_uring_prep_cancel (sqe, &usock->recv_op, 0);
+        io_uring_sqe_set_data (sqe, &usock->cancel_op);
+        uring_socket_ref (usock);
+    }
+}
+
+/* No callbacks are made after this. The sends in flight get a moment to
+ * complete first, @sent is set to what they wrote. Returns FALSE if they
+ * failed or had to be cancelled, what is queued after them can't be
+ * written then. The socket is freed once the cancelled requests have
+ * completed, which has to be submitted before the caller closes the file
+ * descriptor. */
+gboolean
+lm_uring_socket_close (LmUringSocket *usock, gsize *sent)
+{
+    gboolean result = TRUE;
+
+    g_return_val_if_fail (usock != NULL, FALSE);
+    g_return_val_if_fail (!usock->closed, FALSE);
+
+    usock->closed = TRUE;
+    *sent = 0;
+
+    if (usock->n_sends > 0) {
+        uring_socket_wait_for_sends (usock, URING_CLOSE_WAIT);
+
+        if (usock->n_sends == 0) {
+            *sent = usock->sent;
+        }
+        result = usock->n_sends == 0 && usock->send_error == 0;
+    }
+
+    if (usock->recv_armed || usock->n_sends > 0) {
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_get_sqe (usock->uring);
+        if (sqe) {
+            io_uring_prep_cancel_fd (sqe, usock->fd, IORING_ASYNC_CANCEL_ALL);
+            io_uring_sqe_set_data (sqe, &usock->cancel_op);
+            uring_socket_ref (usock);
+        }
+
+        uring_submit (usock->uring);
+    }
+
+    uring_socket_unref (usock);
+
+    return result;
+}
+
+#else /* HAVE_IO_URING */
+
+LmUringSocket *
+lm_uring_socket_new (GMainContext    *context,
+                     LmOldSocketT     fd,
+                     LmUringRecvFunc  recv_func,
+                     LmUringSentFunc  sent_func,
+                     gpointer         user_data)
+{
+    return NULL;
+}
+
+void
+lm_uring_socket_send (LmUringSocket *usock, LmOutputQueue *queue)
+{
+    g_return_if_reached ();
+}
+
+void
+lm_uring_socket_send_later (LmUringSocket *usock, LmOutputQueue *queue)
+{
+    g_return_if_reached ();
+}
+
+gboolean
+lm_uring_socket_is_sending (LmUringSocket *usock)
+{
+    g_return_val_if_reached (FALSE);
+}
+
+void
+lm_uring_socket_flush (LmUringSocket *usock)
+{
+    g_return_if_reached ();
+}
+
+void
+lm_uring_socket_set_receiving (LmUringSocket *usock, gboolean receiving)
+{
+    g_return_if_reached ();
+}
+
+gboolean
+lm_uring_socket_close (LmUringSocket *usock, gsize *sent)
+{
+    g_return_val_if_reached (FALSE);
+}
+
+#endif /* HAVE_IO_URING */
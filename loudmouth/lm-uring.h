@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_URING_H__
+#define __LM_URING_H__
+
+#include <glib.h>
+
+#include "lm-internals.h"
+#include "lm-output-queue.h"
+
+G_BEGIN_DECLS
+
+/* Socket I/O through io_uring. All sockets on a main context share one
+ * ring, its completions are reaped from a single source woken up by an
+ * eventfd. Incoming data is received with a multishot recv into buffers
+ * provided by the ring, queued output is sent with one sendmsg per batch.
+ *
+ * Only available when built with --enable-io-uring, lm_uring_socket_new()
+ * returns NULL if the running kernel lacks support, callers then fall back
+ * to watching the socket. */
+typedef struct _LmUringSocket LmUringSocket;
+
+/* @buf is nul terminated and only valid during the call. A @len of 0 means
+ * the peer closed the connection, a negative @len is an errno value. */
+typedef void (* LmUringRecvFunc) (LmUringSocket *usock,
+                                  const gchar   *buf,
+                                  gssize         len,
+                                  gpointer       user_data);
+
+/* Called once a batch of sends has completed, @sent bytes of the queue
+ * have been written and can be consumed. @error is a negative errno value
+ * if a send failed. */
+typedef void (* LmUringSentFunc) (LmUringSocket *usock,
+                                  gsize          sent,
+                                  gint           error,
+                                  gpointer       user_data);
+
+LmUringSocket * lm_uring_socket_new        (GMainContext    *context,
+                                            LmOldSocketT     fd,
+                                            LmUringRecvFunc  recv_func,
+                                            LmUringSentFunc  sent_func,
+                                            gpointer         user_data);
+void            lm_uring_socket_send       (LmUringSocket   *usock,
+                                            LmOutputQueue   *queue);
+void            lm_uring_socket_send_later (LmUringSocket   *usock,
+                                            LmOutputQueue   *queue);
+gboolean        lm_uring_socket_is_sending (LmUringSocket   *usock);
+void            lm_uring_socket_flush      (LmUringSocket   *usock);
+void            lm_uring_socket_set_receiving (LmUringSocket *usock,
+                                            gboolean         receiving);
+gboolean        lm_uring_socket_close      (LmUringSocket   *usock,
+                                            gsize           *sent);
+
+G_END_DECLS
+
+#endif /* __LM_URING_H__ */
@@ -24,11 +24,14 @@
 #define LM_INSIDE_LOUDMOUTH_H 1
 
 #include <loudmouth/lm-connection.h>
+#include <loudmouth/lm-connection-manager.h>
+#include <loudmouth/lm-connection-pool.h>
 #include <loudmouth/lm-error.h>
 #include <loudmouth/lm-message.h>
 #include <loudmouth/lm-message-handler.h>
 #include <loudmouth/lm-message-node.h>
 #include <loudmouth/lm-proxy.h>
+#include <loudmouth/lm-reactor.h>
 #include <loudmouth/lm-utils.h>
 #include <loudmouth/lm-ssl.h>
 
@@ -0,0 +1,142 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+
+typedef struct {
+    GMutex   lock;
+    GCond    cond;
+    GThread *thread;
+    gboolean done;
+} Call;
+
+static void
+record_thread_cb (LmConnectionManager *manager,
+                  LmConnection        *connection,
+                  Call                *call)
+{
+    g_mutex_lock (&call->lock);
+    call->thread = g_thread_self ();
+    call->done = TRUE;
+    g_cond_signal (&call->cond);
+    g_mutex_unlock (&call->lock);
+}
+
+/* Returns the thread running @connection, waiting for everything invoked
+ * for it before */
+static GThread *
+thread_of (LmConnectionManager *manager, LmConnection *connection)
+{
+    Call call;
+
+    g_mutex_init (&call.lock);
+    g_cond_init (&call.cond);
+    call.thread = NULL;
+    call.done = FALSE;
+
+    lm_connection_manager_invoke (manager, connection,
+                                  (LmConnectionManagerFunc) record_thread_cb,
+                                  &call, NULL);
+
+    g_mutex_lock (&call.lock);
+    while (!call.done) {
+        g_cond_wait (&call.cond, &call.lock);
+    }
+    g_mutex_unlock (&call.lock);
+
+    g_mutex_clear (&call.lock);
+    g_cond_clear (&call.cond);
+
+    return call.thread;
+}
+
+static void
+test_placement ()
+{
+    LmConnectionManager *manager;
+    LmConnection        *connections[4];
+    gint                 i;
+
+    manager = lm_connection_manager_new (2);
+    g_assert_cmpuint (lm_connection_manager_get_n_threads (manager), ==, 2);
+
+    for (i = 0; i < 4; i++) {
+        connections[i] = lm_connection_manager_add_connection (manager,
+                                                               "localhost");
+        g_assert_cmpint (lm_connection_manager_get_thread (manager, connections[i]),
+                         ==, i % 2);
+    }
+
+    g_assert_cmpuint (lm_connection_manager_get_n_connections (manager, 0), ==, 2);
+    g_assert_cmpuint (lm_connection_manager_get_n_connections (manager, 1), ==, 2);
+
+    /* Each connection is run by its own thread, not the caller */
+    g_assert (thread_of (manager, connections[0]) ==
+              thread_of (manager, connections[2]));
+    g_assert (thread_of (manager, connections[0]) !=
+              thread_of (manager, connections[1]));
+    g_assert (thread_of (manager, connections[0]) != g_thread_self ());
+
+    lm_connection_manager_unref (manager);
+}
+
+static void
+test_migrate ()
+{
+    LmConnectionManager *manager;
+    LmConnection        *a;
+    LmConnection        *b;
+    GThread             *thread_b;
+
+    manager = lm_connection_manager_new (2);
+
+    a = lm_connection_manager_add_connection (manager, "localhost");
+    b = lm_connection_manager_add_connection (manager, "localhost");
+    thread_b = thread_of (manager, b);
+
+    lm_connection_manager_migrate (manager, a, 1);
+
+    /* Follows the connection to its new thread */
+    g_assert (thread_of (manager, a) == thread_b);
+    g_assert_cmpint (lm_connection_manager_get_thread (manager, a), ==, 1);
+    g_assert_cmpuint (lm_connection_manager_get_n_connections (manager, 0), ==, 0);
+    g_assert_cmpuint (lm_connection_manager_get_n_connections (manager, 1), ==, 2);
+
+    lm_connection_manager_remove_connection (manager, b);
+    thread_of (manager, a);
+    g_assert_cmpint (lm_connection_manager_get_thread (manager, b), ==, -1);
+    g_assert_cmpuint (lm_connection_manager_get_n_connections (manager, 1), ==, 1);
+
+    lm_connection_manager_unref (manager);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/connection_manager/placement", test_placement);
+    g_test_add_func ("/connection_manager/migrate", test_migrate);
+
+    return g_test_run ();
+}
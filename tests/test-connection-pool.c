@@ -0,0 +1,293 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "test-server.h"
+
+#define N_CONNECTIONS 6
+
+typedef struct {
+    gint              result;
+    gboolean          freed;
+} Open;
+
+/* The connections are refused by a local port nobody listens on, the
+ * tests only look at when the pool starts opening them */
+typedef struct {
+    LmConnectionPool *pool;
+    LmConnection     *connections[N_CONNECTIONS];
+    Open              opens[N_CONNECTIONS];
+} Pool;
+
+static guint
+closed_port (void)
+{
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof (addr);
+    gint               fd;
+
+    fd = socket (AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint (fd, >=, 0);
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    g_assert (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0);
+    g_assert (getsockname (fd, (struct sockaddr *) &addr, &len) == 0);
+    close (fd);
+
+    return ntohs (addr.sin_port);
+}
+
+static void
+result_cb (LmConnection *connection, gboolean success, Open *open)
+{
+    open->result = success;
+}
+
+static void
+freed_cb (Open *open)
+{
+    open->freed = TRUE;
+}
+
+static void
+pool_setup (Pool *p, guint rate)
+{
+    guint port = closed_port ();
+    guint i;
+
+    p->pool = lm_connection_pool_new (NULL);
+    lm_connection_pool_set_open_rate (p->pool, rate);
+
+    for (i = 0; i < N_CONNECTIONS; i++) {
+        p->connections[i] = lm_connection_new ("127.0.0.1");
+        lm_connection_set_port (p->connections[i], port);
+        lm_connection_pool_add_connection (p->pool, p->connections[i]);
+        p->opens[i].result = -1;
+        p->opens[i].freed = FALSE;
+    }
+}
+
+static void
+pool_open_all (Pool *p)
+{
+    guint i;
+
+    for (i = 0; i < N_CONNECTIONS; i++) {
+        g_assert (lm_connection_pool_open (p->pool, p->connections[i],
+                                           (LmResultFunction) result_cb,
+                                           &p->opens[i],
+                                           (GDestroyNotify) freed_cb,
+                                           NULL));
+    }
+}
+
+static void
+pool_teardown (Pool *p)
+{
+    guint i;
+
+    for (i = 0; i < N_CONNECTIONS; i++) {
+        lm_connection_unref (p->connections[i]);
+    }
+    lm_connection_pool_unref (p->pool);
+}
+
+/* Runs the default context until fewer than @n_pending opens are left
+ * waiting, returns when that was */
+static gint64
+wait_for_open (Pool *p, guint n_pending)
+{
+    test_iterate_until (NULL,
+                        lm_connection_pool_get_n_pending (p->pool) < n_pending);
+
+    return g_get_monotonic_time ();
+}
+
+/* Every connection but @cancelled fails to open */
+static void
+wait_for_results (Pool *p, gint cancelled)
+{
+    gint i;
+
+    for (i = 0; i < N_CONNECTIONS; i++) {
+        if (i != cancelled) {
+            test_iterate_until (NULL, p->opens[i].result != -1);
+            g_assert_cmpint (p->opens[i].result, ==, FALSE);
+        }
+    }
+}
+
+/* Opens are spaced by the interval of the rate, one at a time */
+static void
+test_pacing ()
+{
+    Pool   p;
+    gint64 start;
+    gint64 opened;
+    guint  i;
+
+    pool_setup (&p, 20);
+    g_assert_cmpuint (lm_connection_pool_get_open_rate (p.pool), ==, 20);
+
+    start = g_get_monotonic_time ();
+    pool_open_all (&p);
+    g_assert_cmpuint (lm_connection_pool_get_n_pending (p.pool), ==,
+                      N_CONNECTIONS);
+
+    for (i = 0; i < N_CONNECTIONS; i++) {
+        opened = wait_for_open (&p, N_CONNECTIONS - i);
+        g_assert_cmpuint (lm_connection_pool_get_n_pending (p.pool), ==,
+                          N_CONNECTIONS - i - 1);
+        g_assert_cmpint (opened - start, >=, i * 50 * 1000);
+    }
+    g_assert_cmpint (opened - start, <, (N_CONNECTIONS - 1) * 50 * 1000 +
+                     G_USEC_PER_SEC);
+
+    wait_for_results (&p, -1);
+    pool_teardown (&p);
+}
+
+/* Opens that fell due while the main loop was busy are caught up on at
+ * once, without delaying the ones after them */
+static void
+test_catch_up ()
+{
+    Pool   p;
+    gint64 start;
+    gint64 opened;
+    guint  n_pending;
+
+    pool_setup (&p, 20);
+    pool_open_all (&p);
+
+    start = wait_for_open (&p, N_CONNECTIONS);
+    g_usleep (175 * 1000);
+
+    /* The second to the fourth open were due meanwhile */
+    n_pending = lm_connection_pool_get_n_pending (p.pool);
+    opened = wait_for_open (&p, n_pending);
+    g_assert_cmpuint (lm_connection_pool_get_n_pending (p.pool), ==,
+                      n_pending - 3);
+    g_assert_cmpint (opened - start, <, 200 * 1000);
+
+    /* The fifth is still due 200 ms after the first */
+    opened = wait_for_open (&p, n_pending - 3);
+    g_assert_cmpint (opened - start, >=, 190 * 1000);
+    g_assert_cmpint (opened - start, <, 300 * 1000);
+
+    wait_for_results (&p, -1);
+    pool_teardown (&p);
+}
+
+/* A new rate applies right away instead of after the interval of the old
+ * one */
+static void
+test_rate_change ()
+{
+    Pool   p;
+    gint64 start;
+    gint64 opened;
+
+    pool_setup (&p, 1);
+    pool_open_all (&p);
+
+    start = wait_for_open (&p, N_CONNECTIONS);
+    g_assert_cmpuint (lm_connection_pool_get_n_pending (p.pool), ==,
+                      N_CONNECTIONS - 1);
+
+    lm_connection_pool_set_open_rate (p.pool, 10);
+    opened = wait_for_open (&p, N_CONNECTIONS - 1);
+    g_assert_cmpint (opened - start, <, 500 * 1000);
+
+    /* Paced at the new rate from there on */
+    g_assert_cmpuint (lm_connection_pool_get_n_pending (p.pool), ==,
+                      N_CONNECTIONS - 2);
+    start = opened;
+    opened = wait_for_open (&p, N_CONNECTIONS - 2);
+    g_assert_cmpint (opened - start, >=, 90 * 1000);
+
+    /* Without a limit the rest is opened at once */
+    lm_connection_pool_set_open_rate (p.pool, 0);
+    test_iterate_until (NULL, lm_connection_pool_get_n_pending (p.pool) == 0);
+
+    wait_for_results (&p, -1);
+    pool_teardown (&p);
+}
+
+/* Removing a connection cancels its pending open, the result function is
+ * never called and the user data is freed */
+static void
+test_remove_cancels ()
+{
+    Pool  p;
+    guint i;
+
+    pool_setup (&p, 1);
+    pool_open_all (&p);
+
+    wait_for_open (&p, N_CONNECTIONS);
+
+    lm_connection_pool_remove_connection (p.pool, p.connections[1]);
+    g_assert_cmpuint (lm_connection_pool_get_n_pending (p.pool), ==,
+                      N_CONNECTIONS - 2);
+    g_assert_cmpuint (lm_connection_pool_get_n_connections (p.pool), ==,
+                      N_CONNECTIONS - 1);
+    g_assert (p.opens[1].freed);
+
+    /* Already queued */
+    g_assert (!lm_connection_pool_open (p.pool, p.connections[2],
+                                        NULL, NULL, NULL, NULL));
+
+    lm_connection_pool_set_open_rate (p.pool, 0);
+    test_iterate_until (NULL, lm_connection_pool_get_n_pending (p.pool) == 0);
+
+    wait_for_results (&p, 1);
+    g_assert_cmpint (p.opens[1].result, ==, -1);
+    for (i = 0; i < N_CONNECTIONS; i++) {
+        g_assert (p.opens[i].freed);
+    }
+    g_assert_cmpint (lm_connection_get_state (p.connections[1]), ==,
+                     LM_CONNECTION_STATE_CLOSED);
+
+    pool_teardown (&p);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/connection_pool/pacing", test_pacing);
+    g_test_add_func ("/connection_pool/catch_up", test_catch_up);
+    g_test_add_func ("/connection_pool/rate_change", test_rate_change);
+    g_test_add_func ("/connection_pool/remove_cancels", test_remove_cancels);
+
+    return g_test_run ();
+}
@@ -0,0 +1,1046 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/tcp.h>
+#else
+#include <netinet/tcp.h>
+#endif
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "test-server.h"
+
+typedef struct {
+    GMutex              lock;
+    GCond               cond;
+    gboolean            released;
+    gboolean            close;
+    gint                started;
+    gint                done;
+    gboolean            close_result;
+} Handler;
+
+typedef struct {
+    gint                n_calls;
+    LmDisconnectReason  reason;
+    GThread            *thread;
+} Disconnect;
+
+static void
+open_cb (LmConnection *connection, gboolean success, gboolean *opened)
+{
+    g_assert (success);
+    *opened = TRUE;
+}
+
+static void
+disconnect_cb (LmConnection       *connection,
+               LmDisconnectReason  reason,
+               Disconnect         *disconnect)
+{
+    disconnect->reason = reason;
+    disconnect->thread = g_thread_self ();
+    g_atomic_int_inc (&disconnect->n_calls);
+}
+
+/* Returns an open connection to @server */
+static LmConnection *
+connection_open (TestServer *server, LmSSL *ssl)
+{
+    LmConnection *connection;
+    gboolean      opened = FALSE;
+
+    connection = lm_connection_new ("127.0.0.1");
+    lm_connection_set_port (connection, test_server_get_port (server));
+    if (ssl) {
+        lm_connection_set_ssl (connection, ssl);
+    }
+
+    g_assert (lm_connection_open (connection,
+                                  (LmResultFunction) open_cb, &opened,
+                                  NULL, NULL));
+    test_iterate_until (NULL, opened);
+    g_assert (test_server_is_open (server));
+
+    return connection;
+}
+
+static LmSSLResponse
+ssl_cb (LmSSL *ssl, LmSSLStatus status, gpointer user_data)
+{
+    /* The test certificate is self-signed */
+    return LM_SSL_RESPONSE_CONTINUE;
+}
+
+/* TLS from the first byte, accepting the certificate of the test server */
+static LmSSL *
+ssl_new (void)
+{
+    LmSSL *ssl;
+
+    ssl = lm_ssl_new (NULL, ssl_cb, NULL, NULL);
+    lm_ssl_use_starttls (ssl, FALSE, FALSE);
+
+    return ssl;
+}
+
+/* Runs the default context for @msec, returns how many times something
+ * was dispatched */
+static guint
+count_dispatches (guint msec)
+{
+    gint64 end = g_get_monotonic_time () + msec * 1000;
+    guint  n = 0;
+
+    while (g_get_monotonic_time () < end) {
+        if (g_main_context_iteration (NULL, FALSE)) {
+            n++;
+        } else {
+            g_usleep (1000);
+        }
+    }
+
+    return n;
+}
+
+/* Runs the default context until nothing is left buffered or @msec have
+ * passed, returns whether some output is still buffered */
+static gboolean
+still_buffered (LmConnection *connection, guint msec)
+{
+    gint64 end = g_get_monotonic_time () + msec * 1000;
+
+    while (lm_connection_get_send_buffered (connection) > 0) {
+        if (g_get_monotonic_time () >= end) {
+            return TRUE;
+        }
+        test_iterate (NULL);
+    }
+
+    return FALSE;
+}
+
+static LmHandlerResult
+handler_cb (LmMessageHandler *message_handler,
+            LmConnection     *connection,
+            LmMessage        *message,
+            Handler          *handler)
+{
+    g_mutex_lock (&handler->lock);
+    g_atomic_int_inc (&handler->started);
+    while (!handler->released) {
+        g_cond_wait (&handler->cond, &handler->lock);
+    }
+    g_mutex_unlock (&handler->lock);
+
+    if (handler->close) {
+        handler->close_result = lm_connection_close (connection, NULL);
+    }
+
+    g_atomic_int_inc (&handler->done);
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static void
+handler_init (Handler *handler)
+{
+    memset (handler, 0, sizeof (Handler));
+    g_mutex_init (&handler->lock);
+    g_cond_init (&handler->cond);
+}
+
+static void
+handler_clear (Handler *handler)
+{
+    g_mutex_clear (&handler->lock);
+    g_cond_clear (&handler->cond);
+}
+
+static void
+handler_release (Handler *handler)
+{
+    g_mutex_lock (&handler->lock);
+    handler->released = TRUE;
+    g_cond_broadcast (&handler->cond);
+    g_mutex_unlock (&handler->lock);
+}
+
+/* Keeps running the connection meanwhile */
+static void
+handler_wait (Handler *handler, gint *count, gint n)
+{
+    test_iterate_until (NULL, g_atomic_int_get (count) >= n);
+}
+
+static void
+register_handler (LmConnection *connection, Handler *handler)
+{
+    LmMessageHandler *message_handler;
+
+    message_handler = lm_message_handler_new ((LmHandleMessageFunction) handler_cb,
+                                              handler, NULL);
+    lm_connection_register_threaded_message_handler (connection,
+                                                     message_handler,
+                                                     LM_MESSAGE_TYPE_MESSAGE,
+                                                     LM_HANDLER_PRIORITY_NORMAL);
+    lm_message_handler_unref (message_handler);
+}
+
+static void
+test_close_blocked_handler ()
+{
+    TestServer   *server;
+    LmConnection *connection;
+    Handler       handler;
+    Disconnect    disconnect = { 0 };
+    gint64        start;
+
+    handler_init (&handler);
+
+    server = test_server_new ("127.0.0.1");
+    connection = connection_open (server, NULL);
+    lm_connection_set_disconnect_function (connection,
+                                           (LmDisconnectFunction) disconnect_cb,
+                                           &disconnect, NULL);
+    register_handler (connection, &handler);
+
+    test_server_send (server, "<message from='a@localhost'><body>1</body></message>"
+                      "<message from='a@localhost'><body>2</body></message>");
+    handler_wait (&handler, &handler.started, 1);
+
+    /* Returns while the handler is blocked, the second message still waits
+     * for it */
+    start = g_get_monotonic_time ();
+    g_assert (lm_connection_close (connection, NULL));
+    g_assert_cmpint (g_get_monotonic_time () - start, <, G_USEC_PER_SEC);
+
+    g_assert_cmpint (lm_connection_get_state (connection), ==,
+                     LM_CONNECTION_STATE_CLOSED);
+    g_assert_cmpint (disconnect.n_calls, ==, 1);
+    g_assert_cmpint (disconnect.reason, ==, LM_DISCONNECT_REASON_OK);
+    g_assert_cmpint (g_atomic_int_get (&handler.done), ==, 0);
+
+    test_iterate_until (NULL, test_server_is_closed (server));
+    g_assert (strstr (test_server_get_received (server)->str,
+                      "</stream:stream>") != NULL);
+
+    /* Both messages are still handled after the close */
+    handler_release (&handler);
+    handler_wait (&handler, &handler.done, 2);
+
+    lm_connection_unref (connection);
+    test_server_free (server);
+
+    /* Runs the idle dropping the last reference of the handler job */
+    while (g_main_context_iteration (NULL, FALSE));
+
+    handler_clear (&handler);
+}
+
+static void
+test_close_from_handler ()
+{
+    TestServer   *server;
+    LmConnection *connection;
+    Handler       handler;
+    Disconnect    disconnect = { 0 };
+
+    handler_init (&handler);
+    handler.released = TRUE;
+    handler.close = TRUE;
+
+    server = test_server_new ("127.0.0.1");
+    connection = connection_open (server, NULL);
+    lm_connection_set_disconnect_function (connection,
+                                           (LmDisconnectFunction) disconnect_cb,
+                                           &disconnect, NULL);
+    register_handler (connection, &handler);
+
+    test_server_send (server, "<message from='a@localhost'><body>1</body></message>");
+
+    handler_wait (&handler, &handler.done, 1);
+    g_assert (handler.close_result);
+
+    /* Closed by the thread running the connection */
+    test_iterate_until (NULL, g_atomic_int_get (&disconnect.n_calls) == 1);
+    g_assert_cmpint (disconnect.reason, ==, LM_DISCONNECT_REASON_OK);
+    g_assert (disconnect.thread == g_thread_self ());
+    g_assert_cmpint (lm_connection_get_state (connection), ==,
+                     LM_CONNECTION_STATE_CLOSED);
+
+    test_iterate_until (NULL, test_server_is_closed (server));
+    g_assert (strstr (test_server_get_received (server)->str,
+                      "</stream:stream>") != NULL);
+
+    lm_connection_unref (connection);
+    test_server_free (server);
+
+    while (g_main_context_iteration (NULL, FALSE));
+
+    handler_clear (&handler);
+}
+
+/* Fills the socket buffers, the rest has to wait in the output queue
+ * and go out in order once the server reads again */
+static void
+full_send_buffer (gboolean tls)
+{
+    TestServer   *server;
+    LmConnection *connection;
+    LmSSL        *ssl = NULL;
+    GString      *expected;
+    gint64        start;
+    guint         i;
+
+    server = test_server_new ("127.0.0.1");
+    test_server_set_receive_buffer (server, 4096);
+    if (tls) {
+        test_server_set_tls (server, TRUE);
+        ssl = ssl_new ();
+    }
+
+    connection = connection_open (server, ssl);
+    lm_connection_set_socket_buffer_sizes (connection, 4096, 0);
+    test_server_set_reading (server, FALSE);
+
+    expected = g_string_new (test_server_get_received (server)->str);
+
+    /* Stops once some of it stays queued, so that little is left */
+    start = g_get_monotonic_time ();
+    for (i = 0; TRUE; i++) {
+        gchar *str;
+
+        /* With io_uring everything is buffered until the send completes */
+        if (still_buffered (connection, 50)) {
+            break;
+        }
+
+        g_assert_cmpuint (i, <, 100000);
+
+        str = g_strdup_printf ("<message id='%u'><body>"
+                               "0123456789abcdef0123456789abcdef"
+                               "0123456789abcdef0123456789abcdef"
+                               "</body></message>", i);
+        g_assert (lm_connection_send_raw (connection, str, NULL));
+        g_assert (lm_connection_flush (connection, NULL));
+        g_string_append (expected, str);
+        g_free (str);
+    }
+
+    /* Never blocks on the full socket */
+    g_assert_cmpint (g_get_monotonic_time () - start, <, 5 * G_USEC_PER_SEC);
+
+    /* Each flush tries to write the keyed message along with what is left
+     * of the last one. Without TLS nothing of it is written and the next
+     * one replaces it, a blocked TLS write has to be retried with the same
+     * data so it can't be replaced any more. */
+    for (i = 0; i < 10; i++) {
+        LmMessage *m;
+        gchar     *id;
+        gchar     *str;
+
+        id = g_strdup_printf ("p%u", i);
+        m = lm_message_new (NULL, LM_MESSAGE_TYPE_PRESENCE);
+        lm_message_node_set_attribute (m->node, "id", id);
+        g_assert (lm_connection_send_with_key (connection, m, "presence",
+                                               NULL));
+        g_assert (lm_connection_flush (connection, NULL));
+
+        if (tls || i == 9) {
+            str = lm_message_node_to_string (m->node);
+            g_string_append (expected, str);
+            g_free (str);
+        }
+
+        lm_message_unref (m);
+        g_free (id);
+    }
+
+    /* Waits for the socket to become writable instead of retrying */
+    g_assert_cmpuint (count_dispatches (200), <, 20);
+    g_assert_cmpuint (lm_connection_get_send_buffered (connection), >, 0);
+
+    test_server_set_reading (server, TRUE);
+    test_iterate_until (NULL,
+                        test_server_get_received (server)->len >= expected->len);
+    g_assert_cmpstr (test_server_get_received (server)->str, ==,
+                     expected->str);
+    g_assert_cmpuint (lm_connection_get_send_buffered (connection), ==, 0);
+    g_assert (lm_connection_is_open (connection));
+
+    lm_connection_close (connection, NULL);
+    lm_connection_unref (connection);
+    if (ssl) {
+        lm_ssl_unref (ssl);
+    }
+    test_server_free (server);
+    g_string_free (expected, TRUE);
+}
+
+static void
+test_full_send_buffer ()
+{
+    full_send_buffer (FALSE);
+}
+
+static void
+test_full_send_buffer_tls ()
+{
+    /* A write the TLS library didn't take has to be retried with the
+     * same data */
+    full_send_buffer (TRUE);
+}
+
+/* Closing right after sending more than goes out in one go still writes
+ * all of it and the end of the stream, in order */
+static void
+test_close_sends_queued ()
+{
+    TestServer   *server;
+    LmConnection *connection;
+    GString      *expected;
+    guint         i;
+
+    server = test_server_new ("127.0.0.1");
+    connection = connection_open (server, NULL);
+
+    expected = g_string_new (test_server_get_received (server)->str);
+
+    for (i = 0; i < 100; i++) {
+        gchar *str;
+
+        str = g_strdup_printf ("<message id='%u'/>", i);
+        g_assert (lm_connection_send_raw (connection, str, NULL));
+        g_string_append (expected, str);
+        g_free (str);
+    }
+    g_string_append (expected, "</stream:stream>");
+
+    g_assert (lm_connection_close (connection, NULL));
+
+    test_iterate_until (NULL, test_server_is_closed (server));
+    g_assert_cmpstr (test_server_get_received (server)->str, ==,
+                     expected->str);
+
+    lm_connection_unref (connection);
+    test_server_free (server);
+    g_string_free (expected, TRUE);
+}
+
+static void
+open_failed_cb (LmConnection *connection, gboolean success, gint *result)
+{
+    *result = success;
+}
+
+/* A server that never answers the hello fails the connection once the
+ * handshake timeout passes, without the socket being polled meanwhile */
+static void
+test_tls_handshake_timeout ()
+{
+    TestServer   *server;
+    LmConnection *connection;
+    LmSSL        *ssl;
+    gint          result = -1;
+    gint64        start;
+    gint64        elapsed;
+    guint         n_dispatches = 0;
+
+    server = test_server_new ("127.0.0.1");
+    test_server_set_tls (server, TRUE);
+    test_server_set_reading (server, FALSE);
+
+    ssl = ssl_new ();
+    lm_ssl_set_handshake_timeout (ssl, 300);
+
+    connection = lm_connection_new ("127.0.0.1");
+    lm_connection_set_port (connection, test_server_get_port (server));
+    lm_connection_set_ssl (connection, ssl);
+
+    start = g_get_monotonic_time ();
+    g_assert (lm_connection_open (connection,
+                                  (LmResultFunction) open_failed_cb, &result,
+                                  NULL, NULL));
+    while (result == -1) {
+        g_assert (g_get_monotonic_time () - start < 10 * G_USEC_PER_SEC);
+        n_dispatches += count_dispatches (10);
+    }
+    elapsed = g_get_monotonic_time () - start;
+
+    g_assert (!result);
+    g_assert_cmpint (elapsed, >=, 300 * 1000);
+    g_assert_cmpint (elapsed, <, 5 * G_USEC_PER_SEC);
+    g_assert_cmpuint (n_dispatches, <, 20);
+    g_assert_cmpuint (test_server_get_n_accepted (server), ==, 1);
+
+    lm_connection_unref (connection);
+    lm_ssl_unref (ssl);
+    test_server_free (server);
+}
+
+static LmSSLResponse
+ssl_stop_cb (LmSSL *ssl, LmSSLStatus status, gpointer user_data)
+{
+    return LM_SSL_RESPONSE_STOP;
+}
+
+static void
+connection_close (LmConnection *connection, TestServer *server)
+{
+    lm_connection_close (connection, NULL);
+    lm_connection_unref (connection);
+    test_iterate_until (NULL, test_server_is_closed (server));
+}
+
+/* Connecting again resumes the session of the first connection, unless
+ * the certificate was rejected in between */
+static void
+test_tls_resumption ()
+{
+    TestServer   *server;
+    LmConnection *connection;
+    LmSSL        *ssl;
+    LmSSL        *rejecting;
+    gint          result = -1;
+
+    server = test_server_new ("127.0.0.1");
+    test_server_set_tls (server, TRUE);
+
+    ssl = ssl_new ();
+
+    connection = connection_open (server, ssl);
+    connection_close (connection, server);
+    g_assert_cmpuint (lm_ssl_get_resumption_hits (ssl), ==, 0);
+    g_assert_cmpuint (lm_ssl_get_resumption_misses (ssl), ==, 1);
+
+    connection = connection_open (server, ssl);
+    connection_close (connection, server);
+    g_assert_cmpuint (lm_ssl_get_resumption_hits (ssl), ==, 1);
+    g_assert_cmpuint (lm_ssl_get_resumption_misses (ssl), ==, 1);
+
+    /* Shares the session cache, but doesn't accept the certificate */
+    rejecting = lm_ssl_new (NULL, ssl_stop_cb, NULL, NULL);
+    lm_ssl_use_starttls (rejecting, FALSE, FALSE);
+
+    connection = lm_connection_new ("127.0.0.1");
+    lm_connection_set_port (connection, test_server_get_port (server));
+    lm_connection_set_ssl (connection, rejecting);
+    g_assert (lm_connection_open (connection,
+                                  (LmResultFunction) open_failed_cb, &result,
+                                  NULL, NULL));
+    test_iterate_until (NULL, result != -1);
+    g_assert (!result);
+    g_assert_cmpuint (lm_ssl_get_resumption_hits (rejecting), ==, 1);
+    lm_connection_unref (connection);
+
+    /* The session was dropped with the rejected certificate */
+    connection = connection_open (server, ssl);
+    connection_close (connection, server);
+    g_assert_cmpuint (lm_ssl_get_resumption_hits (ssl), ==, 1);
+    g_assert_cmpuint (lm_ssl_get_resumption_misses (ssl), ==, 2);
+
+    connection = connection_open (server, ssl);
+    connection_close (connection, server);
+    g_assert_cmpuint (lm_ssl_get_resumption_hits (ssl), ==, 2);
+    g_assert_cmpuint (lm_ssl_get_resumption_misses (ssl), ==, 2);
+
+    lm_ssl_unref (rejecting);
+    lm_ssl_unref (ssl);
+    test_server_free (server);
+}
+
+typedef struct {
+    LmConnection *connection;
+    GString      *expected;
+    gboolean      done;
+} Coalesce;
+
+static gboolean
+coalesce_send_cb (Coalesce *coalesce)
+{
+    gsize total = 0;
+    guint i;
+
+    for (i = 0; i < 10; i++) {
+        gchar *str;
+
+        str = g_strdup_printf ("<message id='%u'/>", i);
+        g_assert (lm_connection_send_raw (coalesce->connection, str, NULL));
+        g_string_append (coalesce->expected, str);
+        total += strlen (str);
+        g_free (str);
+
+        /* Nothing is written from the callback */
+        g_assert_cmpuint (lm_connection_get_send_buffered (coalesce->connection),
+                          ==, total);
+    }
+
+    coalesce->done = TRUE;
+
+    return FALSE;
+}
+
+#ifdef __linux__
+static guint
+data_segments_out (gint fd)
+{
+    struct tcp_info info;
+    socklen_t       len = sizeof (info);
+
+    memset (&info, 0, sizeof (info));
+    g_assert (getsockopt (fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0);
+
+    return info.tcpi_data_segs_out;
+}
+#endif
+
+/* Everything sent during one dispatch goes out in a single write once the
+ * main loop gets back to the connection */
+static void
+test_coalesce_writes ()
+{
+    TestServer   *server;
+    LmConnection *connection;
+    Coalesce      coalesce;
+    gint          fd;
+#ifdef __linux__
+    guint         segments;
+#endif
+
+    server = test_server_new ("127.0.0.1");
+    connection = connection_open (server, NULL);
+
+    /* Each write would be a segment of its own */
+    lm_connection_set_tcp_nodelay (connection, TRUE);
+    lm_connection_set_coalesce_writes (connection, TRUE);
+
+    fd = test_server_get_client_fd (server);
+    g_assert_cmpint (fd, >=, 0);
+
+    coalesce.connection = connection;
+    coalesce.expected = g_string_new (test_server_get_received (server)->str);
+    coalesce.done = FALSE;
+
+#ifdef __linux__
+    segments = data_segments_out (fd);
+#endif
+
+    g_idle_add ((GSourceFunc) coalesce_send_cb, &coalesce);
+    test_iterate_until (NULL, coalesce.done);
+    test_iterate_until (NULL, test_server_get_received (server)->len >=
+                        coalesce.expected->len);
+    g_assert_cmpstr (test_server_get_received (server)->str, ==,
+                     coalesce.expected->str);
+    g_assert_cmpuint (lm_connection_get_send_buffered (connection), ==, 0);
+
+#ifdef __linux__
+    g_assert_cmpuint (data_segments_out (fd) - segments, ==, 1);
+#endif
+
+    connection_close (connection, server);
+    test_server_free (server);
+    g_string_free (coalesce.expected, TRUE);
+}
+
+/* Flushing writes the coalesced data right away */
+static void
+test_flush ()
+{
+    TestServer   *server;
+    LmConnection *connection;
+    GString      *expected;
+    guint         i;
+
+    server = test_server_new ("127.0.0.1");
+    connection = connection_open (server, NULL);
+    lm_connection_set_coalesce_writes (connection, TRUE);
+
+    expected = g_string_new (test_server_get_received (server)->str);
+
+    for (i = 0; i < 10; i++) {
+        gchar *str;
+
+        str = g_strdup_printf ("<message id='%u'/>", i);
+        g_assert (lm_connection_send_raw (connection, str, NULL));
+        g_string_append (expected, str);
+        g_free (str);
+    }
+
+    g_assert_cmpuint (lm_connection_get_send_buffered (connection), >, 0);
+    g_assert (lm_connection_flush (connection, NULL));
+    g_assert_cmpuint (lm_connection_get_send_buffered (connection), ==, 0);
+
+    test_iterate_until (NULL,
+                        test_server_get_received (server)->len >= expected->len);
+    g_assert_cmpstr (test_server_get_received (server)->str, ==,
+                     expected->str);
+
+    connection_close (connection, server);
+    test_server_free (server);
+    g_string_free (expected, TRUE);
+}
+
+static void
+assert_socket_options (gint     fd,
+                       gboolean nodelay,
+                       gint     send_size,
+                       gint     receive_size)
+{
+    gint      value;
+    socklen_t len;
+
+    len = sizeof (value);
+    g_assert (getsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &value, &len) == 0);
+    g_assert_cmpint (value != 0, ==, nodelay);
+
+    /* Linux reports twice the size that was set */
+    len = sizeof (value);
+    g_assert (getsockopt (fd, SOL_SOCKET, SO_SNDBUF, &value, &len) == 0);
+    g_assert_cmpint (value, >=, send_size);
+    g_assert_cmpint (value, <=, 2 * send_size);
+
+    len = sizeof (value);
+    g_assert (getsockopt (fd, SOL_SOCKET, SO_RCVBUF, &value, &len) == 0);
+    g_assert_cmpint (value, >=, receive_size);
+    g_assert_cmpint (value, <=, 2 * receive_size);
+}
+
+/* The socket options are applied when connecting and on an open
+ * connection. The sizes are below the defaults so they show. */
+static void
+test_socket_options ()
+{
+    TestServer   *server;
+    LmConnection *connection;
+    gboolean      opened = FALSE;
+    gint          fd;
+
+    server = test_server_new ("127.0.0.1");
+
+    connection = lm_connection_new ("127.0.0.1");
+    lm_connection_set_port (connection, test_server_get_port (server));
+    lm_connection_set_tcp_nodelay (connection, TRUE);
+    lm_connection_set_socket_buffer_sizes (connection, 8192, 16384);
+    g_assert (lm_connection_open (connection,
+                                  (LmResultFunction) open_cb, &opened,
+                                  NULL, NULL));
+    test_iterate_until (NULL, opened);
+
+    fd = test_server_get_client_fd (server);
+    g_assert_cmpint (fd, >=, 0);
+    assert_socket_options (fd, TRUE, 8192, 16384);
+
+    lm_connection_set_tcp_nodelay (connection, FALSE);
+    lm_connection_set_socket_buffer_sizes (connection, 32768, 4096);
+    assert_socket_options (fd, FALSE, 32768, 4096);
+
+    connection_close (connection, server);
+    test_server_free (server);
+}
+
+/* The family localhost resolves to first, 0 unless it resolves to both
+ * loopback addresses */
+static gint
+localhost_first_family (void)
+{
+    struct addrinfo  hints;
+    struct addrinfo *results;
+    struct addrinfo *ai;
+    gboolean         ipv4 = FALSE;
+    gboolean         ipv6 = FALSE;
+    gint             family;
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo ("localhost", NULL, &hints, &results) != 0) {
+        return 0;
+    }
+
+    for (ai = results; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET) {
+            ipv4 = TRUE;
+        } else if (ai->ai_family == AF_INET6) {
+            ipv6 = TRUE;
+        }
+    }
+    family = results->ai_family;
+    freeaddrinfo (results);
+
+    return ipv4 && ipv6 ? family : 0;
+}
+
+static const gchar *
+loopback_address (gint family)
+{
+    return family == AF_INET6 ? "::1" : "127.0.0.1";
+}
+
+static gint
+other_family (gint family)
+{
+    return family == AF_INET6 ? AF_INET : AF_INET6;
+}
+
+/* A socket bound to the loopback address of @family at @port */
+static gint
+loopback_bind (gint family, guint port)
+{
+    struct sockaddr_storage addr;
+    socklen_t               len;
+    gint                    one = 1;
+    gint                    fd;
+
+    memset (&addr, 0, sizeof (addr));
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) &addr;
+
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_loopback;
+        addr6->sin6_port = htons (port);
+        len = sizeof (struct sockaddr_in6);
+    } else {
+        struct sockaddr_in *addr4 = (struct sockaddr_in *) &addr;
+
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+        addr4->sin_port = htons (port);
+        len = sizeof (struct sockaddr_in);
+    }
+
+    fd = socket (family, SOCK_STREAM, 0);
+    g_assert_cmpint (fd, >=, 0);
+    if (family == AF_INET6) {
+        setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof (one));
+    }
+    g_assert (bind (fd, (struct sockaddr *) &addr, len) == 0);
+
+    return fd;
+}
+
+/* Listens at @port with a full backlog, so that further connects to it
+ * get no answer at all. Returns the sockets to close afterwards. */
+static GSList *
+blackhole_new (gint family, guint port)
+{
+    struct sockaddr_storage addr;
+    socklen_t               len = sizeof (addr);
+    GSList                 *fds = NULL;
+    gint                    fd;
+    guint                   i;
+
+    fd = loopback_bind (family, port);
+    g_assert (listen (fd, 0) == 0);
+    g_assert (getsockname (fd, (struct sockaddr *) &addr, &len) == 0);
+    fds = g_slist_prepend (fds, GINT_TO_POINTER (fd));
+
+    for (i = 0; i < 16; i++) {
+        struct pollfd pfd;
+
+        fd = socket (family, SOCK_STREAM, 0);
+        fcntl (fd, F_SETFL, O_NONBLOCK);
+        fds = g_slist_prepend (fds, GINT_TO_POINTER (fd));
+
+        if (connect (fd, (struct sockaddr *) &addr, len) == 0) {
+            continue;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        if (poll (&pfd, 1, 200) == 0) {
+            return fds;
+        }
+    }
+
+    g_assert_not_reached ();
+    return NULL;
+}
+
+static void
+blackhole_free (GSList *fds)
+{
+    GSList *l;
+
+    for (l = fds; l; l = l->next) {
+        close (GPOINTER_TO_INT (l->data));
+    }
+    g_slist_free (fds);
+}
+
+/* Counts the sockets of @family this process has open, leaving out @fds */
+static guint
+count_sockets (gint family, GSList *fds)
+{
+    guint n = 0;
+    gint  fd;
+
+    for (fd = 0; fd < 1024; fd++) {
+        struct sockaddr_storage addr;
+        socklen_t               len = sizeof (addr);
+
+        if (g_slist_find (fds, GINT_TO_POINTER (fd))) {
+            continue;
+        }
+
+        if (getsockname (fd, (struct sockaddr *) &addr, &len) == 0 &&
+            addr.ss_family == family) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/* Connects to localhost, returns how long it took */
+static gint64
+connection_open_localhost (TestServer *server, LmConnection **connection)
+{
+    gboolean opened = FALSE;
+    gint64   start;
+
+    *connection = lm_connection_new ("localhost");
+    lm_connection_set_port (*connection, test_server_get_port (server));
+
+    start = g_get_monotonic_time ();
+    g_assert (lm_connection_open (*connection,
+                                  (LmResultFunction) open_cb, &opened,
+                                  NULL, NULL));
+    test_iterate_until (NULL, opened);
+
+    return g_get_monotonic_time () - start;
+}
+
+/* An address that doesn't answer doesn't hold up the next one for longer
+ * than the attempt delay, and the attempt on it is given up once the next
+ * one connects */
+static void
+test_racing_blackhole ()
+{
+    TestServer   *server;
+    LmConnection *connection;
+    GSList       *blackhole;
+    gint          family = localhost_first_family ();
+    gint64        elapsed;
+
+    server = test_server_new (loopback_address (other_family (family)));
+    blackhole = blackhole_new (family, test_server_get_port (server));
+    g_assert_cmpuint (count_sockets (family, blackhole), ==, 0);
+
+    elapsed = connection_open_localhost (server, &connection);
+    g_assert_cmpint (elapsed, >=, 250 * 1000);
+    g_assert_cmpint (elapsed, <, 750 * 1000);
+    g_assert (test_server_is_open (server));
+
+    g_assert_cmpuint (count_sockets (family, blackhole), ==, 0);
+
+    connection_close (connection, server);
+    blackhole_free (blackhole);
+    test_server_free (server);
+}
+
+/* A refused address moves on to the next one right away */
+static void
+test_racing_refused ()
+{
+    TestServer   *server;
+    LmConnection *connection;
+    gint          family = localhost_first_family ();
+    gint          fd;
+    gint64        elapsed;
+
+    server = test_server_new (loopback_address (other_family (family)));
+    fd = loopback_bind (family, test_server_get_port (server));
+
+    elapsed = connection_open_localhost (server, &connection);
+    g_assert_cmpint (elapsed, <, 200 * 1000);
+
+    connection_close (connection, server);
+    close (fd);
+    test_server_free (server);
+}
+
+/* IPv6 results are used, whichever family comes first */
+static void
+test_racing_ipv6 ()
+{
+    TestServer              *server;
+    LmConnection            *connection;
+    struct sockaddr_storage  addr;
+    socklen_t                len = sizeof (addr);
+    gint                     fd;
+
+    server = test_server_new ("::1");
+    fd = loopback_bind (AF_INET, test_server_get_port (server));
+
+    connection_open_localhost (server, &connection);
+    g_assert (getsockname (test_server_get_client_fd (server),
+                           (struct sockaddr *) &addr, &len) == 0);
+    g_assert_cmpint (addr.ss_family, ==, AF_INET6);
+
+    connection_close (connection, server);
+    close (fd);
+    test_server_free (server);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/connection/close_blocked_handler",
+                     test_close_blocked_handler);
+    g_test_add_func ("/connection/close_from_handler",
+                     test_close_from_handler);
+    g_test_add_func ("/connection/full_send_buffer", test_full_send_buffer);
+    if (test_server_supports_tls ()) {
+        g_test_add_func ("/connection/full_send_buffer_tls",
+                         test_full_send_buffer_tls);
+        g_test_add_func ("/connection/tls_handshake_timeout",
+                         test_tls_handshake_timeout);
+        g_test_add_func ("/connection/tls_resumption", test_tls_resumption);
+    }
+    g_test_add_func ("/connection/close_sends_queued",
+                     test_close_sends_queued);
+    g_test_add_func ("/connection/coalesce_writes", test_coalesce_writes);
+    g_test_add_func ("/connection/flush", test_flush);
+    g_test_add_func ("/connection/socket_options", test_socket_options);
+    /* Needs localhost to resolve to both loopback addresses */
+    if (localhost_first_family ()) {
+        g_test_add_func ("/connection/racing_blackhole",
+                         test_racing_blackhole);
+        g_test_add_func ("/connection/racing_refused", test_racing_refused);
+        g_test_add_func ("/connection/racing_ipv6", test_racing_ipv6);
+    }
+
+    return g_test_run ();
+}
@@ -0,0 +1,231 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/lm-handler-pool.h"
+
+#define N_KEYS 8
+#define N_JOBS 500
+
+typedef struct {
+    guint key;
+    guint seq;
+} Job;
+
+typedef struct {
+    GMutex lock;
+    GCond  cond;
+    guint  next_seq[N_KEYS];
+    gint   running[N_KEYS];
+    guint  done;
+} State;
+
+typedef struct {
+    GMutex         lock;
+    GCond          cond;
+    gboolean       released;
+    guint          started;
+    guint          done;
+    LmHandlerPool *pool;
+} Blocker;
+
+static void
+run_job (Job *job, State *state)
+{
+    g_assert_cmpint (g_atomic_int_add (&state->running[job->key], 1), ==, 0);
+
+    g_mutex_lock (&state->lock);
+    g_assert_cmpuint (job->seq, ==, state->next_seq[job->key]);
+    state->next_seq[job->key]++;
+    state->done++;
+    g_cond_signal (&state->cond);
+    g_mutex_unlock (&state->lock);
+
+    if (job->seq % 100 == 0) {
+        g_usleep (1000);
+    }
+
+    g_atomic_int_add (&state->running[job->key], -1);
+
+    g_free (job);
+}
+
+/* Waits until the test releases it */
+static void
+blocking_job (gpointer job, Blocker *blocker)
+{
+    g_mutex_lock (&blocker->lock);
+    blocker->started++;
+    g_cond_broadcast (&blocker->cond);
+    while (!blocker->released) {
+        g_cond_wait (&blocker->cond, &blocker->lock);
+    }
+    blocker->done++;
+    g_cond_broadcast (&blocker->cond);
+    g_mutex_unlock (&blocker->lock);
+}
+
+/* Frees the pool it runs on */
+static void
+freeing_job (gpointer job, Blocker *blocker)
+{
+    g_mutex_lock (&blocker->lock);
+    if (blocker->pool) {
+        lm_handler_pool_free (blocker->pool);
+        blocker->pool = NULL;
+    }
+    blocker->done++;
+    g_cond_broadcast (&blocker->cond);
+    g_mutex_unlock (&blocker->lock);
+}
+
+static void
+blocker_wait (Blocker *blocker, guint *count, guint n)
+{
+    g_mutex_lock (&blocker->lock);
+    while (*count < n) {
+        g_cond_wait (&blocker->cond, &blocker->lock);
+    }
+    g_mutex_unlock (&blocker->lock);
+}
+
+static void
+test_key_order ()
+{
+    LmHandlerPool *pool;
+    State          state = { { 0 } };
+    guint          i, j;
+
+    g_mutex_init (&state.lock);
+    g_cond_init (&state.cond);
+
+    pool = lm_handler_pool_new (4, (LmHandlerPoolFunc) run_job, &state);
+
+    for (i = 0; i < N_JOBS; i++) {
+        for (j = 0; j < N_KEYS; j++) {
+            Job   *job = g_new (Job, 1);
+            gchar  key[16];
+
+            job->key = j;
+            job->seq = i;
+
+            g_snprintf (key, sizeof (key), "user%u@example.com", j);
+            lm_handler_pool_push (pool, key, job);
+        }
+    }
+
+    /* Doesn't wait, the jobs already pushed still run */
+    lm_handler_pool_free (pool);
+
+    g_mutex_lock (&state.lock);
+    while (state.done < N_JOBS * N_KEYS) {
+        g_cond_wait (&state.cond, &state.lock);
+    }
+    g_mutex_unlock (&state.lock);
+
+    for (j = 0; j < N_KEYS; j++) {
+        g_assert_cmpuint (state.next_seq[j], ==, N_JOBS);
+    }
+
+    /* Lets the last job leave run_job() */
+    for (j = 0; j < N_KEYS; j++) {
+        while (g_atomic_int_get (&state.running[j]) != 0) {
+            g_usleep (1000);
+        }
+    }
+
+    g_mutex_clear (&state.lock);
+    g_cond_clear (&state.cond);
+}
+
+static void
+test_free_while_blocked ()
+{
+    LmHandlerPool *pool;
+    Blocker        blocker = { { 0 } };
+    gint64         start;
+
+    g_mutex_init (&blocker.lock);
+    g_cond_init (&blocker.cond);
+
+    pool = lm_handler_pool_new (2, (LmHandlerPoolFunc) blocking_job,
+                                &blocker);
+
+    lm_handler_pool_push (pool, "a@example.com", GINT_TO_POINTER (1));
+    lm_handler_pool_push (pool, "a@example.com", GINT_TO_POINTER (2));
+    lm_handler_pool_push (pool, "b@example.com", GINT_TO_POINTER (3));
+    blocker_wait (&blocker, &blocker.started, 2);
+
+    /* Returns while both threads are blocked */
+    start = g_get_monotonic_time ();
+    lm_handler_pool_free (pool);
+    g_assert_cmpint (g_get_monotonic_time () - start, <, G_USEC_PER_SEC);
+
+    g_mutex_lock (&blocker.lock);
+    g_assert_cmpuint (blocker.done, ==, 0);
+    blocker.released = TRUE;
+    g_cond_broadcast (&blocker.cond);
+    g_mutex_unlock (&blocker.lock);
+
+    /* The job queued behind the blocked one runs as well */
+    blocker_wait (&blocker, &blocker.done, 3);
+    g_assert_cmpuint (blocker.started, ==, 3);
+
+    g_mutex_clear (&blocker.lock);
+    g_cond_clear (&blocker.cond);
+}
+
+static void
+test_free_from_job ()
+{
+    Blocker blocker = { { 0 } };
+
+    g_mutex_init (&blocker.lock);
+    g_cond_init (&blocker.cond);
+
+    blocker.pool = lm_handler_pool_new (1, (LmHandlerPoolFunc) freeing_job,
+                                        &blocker);
+
+    g_mutex_lock (&blocker.lock);
+    lm_handler_pool_push (blocker.pool, "a@example.com", GINT_TO_POINTER (1));
+    lm_handler_pool_push (blocker.pool, "a@example.com", GINT_TO_POINTER (2));
+    g_mutex_unlock (&blocker.lock);
+
+    /* Both run, the pool is freed by the first one */
+    blocker_wait (&blocker, &blocker.done, 2);
+    g_assert (blocker.pool == NULL);
+
+    g_mutex_clear (&blocker.lock);
+    g_cond_clear (&blocker.cond);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/handler_pool/key_order", test_key_order);
+    g_test_add_func ("/handler_pool/free_while_blocked",
+                     test_free_while_blocked);
+    g_test_add_func ("/handler_pool/free_from_job", test_free_from_job);
+
+    return g_test_run ();
+}
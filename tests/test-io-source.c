@@ -0,0 +1,363 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include "loudmouth/lm-io-source.h"
+
+#define BENCH_SECONDS 1.0
+
+typedef struct {
+    int         fds[2];
+    GIOChannel *channel;
+    guint       dispatched;
+} SocketPair;
+
+static SocketPair *
+socket_pairs_new (guint n)
+{
+    SocketPair *pairs;
+    guint       i;
+
+    pairs = g_new0 (SocketPair, n);
+
+    for (i = 0; i < n; i++) {
+        g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, pairs[i].fds) == 0);
+        pairs[i].channel = g_io_channel_unix_new (pairs[i].fds[0]);
+    }
+
+    return pairs;
+}
+
+static void
+socket_pairs_free (SocketPair *pairs, guint n)
+{
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        g_io_channel_unref (pairs[i].channel);
+        close (pairs[i].fds[0]);
+        close (pairs[i].fds[1]);
+    }
+
+    g_free (pairs);
+}
+
+static void
+socket_pair_read (SocketPair *pair)
+{
+    gchar buf[16];
+
+    g_assert (read (pair->fds[0], buf, sizeof (buf)) > 0);
+    pair->dispatched++;
+}
+
+static gboolean
+io_source_cb (LmIOSource *source, GIOCondition condition, SocketPair *pair)
+{
+    if (condition & G_IO_IN) {
+        socket_pair_read (pair);
+    }
+
+    if (condition & G_IO_OUT) {
+        lm_io_source_set_condition (source, G_IO_IN);
+        pair->dispatched++;
+    }
+
+    return TRUE;
+}
+
+/* Edge triggered, reads everything until the socket would block */
+static gboolean
+reactor_cb (LmIOSource *source, GIOCondition condition, SocketPair *pair)
+{
+    gchar buf[16];
+
+    if (condition & G_IO_IN) {
+        while (recv (pair->fds[0], buf, sizeof (buf), MSG_DONTWAIT) > 0) {
+            ;
+        }
+    }
+
+    pair->dispatched++;
+
+    return TRUE;
+}
+
+static gboolean
+watch_in_cb (GIOChannel *channel, GIOCondition condition, SocketPair *pair)
+{
+    socket_pair_read (pair);
+
+    return TRUE;
+}
+
+static gboolean
+watch_err_cb (GIOChannel *channel, GIOCondition condition, SocketPair *pair)
+{
+    g_assert_not_reached ();
+
+    return TRUE;
+}
+
+static void
+test_condition ()
+{
+    GMainContext *context;
+    SocketPair   *pair;
+    LmIOSource   *source;
+
+    context = g_main_context_new ();
+    pair = socket_pairs_new (1);
+
+    source = lm_io_source_new (context, pair->channel, G_IO_IN,
+                               (LmIOSourceFunc) io_source_cb, pair);
+
+    /* Nothing to read */
+    g_assert (!g_main_context_iteration (context, FALSE));
+    g_assert_cmpuint (pair->dispatched, ==, 0);
+
+    g_assert (write (pair->fds[1], "x", 1) == 1);
+    g_assert (g_main_context_iteration (context, FALSE));
+    g_assert_cmpuint (pair->dispatched, ==, 1);
+
+    /* The socket is writable right away, the callback switches back */
+    lm_io_source_set_condition (source, G_IO_IN | G_IO_OUT);
+    g_assert_cmpuint (lm_io_source_get_condition (source), ==,
+                      G_IO_IN | G_IO_OUT);
+    g_assert (g_main_context_iteration (context, FALSE));
+    g_assert_cmpuint (pair->dispatched, ==, 2);
+    g_assert_cmpuint (lm_io_source_get_condition (source), ==, G_IO_IN);
+    g_assert (!g_main_context_iteration (context, FALSE));
+
+    lm_io_source_destroy (source);
+    socket_pairs_free (pair, 1);
+    g_main_context_unref (context);
+}
+
+static void
+test_reactor ()
+{
+    GMainContext *context;
+    LmReactor    *reactor;
+    SocketPair   *pairs;
+    LmIOSource   *sources[2];
+
+    if (!lm_reactor_is_supported ()) {
+        return;
+    }
+
+    context = g_main_context_new ();
+    reactor = lm_reactor_new (context);
+    pairs = socket_pairs_new (2);
+
+    sources[0] = lm_io_source_new_with_reactor (reactor, pairs[0].channel,
+                                                G_IO_IN,
+                                                (LmIOSourceFunc) reactor_cb,
+                                                &pairs[0]);
+    sources[1] = lm_io_source_new_with_reactor (reactor, pairs[1].channel,
+                                                G_IO_IN,
+                                                (LmIOSourceFunc) reactor_cb,
+                                                &pairs[1]);
+    g_assert (lm_io_source_is_edge_triggered (sources[0]));
+
+    g_assert (!g_main_context_iteration (context, FALSE));
+
+    /* Only the ready socket is dispatched */
+    g_assert (write (pairs[1].fds[1], "xyz", 3) == 3);
+    g_assert (g_main_context_iteration (context, FALSE));
+    g_assert_cmpuint (pairs[0].dispatched, ==, 0);
+    g_assert_cmpuint (pairs[1].dispatched, ==, 1);
+    g_assert (!g_main_context_iteration (context, FALSE));
+
+    /* Dispatched again without a new event */
+    lm_io_source_mark_ready (sources[0], G_IO_IN);
+    g_assert (g_main_context_iteration (context, FALSE));
+    g_assert_cmpuint (pairs[0].dispatched, ==, 1);
+
+    /* Asking for G_IO_OUT on a writable socket fires right away */
+    lm_io_source_set_condition (sources[0], G_IO_IN | G_IO_OUT);
+    g_assert (g_main_context_iteration (context, FALSE));
+    g_assert_cmpuint (pairs[0].dispatched, ==, 2);
+    g_assert (!g_main_context_iteration (context, FALSE));
+
+    lm_io_source_destroy (sources[0]);
+    lm_io_source_destroy (sources[1]);
+    lm_reactor_unref (reactor);
+    socket_pairs_free (pairs, 2);
+    g_main_context_unref (context);
+}
+
+/* Runs the main loop for a while with @n_idle connections that never see
+ * any data and @n_active connections that get a byte in each iteration,
+ * returns the number of iterations per second. */
+static gdouble
+bench_iterations (GMainContext *context,
+                  SocketPair   *pairs,
+                  guint         n_idle,
+                  guint         n_active)
+{
+    GTimer *timer;
+    guint   iterations = 0;
+    guint   i;
+
+    timer = g_timer_new ();
+
+    while (g_timer_elapsed (timer, NULL) < BENCH_SECONDS) {
+        for (i = n_idle; i < n_idle + n_active; i++) {
+            g_assert (write (pairs[i].fds[1], "x", 1) == 1);
+        }
+
+        g_main_context_iteration (context, FALSE);
+        iterations++;
+    }
+
+    g_timer_stop (timer);
+
+    return iterations / g_timer_elapsed (timer, NULL);
+}
+
+static void
+bench_connections (guint n_idle, guint n_active)
+{
+    GMainContext *context;
+    SocketPair   *pairs;
+    GSource     **sources;
+    LmIOSource  **io_sources;
+    guint         n = n_idle + n_active;
+    guint         i;
+    gdouble       rate;
+
+    pairs = socket_pairs_new (n);
+    sources = g_new0 (GSource *, 3 * n);
+    io_sources = g_new0 (LmIOSource *, n);
+
+    /* One LmIOSource per connection */
+    context = g_main_context_new ();
+    for (i = 0; i < n; i++) {
+        io_sources[i] = lm_io_source_new (context, pairs[i].channel,
+                                          G_IO_IN,
+                                          (LmIOSourceFunc) io_source_cb,
+                                          &pairs[i]);
+    }
+
+    rate = bench_iterations (context, pairs, n_idle, n_active);
+    g_test_message ("%u idle, %u active, one source: %.0f iterations/s",
+                    n_idle, n_active, rate);
+    g_test_maximized_result (rate, "%u idle, %u active: %.0f iterations/s",
+                             n_idle, n_active, rate);
+
+    for (i = 0; i < n; i++) {
+        lm_io_source_destroy (io_sources[i]);
+    }
+    g_main_context_unref (context);
+
+    /* Separate in, error and hangup watches as used before */
+    context = g_main_context_new ();
+    for (i = 0; i < n; i++) {
+        sources[3 * i] = g_io_create_watch (pairs[i].channel, G_IO_IN);
+        sources[3 * i + 1] = g_io_create_watch (pairs[i].channel, G_IO_ERR);
+        sources[3 * i + 2] = g_io_create_watch (pairs[i].channel, G_IO_HUP);
+
+        g_source_set_callback (sources[3 * i], (GSourceFunc) watch_in_cb,
+                               &pairs[i], NULL);
+        g_source_set_callback (sources[3 * i + 1], (GSourceFunc) watch_err_cb,
+                               &pairs[i], NULL);
+        g_source_set_callback (sources[3 * i + 2], (GSourceFunc) watch_err_cb,
+                               &pairs[i], NULL);
+
+        g_source_attach (sources[3 * i], context);
+        g_source_attach (sources[3 * i + 1], context);
+        g_source_attach (sources[3 * i + 2], context);
+    }
+
+    rate = bench_iterations (context, pairs, n_idle, n_active);
+    g_test_message ("%u idle, %u active, three watches: %.0f iterations/s",
+                    n_idle, n_active, rate);
+
+    for (i = 0; i < 3 * n; i++) {
+        g_source_destroy (sources[i]);
+        g_source_unref (sources[i]);
+    }
+    g_main_context_unref (context);
+
+    /* All connections on one reactor */
+    if (lm_reactor_is_supported ()) {
+        LmReactor *reactor;
+
+        context = g_main_context_new ();
+        reactor = lm_reactor_new (context);
+        for (i = 0; i < n; i++) {
+            io_sources[i] =
+                lm_io_source_new_with_reactor (reactor, pairs[i].channel,
+                                               G_IO_IN,
+                                               (LmIOSourceFunc) reactor_cb,
+                                               &pairs[i]);
+        }
+
+        rate = bench_iterations (context, pairs, n_idle, n_active);
+        g_test_message ("%u idle, %u active, reactor: %.0f iterations/s",
+                        n_idle, n_active, rate);
+
+        for (i = 0; i < n; i++) {
+            lm_io_source_destroy (io_sources[i]);
+        }
+        lm_reactor_unref (reactor);
+        g_main_context_unref (context);
+    }
+
+    g_free (sources);
+    g_free (io_sources);
+    socket_pairs_free (pairs, n);
+}
+
+static void
+test_bench_idle ()
+{
+    bench_connections (500, 0);
+}
+
+static void
+test_bench_mixed ()
+{
+    bench_connections (450, 50);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/io_source/condition", test_condition);
+    g_test_add_func ("/io_source/reactor", test_reactor);
+
+    /* Run with -m perf */
+    if (g_test_perf ()) {
+        g_test_add_func ("/io_source/bench/idle", test_bench_idle);
+        g_test_add_func ("/io_source/bench/mixed", test_bench_mixed);
+    }
+
+    return g_test_run ();
+}
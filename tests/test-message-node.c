@@ -0,0 +1,202 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+
+#define N_THREADS 8
+#define N_REFS    100000
+
+static guint n_criticals = 0;
+
+static void
+count_critical (const gchar    *log_domain,
+                GLogLevelFlags  log_level,
+                const gchar    *message,
+                gpointer        user_data)
+{
+    n_criticals++;
+}
+
+static LmMessageNode *
+build_tree (void)
+{
+    LmMessage     *m;
+    LmMessageNode *node;
+
+    m = lm_message_new ("user@example.com", LM_MESSAGE_TYPE_MESSAGE);
+    lm_message_node_set_attribute (m->node, "id", "m1");
+    node = lm_message_node_add_child (m->node, "body", "Hello");
+    lm_message_node_add_child (node, "b", "bold");
+
+    node = lm_message_node_ref (m->node);
+    lm_message_unref (m);
+
+    return node;
+}
+
+static void
+test_freeze ()
+{
+    LmMessageNode *node;
+    LmMessageNode *body;
+    gchar         *before;
+    gchar         *after;
+
+    node = build_tree ();
+    body = lm_message_node_get_child (node, "body");
+
+    g_assert (!lm_message_node_is_frozen (node));
+    g_assert (!lm_message_node_is_frozen (body));
+
+    before = lm_message_node_to_string (node);
+    lm_message_node_freeze (node);
+
+    /* All of the tree */
+    g_assert (lm_message_node_is_frozen (node));
+    g_assert (lm_message_node_is_frozen (body));
+    g_assert (lm_message_node_is_frozen (lm_message_node_get_child (body, "b")));
+
+    /* Freezing again changes nothing, references don't thaw it */
+    lm_message_node_freeze (node);
+    lm_message_node_unref (lm_message_node_ref (node));
+    g_assert (lm_message_node_is_frozen (node));
+
+    /* Still readable */
+    g_assert_cmpstr (lm_message_node_get_attribute (node, "id"), ==, "m1");
+    g_assert_cmpstr (lm_message_node_get_value (body), ==, "Hello");
+    after = lm_message_node_to_string (node);
+    g_assert_cmpstr (after, ==, before);
+
+    g_free (before);
+    g_free (after);
+    lm_message_node_unref (node);
+}
+
+/* Each setter fails with a warning and leaves the node as it was */
+static void
+test_frozen_setters ()
+{
+    LmMessageNode *node;
+    LmMessageNode *body;
+    gchar         *before;
+    gchar         *after;
+
+    node = build_tree ();
+    body = lm_message_node_get_child (node, "body");
+    lm_message_node_freeze (node);
+    before = lm_message_node_to_string (node);
+
+    g_log_set_always_fatal (G_LOG_FATAL_MASK);
+    g_log_set_handler (NULL, G_LOG_LEVEL_CRITICAL, count_critical, NULL);
+
+    n_criticals = 0;
+    lm_message_node_set_value (body, "Bye");
+    g_assert_cmpuint (n_criticals, ==, 1);
+
+    g_assert (lm_message_node_add_child (node, "subject", "Hi") == NULL);
+    g_assert_cmpuint (n_criticals, ==, 2);
+
+    lm_message_node_set_attribute (node, "id", "m2");
+    g_assert_cmpuint (n_criticals, ==, 3);
+
+    lm_message_node_set_attributes (body, "xml:lang", "en", NULL);
+    g_assert_cmpuint (n_criticals, ==, 4);
+
+    lm_message_node_set_raw_mode (body, TRUE);
+    g_assert_cmpuint (n_criticals, ==, 5);
+
+    g_log_set_always_fatal (G_LOG_FATAL_MASK | G_LOG_LEVEL_CRITICAL);
+
+    g_assert (!lm_message_node_get_raw_mode (body));
+    after = lm_message_node_to_string (node);
+    g_assert_cmpstr (after, ==, before);
+
+    g_free (before);
+    g_free (after);
+    lm_message_node_unref (node);
+}
+
+static gpointer
+ref_thread (gpointer data)
+{
+    LmMessageNode *node = data;
+    LmMessageNode *body;
+    gint           i;
+
+    for (i = 0; i < N_REFS; i++) {
+        lm_message_node_ref (node);
+        body = lm_message_node_ref (lm_message_node_get_child (node, "body"));
+
+        g_assert_cmpstr (lm_message_node_get_attribute (node, "id"), ==, "m1");
+        g_assert (lm_message_node_is_frozen (body));
+
+        lm_message_node_unref (body);
+        lm_message_node_unref (node);
+    }
+
+    /* The last reference of this thread */
+    lm_message_node_unref (node);
+
+    return NULL;
+}
+
+/* A frozen tree shared between threads, each with its own reference */
+static void
+test_concurrent_refs ()
+{
+    LmMessageNode *node;
+    GThread       *threads[N_THREADS];
+    gint           ref_count;
+    gint           i;
+
+    node = build_tree ();
+    lm_message_node_freeze (node);
+    ref_count = node->ref_count;
+
+    for (i = 0; i < N_THREADS; i++) {
+        threads[i] = g_thread_new ("ref", ref_thread,
+                                   lm_message_node_ref (node));
+    }
+
+    for (i = 0; i < N_THREADS; i++) {
+        g_thread_join (threads[i]);
+    }
+
+    /* No reference got lost and the flag is still there */
+    g_assert_cmpint (node->ref_count, ==, ref_count);
+    g_assert (lm_message_node_is_frozen (node));
+
+    lm_message_node_unref (node);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/message_node/freeze", test_freeze);
+    g_test_add_func ("/message_node/frozen_setters", test_frozen_setters);
+    g_test_add_func ("/message_node/concurrent_refs", test_concurrent_refs);
+
+    return g_test_run ();
+}
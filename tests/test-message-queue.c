@@ -0,0 +1,225 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "loudmouth/lm-message-queue.h"
+
+static void
+test_priority ()
+{
+    LmMessageQueue *queue;
+    LmMessage      *presence;
+    LmMessage      *iq;
+    LmMessage      *m;
+
+    queue = lm_message_queue_new (NULL, NULL);
+
+    presence = lm_message_new (NULL, LM_MESSAGE_TYPE_PRESENCE);
+    iq = lm_message_new (NULL, LM_MESSAGE_TYPE_IQ);
+
+    lm_message_queue_push_tail (queue, lm_message_ref (presence));
+    lm_message_queue_push_with_priority (queue, lm_message_ref (iq),
+                                         LM_MESSAGE_QUEUE_PRIORITY_HIGH);
+
+    g_assert_cmpuint (lm_message_queue_get_length (queue), ==, 2);
+    g_assert (lm_message_queue_peek_nth (queue, 0) == iq);
+    g_assert (lm_message_queue_peek_nth (queue, 1) == presence);
+    g_assert (lm_message_queue_peek_nth (queue, 2) == NULL);
+
+    m = lm_message_queue_pop_next (queue);
+    g_assert (m == iq);
+    lm_message_unref (m);
+
+    m = lm_message_queue_pop_next (queue);
+    g_assert (m == presence);
+    lm_message_unref (m);
+
+    g_assert (lm_message_queue_is_empty (queue));
+    g_assert (lm_message_queue_pop_next (queue) == NULL);
+
+    lm_message_unref (presence);
+    lm_message_unref (iq);
+    lm_message_queue_unref (queue);
+}
+
+static void
+test_no_starvation ()
+{
+    LmMessageQueue *queue;
+    LmMessage      *presence;
+    LmMessage      *iq;
+    LmMessage      *m;
+    guint           i;
+
+    queue = lm_message_queue_new (NULL, NULL);
+
+    presence = lm_message_new (NULL, LM_MESSAGE_TYPE_PRESENCE);
+    iq = lm_message_new (NULL, LM_MESSAGE_TYPE_IQ);
+
+    lm_message_queue_push_tail (queue, lm_message_ref (presence));
+    for (i = 0; i < 100; i++) {
+        lm_message_queue_push_with_priority (queue, lm_message_ref (iq),
+                                             LM_MESSAGE_QUEUE_PRIORITY_HIGH);
+    }
+
+    /* The normal message gets through before the flood is over */
+    for (i = 0; i < 100; i++) {
+        m = lm_message_queue_pop_next (queue);
+        lm_message_unref (m);
+
+        if (m == presence) {
+            break;
+        }
+    }
+    g_assert_cmpuint (i, <, 100);
+
+    while ((m = lm_message_queue_pop_next (queue))) {
+        g_assert (m == iq);
+        lm_message_unref (m);
+    }
+
+    lm_message_unref (presence);
+    lm_message_unref (iq);
+    lm_message_queue_unref (queue);
+}
+
+static void
+test_pop_oldest ()
+{
+    LmMessageQueue *queue;
+    LmMessage      *presence;
+    LmMessage      *message;
+    LmMessage      *iq;
+    gsize           size;
+
+    queue = lm_message_queue_new (NULL, NULL);
+
+    presence = lm_message_new (NULL, LM_MESSAGE_TYPE_PRESENCE);
+    message = lm_message_new (NULL, LM_MESSAGE_TYPE_MESSAGE);
+    iq = lm_message_new (NULL, LM_MESSAGE_TYPE_IQ);
+
+    lm_message_queue_push_tail (queue, lm_message_ref (message));
+    size = lm_message_queue_get_size (queue);
+    g_assert_cmpuint (size, >, 0);
+
+    lm_message_queue_push_tail (queue, lm_message_ref (presence));
+    lm_message_queue_push_with_priority (queue, lm_message_ref (iq),
+                                         LM_MESSAGE_QUEUE_PRIORITY_HIGH);
+
+    /* High priority messages are never picked */
+    g_assert (lm_message_queue_pop_oldest (queue, LM_MESSAGE_TYPE_IQ) == NULL);
+    g_assert (lm_message_queue_pop_oldest (queue,
+                                           LM_MESSAGE_TYPE_PRESENCE) == presence);
+    lm_message_unref (presence);
+    g_assert (lm_message_queue_pop_oldest (queue,
+                                           LM_MESSAGE_TYPE_PRESENCE) == NULL);
+    g_assert_cmpuint (lm_message_queue_get_length (queue), ==, 2);
+
+    g_assert (lm_message_queue_pop_next (queue) == iq);
+    lm_message_unref (iq);
+    g_assert_cmpuint (lm_message_queue_get_size (queue), ==, size);
+
+    g_assert (lm_message_queue_pop_next (queue) == message);
+    lm_message_unref (message);
+    g_assert_cmpuint (lm_message_queue_get_size (queue), ==, 0);
+
+    lm_message_unref (presence);
+    lm_message_unref (message);
+    lm_message_unref (iq);
+    lm_message_queue_unref (queue);
+}
+
+static LmMessage *
+new_presence (const gchar *from, LmMessageSubType sub_type)
+{
+    LmMessage *m;
+
+    m = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_PRESENCE,
+                                      sub_type);
+    lm_message_node_set_attribute (m->node, "from", from);
+
+    return m;
+}
+
+static void
+test_coalesce_presence ()
+{
+    LmMessageQueue *queue;
+    LmMessage      *first;
+    LmMessage      *other;
+    LmMessage      *latest;
+    LmMessage      *subscribe;
+    LmMessage      *m;
+
+    queue = lm_message_queue_new (NULL, NULL);
+    lm_message_queue_set_coalesce_presence (queue, TRUE);
+
+    first = new_presence ("a@example.com/x", LM_MESSAGE_SUB_TYPE_AVAILABLE);
+    other = new_presence ("b@example.com/x", LM_MESSAGE_SUB_TYPE_AVAILABLE);
+    subscribe = new_presence ("a@example.com/x", LM_MESSAGE_SUB_TYPE_SUBSCRIBE);
+    latest = new_presence ("a@example.com/x", LM_MESSAGE_SUB_TYPE_UNAVAILABLE);
+
+    lm_message_queue_push_tail (queue, first);
+    lm_message_queue_push_tail (queue, other);
+    lm_message_queue_push_tail (queue, subscribe);
+    lm_message_queue_push_tail (queue, latest);
+
+    /* The latest presence takes the place of the first one */
+    g_assert_cmpuint (lm_message_queue_get_length (queue), ==, 3);
+
+    m = lm_message_queue_pop_next (queue);
+    g_assert (m == latest);
+    lm_message_unref (m);
+
+    m = lm_message_queue_pop_next (queue);
+    g_assert (m == other);
+    lm_message_unref (m);
+
+    /* Once dispatched it is not replaced anymore */
+    latest = new_presence ("a@example.com/x", LM_MESSAGE_SUB_TYPE_AVAILABLE);
+    lm_message_queue_push_tail (queue, latest);
+    g_assert_cmpuint (lm_message_queue_get_length (queue), ==, 2);
+
+    m = lm_message_queue_pop_next (queue);
+    g_assert (m == subscribe);
+    lm_message_unref (m);
+
+    m = lm_message_queue_pop_next (queue);
+    g_assert (m == latest);
+    lm_message_unref (m);
+
+    lm_message_queue_unref (queue);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/message_queue/priority", test_priority);
+    g_test_add_func ("/message_queue/no_starvation", test_no_starvation);
+    g_test_add_func ("/message_queue/pop_oldest", test_pop_oldest);
+    g_test_add_func ("/message_queue/coalesce_presence",
+                     test_coalesce_presence);
+
+    return g_test_run ();
+}
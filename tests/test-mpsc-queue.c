@@ -0,0 +1,164 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/lm-mpsc-queue.h"
+
+#define N_PRODUCERS 4
+#define N_ITEMS     10000
+
+typedef struct {
+    LmMpscNode node;
+    guint      producer;
+    guint      seq;
+} Item;
+
+typedef struct {
+    LmMpscQueue *queue;
+    GMainLoop   *loop;
+    guint        next_seq[N_PRODUCERS];
+    guint        received;
+    guint        batches;
+} Consumer;
+
+typedef struct {
+    Consumer *consumer;
+    guint     id;
+} Producer;
+
+static void
+consume_cb (LmMpscNode *nodes, Consumer *consumer)
+{
+    consumer->batches++;
+
+    while (nodes) {
+        Item *item = (Item *) nodes;
+
+        nodes = nodes->next;
+
+        /* Each producer's items come in the order they were pushed */
+        g_assert_cmpuint (item->seq, ==, consumer->next_seq[item->producer]);
+        consumer->next_seq[item->producer]++;
+        consumer->received++;
+
+        g_slice_free (Item, item);
+    }
+
+    if (consumer->received == N_PRODUCERS * N_ITEMS) {
+        g_main_loop_quit (consumer->loop);
+    }
+}
+
+static gpointer
+produce (Producer *producer)
+{
+    guint i;
+
+    for (i = 0; i < N_ITEMS; i++) {
+        Item *item = g_slice_new (Item);
+
+        item->producer = producer->id;
+        item->seq = i;
+
+        lm_mpsc_queue_push (producer->consumer->queue, &item->node);
+    }
+
+    return NULL;
+}
+
+static void
+test_producers ()
+{
+    GMainContext *context;
+    Consumer      consumer = { 0 };
+    Producer      producers[N_PRODUCERS];
+    GThread      *threads[N_PRODUCERS];
+    guint         i;
+
+    context = g_main_context_new ();
+    consumer.loop = g_main_loop_new (context, FALSE);
+    consumer.queue = lm_mpsc_queue_new ((LmMpscQueueFunc) consume_cb,
+                                        &consumer);
+    lm_mpsc_queue_attach (consumer.queue, context);
+
+    for (i = 0; i < N_PRODUCERS; i++) {
+        producers[i].consumer = &consumer;
+        producers[i].id = i;
+        threads[i] = g_thread_new ("producer", (GThreadFunc) produce,
+                                   &producers[i]);
+    }
+
+    g_main_loop_run (consumer.loop);
+
+    for (i = 0; i < N_PRODUCERS; i++) {
+        g_thread_join (threads[i]);
+    }
+
+    g_assert_cmpuint (consumer.received, ==, N_PRODUCERS * N_ITEMS);
+    g_assert (consumer.batches <= consumer.received);
+    g_assert (lm_mpsc_queue_is_empty (consumer.queue));
+
+    lm_mpsc_queue_free (consumer.queue);
+    g_main_loop_unref (consumer.loop);
+    g_main_context_unref (context);
+}
+
+static void
+test_batch ()
+{
+    LmMpscQueue *queue;
+    Consumer     consumer = { 0 };
+    Item         items[3];
+    LmMpscNode  *nodes;
+    guint        i;
+
+    queue = lm_mpsc_queue_new ((LmMpscQueueFunc) consume_cb, &consumer);
+
+    /* Only the push into an empty queue needs a wakeup */
+    g_assert (lm_mpsc_queue_push (queue, &items[0].node));
+    g_assert (!lm_mpsc_queue_push (queue, &items[1].node));
+    g_assert (!lm_mpsc_queue_push (queue, &items[2].node));
+
+    nodes = lm_mpsc_queue_pop_all (queue);
+    for (i = 0; i < 3; i++) {
+        g_assert (nodes == &items[i].node);
+        nodes = nodes->next;
+    }
+    g_assert (nodes == NULL);
+
+    g_assert (lm_mpsc_queue_is_empty (queue));
+    g_assert (lm_mpsc_queue_pop_all (queue) == NULL);
+    g_assert (lm_mpsc_queue_push (queue, &items[0].node));
+    g_assert (lm_mpsc_queue_pop_all (queue) == &items[0].node);
+
+    lm_mpsc_queue_free (queue);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/mpsc_queue/batch", test_batch);
+    g_test_add_func ("/mpsc_queue/producers", test_producers);
+
+    return g_test_run ();
+}
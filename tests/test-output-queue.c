@@ -0,0 +1,304 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#ifndef G_OS_WIN32
+#include <sys/socket.h>
+#endif
+
+#include "loudmouth/lm-internals.h"
+#include "loudmouth/lm-output-queue.h"
+
+static void
+test_push_and_consume ()
+{
+    LmOutputQueue *queue;
+    LmOutputChunk *chunk;
+    gchar          buf[32];
+    gsize          len;
+
+    queue = lm_output_queue_new ();
+    g_assert (lm_output_queue_is_empty (queue));
+
+    chunk = lm_output_chunk_new ("<presence/>", 11);
+    lm_output_queue_push (queue, chunk, 0);
+    lm_output_chunk_unref (chunk);
+
+    /* Partially written before being queued */
+    chunk = lm_output_chunk_new ("<message/>", 10);
+    lm_output_queue_push (queue, chunk, 1);
+    lm_output_chunk_unref (chunk);
+
+    g_assert_cmpuint (lm_output_queue_get_size (queue), ==, 20);
+
+    len = lm_output_queue_peek (queue, buf, sizeof (buf));
+    g_assert_cmpuint (len, ==, 20);
+    g_assert (memcmp (buf, "<presence/>message/>", 20) == 0);
+
+    /* Partial write only moves the offset of the head chunk */
+    lm_output_queue_consume (queue, 5);
+    g_assert_cmpuint (lm_output_queue_get_size (queue), ==, 15);
+    len = lm_output_queue_peek (queue, buf, 8);
+    g_assert_cmpuint (len, ==, 8);
+    g_assert (memcmp (buf, "ence/>me", 8) == 0);
+
+    lm_output_queue_consume (queue, 15);
+    g_assert (lm_output_queue_is_empty (queue));
+
+    lm_output_queue_free (queue);
+}
+
+static void
+test_shared_chunk ()
+{
+    LmOutputQueue *queue_a;
+    LmOutputQueue *queue_b;
+    LmOutputChunk *chunk;
+    gchar          buf[16];
+
+    queue_a = lm_output_queue_new ();
+    queue_b = lm_output_queue_new ();
+
+    chunk = lm_output_chunk_new_take (g_strdup ("<iq/>"), 5);
+    lm_output_queue_push (queue_a, chunk, 0);
+    lm_output_queue_push (queue_b, chunk, 0);
+    lm_output_chunk_unref (chunk);
+
+    lm_output_queue_consume (queue_a, 3);
+    g_assert_cmpuint (lm_output_queue_peek (queue_b, buf, sizeof (buf)), ==, 5);
+    g_assert (memcmp (buf, "<iq/>", 5) == 0);
+
+    lm_output_queue_free (queue_a);
+    lm_output_queue_free (queue_b);
+}
+
+static void
+test_keyed ()
+{
+    LmOutputQueue *queue;
+    LmOutputChunk *chunk;
+    gchar          buf[32];
+
+    queue = lm_output_queue_new ();
+
+    chunk = lm_output_chunk_new ("<p1/>", 5);
+    g_assert (!lm_output_queue_push_keyed (queue, chunk, "presence"));
+    lm_output_chunk_unref (chunk);
+
+    chunk = lm_output_chunk_new ("<m/>", 4);
+    lm_output_queue_push (queue, chunk, 0);
+    lm_output_chunk_unref (chunk);
+
+    /* Replaced in place while none of it has been written */
+    chunk = lm_output_chunk_new ("<p22/>", 6);
+    g_assert (lm_output_queue_push_keyed (queue, chunk, "presence"));
+    lm_output_chunk_unref (chunk);
+
+    g_assert_cmpuint (lm_output_queue_get_size (queue), ==, 10);
+    g_assert_cmpuint (lm_output_queue_peek (queue, buf, sizeof (buf)), ==, 10);
+    g_assert (memcmp (buf, "<p22/><m/>", 10) == 0);
+
+    /* Partly written output is appended to instead */
+    lm_output_queue_consume (queue, 1);
+    chunk = lm_output_chunk_new ("<p3/>", 5);
+    g_assert (!lm_output_queue_push_keyed (queue, chunk, "presence"));
+    lm_output_chunk_unref (chunk);
+
+    /* And so is output that has been handed to a write */
+    lm_output_queue_pin (queue, 14);
+    chunk = lm_output_chunk_new ("<p4/>", 5);
+    g_assert (!lm_output_queue_push_keyed (queue, chunk, "presence"));
+    lm_output_chunk_unref (chunk);
+
+    g_assert_cmpuint (lm_output_queue_peek (queue, buf, sizeof (buf)), ==, 19);
+    g_assert (memcmp (buf, "p22/><m/><p3/><p4/>", 19) == 0);
+
+    lm_output_queue_free (queue);
+}
+
+/* A TLS write that would block is queued and pinned by the socket, the
+ * retry has to find the same bytes even if the key is sent again */
+static void
+test_keyed_blocked_write ()
+{
+    LmOutputQueue *queue;
+    LmOutputChunk *chunk;
+    gchar          record[32];
+    gchar          buf[32];
+    gsize          attempted;
+
+    queue = lm_output_queue_new ();
+
+    chunk = lm_output_chunk_new ("<p1/>", 5);
+    attempted = lm_output_chunk_get_length (chunk);
+    g_assert (!lm_output_queue_push_keyed (queue, chunk, "presence"));
+    lm_output_chunk_unref (chunk);
+    lm_output_queue_pin (queue, attempted);
+
+    chunk = lm_output_chunk_new ("<p22/>", 6);
+    g_assert (!lm_output_queue_push_keyed (queue, chunk, "presence"));
+    lm_output_chunk_unref (chunk);
+
+    /* The retry is gathered from the head of the queue */
+    g_assert_cmpuint (lm_output_queue_peek (queue, record, attempted), ==, 5);
+    g_assert (memcmp (record, "<p1/>", 5) == 0);
+    lm_output_queue_consume (queue, attempted);
+
+    /* The newer entry can still be replaced until it is written */
+    chunk = lm_output_chunk_new ("<p3/>", 5);
+    g_assert (lm_output_queue_push_keyed (queue, chunk, "presence"));
+    lm_output_chunk_unref (chunk);
+
+    g_assert_cmpuint (lm_output_queue_peek (queue, buf, sizeof (buf)), ==, 5);
+    g_assert (memcmp (buf, "<p3/>", 5) == 0);
+
+    lm_output_queue_free (queue);
+}
+
+#ifndef G_OS_WIN32
+static void
+test_iovec ()
+{
+    LmOutputQueue *queue;
+    LmOutputChunk *chunk;
+    struct iovec   iov[2];
+    gint           i;
+
+    queue = lm_output_queue_new ();
+
+    for (i = 0; i < 3; i++) {
+        chunk = lm_output_chunk_new ("abcd", 4);
+        lm_output_queue_push (queue, chunk, 0);
+        lm_output_chunk_unref (chunk);
+    }
+
+    lm_output_queue_consume (queue, 1);
+
+    g_assert_cmpuint (lm_output_queue_get_iovec (queue, iov, 2), ==, 2);
+    g_assert_cmpuint (iov[0].iov_len, ==, 3);
+    g_assert (memcmp (iov[0].iov_base, "bcd", 3) == 0);
+    g_assert_cmpuint (iov[1].iov_len, ==, 4);
+
+    lm_output_queue_free (queue);
+}
+
+/* Drains a queue larger than the socket buffer, the writes have to return 0
+ * when the socket is full instead of blocking or spinning. */
+static void
+test_socketpair_eagain ()
+{
+    LmOutputQueue *queue;
+    LmOutputChunk *chunk;
+    struct iovec   iov[16];
+    int            fds[2];
+    int            sndbuf = 1024;
+    gchar          data[1024];
+    gchar          buf[4096];
+    gsize          total;
+    gsize          received = 0;
+    guint          would_block = 0;
+    gint           i;
+
+    g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    setsockopt (fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
+    _lm_sock_set_blocking (fds[0], FALSE);
+
+    queue = lm_output_queue_new ();
+    for (i = 0; i < 64; i++) {
+        memset (data, 'a' + (i % 26), sizeof (data));
+        chunk = lm_output_chunk_new (data, sizeof (data));
+        lm_output_queue_push (queue, chunk, 0);
+        lm_output_chunk_unref (chunk);
+    }
+    total = lm_output_queue_get_size (queue);
+
+    while (!lm_output_queue_is_empty (queue)) {
+        gssize written;
+        guint  n;
+
+        n = lm_output_queue_get_iovec (queue, iov, G_N_ELEMENTS (iov));
+        written = _lm_sock_writev (fds[0], iov, n);
+        g_assert_cmpint (written, >=, 0);
+
+        if (written > 0) {
+            lm_output_queue_consume (queue, written);
+            continue;
+        }
+
+        would_block++;
+
+        /* A plain write on the full socket doesn't fail either */
+        g_assert_cmpint (_lm_sock_write (fds[0], data, sizeof (data)), ==, 0);
+
+        do {
+            gssize r = recv (fds[1], buf, sizeof (buf), MSG_DONTWAIT);
+            gssize j;
+
+            if (r <= 0) {
+                break;
+            }
+
+            for (j = 0; j < r; j++) {
+                g_assert_cmpint (buf[j], ==, 'a' + (((received + j) / 1024) % 26));
+            }
+            received += r;
+        } while (TRUE);
+    }
+
+    while (received < total) {
+        gssize r = recv (fds[1], buf, sizeof (buf), 0);
+        gssize j;
+
+        g_assert_cmpint (r, >, 0);
+        for (j = 0; j < r; j++) {
+            g_assert_cmpint (buf[j], ==, 'a' + (((received + j) / 1024) % 26));
+        }
+        received += r;
+    }
+
+    g_assert_cmpuint (would_block, >, 0);
+
+    lm_output_queue_free (queue);
+    close (fds[0]);
+    close (fds[1]);
+}
+#endif
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/output_queue/push_and_consume", test_push_and_consume);
+    g_test_add_func ("/output_queue/shared_chunk", test_shared_chunk);
+    g_test_add_func ("/output_queue/keyed", test_keyed);
+    g_test_add_func ("/output_queue/keyed_blocked_write",
+                     test_keyed_blocked_write);
+#ifndef G_OS_WIN32
+    g_test_add_func ("/output_queue/iovec", test_iovec);
+    g_test_add_func ("/output_queue/socketpair_eagain",
+                     test_socketpair_eagain);
+#endif
+
+    return g_test_run ();
+}
@@ -0,0 +1,619 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <glib.h>
+
+#include "loudmouth/lm-resolver.h"
+
+/* Lookups are never sent, the test completes them by hand */
+static GSList *lookups;
+
+typedef struct {
+    LmResolverResult result;
+    guint            n_calls;
+    gchar           *first_host;
+} Reply;
+
+static void
+fake_lookup (LmResolver *resolver)
+{
+    lookups = g_slist_append (lookups, resolver);
+}
+
+static void
+fake_cancel (LmResolver *resolver)
+{
+    lookups = g_slist_remove (lookups, resolver);
+}
+
+static void
+reply_cb (LmResolver *resolver, LmResolverResult result, Reply *reply)
+{
+    GList *targets;
+
+    reply->result = result;
+    reply->n_calls++;
+
+    targets = lm_resolver_get_srv_targets (resolver);
+    if (targets) {
+        g_free (reply->first_host);
+        reply->first_host = g_strdup (((LmSrvTarget *) targets->data)->host);
+        lm_resolver_free_srv_targets (targets);
+    }
+}
+
+static void
+patch_class (LmResolver *resolver)
+{
+    LmResolverClass *klass = LM_RESOLVER_GET_CLASS (resolver);
+
+    klass->lookup = fake_lookup;
+    klass->cancel = fake_cancel;
+}
+
+static LmResolver *
+host_resolver_new (const gchar *host, Reply *reply)
+{
+    LmResolver *resolver;
+
+    resolver = lm_resolver_new_for_host (host,
+                                         (LmResolverCallback) reply_cb,
+                                         reply);
+    patch_class (resolver);
+
+    return resolver;
+}
+
+static LmResolver *
+srv_resolver_new (const gchar *domain, Reply *reply)
+{
+    LmResolver *resolver;
+
+    resolver = lm_resolver_new_for_service (domain, "xmpp-client", "tcp",
+                                            (LmResolverCallback) reply_cb,
+                                            reply);
+    patch_class (resolver);
+
+    return resolver;
+}
+
+static struct addrinfo *
+loopback_addrinfo (void)
+{
+    struct addrinfo  hints;
+    struct addrinfo *ai = NULL;
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    g_assert_cmpint (getaddrinfo ("127.0.0.1", "5222", &hints, &ai), ==, 0);
+
+    return ai;
+}
+
+static LmSrvTarget *
+srv_target_new (const gchar *host, guint priority, guint weight)
+{
+    LmSrvTarget *target = g_slice_new0 (LmSrvTarget);
+
+    target->host = g_strdup (host);
+    target->port = 5222;
+    target->priority = priority;
+    target->weight = weight;
+    target->ttl = 300;
+
+    return target;
+}
+
+/* Builds DNS responses for _lm_resolver_parse_srv_response() */
+static void
+append_short (GByteArray *packet, guint16 value)
+{
+    guint8 bytes[2] = { value >> 8, value & 0xff };
+
+    g_byte_array_append (packet, bytes, 2);
+}
+
+static void
+append_long (GByteArray *packet, guint32 value)
+{
+    append_short (packet, value >> 16);
+    append_short (packet, value & 0xffff);
+}
+
+static void
+append_name (GByteArray *packet, const gchar *name)
+{
+    gchar **labels;
+    guint   i;
+    guint8  zero = 0;
+
+    labels = g_strsplit (name, ".", -1);
+    for (i = 0; labels[i]; i++) {
+        guint8 len = strlen (labels[i]);
+
+        if (len > 0) {
+            g_byte_array_append (packet, &len, 1);
+            g_byte_array_append (packet, (guint8 *) labels[i], len);
+        }
+    }
+    g_strfreev (labels);
+
+    g_byte_array_append (packet, &zero, 1);
+}
+
+static GByteArray *
+response_new (guint16 ancount)
+{
+    GByteArray *packet = g_byte_array_new ();
+
+    append_short (packet, 0x1234);
+    append_short (packet, 0x8180);
+    append_short (packet, 1);
+    append_short (packet, ancount);
+    append_short (packet, 0);
+    append_short (packet, 0);
+
+    append_name (packet, "_xmpp-client._tcp.example.org");
+    append_short (packet, 33);
+    append_short (packet, 1);
+
+    return packet;
+}
+
+/* The owner name points back at the question */
+static void
+append_record_header (GByteArray *packet, guint16 type, guint16 dlen)
+{
+    append_short (packet, 0xc00c);
+    append_short (packet, type);
+    append_short (packet, 1);
+    append_long (packet, 300);
+    append_short (packet, dlen);
+}
+
+static void
+append_srv (GByteArray  *packet,
+            guint16      priority,
+            guint16      weight,
+            guint16      port,
+            const gchar *target)
+{
+    GByteArray *rdata = g_byte_array_new ();
+
+    append_short (rdata, priority);
+    append_short (rdata, weight);
+    append_short (rdata, port);
+    append_name (rdata, target);
+
+    append_record_header (packet, 33, rdata->len);
+    g_byte_array_append (packet, rdata->data, rdata->len);
+    g_byte_array_free (rdata, TRUE);
+}
+
+static gboolean
+parse (GByteArray *packet, guint len, GList **targets)
+{
+    *targets = NULL;
+
+    return _lm_resolver_parse_srv_response (packet->data, len, targets);
+}
+
+static const gchar *
+target_host (GList *targets, guint n)
+{
+    return ((LmSrvTarget *) g_list_nth_data (targets, n))->host;
+}
+
+static void
+iterate_until (guint *n_calls, guint n)
+{
+    while (*n_calls < n) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+}
+
+static void
+test_merge_lookups ()
+{
+    LmResolver *resolvers[3];
+    LmResolver *cached;
+    Reply       replies[4];
+    guint       i;
+
+    memset (replies, 0, sizeof (replies));
+
+    for (i = 0; i < 3; i++) {
+        resolvers[i] = host_resolver_new ("merge.example", &replies[i]);
+        lm_resolver_lookup (resolvers[i]);
+    }
+
+    /* Only the first resolver looks up, the others wait for it */
+    g_assert_cmpuint (g_slist_length (lookups), ==, 1);
+    g_assert (lookups->data == resolvers[0]);
+
+    _lm_resolver_set_result (resolvers[0], LM_RESOLVER_RESULT_OK,
+                             loopback_addrinfo ());
+    g_slist_free (lookups);
+    lookups = NULL;
+
+    for (i = 0; i < 3; i++) {
+        iterate_until (&replies[i].n_calls, 1);
+        g_assert_cmpint (replies[i].result, ==, LM_RESOLVER_RESULT_OK);
+        g_assert (lm_resolver_results_get_next (resolvers[i]) != NULL);
+    }
+
+    /* Answered from the cache later on */
+    cached = host_resolver_new ("merge.example", &replies[3]);
+    lm_resolver_lookup (cached);
+    g_assert (lookups == NULL);
+    iterate_until (&replies[3].n_calls, 1);
+    g_assert_cmpint (replies[3].result, ==, LM_RESOLVER_RESULT_OK);
+
+    for (i = 0; i < 3; i++) {
+        g_object_unref (resolvers[i]);
+    }
+    g_object_unref (cached);
+}
+
+static void
+test_negative_ttl ()
+{
+    LmResolver *resolver;
+    LmResolver *cached;
+    Reply       reply = { 0 };
+    Reply       cached_reply = { 0 };
+
+    resolver = host_resolver_new ("fail.example", &reply);
+    lm_resolver_lookup (resolver);
+    _lm_resolver_set_result (resolver, LM_RESOLVER_RESULT_FAILED, NULL);
+    g_slist_free (lookups);
+    lookups = NULL;
+    g_assert_cmpint (reply.result, ==, LM_RESOLVER_RESULT_FAILED);
+
+    /* The failure is kept for a moment */
+    cached = host_resolver_new ("fail.example", &cached_reply);
+    lm_resolver_lookup (cached);
+    g_assert (lookups == NULL);
+    iterate_until (&cached_reply.n_calls, 1);
+    g_assert_cmpint (cached_reply.result, ==, LM_RESOLVER_RESULT_FAILED);
+    g_object_unref (cached);
+
+    if (g_test_slow ()) {
+        /* But looked up again once it expired */
+        g_usleep (6 * G_USEC_PER_SEC);
+
+        cached = host_resolver_new ("fail.example", &cached_reply);
+        lm_resolver_lookup (cached);
+        g_assert_cmpuint (g_slist_length (lookups), ==, 1);
+        lm_resolver_cancel (cached);
+        g_object_unref (cached);
+    }
+
+    g_object_unref (resolver);
+}
+
+static void
+test_cancel_hands_over ()
+{
+    LmResolver *first;
+    LmResolver *second;
+    Reply       first_reply = { 0 };
+    Reply       second_reply = { 0 };
+
+    first = host_resolver_new ("cancel.example", &first_reply);
+    second = host_resolver_new ("cancel.example", &second_reply);
+    lm_resolver_lookup (first);
+    lm_resolver_lookup (second);
+    g_assert_cmpuint (g_slist_length (lookups), ==, 1);
+
+    /* The waiting resolver takes over the lookup */
+    lm_resolver_cancel (first);
+    g_assert (lookups == NULL);
+    while (!lookups) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert (lookups->data == second);
+
+    _lm_resolver_set_result (second, LM_RESOLVER_RESULT_OK,
+                             loopback_addrinfo ());
+    g_slist_free (lookups);
+    lookups = NULL;
+
+    g_assert_cmpuint (second_reply.n_calls, ==, 1);
+    g_assert_cmpint (second_reply.result, ==, LM_RESOLVER_RESULT_OK);
+    g_assert_cmpuint (first_reply.n_calls, ==, 0);
+
+    g_object_unref (first);
+    g_object_unref (second);
+}
+
+static void
+test_srv_order_per_delivery ()
+{
+    const gchar *hosts[] = { "a.order.example", "b.order.example",
+                             "c.order.example", "d.order.example" };
+    LmResolver  *resolver;
+    GList       *targets = NULL;
+    GHashTable  *firsts;
+    Reply        reply = { 0 };
+    guint        i;
+
+    resolver = srv_resolver_new ("order.example", &reply);
+    lm_resolver_lookup (resolver);
+
+    for (i = 0; i < G_N_ELEMENTS (hosts); i++) {
+        targets = g_list_append (targets, srv_target_new (hosts[i], 10, 10));
+    }
+    _lm_resolver_set_srv_targets (resolver, targets);
+    _lm_resolver_set_result (resolver, LM_RESOLVER_RESULT_OK, NULL);
+    g_slist_free (lookups);
+    lookups = NULL;
+    g_free (reply.first_host);
+    g_object_unref (resolver);
+
+    /* Cached deliveries spread over the equally weighted targets */
+    firsts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (i = 0; i < 32; i++) {
+        Reply cached_reply = { 0 };
+
+        resolver = srv_resolver_new ("order.example", &cached_reply);
+        lm_resolver_lookup (resolver);
+        iterate_until (&cached_reply.n_calls, 1);
+        g_hash_table_add (firsts, cached_reply.first_host);
+        g_object_unref (resolver);
+    }
+    g_assert_cmpuint (g_hash_table_size (firsts), >, 1);
+    g_hash_table_destroy (firsts);
+
+    /* And prefer a target that connected fast since */
+    lm_resolver_add_connect_time ("c.order.example", 5222, 1000);
+    for (i = 0; i < 8; i++) {
+        Reply cached_reply = { 0 };
+
+        resolver = srv_resolver_new ("order.example", &cached_reply);
+        lm_resolver_lookup (resolver);
+        iterate_until (&cached_reply.n_calls, 1);
+        g_assert_cmpstr (cached_reply.first_host, ==, "c.order.example");
+        g_free (cached_reply.first_host);
+        g_object_unref (resolver);
+    }
+}
+
+static void
+test_parse_srv ()
+{
+    GByteArray  *packet;
+    GList       *targets;
+    LmSrvTarget *target;
+
+    packet = response_new (2);
+    append_srv (packet, 20, 0, 5223, "b.example.org");
+    append_srv (packet, 10, 0, 5222, "a.example.org");
+
+    g_assert (parse (packet, packet->len, &targets));
+    g_assert_cmpuint (g_list_length (targets), ==, 2);
+
+    target = targets->data;
+    g_assert_cmpstr (target->host, ==, "a.example.org");
+    g_assert_cmpuint (target->port, ==, 5222);
+    g_assert_cmpuint (target->priority, ==, 10);
+    g_assert_cmpuint (target->ttl, ==, 300);
+    g_assert (!target->direct_tls);
+    g_assert_cmpstr (target_host (targets, 1), ==, "b.example.org");
+
+    lm_resolver_free_srv_targets (targets);
+    g_byte_array_free (packet, TRUE);
+}
+
+static void
+test_parse_truncated ()
+{
+    GByteArray *packet;
+    GList      *targets;
+    guint       first_end;
+    guint       len;
+
+    packet = response_new (2);
+    append_srv (packet, 10, 0, 5222, "a.example.org");
+    first_end = packet->len;
+    append_srv (packet, 10, 0, 5222, "b.example.org");
+
+    g_assert (!parse (packet, 0, &targets));
+    g_assert (!parse (packet, 11, &targets));
+
+    /* Cut anywhere, only complete records are used */
+    for (len = 12; len < packet->len; len++) {
+        gboolean found = parse (packet, len, &targets);
+
+        if (len < first_end) {
+            g_assert (!found);
+            g_assert (targets == NULL);
+        } else {
+            g_assert (found);
+            g_assert_cmpuint (g_list_length (targets), ==, 1);
+            g_assert_cmpstr (target_host (targets, 0), ==, "a.example.org");
+            lm_resolver_free_srv_targets (targets);
+        }
+    }
+
+    g_byte_array_free (packet, TRUE);
+}
+
+static void
+test_parse_other_records ()
+{
+    GByteArray *packet;
+    GList      *targets;
+    guint8      addr[4] = { 127, 0, 0, 1 };
+
+    packet = response_new (3);
+    append_record_header (packet, 1, sizeof (addr));
+    g_byte_array_append (packet, addr, sizeof (addr));
+    append_srv (packet, 10, 0, 5222, "a.example.org");
+    /* Too short for an SRV record */
+    append_record_header (packet, 33, 4);
+    g_byte_array_append (packet, addr, sizeof (addr));
+
+    g_assert (parse (packet, packet->len, &targets));
+    g_assert_cmpuint (g_list_length (targets), ==, 1);
+    g_assert_cmpstr (target_host (targets, 0), ==, "a.example.org");
+
+    lm_resolver_free_srv_targets (targets);
+    g_byte_array_free (packet, TRUE);
+}
+
+static void
+test_parse_no_service ()
+{
+    GByteArray *packet;
+    GList      *targets;
+
+    /* "." means the service isn't offered */
+    packet = response_new (1);
+    append_srv (packet, 0, 0, 0, ".");
+    g_assert (!parse (packet, packet->len, &targets));
+    g_byte_array_free (packet, TRUE);
+
+    packet = response_new (2);
+    append_srv (packet, 0, 0, 0, ".");
+    append_srv (packet, 10, 0, 5222, "a.example.org");
+    g_assert (parse (packet, packet->len, &targets));
+    g_assert_cmpuint (g_list_length (targets), ==, 1);
+    g_assert_cmpstr (target_host (targets, 0), ==, "a.example.org");
+
+    lm_resolver_free_srv_targets (targets);
+    g_byte_array_free (packet, TRUE);
+}
+
+static void
+test_parse_long_dlen ()
+{
+    GByteArray *packet;
+    GList      *targets;
+
+    packet = response_new (3);
+    append_srv (packet, 10, 0, 5222, "a.example.org");
+    /* Claims more data than there is, parsing stops there */
+    append_record_header (packet, 1, 0xffff);
+    append_srv (packet, 10, 0, 5222, "b.example.org");
+
+    g_assert (parse (packet, packet->len, &targets));
+    g_assert_cmpuint (g_list_length (targets), ==, 1);
+    g_assert_cmpstr (target_host (targets, 0), ==, "a.example.org");
+
+    lm_resolver_free_srv_targets (targets);
+    g_byte_array_free (packet, TRUE);
+}
+
+static void
+test_parse_priorities ()
+{
+    GByteArray *packet;
+    guint       i;
+
+    packet = response_new (4);
+    append_srv (packet, 20, 50, 5222, "c.example.org");
+    append_srv (packet, 10, 50, 5222, "a.example.org");
+    append_srv (packet, 20, 50, 5222, "d.example.org");
+    append_srv (packet, 10, 50, 5222, "b.example.org");
+
+    /* The weights shuffle targets within their priority only */
+    for (i = 0; i < 32; i++) {
+        GList *targets;
+        guint  n;
+
+        g_assert (parse (packet, packet->len, &targets));
+        g_assert_cmpuint (g_list_length (targets), ==, 4);
+
+        for (n = 0; n < 4; n++) {
+            LmSrvTarget *target = g_list_nth_data (targets, n);
+
+            g_assert_cmpuint (target->priority, ==, n < 2 ? 10 : 20);
+        }
+
+        lm_resolver_free_srv_targets (targets);
+    }
+
+    g_byte_array_free (packet, TRUE);
+}
+
+static void
+test_parse_zero_weight ()
+{
+    GByteArray *packet;
+    GList      *targets;
+    guint       n_first = 0;
+    guint       i;
+
+    /* Without weights the targets keep the order of the answer */
+    packet = response_new (2);
+    append_srv (packet, 10, 0, 5222, "a.example.org");
+    append_srv (packet, 10, 0, 5222, "b.example.org");
+    for (i = 0; i < 8; i++) {
+        g_assert (parse (packet, packet->len, &targets));
+        g_assert_cmpstr (target_host (targets, 0), ==, "a.example.org");
+        lm_resolver_free_srv_targets (targets);
+    }
+    g_byte_array_free (packet, TRUE);
+
+    /* Among weighted targets one without weight is placed first before
+     * picking, so it only wins when the pick is 0 (RFC 2782) */
+    packet = response_new (2);
+    append_srv (packet, 10, 100, 5222, "weighted.example.org");
+    append_srv (packet, 10, 0, 5222, "zero.example.org");
+    for (i = 0; i < 100; i++) {
+        g_assert (parse (packet, packet->len, &targets));
+        if (g_str_equal (target_host (targets, 0), "zero.example.org")) {
+            n_first++;
+        }
+        lm_resolver_free_srv_targets (targets);
+    }
+    g_assert_cmpuint (n_first, <, 20);
+    g_byte_array_free (packet, TRUE);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/resolver/merge_lookups", test_merge_lookups);
+    g_test_add_func ("/resolver/negative_ttl", test_negative_ttl);
+    g_test_add_func ("/resolver/cancel_hands_over", test_cancel_hands_over);
+    g_test_add_func ("/resolver/srv_order_per_delivery",
+                     test_srv_order_per_delivery);
+    g_test_add_func ("/resolver/parse_srv", test_parse_srv);
+    g_test_add_func ("/resolver/parse_truncated", test_parse_truncated);
+    g_test_add_func ("/resolver/parse_other_records",
+                     test_parse_other_records);
+    g_test_add_func ("/resolver/parse_no_service", test_parse_no_service);
+    g_test_add_func ("/resolver/parse_long_dlen", test_parse_long_dlen);
+    g_test_add_func ("/resolver/parse_priorities", test_parse_priorities);
+    g_test_add_func ("/resolver/parse_zero_weight", test_parse_zero_weight);
+
+    return g_test_run ();
+}
@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __TEST_SERVER_H__
+#define __TEST_SERVER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A fake XMPP server on a loopback address, run by the main context of
+ * the test thread. It answers the stream header of each client it
+ * accepts, without authentication, and records what the client sends
+ * after it. */
+typedef struct _TestServer TestServer;
+
+TestServer *    test_server_new              (const gchar *address);
+void            test_server_free             (TestServer  *server);
+guint           test_server_get_port         (TestServer  *server);
+
+/* TLS from the first byte, with a self-signed certificate */
+gboolean        test_server_supports_tls     (void);
+void            test_server_set_tls          (TestServer  *server,
+                                              gboolean     tls);
+/* Stops reading from the client, leaving the data in its socket */
+void            test_server_set_reading      (TestServer  *server,
+                                              gboolean     reading);
+/* Sets the receive buffer of the sockets accepted from now on */
+void            test_server_set_receive_buffer (TestServer *server,
+                                                gint        size);
+
+/* Drops the next @len bytes from the current client unread, before the
+ * TLS handshake */
+void            test_server_skip             (TestServer  *server,
+                                              gsize        len);
+
+guint           test_server_get_n_accepted   (TestServer  *server);
+gboolean        test_server_is_open          (TestServer  *server);
+gboolean        test_server_is_closed        (TestServer  *server);
+GString *       test_server_get_received     (TestServer  *server);
+void            test_server_send             (TestServer  *server,
+                                              const gchar *str);
+void            test_server_disconnect       (TestServer  *server);
+
+/* The socket of the current client on the side of the connection,
+ * found among the descriptors of this process */
+gint            test_server_get_client_fd    (TestServer  *server);
+
+/* Runs @context once, sleeping a little if nothing was ready */
+void            test_iterate                 (GMainContext *context);
+
+#define test_iterate_until(context, condition)                          \
+    G_STMT_START {                                                      \
+        gint64 _end = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;    \
+        while (!(condition)) {                                          \
+            g_assert (g_get_monotonic_time () < _end);                  \
+            test_iterate (context);                                     \
+        }                                                               \
+    } G_STMT_END
+
+G_END_DECLS
+
+#endif /* __TEST_SERVER_H__ */
@@ -0,0 +1,189 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "loudmouth/lm-ssl-internals.h"
+#include "test-server.h"
+
+static LmSSLResponse
+ssl_cb (LmSSL *ssl, LmSSLStatus status, gpointer user_data)
+{
+    /* The test certificate is self-signed */
+    return LM_SSL_RESPONSE_CONTINUE;
+}
+
+/* A client socket connected to @server, with a small send buffer */
+static gint
+client_connect (TestServer *server)
+{
+    struct sockaddr_in addr;
+    gint               fd;
+    gint               size = 4096;
+
+    fd = socket (AF_INET, SOCK_STREAM, 0);
+    g_assert (fd >= 0);
+    g_assert (setsockopt (fd, SOL_SOCKET, SO_SNDBUF,
+                          &size, sizeof (size)) == 0);
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons (test_server_get_port (server));
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    /* Completed by the kernel before the server accepts */
+    g_assert (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0);
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+    test_iterate_until (NULL, test_server_get_n_accepted (server) == 1);
+
+    return fd;
+}
+
+/* Writes until the socket takes no more, returns how much it took */
+static gsize
+client_fill (gint fd)
+{
+    gchar  buf[1024];
+    gsize  total = 0;
+    gsize  len;
+
+    memset (buf, ' ', sizeof (buf));
+
+    /* The kernel keeps moving data on to the receiving side for a while */
+    while (TRUE) {
+        len = sizeof (buf);
+        while (len > 0) {
+            gssize n = send (fd, buf, len, MSG_DONTWAIT);
+
+            if (n < 0) {
+                g_assert (errno == EAGAIN || errno == EWOULDBLOCK);
+                len /= 2;
+                continue;
+            }
+            total += n;
+            len = sizeof (buf);
+        }
+
+        g_usleep (50000);
+        if (send (fd, buf, 1, MSG_DONTWAIT) != 1) {
+            break;
+        }
+        total++;
+    }
+
+    return total;
+}
+
+/* Runs the server until @fd is ready for @condition */
+static void
+client_wait (gint fd, GIOCondition condition)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = 0;
+    if (condition & G_IO_IN) {
+        pfd.events |= POLLIN;
+    }
+    if (condition & G_IO_OUT) {
+        pfd.events |= POLLOUT;
+    }
+
+    test_iterate_until (NULL, poll (&pfd, 1, 0) > 0);
+}
+
+/* The handshake stops whenever the socket isn't ready and goes on from
+ * there once it is, first waiting to write the hello and then for the
+ * answer of the server */
+static void
+test_handshake_resume ()
+{
+    TestServer   *server;
+    LmSSL        *ssl;
+    GError       *error = NULL;
+    GIOCondition  wait;
+    GIOCondition  waited = 0;
+    GIOStatus     status;
+    guint         n_calls = 0;
+    gint          fd;
+
+    server = test_server_new ("127.0.0.1");
+    test_server_set_tls (server, TRUE);
+    test_server_set_receive_buffer (server, 4096);
+    test_server_set_reading (server, FALSE);
+
+    fd = client_connect (server);
+
+    /* The server drops the filler before it starts the handshake */
+    test_server_skip (server, client_fill (fd));
+
+    ssl = _lm_ssl_new (NULL, ssl_cb, NULL, NULL);
+    _lm_ssl_initialize (ssl);
+    g_assert (_lm_ssl_begin (ssl, fd, "localhost", NULL, &error));
+    g_assert (error == NULL);
+
+    status = _lm_ssl_handshake (ssl, &wait, &error);
+    g_assert_cmpint (status, ==, G_IO_STATUS_AGAIN);
+    g_assert_cmpint (wait, ==, G_IO_OUT);
+
+    test_server_set_reading (server, TRUE);
+
+    while (status == G_IO_STATUS_AGAIN) {
+        g_assert (wait != 0);
+        waited |= wait;
+
+        client_wait (fd, wait);
+
+        status = _lm_ssl_handshake (ssl, &wait, &error);
+        n_calls++;
+    }
+
+    g_assert (error == NULL);
+    g_assert_cmpint (status, ==, G_IO_STATUS_NORMAL);
+    g_assert_cmpint (waited, ==, G_IO_OUT | G_IO_IN);
+
+    /* Only called again once the socket was ready */
+    g_assert_cmpuint (n_calls, <, 10);
+
+    _lm_ssl_close (ssl);
+    lm_ssl_unref (ssl);
+    close (fd);
+    test_server_free (server);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/ssl/handshake_resume", test_handshake_resume);
+
+    return g_test_run ();
+}
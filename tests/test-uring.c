@@ -0,0 +1,289 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include "loudmouth/lm-internals.h"
+#include "loudmouth/lm-output-queue.h"
+#include "loudmouth/lm-uring.h"
+
+#define N_CHUNKS   64
+#define CHUNK_SIZE 1024
+/* Chunks of one batch of sends */
+#define URING_TEST_BATCH 16
+
+typedef struct {
+    LmOutputQueue *queue;
+    GString       *received;
+    gboolean       eof;
+    guint          batches;
+} UringTest;
+
+static void
+recv_cb (LmUringSocket *usock,
+         const gchar   *buf,
+         gssize         len,
+         UringTest     *test)
+{
+    g_assert_cmpint (len, >=, 0);
+
+    if (len == 0) {
+        test->eof = TRUE;
+        return;
+    }
+
+    g_assert_cmpuint (strlen (buf), ==, len);
+    g_string_append_len (test->received, buf, len);
+}
+
+static void
+sent_cb (LmUringSocket *usock,
+         gsize          sent,
+         gint           error,
+         UringTest     *test)
+{
+    g_assert_cmpint (error, ==, 0);
+
+    test->batches++;
+    lm_output_queue_consume (test->queue, sent);
+    lm_uring_socket_send (usock, test->queue);
+}
+
+/* Same loopback as the socket watch tests, but all reads and writes go
+ * through the ring */
+static void
+test_loopback ()
+{
+    LmUringSocket *usock;
+    UringTest      test = { NULL, };
+    int            fds[2];
+    gchar          data[CHUNK_SIZE];
+    gchar          buf[4096];
+    gsize          total;
+    gsize          received = 0;
+    gsize          sent;
+    gint           i;
+
+    g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    test.queue = lm_output_queue_new ();
+    test.received = g_string_new (NULL);
+
+    usock = lm_uring_socket_new (NULL, fds[0],
+                                 (LmUringRecvFunc) recv_cb,
+                                 (LmUringSentFunc) sent_cb,
+                                 &test);
+    if (!usock) {
+        /* Not built with io_uring or the kernel is too old */
+        goto out;
+    }
+
+    for (i = 0; i < N_CHUNKS; i++) {
+        LmOutputChunk *chunk;
+
+        memset (data, 'a' + (i % 26), sizeof (data));
+        chunk = lm_output_chunk_new (data, sizeof (data));
+        lm_output_queue_push (test.queue, chunk, 0);
+        lm_output_chunk_unref (chunk);
+    }
+    total = lm_output_queue_get_size (test.queue);
+
+    lm_uring_socket_send (usock, test.queue);
+    g_assert (lm_uring_socket_is_sending (usock));
+
+    /* More than one batch, in order, while the peer keeps reading */
+    while (received < total) {
+        gssize r;
+        gssize j;
+
+        g_main_context_iteration (NULL, FALSE);
+
+        r = recv (fds[1], buf, sizeof (buf), MSG_DONTWAIT);
+        for (j = 0; j < r; j++) {
+            g_assert_cmpint (buf[j], ==,
+                             'a' + (((received + j) / CHUNK_SIZE) % 26));
+        }
+        if (r > 0) {
+            received += r;
+        }
+    }
+
+    while (!lm_output_queue_is_empty (test.queue)) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_cmpuint (test.batches, >, 1);
+
+    g_assert (write (fds[1], "<presence/>", 11) == 11);
+    while (test.received->len < 11) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_assert_cmpstr (test.received->str, ==, "<presence/>");
+
+    close (fds[1]);
+    fds[1] = -1;
+    while (!test.eof) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    /* Nothing in flight */
+    g_assert (lm_uring_socket_close (usock, &sent));
+    g_assert_cmpuint (sent, ==, 0);
+
+    /* Let the cancellation complete */
+    while (g_main_context_iteration (NULL, FALSE));
+
+ out:
+    close (fds[0]);
+    if (fds[1] >= 0) {
+        close (fds[1]);
+    }
+
+    lm_output_queue_free (test.queue);
+    g_string_free (test.received, TRUE);
+}
+
+static void
+close_sent_cb (LmUringSocket *usock,
+               gsize          sent,
+               gint           error,
+               UringTest     *test)
+{
+    g_assert_not_reached ();
+}
+
+static gpointer
+reader_thread (gpointer data)
+{
+    gint   fd = GPOINTER_TO_INT (data);
+    gchar  buf[4096];
+    gsize  received = 0;
+    gssize r;
+
+    while ((r = read (fd, buf, sizeof (buf))) > 0) {
+        received += r;
+    }
+
+    return GSIZE_TO_POINTER (received);
+}
+
+static LmUringSocket *
+close_setup (UringTest *test, int *fds)
+{
+    LmUringSocket *usock;
+    gchar          data[CHUNK_SIZE];
+    gint           size = 4096;
+    gint           i;
+
+    g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    g_assert (setsockopt (fds[0], SOL_SOCKET, SO_SNDBUF,
+                          &size, sizeof (size)) == 0);
+
+    usock = lm_uring_socket_new (NULL, fds[0],
+                                 (LmUringRecvFunc) recv_cb,
+                                 (LmUringSentFunc) close_sent_cb,
+                                 test);
+    if (!usock) {
+        return NULL;
+    }
+
+    memset (data, 'x', sizeof (data));
+    for (i = 0; i < URING_TEST_BATCH; i++) {
+        LmOutputChunk *chunk;
+
+        chunk = lm_output_chunk_new (data, sizeof (data));
+        lm_output_queue_push (test->queue, chunk, 0);
+        lm_output_chunk_unref (chunk);
+    }
+
+    /* More than the socket buffer takes, the sends stay in flight */
+    lm_uring_socket_send (usock, test->queue);
+    lm_uring_socket_flush (usock);
+
+    return usock;
+}
+
+/* Closing waits for the sends in flight instead of cancelling them,
+ * unless the peer doesn't read them in time */
+static void
+test_close_in_flight ()
+{
+    LmUringSocket *usock;
+    UringTest      test = { NULL, };
+    GThread       *reader;
+    int            fds[2];
+    gsize          total;
+    gsize          sent;
+    gint64         start;
+
+    test.queue = lm_output_queue_new ();
+    test.received = g_string_new (NULL);
+
+    usock = close_setup (&test, fds);
+    if (!usock) {
+        goto out;
+    }
+    total = lm_output_queue_get_size (test.queue);
+
+    reader = g_thread_new ("reader", reader_thread, GINT_TO_POINTER (fds[1]));
+
+    g_assert (lm_uring_socket_close (usock, &sent));
+    g_assert_cmpuint (sent, ==, total);
+
+    shutdown (fds[0], SHUT_WR);
+    g_assert_cmpuint (GPOINTER_TO_SIZE (g_thread_join (reader)), ==, total);
+
+    close (fds[0]);
+    close (fds[1]);
+    while (g_main_context_iteration (NULL, FALSE));
+
+    lm_output_queue_clear (test.queue);
+
+    /* A peer that doesn't read holds up the close only for a moment */
+    usock = close_setup (&test, fds);
+    g_assert (usock != NULL);
+
+    start = g_get_monotonic_time ();
+    g_assert (!lm_uring_socket_close (usock, &sent));
+    g_assert_cmpint (g_get_monotonic_time () - start, <, 2 * G_USEC_PER_SEC);
+
+    close (fds[0]);
+    close (fds[1]);
+    while (g_main_context_iteration (NULL, FALSE));
+
+ out:
+    lm_output_queue_free (test.queue);
+    g_string_free (test.received, TRUE);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/uring/loopback", test_loopback);
+    g_test_add_func ("/uring/close_in_flight", test_close_in_flight);
+
+    return g_test_run ();
+}